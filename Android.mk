@@ -41,6 +41,7 @@ libweaveSharedLibraries := \
 	libchrome \
 	libexpat \
 	libcrypto \
+	libz \
 
 # libweave-external
 # ========================================================
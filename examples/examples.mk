@@ -50,7 +50,8 @@ daemon_common_flags := \
 	-lexpat \
 	-lcurl \
 	-lssl \
-	-lcrypto
+	-lcrypto \
+	-lz
 
 daemon_deps := out/$(BUILD_MODE)/examples_provider.a out/$(BUILD_MODE)/libweave.so
 
@@ -7,10 +7,13 @@ WEAVE_SRC_FILES := \
 	src/access_black_list_manager_impl.cc \
 	src/backoff_entry.cc \
 	src/base_api_handler.cc \
-	src/commands/cloud_command_proxy.cc \
+	src/cloud_request_scheduler.cc \
+	src/commands/cloud_command_updater.cc \
+	src/commands/command_history.cc \
 	src/commands/command_instance.cc \
 	src/commands/command_queue.cc \
 	src/commands/schema_constants.cc \
+	src/commands/thread_safe_command_proxy.cc \
 	src/component_manager_impl.cc \
 	src/config.cc \
 	src/data_encoding.cc \
@@ -19,6 +22,7 @@ WEAVE_SRC_FILES := \
 	src/error.cc \
 	src/http_constants.cc \
 	src/json_error_codes.cc \
+	src/json_stream_writer.cc \
 	src/notification/notification_parser.cc \
 	src/notification/pull_channel.cc \
 	src/notification/xml_node.cc \
@@ -40,6 +44,7 @@ WEAVE_SRC_FILES := \
 	src/privet/wifi_ssid_generator.cc \
 	src/registration_status.cc \
 	src/states/state_change_queue.cc \
+	src/states/state_ingestion_queue.cc \
 	src/streams.cc \
 	src/string_utils.cc \
 	src/utils.cc
@@ -54,24 +59,30 @@ WEAVE_UNITTEST_SRC_FILES := \
 	src/access_black_list_manager_impl_unittest.cc \
 	src/backoff_entry_unittest.cc \
 	src/base_api_handler_unittest.cc \
-	src/commands/cloud_command_proxy_unittest.cc \
+	src/cloud_request_scheduler_unittest.cc \
+	src/commands/cloud_command_updater_unittest.cc \
+	src/commands/command_history_unittest.cc \
 	src/commands/command_instance_unittest.cc \
 	src/commands/command_queue_unittest.cc \
+	src/commands/thread_safe_command_proxy_unittest.cc \
 	src/component_manager_unittest.cc \
 	src/config_unittest.cc \
 	src/data_encoding_unittest.cc \
 	src/device_registration_info_unittest.cc \
 	src/error_unittest.cc \
+	src/json_stream_writer_unittest.cc \
 	src/notification/notification_parser_unittest.cc \
 	src/notification/xml_node_unittest.cc \
 	src/notification/xmpp_channel_unittest.cc \
 	src/notification/xmpp_iq_stanza_handler_unittest.cc \
 	src/notification/xmpp_stream_parser_unittest.cc \
 	src/privet/auth_manager_unittest.cc \
+	src/privet/cloud_delegate_unittest.cc \
 	src/privet/privet_handler_unittest.cc \
 	src/privet/security_manager_unittest.cc \
 	src/privet/wifi_ssid_generator_unittest.cc \
 	src/states/state_change_queue_unittest.cc \
+	src/states/state_ingestion_queue_unittest.cc \
 	src/streams_unittest.cc \
 	src/string_utils_unittest.cc \
 	src/test/weave_testrunner.cc
@@ -15,6 +15,7 @@
 #include <weave/provider/bluetooth.h>
 #include <weave/provider/config_store.h>
 #include <weave/provider/dns_service_discovery.h>
+#include <weave/provider/executor.h>
 #include <weave/provider/http_client.h>
 #include <weave/provider/http_server.h>
 #include <weave/provider/network.h>
@@ -100,6 +101,50 @@ class Device {
                                 const base::Value& value,
                                 ErrorPtr* error) = 0;
 
+  // Identifies a state property resolved by GetStatePropertyHandle().
+  using StatePropertyHandle = uint32_t;
+
+  // Resolves state property |name| (e.g. "base.network") of |component| into
+  // a |handle| which can be passed to UpdateStateProperty(). Intended for
+  // properties updated at high frequency, such as sensor readings.
+  // The handle stays usable for the lifetime of the device, even if the
+  // component is removed and added again.
+  virtual bool GetStatePropertyHandle(const std::string& component,
+                                      const std::string& name,
+                                      StatePropertyHandle* handle,
+                                      ErrorPtr* error) = 0;
+
+  // Same as SetStateProperty(), but the property is identified by a |handle|
+  // obtained from GetStatePropertyHandle(). The component path and property
+  // name are not parsed again and primitive values are updated in place.
+  // Dictionary values are merged into the property, as by SetStateProperty().
+  virtual bool UpdateStateProperty(StatePropertyHandle handle,
+                                   const base::Value& value,
+                                   ErrorPtr* error) = 0;
+
+  // Queues a new primitive |value| of the state property identified by
+  // |handle|. Unlike other methods of this class, it can be called from any
+  // thread, as long as the TaskRunner provider accepts tasks posted from that
+  // thread. Queued updates are applied in batches, each as a single state
+  // transaction, by a task posted to the TaskRunner.
+  // Returns false if the queue is full; the caller may retry later or drop
+  // the update.
+  virtual bool EnqueueStateUpdate(StatePropertyHandle handle,
+                                  const base::FundamentalValue& value) = 0;
+
+  // Groups state updates made until the matching CommitStateTransaction().
+  // All updates of the transaction share a single state change ID and
+  // timestamp, and state change notifications are sent once on commit instead
+  // of once per update. Transactions may be nested; only the outermost commit
+  // sends the notification.
+  // Example:
+  //   device->BeginStateTransaction();
+  //   device->SetStateProperty("comp1", "trait1.prop", value1, nullptr);
+  //   device->SetStateProperty("comp2", "trait2.prop", value2, nullptr);
+  //   device->CommitStateTransaction();
+  virtual void BeginStateTransaction() = 0;
+  virtual void CommitStateTransaction() = 0;
+
   // Callback type for AddCommandHandler.
   using CommandHandlerCallback =
       base::Callback<void(const std::weak_ptr<Command>& command)>;
@@ -116,6 +161,40 @@ class Device {
                                  const std::string& command_name,
                                  const CommandHandlerCallback& callback) = 0;
 
+  // Callback type for AddCommandBatchHandler.
+  using CommandBatchHandlerCallback = base::Callback<void(
+      const std::vector<std::weak_ptr<Command>>& commands)>;
+
+  // Same as AddCommandHandler(), but the queued commands are passed to
+  // |callback| in batches, e.g. to apply them in a single hardware
+  // transaction. Commands queued during one task of the TaskRunner are
+  // delivered together by a task posted after it, ordered by priority.
+  // Commands which are no longer queued by then are left out.
+  // Empty |command_name| selects all commands of |component| which have no
+  // handler of their own. |component| must not be empty.
+  virtual void AddCommandBatchHandler(
+      const std::string& component,
+      const std::string& command_name,
+      const CommandBatchHandlerCallback& callback) = 0;
+
+  // Callback type for AddWorkerCommandHandler.
+  using WorkerCommandHandlerCallback =
+      base::Callback<void(const std::shared_ptr<Command>& command)>;
+
+  // Same as AddCommandHandler(), but |callback| is run by |executor|, so
+  // long-running handlers do not block the thread running libweave.
+  // The |command| passed to |callback| is a proxy which may be kept and used
+  // on a worker thread: its getters return a snapshot of the command and its
+  // setters post the changes back to the TaskRunner, which applies them to
+  // the actual command. So the TaskRunner provider must accept tasks posted
+  // from the threads of |executor|. As the changes are applied later, errors
+  // reported by the actual command are only logged.
+  virtual void AddWorkerCommandHandler(
+      const std::string& component,
+      const std::string& command_name,
+      provider::Executor* executor,
+      const WorkerCommandHandlerCallback& callback) = 0;
+
   // Adds a new command to the command queue.
   virtual bool AddCommand(const base::DictionaryValue& command,
                           std::string* id,
@@ -126,6 +205,15 @@ class Device {
   // for a long period of time.
   virtual Command* FindCommand(const std::string& id) = 0;
 
+  // Returns timestamps of the lifecycle stages of recent commands, from their
+  // arrival to the acknowledgment of their updates by the cloud, and latency
+  // histograms of completed commands by command name.
+  virtual const base::DictionaryValue& GetCommandHistory() const = 0;
+
+  // Returns queue depth and wait time statistics of the requests to the cloud
+  // server, by priority class, and the bytes saved by compression.
+  virtual const base::DictionaryValue& GetCloudRequestMetrics() const = 0;
+
   // Sets callback which is called when stat is changed.
   virtual void AddStateChangedCallback(const base::Closure& callback) = 0;
 
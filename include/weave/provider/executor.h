@@ -0,0 +1,32 @@
+// Copyright 2015 The Weave Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef LIBWEAVE_INCLUDE_WEAVE_PROVIDER_EXECUTOR_H_
+#define LIBWEAVE_INCLUDE_WEAVE_PROVIDER_EXECUTOR_H_
+
+#include <base/callback.h>
+#include <base/location.h>
+
+namespace weave {
+namespace provider {
+
+// Interface with methods to run tasks on worker threads, outside of the thread
+// running libweave. This provider is optional and is only needed for command
+// handlers added with Device::AddWorkerCommandHandler().
+class Executor {
+ public:
+  // Posts |task| to be executed on a worker thread.
+  // |from_here| argument is used for debugging and usually just provided by
+  // FROM_HERE macro. Implementation may ignore this argument.
+  virtual void PostTask(const tracked_objects::Location& from_here,
+                        const base::Closure& task) = 0;
+
+ protected:
+  virtual ~Executor() {}
+};
+
+}  // namespace provider
+}  // namespace weave
+
+#endif  // LIBWEAVE_INCLUDE_WEAVE_PROVIDER_EXECUTOR_H_
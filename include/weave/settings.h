@@ -69,6 +69,30 @@ struct Settings {
   // Local device id.
   std::string device_id;
 
+  // Limits on the number of commands which are queued or in progress at once,
+  // in total and per local user. Local commands over a limit are rejected
+  // with a retryable error. Zero means no limit.
+  size_t max_active_commands{64};
+  size_t max_active_commands_per_user{16};
+
+  // How long finished local and cloud commands stay available to clients, and
+  // the maximum number of finished commands kept, at least one. The oldest
+  // ones over the limit are removed early.
+  base::TimeDelta local_command_retention{base::TimeDelta::FromMinutes(5)};
+  base::TimeDelta cloud_command_retention{base::TimeDelta::FromMinutes(5)};
+  size_t max_finished_commands{500};
+
+  // Maximum number of requests to the cloud server in flight at once. Waiting
+  // requests are sent in the order of their priority. Zero means no limit.
+  size_t max_cloud_requests_in_flight{4};
+
+  // Bodies of requests to the cloud server larger than this number of bytes
+  // are sent gzip-compressed with zlib |cloud_compression_level| (1 to 9).
+  // Zero level disables compression of requests and doesn't ask the server
+  // to compress responses.
+  size_t cloud_compression_threshold{1024};
+  int cloud_compression_level{0};
+
   // Internal options to tweak some library functionality. External code should
   // avoid using them.
   bool wifi_auto_setup_enabled{true};
@@ -51,13 +51,38 @@ class MockDevice : public Device {
                     const std::string& name,
                     const base::Value& value,
                     ErrorPtr* error));
+  MOCK_METHOD4(GetStatePropertyHandle,
+               bool(const std::string& component,
+                    const std::string& name,
+                    StatePropertyHandle* handle,
+                    ErrorPtr* error));
+  MOCK_METHOD3(UpdateStateProperty,
+               bool(StatePropertyHandle handle,
+                    const base::Value& value,
+                    ErrorPtr* error));
+  MOCK_METHOD2(EnqueueStateUpdate,
+               bool(StatePropertyHandle handle,
+                    const base::FundamentalValue& value));
+  MOCK_METHOD0(BeginStateTransaction, void());
+  MOCK_METHOD0(CommitStateTransaction, void());
   MOCK_METHOD3(AddCommandHandler,
                void(const std::string& component,
                     const std::string& command_name,
                     const CommandHandlerCallback& callback));
+  MOCK_METHOD3(AddCommandBatchHandler,
+               void(const std::string& component,
+                    const std::string& command_name,
+                    const CommandBatchHandlerCallback& callback));
+  MOCK_METHOD4(AddWorkerCommandHandler,
+               void(const std::string& component,
+                    const std::string& command_name,
+                    provider::Executor* executor,
+                    const WorkerCommandHandlerCallback& callback));
   MOCK_METHOD3(AddCommand,
                bool(const base::DictionaryValue&, std::string*, ErrorPtr*));
   MOCK_METHOD1(FindCommand, Command*(const std::string&));
+  MOCK_CONST_METHOD0(GetCommandHistory, const base::DictionaryValue&());
+  MOCK_CONST_METHOD0(GetCloudRequestMetrics, const base::DictionaryValue&());
   MOCK_METHOD1(AddStateChangedCallback, void(const base::Closure& callback));
   MOCK_CONST_METHOD0(GetGcdState, GcdState());
   MOCK_METHOD1(AddGcdStateChangedCallback,
@@ -0,0 +1,132 @@
+// Copyright 2015 The Weave Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "src/cloud_request_scheduler.h"
+
+#include <algorithm>
+
+#include <base/logging.h>
+
+namespace weave {
+
+namespace {
+
+const char* const kPriorityNames[] = {
+    "commands",
+    "state",
+    "deviceResource",
+};
+
+}  // anonymous namespace
+
+const size_t CloudRequestScheduler::kPriorityCount;
+
+CloudRequestScheduler::CloudRequestScheduler(size_t max_requests_in_flight,
+                                             base::Clock* clock)
+    : max_requests_in_flight_{max_requests_in_flight},
+      clock_{clock ? clock : &default_clock_} {}
+
+CloudRequestScheduler::~CloudRequestScheduler() {}
+
+void CloudRequestScheduler::Schedule(Priority priority,
+                                     const base::Closure& start) {
+  json_.reset();
+  PriorityClass& priority_class = GetClass(priority);
+  priority_class.scheduled++;
+  priority_class.queue.push_back(Request{start, clock_->Now()});
+  priority_class.max_queue_depth =
+      std::max(priority_class.max_queue_depth, priority_class.queue.size());
+  StartRequests();
+}
+
+void CloudRequestScheduler::OnRequestDone() {
+  json_.reset();
+  CHECK_GT(requests_in_flight_, 0u);
+  requests_in_flight_--;
+  StartRequests();
+}
+
+void CloudRequestScheduler::RecordDuplicate(Priority priority) {
+  json_.reset();
+  GetClass(priority).deduplicated++;
+}
+
+size_t CloudRequestScheduler::GetQueueDepth(Priority priority) const {
+  return classes_[static_cast<size_t>(priority)].queue.size();
+}
+
+void CloudRequestScheduler::StartRequests() {
+  if (starting_) {
+    more_requests_ = true;
+    return;
+  }
+  starting_ = true;
+  do {
+    more_requests_ = false;
+    StartWaitingRequests();
+  } while (more_requests_);
+  starting_ = false;
+}
+
+void CloudRequestScheduler::StartWaitingRequests() {
+  for (PriorityClass& priority_class : classes_) {
+    while (!priority_class.queue.empty()) {
+      if (max_requests_in_flight_ > 0 &&
+          requests_in_flight_ >= max_requests_in_flight_) {
+        return;
+      }
+      Request request = priority_class.queue.front();
+      priority_class.queue.pop_front();
+      base::TimeDelta wait = clock_->Now() - request.queued_time;
+      priority_class.started++;
+      priority_class.total_wait += wait;
+      priority_class.max_wait = std::max(priority_class.max_wait, wait);
+      requests_in_flight_++;
+      // May schedule or finish other requests. Start over then, as a request
+      // of a higher priority may be waiting now.
+      request.start.Run();
+      if (more_requests_)
+        return;
+    }
+  }
+}
+
+CloudRequestScheduler::PriorityClass& CloudRequestScheduler::GetClass(
+    Priority priority) {
+  size_t index = static_cast<size_t>(priority);
+  CHECK_LT(index, kPriorityCount);
+  return classes_[index];
+}
+
+const base::DictionaryValue& CloudRequestScheduler::GetJson() const {
+  if (json_)
+    return *json_;
+
+  std::unique_ptr<base::DictionaryValue> classes{new base::DictionaryValue};
+  for (size_t i = 0; i < kPriorityCount; i++) {
+    const PriorityClass& priority_class = classes_[i];
+    std::unique_ptr<base::DictionaryValue> stats{new base::DictionaryValue};
+    stats->SetInteger("queueDepth",
+                      static_cast<int>(priority_class.queue.size()));
+    stats->SetInteger("maxQueueDepth",
+                      static_cast<int>(priority_class.max_queue_depth));
+    stats->SetInteger("scheduled", static_cast<int>(priority_class.scheduled));
+    stats->SetInteger("deduplicated",
+                      static_cast<int>(priority_class.deduplicated));
+    stats->SetInteger("started", static_cast<int>(priority_class.started));
+    stats->SetDouble("totalWaitMs",
+                     priority_class.total_wait.InMillisecondsF());
+    stats->SetDouble("maxWaitMs", priority_class.max_wait.InMillisecondsF());
+    classes->Set(kPriorityNames[i], stats.release());
+  }
+
+  json_.reset(new base::DictionaryValue);
+  json_->SetInteger("maxRequestsInFlight",
+                    static_cast<int>(max_requests_in_flight_));
+  json_->SetInteger("requestsInFlight", static_cast<int>(requests_in_flight_));
+  json_->Set("classes", classes.release());
+  return *json_;
+}
+
+}  // namespace weave
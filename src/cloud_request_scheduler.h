@@ -0,0 +1,114 @@
+// Copyright 2015 The Weave Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef LIBWEAVE_SRC_CLOUD_REQUEST_SCHEDULER_H_
+#define LIBWEAVE_SRC_CLOUD_REQUEST_SCHEDULER_H_
+
+#include <deque>
+#include <memory>
+
+#include <base/callback.h>
+#include <base/macros.h>
+#include <base/time/clock.h>
+#include <base/time/default_clock.h>
+#include <base/time/time.h>
+#include <base/values.h>
+
+namespace weave {
+
+// Starts requests to the cloud server in the order of their priority, with a
+// limited number of requests in flight. Keeps queue depth and wait time
+// statistics for each priority class.
+class CloudRequestScheduler final {
+ public:
+  // Priority classes of requests, the highest first.
+  enum class Priority {
+    kCommands,        // Command fetches and updates.
+    kState,           // Device state patches.
+    kDeviceResource,  // Device resource and local auth info updates.
+  };
+
+  // Zero |max_requests_in_flight| means no limit.
+  explicit CloudRequestScheduler(size_t max_requests_in_flight,
+                                 base::Clock* clock = nullptr);
+  ~CloudRequestScheduler();
+
+  // Queues a request of |priority|. |start| is run once a request may be
+  // sent, which can be right away. OnRequestDone() must be called once the
+  // started request is finished.
+  void Schedule(Priority priority, const base::Closure& start);
+
+  // Releases the slot of a finished request and starts waiting requests.
+  void OnRequestDone();
+
+  // Records that a request of |priority| was not scheduled because it is
+  // equivalent to a waiting one.
+  void RecordDuplicate(Priority priority);
+
+  size_t GetQueueDepth(Priority priority) const;
+  size_t GetRequestsInFlight() const { return requests_in_flight_; }
+
+  // Returns the statistics of the requests:
+  // {
+  //   "maxRequestsInFlight": 4,
+  //   "requestsInFlight": 1,
+  //   "classes": {
+  //     "commands": {"queueDepth": 0, "maxQueueDepth": 2, "scheduled": 10,
+  //                  "deduplicated": 1, "started": 10, "totalWaitMs": 3,
+  //                  "maxWaitMs": 2},
+  //     "state": {...},
+  //     "deviceResource": {...}
+  //   }
+  // }
+  const base::DictionaryValue& GetJson() const;
+
+ private:
+  struct Request {
+    base::Closure start;
+    base::Time queued_time;
+  };
+
+  struct PriorityClass {
+    std::deque<Request> queue;
+    size_t max_queue_depth{0};
+    uint64_t scheduled{0};
+    uint64_t deduplicated{0};
+    uint64_t started{0};
+    base::TimeDelta total_wait;
+    base::TimeDelta max_wait;
+  };
+
+  // Starts waiting requests as long as the limit allows. Requests may finish
+  // or schedule other requests as they start. Those nested calls only set
+  // |more_requests_|, and the outermost call picks up their work, so the
+  // recursion depth stays bounded however many requests finish right away.
+  void StartRequests();
+  // Same as above, without the reentrancy guard. Returns early once
+  // |more_requests_| is set.
+  void StartWaitingRequests();
+
+  PriorityClass& GetClass(Priority priority);
+
+  const size_t max_requests_in_flight_;
+  base::DefaultClock default_clock_;
+  base::Clock* clock_{nullptr};
+
+  static const size_t kPriorityCount =
+      static_cast<size_t>(Priority::kDeviceResource) + 1;
+  PriorityClass classes_[kPriorityCount];
+  size_t requests_in_flight_{0};
+  // Set while StartRequests() runs.
+  bool starting_{false};
+  // Set if requests were scheduled or finished by a request being started.
+  bool more_requests_{false};
+
+  // Built on demand, reset on any change.
+  mutable std::unique_ptr<base::DictionaryValue> json_;
+
+  DISALLOW_COPY_AND_ASSIGN(CloudRequestScheduler);
+};
+
+}  // namespace weave
+
+#endif  // LIBWEAVE_SRC_CLOUD_REQUEST_SCHEDULER_H_
@@ -0,0 +1,183 @@
+// Copyright 2015 The Weave Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "src/cloud_request_scheduler.h"
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include <base/bind.h>
+#include <gmock/gmock.h>
+#include <gtest/gtest.h>
+#include <weave/test/unittest_utils.h>
+
+#include "src/bind_lambda.h"
+#include "src/test/mock_clock.h"
+
+namespace weave {
+
+using testing::Invoke;
+using Priority = CloudRequestScheduler::Priority;
+
+class CloudRequestSchedulerTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    EXPECT_CALL(clock_, Now()).WillRepeatedly(Invoke([this]() {
+      return now_;
+    }));
+  }
+
+  void Advance(int ms) { now_ += base::TimeDelta::FromMilliseconds(ms); }
+
+  void Schedule(Priority priority, const std::string& name) {
+    scheduler_.Schedule(priority,
+                        base::Bind(&CloudRequestSchedulerTest::OnStart,
+                                   base::Unretained(this), name));
+  }
+
+  void OnStart(const std::string& name) { started_.push_back(name); }
+
+  base::Time now_{base::Time::FromTimeT(1440000000)};
+  test::MockClock clock_;
+  CloudRequestScheduler scheduler_{2, &clock_};
+  std::vector<std::string> started_;
+};
+
+TEST_F(CloudRequestSchedulerTest, StartsRightAway) {
+  Schedule(Priority::kState, "state");
+  EXPECT_EQ((std::vector<std::string>{"state"}), started_);
+  EXPECT_EQ(1u, scheduler_.GetRequestsInFlight());
+  scheduler_.OnRequestDone();
+  EXPECT_EQ(0u, scheduler_.GetRequestsInFlight());
+}
+
+TEST_F(CloudRequestSchedulerTest, Priority) {
+  Schedule(Priority::kDeviceResource, "resource1");
+  Schedule(Priority::kDeviceResource, "resource2");
+  Schedule(Priority::kDeviceResource, "resource3");
+  Schedule(Priority::kState, "state");
+  Schedule(Priority::kCommands, "commands1");
+  Schedule(Priority::kCommands, "commands2");
+  EXPECT_EQ((std::vector<std::string>{"resource1", "resource2"}), started_);
+  EXPECT_EQ(2u, scheduler_.GetQueueDepth(Priority::kCommands));
+  EXPECT_EQ(1u, scheduler_.GetQueueDepth(Priority::kState));
+  EXPECT_EQ(1u, scheduler_.GetQueueDepth(Priority::kDeviceResource));
+
+  started_.clear();
+  scheduler_.OnRequestDone();
+  EXPECT_EQ((std::vector<std::string>{"commands1"}), started_);
+  scheduler_.OnRequestDone();
+  scheduler_.OnRequestDone();
+  scheduler_.OnRequestDone();
+  EXPECT_EQ((std::vector<std::string>{"commands1", "commands2", "state",
+                                      "resource3"}),
+            started_);
+  EXPECT_EQ(2u, scheduler_.GetRequestsInFlight());
+}
+
+TEST_F(CloudRequestSchedulerTest, NoLimit) {
+  CloudRequestScheduler scheduler{0, &clock_};
+  for (int i = 0; i < 10; i++)
+    scheduler.Schedule(Priority::kState, base::Bind(&base::DoNothing));
+  EXPECT_EQ(10u, scheduler.GetRequestsInFlight());
+  EXPECT_EQ(0u, scheduler.GetQueueDepth(Priority::kState));
+}
+
+TEST_F(CloudRequestSchedulerTest, RequestsFinishingRightAway) {
+  Schedule(Priority::kState, "state1");
+  Schedule(Priority::kState, "state2");
+
+  // Requests which fail as they start, e.g. without an access token, finish
+  // the next one from within OnRequestDone() without nesting deeper.
+  const int kCount = 10000;
+  int started = 0;
+  int depth = 0;
+  int max_depth = 0;
+  auto start = [this, &started, &depth, &max_depth]() {
+    started++;
+    depth++;
+    max_depth = std::max(max_depth, depth);
+    scheduler_.OnRequestDone();
+    depth--;
+  };
+  for (int i = 0; i < kCount; i++)
+    scheduler_.Schedule(Priority::kDeviceResource, base::Bind(start));
+  EXPECT_EQ(0, started);
+
+  scheduler_.OnRequestDone();
+  EXPECT_EQ(kCount, started);
+  EXPECT_EQ(1, max_depth);
+  EXPECT_EQ(1u, scheduler_.GetRequestsInFlight());
+}
+
+TEST_F(CloudRequestSchedulerTest, PriorityOfNestedRequests) {
+  CloudRequestScheduler scheduler{1, &clock_};
+  scheduler.Schedule(Priority::kState, base::Bind(&base::DoNothing));
+  auto record = [this](const std::string& name) { started_.push_back(name); };
+  auto start = [this, &scheduler, record](const std::string& name) {
+    started_.push_back(name);
+    if (name == "resource1")
+      scheduler.Schedule(Priority::kCommands, base::Bind(record, "commands"));
+    scheduler.OnRequestDone();
+  };
+  scheduler.Schedule(Priority::kDeviceResource, base::Bind(start, "resource1"));
+  scheduler.Schedule(Priority::kDeviceResource, base::Bind(start, "resource2"));
+
+  // The request scheduled by "resource1" goes first.
+  scheduler.OnRequestDone();
+  EXPECT_EQ((std::vector<std::string>{"resource1", "commands"}), started_);
+  scheduler.OnRequestDone();
+  EXPECT_EQ((std::vector<std::string>{"resource1", "commands", "resource2"}),
+            started_);
+}
+
+TEST_F(CloudRequestSchedulerTest, GetJson) {
+  Schedule(Priority::kState, "state1");
+  Schedule(Priority::kState, "state2");
+  Schedule(Priority::kState, "state3");
+  Schedule(Priority::kCommands, "commands");
+  scheduler_.RecordDuplicate(Priority::kCommands);
+  Advance(5);
+  scheduler_.OnRequestDone();
+  Advance(10);
+  scheduler_.OnRequestDone();
+
+  const char kExpected[] = R"({
+    'maxRequestsInFlight': 2,
+    'requestsInFlight': 2,
+    'classes': {
+      'commands': {
+        'queueDepth': 0,
+        'maxQueueDepth': 1,
+        'scheduled': 1,
+        'deduplicated': 1,
+        'started': 1,
+        'totalWaitMs': 5.0,
+        'maxWaitMs': 5.0
+      },
+      'state': {
+        'queueDepth': 0,
+        'maxQueueDepth': 1,
+        'scheduled': 3,
+        'deduplicated': 0,
+        'started': 3,
+        'totalWaitMs': 15.0,
+        'maxWaitMs': 15.0
+      },
+      'deviceResource': {
+        'queueDepth': 0,
+        'maxQueueDepth': 0,
+        'scheduled': 0,
+        'deduplicated': 0,
+        'started': 0,
+        'totalWaitMs': 0.0,
+        'maxWaitMs': 0.0
+      }
+    }
+  })";
+  EXPECT_JSON_EQ(kExpected, scheduler_.GetJson());
+}
+
+}  // namespace weave
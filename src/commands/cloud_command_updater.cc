@@ -0,0 +1,269 @@
+// Copyright 2015 The Weave Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "src/commands/cloud_command_updater.h"
+
+#include <base/bind.h>
+#include <base/scoped_observer.h>
+#include <weave/enum_to_string.h>
+#include <weave/provider/task_runner.h>
+
+#include "src/commands/schema_constants.h"
+#include "src/utils.h"
+
+namespace weave {
+
+// Turns notifications of a single command into patches for the updater.
+class CloudCommandUpdater::CommandObserver final
+    : public CommandInstance::Observer {
+ public:
+  CommandObserver(CloudCommandUpdater* updater,
+                  CommandInstance* command_instance)
+      : updater_{updater},
+        command_instance_{command_instance},
+        id_{command_instance->GetID()} {
+    observer_.Add(command_instance);
+  }
+
+  // CommandInstance::Observer implementation.
+  void OnCommandDestroyed() override {
+    // Deletes |this|.
+    updater_->OnCommandDestroyed(id_);
+  }
+
+  void OnErrorChanged() override {
+    std::unique_ptr<base::DictionaryValue> patch{new base::DictionaryValue};
+    patch->Set(commands::attributes::kCommand_Error,
+               command_instance_->GetError()
+                   ? ErrorInfoToJson(*command_instance_->GetError()).release()
+                   : base::Value::CreateNullValue().release());
+    updater_->OnCommandChanged(id_, std::move(patch));
+  }
+
+  void OnProgressChanged() override {
+    std::unique_ptr<base::DictionaryValue> patch{new base::DictionaryValue};
+    patch->Set(commands::attributes::kCommand_Progress,
+               command_instance_->GetProgress().CreateDeepCopy());
+    updater_->OnCommandChanged(id_, std::move(patch));
+  }
+
+  void OnResultsChanged() override {
+    std::unique_ptr<base::DictionaryValue> patch{new base::DictionaryValue};
+    patch->Set(commands::attributes::kCommand_Results,
+               command_instance_->GetResults().CreateDeepCopy());
+    updater_->OnCommandChanged(id_, std::move(patch));
+  }
+
+  void OnStateChanged() override {
+    std::unique_ptr<base::DictionaryValue> patch{new base::DictionaryValue};
+    patch->SetString(commands::attributes::kCommand_State,
+                     EnumToString(command_instance_->GetState()));
+    updater_->OnCommandChanged(id_, std::move(patch));
+  }
+
+ private:
+  CloudCommandUpdater* updater_;
+  CommandInstance* command_instance_;
+  const std::string id_;
+  ScopedObserver<CommandInstance, CommandInstance::Observer> observer_{this};
+
+  DISALLOW_COPY_AND_ASSIGN(CommandObserver);
+};
+
+CloudCommandUpdater::PendingCommand::PendingCommand() {}
+
+CloudCommandUpdater::PendingCommand::~PendingCommand() {}
+
+CloudCommandUpdater::CloudCommandUpdater(
+    CloudCommandUpdateInterface* cloud_command_updater,
+    ComponentManager* component_manager,
+    std::unique_ptr<BackoffEntry> backoff_entry,
+    provider::TaskRunner* task_runner,
+    size_t max_requests_in_flight)
+    : cloud_command_updater_{cloud_command_updater},
+      component_manager_{component_manager},
+      task_runner_{task_runner},
+      max_requests_in_flight_{max_requests_in_flight},
+      cloud_backoff_entry_{std::move(backoff_entry)} {}
+
+CloudCommandUpdater::~CloudCommandUpdater() {}
+
+void CloudCommandUpdater::AddCommand(CommandInstance* command_instance) {
+  if (commands_.empty()) {
+    callback_token_ = component_manager_->AddServerStateUpdatedCallback(
+        base::Bind(&CloudCommandUpdater::OnDeviceStateUpdated,
+                   weak_ptr_factory_.GetWeakPtr()));
+  }
+  std::unique_ptr<PendingCommand> command{new PendingCommand};
+  command->command_instance = command_instance;
+  command->observer.reset(new CommandObserver{this, command_instance});
+  CHECK(commands_.emplace(command_instance->GetID(), std::move(command)).second)
+      << "Command '" << command_instance->GetID() << "' is already tracked";
+}
+
+void CloudCommandUpdater::OnCommandChanged(
+    const std::string& id,
+    std::unique_ptr<base::DictionaryValue> patch) {
+  auto it = commands_.find(id);
+  CHECK(it != commands_.end());
+  QueueCommandUpdate(it->second.get(), std::move(patch));
+}
+
+void CloudCommandUpdater::OnCommandDestroyed(const std::string& id) {
+  // Its entry in |send_queue_|, if any, is skipped later.
+  commands_.erase(id);
+  if (commands_.empty())
+    callback_token_.reset();
+}
+
+void CloudCommandUpdater::QueueCommandUpdate(
+    PendingCommand* command,
+    std::unique_ptr<base::DictionaryValue> patch) {
+  auto& update_queue = command->update_queue;
+  ComponentManager::UpdateID id = component_manager_->GetLastStateChangeId();
+  if (update_queue.empty() || update_queue.back().first != id) {
+    // If queue is currently empty or the device state has changed since the
+    // last patch request queued, add a new request to the queue.
+    update_queue.push_back(std::make_pair(id, std::move(patch)));
+  } else {
+    // Device state hasn't changed since the last time this command update
+    // was queued. We can coalesce the command update patches, unless the
+    // current request is already in flight to the server.
+    if (update_queue.size() == 1 && command->update_in_progress) {
+      // Can't update the request which is being sent to the server.
+      // Queue a new update.
+      update_queue.push_back(std::make_pair(id, std::move(patch)));
+    } else {
+      // Coalesce the patches.
+      update_queue.back().second->MergeDictionary(patch.get());
+    }
+  }
+  WaitToSend(command);
+  ScheduleSend();
+}
+
+void CloudCommandUpdater::WaitToSend(PendingCommand* command) {
+  if (command->waiting_to_send || command->update_in_progress)
+    return;
+  command->waiting_to_send = true;
+  send_queue_.push_back(command->command_instance->GetID());
+}
+
+void CloudCommandUpdater::ScheduleSend() {
+  if (send_scheduled_)
+    return;
+  send_scheduled_ = true;
+  task_runner_->PostDelayedTask(
+      FROM_HERE, base::Bind(&CloudCommandUpdater::SendCommandUpdates,
+                            send_weak_ptr_factory_.GetWeakPtr()),
+      {});
+}
+
+void CloudCommandUpdater::SendCommandUpdates() {
+  send_weak_ptr_factory_.InvalidateWeakPtrs();
+  send_scheduled_ = false;
+  while (max_requests_in_flight_ == 0 ||
+         requests_in_flight_ < max_requests_in_flight_) {
+    PendingCommand* command = PopReadyCommand();
+    if (!command)
+      return;
+    if (cloud_backoff_entry_->ShouldRejectRequest()) {
+      VLOG(1) << "Cloud request delayed for "
+              << cloud_backoff_entry_->GetTimeUntilRelease()
+              << " due to backoff policy";
+      command->waiting_to_send = true;
+      send_queue_.push_front(command->command_instance->GetID());
+      send_scheduled_ = true;
+      task_runner_->PostDelayedTask(
+          FROM_HERE, base::Bind(&CloudCommandUpdater::SendCommandUpdates,
+                                send_weak_ptr_factory_.GetWeakPtr()),
+          cloud_backoff_entry_->GetTimeUntilRelease());
+      return;
+    }
+    SendCommandUpdate(command);
+  }
+}
+
+CloudCommandUpdater::PendingCommand* CloudCommandUpdater::PopReadyCommand() {
+  for (auto it = send_queue_.begin(); it != send_queue_.end();) {
+    auto command = commands_.find(*it);
+    if (command == commands_.end() || !command->second->waiting_to_send) {
+      // The command is gone, or it is a stale entry of a command with the same
+      // ID.
+      it = send_queue_.erase(it);
+      continue;
+    }
+    // We can only send updates for which the device state at the time the
+    // requests have been queued were successfully propagated to the server.
+    // That is, if the pending device state updates that we recorded while the
+    // command update was queued haven't been acknowledged by the server, we
+    // will hold the corresponding command updates until the related device
+    // state has been successfully updated on the server.
+    if (command->second->update_queue.front().first <= last_state_update_id_) {
+      send_queue_.erase(it);
+      command->second->waiting_to_send = false;
+      return command->second.get();
+    }
+    ++it;
+  }
+  return nullptr;
+}
+
+void CloudCommandUpdater::SendCommandUpdate(PendingCommand* command) {
+  // Coalesce any pending updates that were queued prior to the current device
+  // state known to be propagated to the server successfully.
+  auto& update_queue = command->update_queue;
+  auto iter = update_queue.begin();
+  auto start = ++iter;
+  while (iter != update_queue.end()) {
+    if (iter->first > last_state_update_id_)
+      break;
+    update_queue.front().first = iter->first;
+    update_queue.front().second->MergeDictionary(iter->second.get());
+    ++iter;
+  }
+  // Remove all the intermediate items that have been merged into the first
+  // entry.
+  update_queue.erase(start, iter);
+  command->update_in_progress = true;
+  requests_in_flight_++;
+  const std::string& id = command->command_instance->GetID();
+  cloud_command_updater_->UpdateCommand(
+      id, *update_queue.front().second,
+      base::Bind(&CloudCommandUpdater::OnUpdateCommandDone,
+                 weak_ptr_factory_.GetWeakPtr(), id));
+}
+
+void CloudCommandUpdater::OnUpdateCommandDone(const std::string& id,
+                                              ErrorPtr error) {
+  requests_in_flight_--;
+  cloud_backoff_entry_->InformOfRequest(!error);
+  auto it = commands_.find(id);
+  if (it != commands_.end()) {
+    PendingCommand* command = it->second.get();
+    command->update_in_progress = false;
+    if (!error) {
+      // Remove the succeeded update from the queue.
+      command->update_queue.pop_front();
+      component_manager_->RecordCommandStage(
+          id, command->command_instance->GetName(),
+          CommandHistory::Stage::kCloudAcknowledged);
+    }
+    if (!command->update_queue.empty())
+      WaitToSend(command);
+  }
+  // If we have more pending updates, send new requests to the server
+  // immediately, if possible.
+  SendCommandUpdates();
+}
+
+void CloudCommandUpdater::OnDeviceStateUpdated(
+    ComponentManager::UpdateID update_id) {
+  last_state_update_id_ = update_id;
+  // Try to send out any queued command updates that could be performed after
+  // a device state is updated.
+  SendCommandUpdates();
+}
+
+}  // namespace weave
@@ -0,0 +1,149 @@
+// Copyright 2015 The Weave Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef LIBWEAVE_SRC_COMMANDS_CLOUD_COMMAND_UPDATER_H_
+#define LIBWEAVE_SRC_COMMANDS_CLOUD_COMMAND_UPDATER_H_
+
+#include <deque>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <utility>
+
+#include <base/macros.h>
+#include <base/memory/weak_ptr.h>
+#include <weave/command.h>
+
+#include "src/backoff_entry.h"
+#include "src/commands/cloud_command_update_interface.h"
+#include "src/commands/command_instance.h"
+#include "src/component_manager.h"
+
+namespace weave {
+
+namespace provider {
+class TaskRunner;
+}
+
+// Publishes updates of cloud commands to the cloud. Keeps pending patches of
+// each command and sends them through a single backoff entry, with a limited
+// number of requests in flight.
+// Updates of a command are sent one request at a time, each one after the
+// device state the command had when the update was made is propagated to the
+// server.
+class CloudCommandUpdater final {
+ public:
+  // Zero |max_requests_in_flight| means no limit, for a
+  // |cloud_command_updater| which limits requests itself.
+  CloudCommandUpdater(CloudCommandUpdateInterface* cloud_command_updater,
+                      ComponentManager* component_manager,
+                      std::unique_ptr<BackoffEntry> backoff_entry,
+                      provider::TaskRunner* task_runner,
+                      size_t max_requests_in_flight);
+  ~CloudCommandUpdater();
+
+  // Starts publishing updates of |command_instance| until it is destroyed.
+  void AddCommand(CommandInstance* command_instance);
+
+  // Returns the number of commands being tracked.
+  size_t GetCommandCount() const { return commands_.size(); }
+
+ private:
+  class CommandObserver;
+
+  using UpdateQueueEntry = std::pair<ComponentManager::UpdateID,
+                                     std::unique_ptr<base::DictionaryValue>>;
+
+  // Pending updates of a command.
+  struct PendingCommand {
+    PendingCommand();
+    ~PendingCommand();
+
+    CommandInstance* command_instance{nullptr};
+    std::unique_ptr<CommandObserver> observer;
+    // Patches ready to be sent to the server, with the device state update ID
+    // they have to wait for.
+    std::deque<UpdateQueueEntry> update_queue;
+    // Set to true while a PATCH request for the command is in flight.
+    bool update_in_progress{false};
+    // Set to true while the command is in |send_queue_|.
+    bool waiting_to_send{false};
+  };
+
+  // Puts a command update data into the update queue of |command| and
+  // schedules sending it to the server.
+  void QueueCommandUpdate(PendingCommand* command,
+                          std::unique_ptr<base::DictionaryValue> patch);
+
+  // Adds |command| to |send_queue_| unless it is there already, or has an
+  // update in flight.
+  void WaitToSend(PendingCommand* command);
+
+  // Posts a task calling SendCommandUpdates(), to accumulate more changes
+  // during the current message loop task run.
+  void ScheduleSend();
+
+  // Sends asynchronous requests to GCD server for commands with updates ready
+  // to be sent, as long as the backoff and the limit of requests in flight
+  // allow.
+  void SendCommandUpdates();
+
+  // Removes and returns the first command from |send_queue_| with updates
+  // ready to be sent. Returns nullptr if there is none.
+  PendingCommand* PopReadyCommand();
+
+  // Sends the first update of |command| to the server, merged with later
+  // updates which are ready too.
+  void SendCommandUpdate(PendingCommand* command);
+
+  // Callback invoked by the asynchronous PATCH request to the server.
+  void OnUpdateCommandDone(const std::string& id, ErrorPtr error);
+
+  // Callback invoked by the device state change queue to notify of the
+  // successful device state update. |update_id| is the ID of the state that
+  // has been updated on the server.
+  void OnDeviceStateUpdated(ComponentManager::UpdateID update_id);
+
+  // Called by CommandObserver.
+  void OnCommandChanged(const std::string& id,
+                        std::unique_ptr<base::DictionaryValue> patch);
+  void OnCommandDestroyed(const std::string& id);
+
+  CloudCommandUpdateInterface* cloud_command_updater_;
+  ComponentManager* component_manager_;
+  provider::TaskRunner* task_runner_{nullptr};
+  const size_t max_requests_in_flight_;
+
+  // Backoff for SendCommandUpdates() method.
+  std::unique_ptr<BackoffEntry> cloud_backoff_entry_;
+
+  // Tracked commands by ID.
+  std::unordered_map<std::string, std::unique_ptr<PendingCommand>> commands_;
+  // IDs of commands with updates waiting to be sent, in the order they were
+  // made. The commands may still wait for a device state update.
+  std::deque<std::string> send_queue_;
+
+  // Number of PATCH requests in flight to the server.
+  size_t requests_in_flight_{0};
+
+  // Callback token from the state change queue for OnDeviceStateUpdated()
+  // callback for ask the device state change queue to call when the state
+  // is updated on the server. Only held while there are commands to track.
+  ComponentManager::Token callback_token_;
+
+  // Last device state update ID that has been sent out to the server
+  // successfully.
+  ComponentManager::UpdateID last_state_update_id_{0};
+
+  // Set to true while a SendCommandUpdates() task is posted.
+  bool send_scheduled_{false};
+
+  base::WeakPtrFactory<CloudCommandUpdater> send_weak_ptr_factory_{this};
+  base::WeakPtrFactory<CloudCommandUpdater> weak_ptr_factory_{this};
+  DISALLOW_COPY_AND_ASSIGN(CloudCommandUpdater);
+};
+
+}  // namespace weave
+
+#endif  // LIBWEAVE_SRC_COMMANDS_CLOUD_COMMAND_UPDATER_H_
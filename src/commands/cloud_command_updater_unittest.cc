@@ -2,7 +2,7 @@
 // Use of this source code is governed by a BSD-style license that can be
 // found in the LICENSE file.
 
-#include "src/commands/cloud_command_proxy.h"
+#include "src/commands/cloud_command_updater.h"
 
 #include <memory>
 #include <queue>
@@ -32,6 +32,7 @@ using test::CreateValue;
 namespace {
 
 const char kCmdID[] = "abcd";
+const size_t kMaxRequestsInFlight = 2;
 
 MATCHER_P(MatchJson, str, "") {
   return arg.Equals(CreateValue(str).get());
@@ -64,28 +65,7 @@ class TestBackoffEntry : public BackoffEntry {
   base::Time creation_time_;
 };
 
-class CloudCommandProxyWrapper : public CloudCommandProxy {
- public:
-  CloudCommandProxyWrapper(CommandInstance* command_instance,
-                           CloudCommandUpdateInterface* cloud_command_updater,
-                           ComponentManager* component_manager,
-                           std::unique_ptr<BackoffEntry> backoff_entry,
-                           provider::TaskRunner* task_runner,
-                           const base::Closure& destruct_callback)
-      : CloudCommandProxy{command_instance, cloud_command_updater,
-                          component_manager, std::move(backoff_entry),
-                          task_runner},
-        destruct_callback_{destruct_callback} {}
-
-  ~CloudCommandProxyWrapper() {
-    destruct_callback_.Run();
-  }
-
- private:
-  base::Closure destruct_callback_;
-};
-
-class CloudCommandProxyTest : public ::testing::Test {
+class CloudCommandUpdaterTest : public ::testing::Test {
  protected:
   void SetUp() override {
     // Set up the test ComponentManager.
@@ -97,74 +77,72 @@ class CloudCommandProxyTest : public ::testing::Test {
         .WillRepeatedly(Invoke(callback));
     EXPECT_CALL(component_manager_, GetLastStateChangeId())
         .WillRepeatedly(testing::ReturnPointee(&current_state_update_id_));
+    EXPECT_CALL(component_manager_, RecordCommandStage(_, _, _))
+        .Times(testing::AnyNumber());
 
-    CreateCommandInstance();
+    // Backoff - start at 1s and double with each backoff attempt and no jitter.
+    static const BackoffEntry::Policy policy{0,     1000, 2.0,  0.0,
+                                             20000, -1,   false};
+    std::unique_ptr<TestBackoffEntry> backoff{
+        new TestBackoffEntry{&policy, task_runner_.GetClock()}};
+
+    // Finally construct the CloudCommandUpdater we are going to test here.
+    updater_.reset(new CloudCommandUpdater{&cloud_updater_,
+                                           &component_manager_,
+                                           std::move(backoff), &task_runner_,
+                                           kMaxRequestsInFlight});
+
+    command_instance_ = CreateCommandInstance(kCmdID);
   }
 
-  void CreateCommandInstance() {
+  std::unique_ptr<CommandInstance> CreateCommandInstance(
+      const std::string& id) {
     auto command_json = CreateDictionaryValue(R"({
       'name': 'calc.add',
-      'id': 'abcd',
       'parameters': {
         'value1': 10,
         'value2': 20
       }
     })");
     CHECK(command_json.get());
-
-    command_instance_ = CommandInstance::FromJson(
-        command_json.get(), Command::Origin::kCloud, nullptr, nullptr);
-    CHECK(command_instance_.get());
-
-    // Backoff - start at 1s and double with each backoff attempt and no jitter.
-    static const BackoffEntry::Policy policy{0,     1000, 2.0,  0.0,
-                                             20000, -1,   false};
-    std::unique_ptr<TestBackoffEntry> backoff{
-        new TestBackoffEntry{&policy, task_runner_.GetClock()}};
-
-    // Finally construct the CloudCommandProxy we are going to test here.
-    std::unique_ptr<CloudCommandProxy> proxy{new CloudCommandProxyWrapper{
-        command_instance_.get(), &cloud_updater_, &component_manager_,
-        std::move(backoff), &task_runner_,
-        base::Bind(&CloudCommandProxyTest::OnProxyDestroyed,
-                   base::Unretained(this))}};
-    // CloudCommandProxy::CloudCommandProxy() subscribe itself to weave::Command
-    // notifications. When weave::Command is being destroyed it sends
-    // ::OnCommandDestroyed() and CloudCommandProxy deletes itself.
-    proxy.release();
-
-    EXPECT_CALL(*this, OnProxyDestroyed()).Times(AnyNumber());
+    command_json->SetString("id", id);
+
+    std::unique_ptr<CommandInstance> command_instance =
+        CommandInstance::FromJson(command_json.get(), Command::Origin::kCloud,
+                                  nullptr, nullptr);
+    CHECK(command_instance.get());
+    updater_->AddCommand(command_instance.get());
+    return command_instance;
   }
 
-  MOCK_METHOD0(OnProxyDestroyed, void());
-
   ComponentManager::UpdateID current_state_update_id_{0};
   base::CallbackList<void(ComponentManager::UpdateID)> callbacks_;
   testing::StrictMock<MockCloudCommandUpdateInterface> cloud_updater_;
   testing::StrictMock<MockComponentManager> component_manager_;
   testing::StrictMock<provider::test::FakeTaskRunner> task_runner_;
-  std::queue<base::Closure> task_queue_;
+  std::unique_ptr<CloudCommandUpdater> updater_;
   std::unique_ptr<CommandInstance> command_instance_;
 };
 
 }  // anonymous namespace
 
-TEST_F(CloudCommandProxyTest, EnsureDestroyed) {
-  EXPECT_CALL(*this, OnProxyDestroyed()).Times(1);
+TEST_F(CloudCommandUpdaterTest, ForgetDestroyedCommand) {
+  EXPECT_EQ(1u, updater_->GetCommandCount());
+  // The pending update is dropped along with the command.
+  command_instance_->Complete({}, nullptr);
   command_instance_.reset();
-  // Verify that CloudCommandProxy has been destroyed already and not at some
-  // point during the destruction of CloudCommandProxyTest class.
-  testing::Mock::VerifyAndClearExpectations(this);
+  EXPECT_EQ(0u, updater_->GetCommandCount());
+  task_runner_.RunOnce();
 }
 
-TEST_F(CloudCommandProxyTest, ImmediateUpdate) {
+TEST_F(CloudCommandUpdaterTest, ImmediateUpdate) {
   const char expected[] = "{'state':'done'}";
   EXPECT_CALL(cloud_updater_, UpdateCommand(kCmdID, MatchJson(expected), _));
   command_instance_->Complete({}, nullptr);
   task_runner_.RunOnce();
 }
 
-TEST_F(CloudCommandProxyTest, DelayedUpdate) {
+TEST_F(CloudCommandUpdaterTest, DelayedUpdate) {
   // Simulate that the current device state has changed.
   current_state_update_id_ = 20;
   // No command update is expected here.
@@ -177,7 +155,7 @@ TEST_F(CloudCommandProxyTest, DelayedUpdate) {
   callbacks_.Notify(20);
 }
 
-TEST_F(CloudCommandProxyTest, InFlightRequest) {
+TEST_F(CloudCommandUpdaterTest, InFlightRequest) {
   // SetProgress causes two consecutive updates:
   //    state=inProgress
   //    progress={...}
@@ -196,7 +174,7 @@ TEST_F(CloudCommandProxyTest, InFlightRequest) {
   task_runner_.RunOnce();
 }
 
-TEST_F(CloudCommandProxyTest, CombineMultiple) {
+TEST_F(CloudCommandUpdaterTest, CombineMultiple) {
   // Simulate that the current device state has changed.
   current_state_update_id_ = 20;
   // SetProgress causes two consecutive updates:
@@ -216,7 +194,7 @@ TEST_F(CloudCommandProxyTest, CombineMultiple) {
   callbacks_.Notify(20);
 }
 
-TEST_F(CloudCommandProxyTest, RetryFailed) {
+TEST_F(CloudCommandUpdaterTest, RetryFailed) {
   DoneCallback callback;
 
   const char expect[] =
@@ -240,13 +218,16 @@ TEST_F(CloudCommandProxyTest, RetryFailed) {
   EXPECT_GE(task_runner_.GetClock()->Now() - started,
             base::TimeDelta::FromSecondsD(2.9));
 
+  EXPECT_CALL(component_manager_,
+              RecordCommandStage(kCmdID, "calc.add",
+                                 CommandHistory::Stage::kCloudAcknowledged));
   callback.Run(nullptr);
   task_runner_.Run();
   EXPECT_GE(task_runner_.GetClock()->Now() - started,
             base::TimeDelta::FromSecondsD(2.9));
 }
 
-TEST_F(CloudCommandProxyTest, GateOnStateUpdates) {
+TEST_F(CloudCommandUpdaterTest, GateOnStateUpdates) {
   current_state_update_id_ = 20;
   EXPECT_TRUE(command_instance_->SetProgress(
       *CreateDictionaryValue("{'status': 'ready'}"), nullptr));
@@ -285,7 +266,7 @@ TEST_F(CloudCommandProxyTest, GateOnStateUpdates) {
   callback.Run(nullptr);
 }
 
-TEST_F(CloudCommandProxyTest, CombineSomeStates) {
+TEST_F(CloudCommandUpdaterTest, CombineSomeStates) {
   current_state_update_id_ = 20;
   EXPECT_TRUE(command_instance_->SetProgress(
       *CreateDictionaryValue("{'status': 'ready'}"), nullptr));
@@ -314,7 +295,7 @@ TEST_F(CloudCommandProxyTest, CombineSomeStates) {
   callback.Run(nullptr);
 }
 
-TEST_F(CloudCommandProxyTest, CombineAllStates) {
+TEST_F(CloudCommandUpdaterTest, CombineAllStates) {
   current_state_update_id_ = 20;
   EXPECT_TRUE(command_instance_->SetProgress(
       *CreateDictionaryValue("{'status': 'ready'}"), nullptr));
@@ -333,7 +314,7 @@ TEST_F(CloudCommandProxyTest, CombineAllStates) {
   callbacks_.Notify(30);
 }
 
-TEST_F(CloudCommandProxyTest, CoalesceUpdates) {
+TEST_F(CloudCommandUpdaterTest, CoalesceUpdates) {
   current_state_update_id_ = 20;
   EXPECT_TRUE(command_instance_->SetProgress(
       *CreateDictionaryValue("{'status': 'ready'}"), nullptr));
@@ -353,38 +334,100 @@ TEST_F(CloudCommandProxyTest, CoalesceUpdates) {
   callbacks_.Notify(30);
 }
 
-TEST_F(CloudCommandProxyTest, EmptyStateChangeQueue) {
+TEST_F(CloudCommandUpdaterTest, EmptyStateChangeQueue) {
   // Assume the device state update queue was empty and was at update ID 20.
   current_state_update_id_ = 20;
-
-  // Recreate the command instance and proxy with the new state change queue.
-  CreateCommandInstance();
-
-  // Empty queue will immediately call back with the state change notification.
   callbacks_.Notify(20);
 
+  // Commands added later do not wait for any device state update.
+  command_instance_ = CreateCommandInstance("efgh");
+
   // As soon as we change the command, the update to the server should be sent.
   const char expected[] = "{'state':'done'}";
-  EXPECT_CALL(cloud_updater_, UpdateCommand(kCmdID, MatchJson(expected), _));
+  EXPECT_CALL(cloud_updater_, UpdateCommand("efgh", MatchJson(expected), _));
   command_instance_->Complete({}, nullptr);
   task_runner_.RunOnce();
 }
 
-TEST_F(CloudCommandProxyTest, NonEmptyStateChangeQueue) {
+TEST_F(CloudCommandUpdaterTest, NonEmptyStateChangeQueue) {
   // Assume the device state update queue was NOT empty when the command
   // instance was created.
   current_state_update_id_ = 20;
-
-  // Recreate the command instance and proxy with the new state change queue.
-  CreateCommandInstance();
+  command_instance_ = CreateCommandInstance("efgh");
 
   // No command updates right now.
   command_instance_->Complete({}, nullptr);
+  task_runner_.RunOnce();
 
   // Only when the state #20 is published we should update the command
   const char expected[] = "{'state':'done'}";
-  EXPECT_CALL(cloud_updater_, UpdateCommand(kCmdID, MatchJson(expected), _));
+  EXPECT_CALL(cloud_updater_, UpdateCommand("efgh", MatchJson(expected), _));
   callbacks_.Notify(20);
 }
 
+TEST_F(CloudCommandUpdaterTest, RequestsInFlightLimit) {
+  auto command2 = CreateCommandInstance("efgh");
+  auto command3 = CreateCommandInstance("ijkl");
+
+  // Only two requests are sent at once, in the order the updates were made.
+  DoneCallback callback;
+  EXPECT_CALL(cloud_updater_, UpdateCommand(kCmdID, _, _))
+      .WillOnce(SaveArg<2>(&callback));
+  EXPECT_CALL(cloud_updater_, UpdateCommand("efgh", _, _));
+  command_instance_->Complete({}, nullptr);
+  command2->Complete({}, nullptr);
+  command3->Complete({}, nullptr);
+  task_runner_.RunOnce();
+  testing::Mock::VerifyAndClearExpectations(&cloud_updater_);
+
+  // The third one is sent when a request completes.
+  EXPECT_CALL(cloud_updater_,
+              UpdateCommand("ijkl", MatchJson("{'state':'done'}"), _));
+  callback.Run(nullptr);
+}
+
+TEST_F(CloudCommandUpdaterTest, SharedBackoff) {
+  auto command2 = CreateCommandInstance("efgh");
+
+  DoneCallback callback;
+  EXPECT_CALL(cloud_updater_, UpdateCommand(kCmdID, _, _))
+      .WillOnce(SaveArg<2>(&callback));
+  command_instance_->Complete({}, nullptr);
+  task_runner_.RunOnce();
+
+  // Failure of one command delays updates of all commands.
+  auto started = task_runner_.GetClock()->Now();
+  ErrorPtr error;
+  Error::AddTo(&error, FROM_HERE, "TEST", "TEST");
+  callback.Run(std::move(error));
+  command2->Complete({}, nullptr);
+
+  EXPECT_CALL(cloud_updater_, UpdateCommand(kCmdID, _, _));
+  EXPECT_CALL(cloud_updater_, UpdateCommand("efgh", _, _));
+  task_runner_.Run();
+  EXPECT_GE(task_runner_.GetClock()->Now() - started,
+            base::TimeDelta::FromSecondsD(0.9));
+}
+
+TEST_F(CloudCommandUpdaterTest, DestroyedWhileInFlight) {
+  DoneCallback callback;
+  EXPECT_CALL(cloud_updater_, UpdateCommand(kCmdID, _, _))
+      .WillOnce(SaveArg<2>(&callback));
+  command_instance_->Complete({}, nullptr);
+  task_runner_.RunOnce();
+  command_instance_.reset();
+
+  // The request still counts until it completes.
+  auto command2 = CreateCommandInstance("efgh");
+  auto command3 = CreateCommandInstance("ijkl");
+  EXPECT_CALL(cloud_updater_, UpdateCommand("efgh", _, _));
+  command2->Complete({}, nullptr);
+  command3->Complete({}, nullptr);
+  task_runner_.RunOnce();
+  testing::Mock::VerifyAndClearExpectations(&cloud_updater_);
+
+  EXPECT_CALL(cloud_updater_, UpdateCommand("ijkl", _, _));
+  callback.Run(nullptr);
+}
+
 }  // namespace weave
@@ -0,0 +1,160 @@
+// Copyright 2015 The Weave Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "src/commands/command_history.h"
+
+#include <algorithm>
+
+#include <base/logging.h>
+#include <weave/enum_to_string.h>
+
+namespace weave {
+
+namespace {
+
+// Events beyond this number are dropped, e.g. acknowledgments of many progress
+// updates of a long-running command.
+const size_t kMaxEventsPerCommand = 32;
+
+// Bucket |i| counts latencies below 2^i ms, but not below the previous limit.
+const size_t kHistogramBuckets = 16;
+
+const char* const kStageNames[] = {
+    "received",
+    "parsed",
+    "queued",
+    "handlerInvoked",
+    "stateChanged",
+    "cloudAcknowledged",
+};
+
+size_t GetBucket(base::TimeDelta latency) {
+  int64_t ms = latency.InMilliseconds();
+  size_t bucket = 0;
+  while (bucket + 1 < kHistogramBuckets && ms >= (int64_t{1} << bucket))
+    bucket++;
+  return bucket;
+}
+
+}  // anonymous namespace
+
+CommandHistory::Histogram::Histogram() : buckets(kHistogramBuckets) {}
+
+CommandHistory::CommandHistory(base::Clock* clock, size_t capacity)
+    : clock_{clock}, capacity_{capacity} {
+  CHECK(clock_);
+  CHECK_GT(capacity_, 0u);
+  records_.reserve(capacity_);
+}
+
+CommandHistory::~CommandHistory() {}
+
+void CommandHistory::RecordStage(const std::string& id,
+                                 const std::string& name,
+                                 Stage stage) {
+  AddEvent(id, name, Event{stage, Command::State::kQueued, clock_->Now()});
+}
+
+void CommandHistory::RecordStateChange(const std::string& id,
+                                       const std::string& name,
+                                       Command::State state) {
+  base::Time now = clock_->Now();
+  Record* record = AddEvent(id, name, Event{Stage::kStateChanged, state, now});
+  if (state != Command::State::kDone)
+    return;
+  base::TimeDelta latency = now - record->events.front().time;
+  Histogram& histogram = histograms_[record->name];
+  histogram.count++;
+  histogram.total += latency;
+  histogram.max = std::max(histogram.max, latency);
+  histogram.buckets[GetBucket(latency)]++;
+}
+
+CommandHistory::Record* CommandHistory::AddEvent(const std::string& id,
+                                                 const std::string& name,
+                                                 const Event& event) {
+  json_.reset();
+  Record* record = nullptr;
+  auto it = index_.find(id);
+  if (it != index_.end()) {
+    record = &records_[it->second];
+  } else {
+    if (records_.size() < capacity_) {
+      records_.emplace_back();
+    } else {
+      index_.erase(records_[next_].id);
+      records_[next_] = Record{};
+    }
+    index_.emplace(id, next_);
+    record = &records_[next_];
+    record->id = id;
+    next_ = (next_ + 1) % capacity_;
+  }
+  if (record->name.empty())
+    record->name = name;
+  if (record->events.size() < kMaxEventsPerCommand)
+    record->events.push_back(event);
+  return record;
+}
+
+const base::DictionaryValue& CommandHistory::GetJson() const {
+  if (json_)
+    return *json_;
+
+  std::unique_ptr<base::ListValue> commands{new base::ListValue};
+  // Until the buffer is full, |next_| equals to its size.
+  size_t first = records_.size() < capacity_ ? 0 : next_;
+  for (size_t i = 0; i < records_.size(); i++) {
+    const Record& record = records_[(first + i) % records_.size()];
+    base::Time start = record.events.front().time;
+    std::unique_ptr<base::ListValue> events{new base::ListValue};
+    for (const Event& event : record.events) {
+      std::unique_ptr<base::DictionaryValue> event_json{
+          new base::DictionaryValue};
+      event_json->SetString("stage",
+                            kStageNames[static_cast<size_t>(event.stage)]);
+      if (event.stage == Stage::kStateChanged)
+        event_json->SetString("state", EnumToString(event.state));
+      event_json->SetInteger(
+          "elapsedMs",
+          static_cast<int>((event.time - start).InMilliseconds()));
+      events->Append(event_json.release());
+    }
+    std::unique_ptr<base::DictionaryValue> command{new base::DictionaryValue};
+    command->SetString("id", record.id);
+    command->SetString("name", record.name);
+    command->SetDouble("timeMs", start.ToJavaTime());
+    command->Set("events", events.release());
+    commands->Append(command.release());
+  }
+
+  std::unique_ptr<base::ListValue> limits{new base::ListValue};
+  for (size_t i = 0; i + 1 < kHistogramBuckets; i++)
+    limits->AppendInteger(1 << i);
+  std::unique_ptr<base::DictionaryValue> histograms{new base::DictionaryValue};
+  for (const auto& pair : histograms_) {
+    const Histogram& histogram = pair.second;
+    std::unique_ptr<base::ListValue> buckets{new base::ListValue};
+    for (uint64_t count : histogram.buckets)
+      buckets->AppendInteger(static_cast<int>(count));
+    std::unique_ptr<base::DictionaryValue> histogram_json{
+        new base::DictionaryValue};
+    histogram_json->SetInteger("count", static_cast<int>(histogram.count));
+    histogram_json->SetDouble("totalMs", histogram.total.InMillisecondsF());
+    histogram_json->SetDouble("maxMs", histogram.max.InMillisecondsF());
+    histogram_json->Set("buckets", buckets.release());
+    // Command names contain dots, which would be taken for a path.
+    histograms->SetWithoutPathExpansion(pair.first, histogram_json.release());
+  }
+  std::unique_ptr<base::DictionaryValue> latency{new base::DictionaryValue};
+  latency->Set("bucketLimitsMs", limits.release());
+  latency->Set("histograms", histograms.release());
+
+  json_.reset(new base::DictionaryValue);
+  json_->Set("commands", commands.release());
+  json_->Set("latency", latency.release());
+  return *json_;
+}
+
+}  // namespace weave
@@ -0,0 +1,117 @@
+// Copyright 2015 The Weave Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef LIBWEAVE_SRC_COMMANDS_COMMAND_HISTORY_H_
+#define LIBWEAVE_SRC_COMMANDS_COMMAND_HISTORY_H_
+
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <base/macros.h>
+#include <base/time/clock.h>
+#include <base/time/time.h>
+#include <base/values.h>
+#include <weave/command.h>
+
+namespace weave {
+
+// Keeps timestamps of the lifecycle stages of the most recent commands in a
+// ring buffer, along with latency histograms of completed commands by command
+// name.
+class CommandHistory final {
+ public:
+  enum class Stage {
+    kReceived,           // Received from the cloud.
+    kParsed,             // Parsed and validated.
+    kQueued,             // Added to the command queue.
+    kHandlerInvoked,     // Passed to the command handler.
+    kStateChanged,       // Changed its state.
+    kCloudAcknowledged,  // A command update was accepted by the cloud.
+  };
+
+  // Keeps no more than |capacity| commands, dropping the oldest ones.
+  CommandHistory(base::Clock* clock, size_t capacity);
+  ~CommandHistory();
+
+  // Records |stage| of the command with |id|. |name| may be empty if it is not
+  // known yet.
+  void RecordStage(const std::string& id,
+                   const std::string& name,
+                   Stage stage);
+
+  // Records that the command with |id| changed its state to |state|. When the
+  // command is done, the time since its first recorded stage is added to the
+  // latency histogram of |name|.
+  void RecordStateChange(const std::string& id,
+                         const std::string& name,
+                         Command::State state);
+
+  // Returns the recorded commands, oldest first, and the latency histograms:
+  // {
+  //   "commands": [{
+  //     "id": "1", "name": "base.reboot", "timeMs": 1440000000000,
+  //     "events": [{"stage": "queued", "elapsedMs": 0},
+  //                {"stage": "stateChanged", "state": "done", "elapsedMs": 5}]
+  //   }],
+  //   "latency": {
+  //     "bucketLimitsMs": [1, 2, 4, ...],
+  //     "histograms": {
+  //       "base.reboot": {"count": 1, "totalMs": 5, "maxMs": 5,
+  //                       "buckets": [0, 0, 0, 1, 0, ...]}
+  //     }
+  //   }
+  // }
+  // The last bucket counts latencies above the last limit.
+  const base::DictionaryValue& GetJson() const;
+
+ private:
+  struct Event {
+    Stage stage;
+    Command::State state;
+    base::Time time;
+  };
+
+  struct Record {
+    std::string id;
+    std::string name;
+    std::vector<Event> events;
+  };
+
+  struct Histogram {
+    Histogram();
+
+    uint64_t count{0};
+    base::TimeDelta total;
+    base::TimeDelta max;
+    std::vector<uint64_t> buckets;
+  };
+
+  // Appends |event| to the record of command |id|, creating it if needed.
+  // Returns the record.
+  Record* AddEvent(const std::string& id,
+                   const std::string& name,
+                   const Event& event);
+
+  base::Clock* clock_{nullptr};
+  const size_t capacity_;
+
+  // Ring buffer of records. Once it is full, |next_| is the oldest record.
+  std::vector<Record> records_;
+  size_t next_{0};
+  // Index of |records_| by command ID.
+  std::unordered_map<std::string, size_t> index_;
+
+  std::unordered_map<std::string, Histogram> histograms_;
+
+  // Built on demand, reset on any change.
+  mutable std::unique_ptr<base::DictionaryValue> json_;
+
+  DISALLOW_COPY_AND_ASSIGN(CommandHistory);
+};
+
+}  // namespace weave
+
+#endif  // LIBWEAVE_SRC_COMMANDS_COMMAND_HISTORY_H_
@@ -0,0 +1,111 @@
+// Copyright 2015 The Weave Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "src/commands/command_history.h"
+
+#include <gmock/gmock.h>
+#include <gtest/gtest.h>
+#include <weave/test/unittest_utils.h>
+
+#include "src/test/mock_clock.h"
+
+namespace weave {
+
+using testing::Invoke;
+
+class CommandHistoryTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    EXPECT_CALL(clock_, Now()).WillRepeatedly(Invoke([this]() {
+      return now_;
+    }));
+  }
+
+  void Advance(int ms) { now_ += base::TimeDelta::FromMilliseconds(ms); }
+
+  base::Time now_{base::Time::FromTimeT(1440000000)};
+  test::MockClock clock_;
+  CommandHistory history_{&clock_, 2};
+};
+
+TEST_F(CommandHistoryTest, Lifecycle) {
+  history_.RecordStage("1", "", CommandHistory::Stage::kReceived);
+  Advance(1);
+  history_.RecordStage("1", "robot.jump", CommandHistory::Stage::kQueued);
+  Advance(2);
+  history_.RecordStateChange("1", "robot.jump", Command::State::kDone);
+  Advance(10);
+  history_.RecordStage("1", "robot.jump",
+                       CommandHistory::Stage::kCloudAcknowledged);
+
+  const char kExpected[] = R"({
+    'commands': [{
+      'id': '1',
+      'name': 'robot.jump',
+      'timeMs': 1440000000000.0,
+      'events': [
+        {'stage': 'received', 'elapsedMs': 0},
+        {'stage': 'queued', 'elapsedMs': 1},
+        {'stage': 'stateChanged', 'state': 'done', 'elapsedMs': 3},
+        {'stage': 'cloudAcknowledged', 'elapsedMs': 13}
+      ]
+    }],
+    'latency': {
+      'bucketLimitsMs': [1, 2, 4, 8, 16, 32, 64, 128, 256, 512, 1024, 2048,
+                         4096, 8192, 16384],
+      'histograms': {
+        'robot.jump': {
+          'count': 1,
+          'totalMs': 3.0,
+          'maxMs': 3.0,
+          'buckets': [0, 0, 1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0]
+        }
+      }
+    }
+  })";
+  EXPECT_JSON_EQ(kExpected, history_.GetJson());
+}
+
+TEST_F(CommandHistoryTest, DropsOldestCommands) {
+  history_.RecordStage("1", "robot.jump", CommandHistory::Stage::kQueued);
+  history_.RecordStage("2", "robot.jump", CommandHistory::Stage::kQueued);
+  history_.RecordStage("3", "robot.jump", CommandHistory::Stage::kQueued);
+  history_.RecordStage("2", "robot.jump",
+                       CommandHistory::Stage::kHandlerInvoked);
+
+  const base::ListValue* commands = nullptr;
+  ASSERT_TRUE(history_.GetJson().GetList("commands", &commands));
+  ASSERT_EQ(2u, commands->GetSize());
+  const base::DictionaryValue* command = nullptr;
+  ASSERT_TRUE(commands->GetDictionary(0, &command));
+  EXPECT_JSON_EQ(R"({
+    'id': '2', 'name': 'robot.jump', 'timeMs': 1440000000000.0,
+    'events': [{'stage': 'queued', 'elapsedMs': 0},
+               {'stage': 'handlerInvoked', 'elapsedMs': 0}]
+  })", *command);
+  ASSERT_TRUE(commands->GetDictionary(1, &command));
+  std::string id;
+  EXPECT_TRUE(command->GetString("id", &id));
+  EXPECT_EQ("3", id);
+}
+
+TEST_F(CommandHistoryTest, HistogramOverflow) {
+  history_.RecordStage("1", "robot.jump", CommandHistory::Stage::kQueued);
+  Advance(60000);
+  history_.RecordStateChange("1", "robot.jump", Command::State::kDone);
+  history_.RecordStage("2", "robot.jump", CommandHistory::Stage::kQueued);
+  history_.RecordStateChange("2", "robot.jump", Command::State::kAborted);
+
+  const base::DictionaryValue* histogram = nullptr;
+  ASSERT_TRUE(history_.GetJson().GetDictionary("latency.histograms",
+                                               &histogram));
+  ASSERT_TRUE(histogram->GetDictionaryWithoutPathExpansion("robot.jump",
+                                                           &histogram));
+  EXPECT_JSON_EQ(R"({
+    'count': 1, 'totalMs': 60000.0, 'maxMs': 60000.0,
+    'buckets': [0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1]
+  })", *histogram);
+}
+
+}  // namespace weave
@@ -4,6 +4,7 @@
 
 #include "src/commands/command_instance.h"
 
+#include <base/strings/string_number_conversions.h>
 #include <base/values.h>
 #include <weave/enum_to_string.h>
 #include <weave/error.h>
@@ -109,6 +110,7 @@ bool CommandInstance::SetProgress(const base::DictionaryValue& progress,
   if (!progress_.Equals(&progress)) {
     progress_.Clear();
     progress_.MergeDictionary(&progress);
+    json_.reset();
     FOR_EACH_OBSERVER(Observer, observers_, OnProgressChanged());
   }
 
@@ -120,6 +122,7 @@ bool CommandInstance::Complete(const base::DictionaryValue& results,
   if (!results_.Equals(&results)) {
     results_.Clear();
     results_.MergeDictionary(&results);
+    json_.reset();
     FOR_EACH_OBSERVER(Observer, observers_, OnResultsChanged());
   }
   // Change status even if result is unchanged.
@@ -131,6 +134,7 @@ bool CommandInstance::Complete(const base::DictionaryValue& results,
 
 bool CommandInstance::SetError(const Error* command_error, ErrorPtr* error) {
   error_ = command_error ? command_error->Clone() : nullptr;
+  json_.reset();
   FOR_EACH_OBSERVER(Observer, observers_, OnErrorChanged());
   return SetStatus(State::kError, error);
 }
@@ -164,6 +168,25 @@ std::unique_ptr<base::DictionaryValue> GetCommandParameters(
   return params;
 }
 
+// Reads a timestamp in milliseconds since epoch, which is sent by the server
+// either as a number or as a string.
+bool GetTimeMs(const base::DictionaryValue& json,
+               const char* name,
+               base::Time* time) {
+  const base::Value* value = nullptr;
+  if (!json.Get(name, &value))
+    return false;
+  double ms = 0;
+  std::string str;
+  int64_t ms_int = 0;
+  if (value->GetAsString(&str) && base::StringToInt64(str, &ms_int))
+    ms = ms_int;
+  else if (!value->GetAsDouble(&ms))
+    return false;
+  *time = base::Time::FromJsTime(ms);
+  return true;
+}
+
 }  // anonymous namespace
 
 std::unique_ptr<CommandInstance> CommandInstance::FromJson(
@@ -212,10 +235,30 @@ std::unique_ptr<CommandInstance> CommandInstance::FromJson(
   if (json->GetString(commands::attributes::kCommand_Component, &component))
     instance->SetComponent(component);
 
+  int priority = 0;
+  if (json->GetInteger(commands::attributes::kCommand_Priority, &priority))
+    instance->SetPriority(priority);
+
+  base::Time expiration_time;
+  if (GetTimeMs(*json, commands::attributes::kCommand_ExpirationTimeMs,
+                &expiration_time)) {
+    instance->SetExpirationTime(expiration_time);
+  }
+
   return instance;
 }
 
 std::unique_ptr<base::DictionaryValue> CommandInstance::ToJson() const {
+  return std::unique_ptr<base::DictionaryValue>{GetJson().DeepCopy()};
+}
+
+const base::DictionaryValue& CommandInstance::GetJson() const {
+  if (!json_)
+    json_ = BuildJson();
+  return *json_;
+}
+
+std::unique_ptr<base::DictionaryValue> CommandInstance::BuildJson() const {
   std::unique_ptr<base::DictionaryValue> json{new base::DictionaryValue};
 
   json->SetString(commands::attributes::kCommand_Id, id_);
@@ -246,6 +289,7 @@ bool CommandInstance::Pause(ErrorPtr* error) {
 
 bool CommandInstance::Abort(const Error* command_error, ErrorPtr* error) {
   error_ = command_error ? command_error->Clone() : nullptr;
+  json_.reset();
   FOR_EACH_OBSERVER(Observer, observers_, OnErrorChanged());
   bool result = SetStatus(State::kAborted, error);
   RemoveFromQueue();
@@ -253,6 +297,13 @@ bool CommandInstance::Abort(const Error* command_error, ErrorPtr* error) {
   return result;
 }
 
+bool CommandInstance::Expire(ErrorPtr* error) {
+  bool result = SetStatus(State::kExpired, error);
+  RemoveFromQueue();
+  // The command will be destroyed after that, so do not access any members.
+  return result;
+}
+
 bool CommandInstance::Cancel(ErrorPtr* error) {
   bool result = SetStatus(State::kCancelled, error);
   RemoveFromQueue();
@@ -278,6 +329,9 @@ bool CommandInstance::SetStatus(Command::State status, ErrorPtr* error) {
       break;
   }
   state_ = status;
+  json_.reset();
+  if (queue_)
+    queue_->GetHistory()->RecordStateChange(GetID(), GetName(), state_);
   FOR_EACH_OBSERVER(Observer, observers_, OnStateChanged());
   return true;
 }
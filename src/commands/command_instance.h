@@ -12,6 +12,7 @@
 
 #include <base/macros.h>
 #include <base/observer_list.h>
+#include <base/time/time.h>
 #include <weave/command.h>
 #include <weave/error.h>
 
@@ -79,10 +80,48 @@ class CommandInstance final : public Command {
 
   std::unique_ptr<base::DictionaryValue> ToJson() const;
 
+  // Returns the same JSON as ToJson() without copying it. The JSON is cached
+  // until the command changes, and the reference is valid until then.
+  const base::DictionaryValue& GetJson() const;
+
   // Sets the command ID (normally done by CommandQueue when the command
   // instance is added to it).
-  void SetID(const std::string& id) { id_ = id; }
-  void SetComponent(const std::string& component) { component_ = component; }
+  void SetID(const std::string& id) {
+    id_ = id;
+    json_.reset();
+  }
+  void SetComponent(const std::string& component) {
+    component_ = component;
+    handler_slot_ = 0;
+    json_.reset();
+  }
+
+  // Commands with higher priority are dispatched first when several commands
+  // are ready at once. Zero by default.
+  void SetPriority(int priority) { priority_ = priority; }
+  int GetPriority() const { return priority_; }
+
+  // Sets the time after which the command expires if it is still queued.
+  // Null time means that the command never expires.
+  void SetExpirationTime(base::Time time) { expiration_time_ = time; }
+  base::Time GetExpirationTime() const { return expiration_time_; }
+
+  // If set, adding the command to the queue cancels a still queued command
+  // with the same component and name, so only the latest one is executed.
+  void SetSupersedesPending(bool supersedes) {
+    supersedes_pending_ = supersedes;
+  }
+  bool SupersedesPending() const { return supersedes_pending_; }
+
+  // Moves a command which was not executed in time to the expired state and
+  // removes it from the queue.
+  bool Expire(ErrorPtr* error);
+
+  // Sets the slot of the command handler, as found by
+  // CommandQueue::FindHandlerSlot() for the component and name of this
+  // command. Zero means that the slot is not resolved yet.
+  void SetHandlerSlot(size_t slot) { handler_slot_ = slot; }
+  size_t GetHandlerSlot() const { return handler_slot_; }
 
   void AddObserver(Observer* observer);
   void RemoveObserver(Observer* observer);
@@ -92,6 +131,9 @@ class CommandInstance final : public Command {
   void DetachFromQueue() { queue_ = nullptr; }
 
  private:
+  // Builds the JSON returned by GetJson().
+  std::unique_ptr<base::DictionaryValue> BuildJson() const;
+
   // Helper function to update the command status.
   // Used by Abort(), Cancel(), Done() methods.
   bool SetStatus(Command::State status, ErrorPtr* error);
@@ -118,11 +160,21 @@ class CommandInstance final : public Command {
   Command::State state_ = Command::State::kQueued;
   // Error encountered during execution of the command.
   ErrorPtr error_;
+  // Cached result of GetJson(), reset whenever the command changes.
+  mutable std::unique_ptr<base::DictionaryValue> json_;
   // Command observers.
   base::ObserverList<Observer> observers_;
   // Pointer to the command queue this command instance is added to.
   // The queue owns the command instance, so it outlives this object.
   CommandQueue* queue_ = nullptr;
+  // Dispatch priority of the command.
+  int priority_ = 0;
+  // Time after which the queued command expires. Null if it never expires.
+  base::Time expiration_time_;
+  // Whether the command cancels the queued command it supersedes.
+  bool supersedes_pending_ = false;
+  // Slot of the command handler in |queue_|, resolved at parse time.
+  size_t handler_slot_ = 0;
 
   DISALLOW_COPY_AND_ASSIGN(CommandInstance);
 };
@@ -69,6 +69,32 @@ TEST(CommandInstanceTest, FromJson_ParamsOmitted) {
   EXPECT_JSON_EQ("{}", instance->GetParameters());
 }
 
+TEST(CommandInstanceTest, FromJson_PriorityAndExpiration) {
+  auto json = CreateDictionaryValue(R"({
+    'name': 'base.reboot',
+    'priority': 2,
+    'expirationTimeMs': '1450000000000'
+  })");
+  auto instance = CommandInstance::FromJson(json.get(), Command::Origin::kCloud,
+                                            nullptr, nullptr);
+  EXPECT_EQ(2, instance->GetPriority());
+  EXPECT_EQ(base::Time::FromJsTime(1450000000000.0),
+            instance->GetExpirationTime());
+
+  json = CreateDictionaryValue(
+      "{'name': 'base.reboot', 'expirationTimeMs': 1450000000000}");
+  instance = CommandInstance::FromJson(json.get(), Command::Origin::kCloud,
+                                       nullptr, nullptr);
+  EXPECT_EQ(0, instance->GetPriority());
+  EXPECT_EQ(base::Time::FromJsTime(1450000000000.0),
+            instance->GetExpirationTime());
+
+  json = CreateDictionaryValue("{'name': 'base.reboot'}");
+  instance = CommandInstance::FromJson(json.get(), Command::Origin::kCloud,
+                                       nullptr, nullptr);
+  EXPECT_TRUE(instance->GetExpirationTime().is_null());
+}
+
 TEST(CommandInstanceTest, FromJson_NotObject) {
   auto json = CreateValue("'string'");
   ErrorPtr error;
@@ -160,4 +186,42 @@ TEST(CommandInstanceTest, ToJsonError) {
                *json, *converted);
 }
 
+TEST(CommandInstanceTest, GetJsonCached) {
+  CommandInstance instance{"robot.jump", Command::Origin::kLocal, {}};
+  instance.SetID("1");
+  const base::DictionaryValue* json = &instance.GetJson();
+  EXPECT_EQ(json, &instance.GetJson());
+  EXPECT_TRUE(instance.ToJson()->Equals(json));
+
+  EXPECT_TRUE(
+      instance.SetProgress(*CreateDictionaryValue("{'p': 1}"), nullptr));
+  EXPECT_JSON_EQ(R"({
+    'id': '1',
+    'name': 'robot.jump',
+    'parameters': {},
+    'progress': {'p': 1},
+    'results': {},
+    'state': 'inProgress'
+  })",
+                 instance.GetJson());
+  json = &instance.GetJson();
+
+  // Nothing changed.
+  EXPECT_TRUE(
+      instance.SetProgress(*CreateDictionaryValue("{'p': 1}"), nullptr));
+  EXPECT_EQ(json, &instance.GetJson());
+
+  EXPECT_TRUE(
+      instance.Complete(*CreateDictionaryValue("{'r': 2}"), nullptr));
+  EXPECT_JSON_EQ(R"({
+    'id': '1',
+    'name': 'robot.jump',
+    'parameters': {},
+    'progress': {'p': 1},
+    'results': {'r': 2},
+    'state': 'done'
+  })",
+                 instance.GetJson());
+}
+
 }  // namespace weave
@@ -4,6 +4,8 @@
 
 #include "src/commands/command_queue.h"
 
+#include <algorithm>
+
 #include <base/bind.h>
 #include <base/time/time.h>
 
@@ -11,16 +13,63 @@ namespace weave {
 
 namespace {
 const int kRemoveCommandDelayMin = 5;
+const int kCleanupTickSec = 10;
+const size_t kMaxFinishedCommands = 500;
+const size_t kHistoryCapacity = 100;
+
+uint32_t InternId(const std::string& str,
+                  std::unordered_map<std::string, uint32_t>* ids) {
+  auto it = ids->find(str);
+  if (it != ids->end())
+    return it->second;
+  uint32_t id = ids->size() + 1;
+  ids->emplace(str, id);
+  return id;
+}
+
+uint32_t FindId(const std::string& str,
+                const std::unordered_map<std::string, uint32_t>& ids) {
+  auto it = ids.find(str);
+  return it != ids.end() ? it->second : 0;
+}
 
-std::string GetCommandHandlerKey(const std::string& component_path,
-                                 const std::string& command_name) {
-  return component_path + ":" + command_name;
+uint64_t GetHandlerKey(uint32_t component_id, uint32_t command_name_id) {
+  return (static_cast<uint64_t>(component_id) << 32) | command_name_id;
 }
+
+bool IsExpired(const CommandInstance& instance, base::Time now) {
+  return !instance.GetExpirationTime().is_null() &&
+         instance.GetExpirationTime() <= now;
+}
+
+// Runs |callback| for |commands| in the order of priority, keeping the order
+// of commands with equal priority. Expired commands are expired instead.
+void DispatchByPriority(std::vector<std::shared_ptr<CommandInstance>> commands,
+                        base::Time now,
+                        const Device::CommandHandlerCallback& callback) {
+  std::stable_sort(commands.begin(), commands.end(),
+                   [](const std::shared_ptr<CommandInstance>& a,
+                      const std::shared_ptr<CommandInstance>& b) {
+                     return a->GetPriority() > b->GetPriority();
+                   });
+  for (const auto& command : commands) {
+    if (IsExpired(*command, now))
+      command->Expire(nullptr);
+    else
+      callback.Run(command);
+  }
 }
 
+}  // anonymous namespace
+
 CommandQueue::CommandQueue(provider::TaskRunner* task_runner,
                            base::Clock* clock)
-    : task_runner_{task_runner}, clock_{clock} {}
+    : task_runner_{task_runner},
+      clock_{clock},
+      local_retention_{base::TimeDelta::FromMinutes(kRemoveCommandDelayMin)},
+      cloud_retention_{base::TimeDelta::FromMinutes(kRemoveCommandDelayMin)},
+      max_finished_commands_{kMaxFinishedCommands},
+      history_{clock, kHistoryCapacity} {}
 
 void CommandQueue::AddCommandAddedCallback(const CommandCallback& callback) {
   on_command_added_.push_back(callback);
@@ -37,39 +86,166 @@ void CommandQueue::AddCommandHandler(
     const std::string& component_path,
     const std::string& command_name,
     const Device::CommandHandlerCallback& callback) {
+  SetHandler(component_path, command_name,
+             base::Bind(&CommandQueue::RunHandler,
+                        weak_ptr_factory_.GetWeakPtr(), callback));
+}
+
+void CommandQueue::SetHandler(const std::string& component_path,
+                              const std::string& command_name,
+                              const Device::CommandHandlerCallback& callback) {
   if (!command_name.empty()) {
     CHECK(default_command_callback_.is_null())
         << "Commands specific handler are not allowed after default one";
 
+    size_t slot = ResolveHandlerSlot(component_path, command_name);
+    CHECK(handler_slots_[slot].is_null()) << command_name
+                                          << " already has handler";
+
+    // Commands already passed to the handler of their whole component, e.g.
+    // in a pending batch, stay with it.
+    std::vector<std::shared_ptr<CommandInstance>> commands;
     for (const auto& command : map_) {
       if (command.second->GetState() == Command::State::kQueued &&
-          command.second->GetName() == command_name &&
-          command.second->GetComponent() == component_path) {
-        callback.Run(command.second);
+          GetHandlerSlot(*command.second) == slot &&
+          !FindHandler(*command.second)) {
+        commands.push_back(command.second);
       }
     }
+    DispatchByPriority(std::move(commands), clock_->Now(), callback);
 
-    std::string key = GetCommandHandlerKey(component_path, command_name);
-    CHECK(command_callbacks_.insert(std::make_pair(key, callback)).second)
-        << command_name << " already has handler";
-
+    handler_slots_[slot] = callback;
   } else {
     CHECK(component_path.empty())
         << "Default handler must not be component-specific";
+    std::vector<std::shared_ptr<CommandInstance>> commands;
     for (const auto& command : map_) {
-      std::string key = GetCommandHandlerKey(command.second->GetComponent(),
-                                             command.second->GetName());
       if (command.second->GetState() == Command::State::kQueued &&
-          command_callbacks_.find(key) == command_callbacks_.end()) {
-        callback.Run(command.second);
+          !FindHandler(*command.second)) {
+        commands.push_back(command.second);
       }
     }
+    DispatchByPriority(std::move(commands), clock_->Now(), callback);
 
     CHECK(default_command_callback_.is_null()) << "Already has default handler";
     default_command_callback_ = callback;
   }
 }
 
+void CommandQueue::AddCommandBatchHandler(
+    const std::string& component_path,
+    const std::string& command_name,
+    const Device::CommandBatchHandlerCallback& callback) {
+  CHECK(!component_path.empty()) << "Batch handler must be component-specific";
+  batches_.emplace_back(new CommandBatch{callback, {}});
+  Device::CommandHandlerCallback add_to_batch =
+      base::Bind(&CommandQueue::AddToBatch, weak_ptr_factory_.GetWeakPtr(),
+                 batches_.back().get());
+  if (!command_name.empty())
+    return SetHandler(component_path, command_name, add_to_batch);
+
+  CHECK(default_command_callback_.is_null())
+      << "Commands specific handler are not allowed after default one";
+  uint32_t component_id = InternId(component_path, &component_ids_);
+  CHECK(component_handlers_.emplace(component_id, add_to_batch).second)
+      << component_path << " already has handler";
+
+  std::vector<std::shared_ptr<CommandInstance>> commands;
+  for (const auto& command : map_) {
+    if (command.second->GetState() == Command::State::kQueued &&
+        command.second->GetComponent() == component_path &&
+        handler_slots_[GetHandlerSlot(*command.second)].is_null()) {
+      commands.push_back(command.second);
+    }
+  }
+  DispatchByPriority(std::move(commands), clock_->Now(), add_to_batch);
+}
+
+void CommandQueue::AddToBatch(CommandBatch* batch,
+                              const std::weak_ptr<Command>& command) {
+  batch->commands.push_back(command);
+  if (batch->commands.size() > 1)
+    return;
+  task_runner_->PostDelayedTask(
+      FROM_HERE, base::Bind(&CommandQueue::DeliverBatch,
+                            weak_ptr_factory_.GetWeakPtr(), batch),
+      {});
+}
+
+void CommandQueue::DeliverBatch(CommandBatch* batch) {
+  std::vector<std::shared_ptr<CommandInstance>> queued;
+  for (const auto& command : batch->commands) {
+    // All commands in the queue are CommandInstances.
+    auto instance = std::static_pointer_cast<CommandInstance>(command.lock());
+    if (instance && instance->GetState() == Command::State::kQueued)
+      queued.push_back(instance);
+  }
+  batch->commands.clear();
+  if (queued.empty())
+    return;
+
+  std::stable_sort(queued.begin(), queued.end(),
+                   [](const std::shared_ptr<CommandInstance>& a,
+                      const std::shared_ptr<CommandInstance>& b) {
+                     return a->GetPriority() > b->GetPriority();
+                   });
+  for (const auto& instance : queued) {
+    history_.RecordStage(instance->GetID(), instance->GetName(),
+                         CommandHistory::Stage::kHandlerInvoked);
+  }
+  std::vector<std::weak_ptr<Command>> commands{queued.begin(), queued.end()};
+  batch->callback.Run(commands);
+}
+
+void CommandQueue::RunHandler(const Device::CommandHandlerCallback& callback,
+                              const std::weak_ptr<Command>& command) {
+  auto instance = command.lock();
+  if (instance) {
+    history_.RecordStage(instance->GetID(), instance->GetName(),
+                         CommandHistory::Stage::kHandlerInvoked);
+  }
+  callback.Run(command);
+}
+
+const Device::CommandHandlerCallback* CommandQueue::FindHandler(
+    const CommandInstance& instance) const {
+  const auto& handler = handler_slots_[GetHandlerSlot(instance)];
+  if (!handler.is_null())
+    return &handler;
+  if (component_handlers_.empty())
+    return nullptr;
+  auto it = component_handlers_.find(
+      FindId(instance.GetComponent(), component_ids_));
+  return it != component_handlers_.end() ? &it->second : nullptr;
+}
+
+size_t CommandQueue::ResolveHandlerSlot(const std::string& component_path,
+                                        const std::string& command_name) {
+  uint64_t key = GetHandlerKey(InternId(component_path, &component_ids_),
+                               InternId(command_name, &command_name_ids_));
+  auto pair = handler_slot_index_.emplace(key, handler_slots_.size());
+  if (pair.second)
+    handler_slots_.emplace_back();
+  return pair.first->second;
+}
+
+size_t CommandQueue::FindHandlerSlot(const std::string& component_path,
+                                     const std::string& command_name) const {
+  uint32_t component_id = FindId(component_path, component_ids_);
+  uint32_t command_name_id = FindId(command_name, command_name_ids_);
+  if (component_id == 0 || command_name_id == 0)
+    return 0;
+  auto it =
+      handler_slot_index_.find(GetHandlerKey(component_id, command_name_id));
+  return it != handler_slot_index_.end() ? it->second : 0;
+}
+
+size_t CommandQueue::GetHandlerSlot(const CommandInstance& instance) const {
+  if (instance.GetHandlerSlot() != 0)
+    return instance.GetHandlerSlot();
+  return FindHandlerSlot(instance.GetComponent(), instance.GetName());
+}
+
 void CommandQueue::Add(std::unique_ptr<CommandInstance> instance) {
   std::string id = instance->GetID();
   LOG_IF(FATAL, id.empty()) << "Command has no ID";
@@ -77,15 +253,41 @@ void CommandQueue::Add(std::unique_ptr<CommandInstance> instance) {
   auto pair = map_.insert(std::make_pair(id, std::move(instance)));
   LOG_IF(FATAL, !pair.second) << "Command with ID '" << id
                               << "' is already in the queue";
+  history_.RecordStage(id, pair.first->second->GetName(),
+                       CommandHistory::Stage::kQueued);
   for (const auto& cb : on_command_added_)
     cb.Run(pair.first->second.get());
 
-  std::string key = GetCommandHandlerKey(pair.first->second->GetComponent(),
-                                         pair.first->second->GetName());
-  auto it_handler = command_callbacks_.find(key);
+  base::Time expiration_time = pair.first->second->GetExpirationTime();
+  if (!expiration_time.is_null()) {
+    if (expiration_time <= clock_->Now()) {
+      pair.first->second->Expire(nullptr);
+      return;
+    }
+    expiration_queue_.push(std::make_pair(expiration_time, id));
+    ScheduleExpiration(expiration_time);
+  }
+
+  size_t slot = GetHandlerSlot(*pair.first->second);
+  if (pair.first->second->SupersedesPending()) {
+    auto& latest = latest_pending_[std::make_pair(
+        pair.first->second->GetComponent(), pair.first->second->GetName())];
+    auto superseded = latest.lock();
+    if (superseded && superseded->GetState() == Command::State::kQueued)
+      superseded->Cancel(nullptr);
+    latest = pair.first->second;
+  }
 
-  if (it_handler != command_callbacks_.end())
-    it_handler->second.Run(pair.first->second);
+  // Copied, as running the handler may add new ones and move the slots.
+  auto handler = handler_slots_[slot];
+  if (handler.is_null()) {
+    const Device::CommandHandlerCallback* component_handler =
+        FindHandler(*pair.first->second);
+    if (component_handler)
+      handler = *component_handler;
+  }
+  if (!handler.is_null())
+    handler.Run(pair.first->second);
   else if (!default_command_callback_.is_null())
     default_command_callback_.Run(pair.first->second);
 }
@@ -94,13 +296,40 @@ void CommandQueue::RemoveLater(const std::string& id) {
   auto p = map_.find(id);
   if (p == map_.end())
     return;
-  auto remove_delay = base::TimeDelta::FromMinutes(kRemoveCommandDelayMin);
-  remove_queue_.push(std::make_pair(clock_->Now() + remove_delay, id));
-  if (remove_queue_.size() == 1) {
-    // The queue was empty, this is the first command to be removed, schedule
-    // a clean-up task.
-    ScheduleCleanup(remove_delay);
-  }
+  ForgetLatestPending(*p->second);
+  base::TimeDelta retention = p->second->GetOrigin() == Command::Origin::kCloud
+                                  ? cloud_retention_
+                                  : local_retention_;
+  // Rounded up, so the command is kept for at least |retention|.
+  const base::TimeDelta tick = base::TimeDelta::FromSeconds(kCleanupTickSec);
+  size_t bucket = (retention + tick - base::TimeDelta::FromMicroseconds(1)) /
+                  tick;
+  // Make room first, so that the command just finished is kept.
+  while (finished_count_ >= max_finished_commands_)
+    RemoveOldestFinished();
+  if (expiry_buckets_.size() <= bucket)
+    expiry_buckets_.resize(bucket + 1);
+  expiry_buckets_[bucket].push_back(id);
+  finished_count_++;
+  if (!cleanup_scheduled_)
+    ScheduleCleanup();
+}
+
+void CommandQueue::SetRetention(Command::Origin origin,
+                                base::TimeDelta retention) {
+  CHECK(retention >= base::TimeDelta()) << "Retention must not be negative";
+  if (origin == Command::Origin::kCloud)
+    cloud_retention_ = retention;
+  else
+    local_retention_ = retention;
+}
+
+void CommandQueue::SetMaxFinishedCommands(size_t max_finished_commands) {
+  CHECK_GE(max_finished_commands, 1u)
+      << "At least one finished command must be kept";
+  max_finished_commands_ = max_finished_commands;
+  while (finished_count_ > max_finished_commands_)
+    RemoveOldestFinished();
 }
 
 bool CommandQueue::Remove(const std::string& id) {
@@ -108,6 +337,7 @@ bool CommandQueue::Remove(const std::string& id) {
   if (p == map_.end())
     return false;
   std::shared_ptr<CommandInstance> instance = p->second;
+  ForgetLatestPending(*instance);
   instance->DetachFromQueue();
   map_.erase(p);
   for (const auto& cb : on_command_removed_)
@@ -115,26 +345,78 @@ bool CommandQueue::Remove(const std::string& id) {
   return true;
 }
 
-void CommandQueue::Cleanup(const base::Time& cutoff_time) {
-  while (!remove_queue_.empty() && remove_queue_.top().first <= cutoff_time) {
-    Remove(remove_queue_.top().second);
-    remove_queue_.pop();
+void CommandQueue::RemoveOldestFinished() {
+  for (auto& bucket : expiry_buckets_) {
+    if (bucket.empty())
+      continue;
+    std::string id = std::move(bucket.front());
+    bucket.pop_front();
+    finished_count_--;
+    Remove(id);
+    return;
   }
+  NOTREACHED();
 }
 
-void CommandQueue::ScheduleCleanup(base::TimeDelta delay) {
+void CommandQueue::ForgetLatestPending(const CommandInstance& instance) {
+  if (!instance.SupersedesPending())
+    return;
+  auto it = latest_pending_.find(
+      std::make_pair(instance.GetComponent(), instance.GetName()));
+  if (it != latest_pending_.end() && it->second.lock().get() == &instance)
+    latest_pending_.erase(it);
+}
+
+void CommandQueue::ScheduleCleanup() {
+  cleanup_scheduled_ = true;
   task_runner_->PostDelayedTask(
       FROM_HERE,
       base::Bind(&CommandQueue::PerformScheduledCleanup,
                  weak_ptr_factory_.GetWeakPtr()),
-      delay);
+      base::TimeDelta::FromSeconds(kCleanupTickSec));
 }
 
 void CommandQueue::PerformScheduledCleanup() {
+  if (!expiry_buckets_.empty()) {
+    std::deque<std::string> expired;
+    expired.swap(expiry_buckets_.front());
+    expiry_buckets_.pop_front();
+    finished_count_ -= expired.size();
+    for (const std::string& id : expired)
+      Remove(id);
+  }
+  // Cleared only now, so commands finished by the removal callbacks above do
+  // not schedule another tick.
+  cleanup_scheduled_ = false;
+  if (finished_count_ > 0)
+    ScheduleCleanup();
+  else
+    expiry_buckets_.clear();
+}
+
+void CommandQueue::ExpireCommands() {
+  next_expiration_check_ = base::Time();
   base::Time now = clock_->Now();
-  Cleanup(now);
-  if (!remove_queue_.empty())
-    ScheduleCleanup(remove_queue_.top().first - now);
+  while (!expiration_queue_.empty() && expiration_queue_.top().first <= now) {
+    CommandInstance* instance = Find(expiration_queue_.top().second);
+    expiration_queue_.pop();
+    if (instance && instance->GetState() == Command::State::kQueued &&
+        IsExpired(*instance, now)) {
+      instance->Expire(nullptr);
+    }
+  }
+  if (!expiration_queue_.empty())
+    ScheduleExpiration(expiration_queue_.top().first);
+}
+
+void CommandQueue::ScheduleExpiration(base::Time time) {
+  if (!next_expiration_check_.is_null() && next_expiration_check_ <= time)
+    return;
+  next_expiration_check_ = time;
+  task_runner_->PostDelayedTask(
+      FROM_HERE, base::Bind(&CommandQueue::ExpireCommands,
+                            weak_ptr_factory_.GetWeakPtr()),
+      time - clock_->Now());
 }
 
 CommandInstance* CommandQueue::Find(const std::string& id) const {
@@ -5,10 +5,12 @@
 #ifndef LIBWEAVE_SRC_COMMANDS_COMMAND_QUEUE_H_
 #define LIBWEAVE_SRC_COMMANDS_COMMAND_QUEUE_H_
 
+#include <deque>
 #include <map>
 #include <memory>
 #include <queue>
 #include <string>
+#include <unordered_map>
 #include <utility>
 #include <vector>
 
@@ -19,6 +21,7 @@
 #include <weave/device.h>
 #include <weave/provider/task_runner.h>
 
+#include "src/commands/command_history.h"
 #include "src/commands/command_instance.h"
 
 namespace weave {
@@ -40,6 +43,28 @@ class CommandQueue final {
                          const std::string& command_name,
                          const Device::CommandHandlerCallback& callback);
 
+  // Adds a handler receiving commands in batches, see
+  // Device::AddCommandBatchHandler(). Empty |command_name| selects all commands
+  // sent to |component_path| which have no handler of their own.
+  void AddCommandBatchHandler(
+      const std::string& component_path,
+      const std::string& command_name,
+      const Device::CommandBatchHandlerCallback& callback);
+
+  // Returns the slot of the handler of |command_name| commands sent to the
+  // component at |component_path|, creating an empty one if needed.
+  // Slots are never released, so this is only meant for registered handlers.
+  size_t ResolveHandlerSlot(const std::string& component_path,
+                            const std::string& command_name);
+
+  // Returns the slot of the handler of |command_name| commands sent to the
+  // component at |component_path|, or zero if no handler was registered for
+  // them. Doesn't create anything, so it is safe for untrusted names. The slot
+  // is meant to be stored on the command with CommandInstance::SetHandlerSlot()
+  // when it is parsed, so Add() dispatches it without any lookup.
+  size_t FindHandlerSlot(const std::string& component_path,
+                         const std::string& command_name) const;
+
   // Checks if the command queue is empty.
   bool IsEmpty() const { return map_.empty(); }
 
@@ -49,12 +74,32 @@ class CommandQueue final {
   // Adds a new command to the queue. Each command in the queue has a unique
   // ID that identifies that command instance in this queue.
   // One shouldn't attempt to add a command with the same ID.
+  // A command past its expiration time is expired instead of being dispatched
+  // to the handler; other commands with an expiration time are expired later
+  // if they are still queued by then.
+  // A command which supersedes pending ones cancels the previous command with
+  // the same component and name if that one is still queued.
   void Add(std::unique_ptr<CommandInstance> instance);
 
   // Selects command identified by |id| ready for removal. Command will actually
-  // be removed after some time.
+  // be removed after the retention period of its origin, or earlier if there
+  // are too many finished commands.
   void RemoveLater(const std::string& id);
 
+  // Sets how long finished commands of |origin| stay in the queue. Applies to
+  // commands passed to RemoveLater() afterwards. The period is rounded up to
+  // the cleanup tick.
+  void SetRetention(Command::Origin origin, base::TimeDelta retention);
+
+  // Sets the maximum number of finished commands waiting for removal, at least
+  // one. When it would be exceeded, the commands which are the closest to their
+  // removal are removed right away.
+  void SetMaxFinishedCommands(size_t max_finished_commands);
+
+  // Returns the lifecycle history of recent commands.
+  CommandHistory* GetHistory() { return &history_; }
+  const CommandHistory* GetHistory() const { return &history_; }
+
   // Finds a command instance in the queue by the instance |id|. Returns
   // nullptr if the command with the given |id| is not found. The returned
   // pointer should not be persisted for a long period of time.
@@ -63,38 +108,113 @@ class CommandQueue final {
  private:
   friend class CommandQueueTest;
 
+  // Sets |callback| as the handler of |command_name| commands sent to
+  // |component_path|, or as the default handler if both are empty.
+  void SetHandler(const std::string& component_path,
+                  const std::string& command_name,
+                  const Device::CommandHandlerCallback& callback);
+
+  // Records in the history that |command| is passed to |callback| and runs it.
+  void RunHandler(const Device::CommandHandlerCallback& callback,
+                  const std::weak_ptr<Command>& command);
+
   // Removes a command identified by |id| from the queue.
   bool Remove(const std::string& id);
 
-  // Removes old commands scheduled by RemoveLater() to be deleted after
-  // |cutoff_time|.
-  void Cleanup(const base::Time& cutoff_time);
-
-  // Schedule a cleanup task to be run after the specified |delay|.
-  void ScheduleCleanup(base::TimeDelta delay);
+  // Schedules the next cleanup tick.
+  void ScheduleCleanup();
 
-  // Perform removal of scheduled commands (by calling Cleanup()) and scheduling
-  // another cleanup task if the removal queue is still not empty.
+  // Removes commands expiring on this tick and the ones over the limit of
+  // finished commands, and schedules the next tick if there are more finished
+  // commands.
   void PerformScheduledCleanup();
 
+  // Removes the finished command which is the closest to its removal.
+  void RemoveOldestFinished();
+
+  // Drops |instance| from |latest_pending_| if it is the latest command there.
+  void ForgetLatestPending(const CommandInstance& instance);
+
+  // Expires commands which are still queued after their expiration time and
+  // schedules the next check.
+  void ExpireCommands();
+
+  // Schedules ExpireCommands() to run at |time| unless it runs before then.
+  void ScheduleExpiration(base::Time time);
+
+  // Commands accumulated for a batch handler.
+  struct CommandBatch {
+    Device::CommandBatchHandlerCallback callback;
+    std::vector<std::weak_ptr<Command>> commands;
+  };
+
+  // Adds |command| to |batch| and schedules delivery of the batch.
+  void AddToBatch(CommandBatch* batch, const std::weak_ptr<Command>& command);
+
+  // Passes the commands of |batch| which are still queued to its handler.
+  void DeliverBatch(CommandBatch* batch);
+
+  // Returns the handler of |instance|: the handler of its command, or else
+  // the handler of all commands of its component. Returns nullptr if there
+  // is none.
+  const Device::CommandHandlerCallback* FindHandler(
+      const CommandInstance& instance) const;
+
+  // Returns the handler slot of |instance|, looking it up if it was not
+  // resolved at parse time. Returns zero if no handler was ever resolved for
+  // the command.
+  size_t GetHandlerSlot(const CommandInstance& instance) const;
+
   provider::TaskRunner* task_runner_{nullptr};
   base::Clock* clock_{nullptr};
 
   // ID-to-CommandInstance map.
-  std::map<std::string, std::shared_ptr<CommandInstance>> map_;
-
-  // Queue of commands to be removed, keeps them sorted by the timestamp
-  // (earliest first). This is done to tolerate system clock changes.
+  std::unordered_map<std::string, std::shared_ptr<CommandInstance>> map_;
+
+  // IDs of finished commands to be removed, bucketed by the cleanup tick
+  // they expire on. The front bucket expires on the next tick. Counting ticks
+  // instead of comparing timestamps tolerates system clock changes.
+  std::deque<std::deque<std::string>> expiry_buckets_;
+  // Number of IDs in |expiry_buckets_|.
+  size_t finished_count_{0};
+  bool cleanup_scheduled_{false};
+
+  // The last command superseding pending ones, by component and name. Those
+  // are validated when the command is parsed. Entries are dropped when their
+  // command finishes.
+  std::map<std::pair<std::string, std::string>,
+           std::weak_ptr<CommandInstance>>
+      latest_pending_;
+
+  // Commands with an expiration time, earliest first.
   template <typename T>
   using InversePriorityQueue =
       std::priority_queue<T, std::vector<T>, std::greater<T>>;
-  InversePriorityQueue<std::pair<base::Time, std::string>> remove_queue_;
+  InversePriorityQueue<std::pair<base::Time, std::string>> expiration_queue_;
+  // Time of the next scheduled ExpireCommands() call, null if none.
+  base::Time next_expiration_check_;
+
+  base::TimeDelta local_retention_;
+  base::TimeDelta cloud_retention_;
+  size_t max_finished_commands_;
 
   using CallbackList = std::vector<CommandCallback>;
   CallbackList on_command_added_;
   CallbackList on_command_removed_;
-  std::map<std::string, Device::CommandHandlerCallback> command_callbacks_;
+  // Interned component paths and command names. IDs start from one.
+  std::unordered_map<std::string, uint32_t> component_ids_;
+  std::unordered_map<std::string, uint32_t> command_name_ids_;
+  // Maps the pair of component and command name IDs to the handler slot.
+  std::unordered_map<uint64_t, size_t> handler_slot_index_;
+  // Command handlers by slot. Slot zero is never resolved and stays empty.
+  std::vector<Device::CommandHandlerCallback> handler_slots_{1};
   Device::CommandHandlerCallback default_command_callback_;
+  // Handlers of all commands of a component, by interned component path.
+  std::unordered_map<uint32_t, Device::CommandHandlerCallback>
+      component_handlers_;
+  std::vector<std::unique_ptr<CommandBatch>> batches_;
+
+  CommandHistory history_;
 
   // WeakPtr factory for controlling the lifetime of command queue cleanup
   // tasks.
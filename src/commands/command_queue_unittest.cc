@@ -4,6 +4,7 @@
 
 #include "src/commands/command_queue.h"
 
+#include <algorithm>
 #include <set>
 #include <string>
 #include <vector>
@@ -26,21 +27,26 @@ class CommandQueueTest : public testing::Test {
  public:
   std::unique_ptr<CommandInstance> CreateDummyCommandInstance(
       const std::string& name,
-      const std::string& id) {
-    std::unique_ptr<CommandInstance> cmd{
-        new CommandInstance{name, Command::Origin::kLocal, {}}};
+      const std::string& id,
+      Command::Origin origin = Command::Origin::kLocal) {
+    std::unique_ptr<CommandInstance> cmd{new CommandInstance{name, origin, {}}};
     cmd->SetID(id);
     return cmd;
   }
 
   bool Remove(const std::string& id) { return queue_.Remove(id); }
 
-  void Cleanup(const base::TimeDelta& interval) {
-    return queue_.Cleanup(task_runner_.GetClock()->Now() + interval);
+  size_t GetHandlerSlotCount() const { return queue_.handler_slots_.size(); }
+
+  size_t GetLatestPendingCount() const {
+    return queue_.latest_pending_.size();
   }
 
-  std::string GetFirstCommandToBeRemoved() const {
-    return queue_.remove_queue_.top().second;
+  // Runs posted tasks scheduled within |interval| from now.
+  void RunFor(const base::TimeDelta& interval) {
+    base::Time end = task_runner_.GetClock()->Now() + interval;
+    while (task_runner_.GetClock()->Now() < end && task_runner_.RunOnce()) {
+    }
   }
 
   StrictMock<provider::test::FakeTaskRunner> task_runner_;
@@ -123,23 +129,28 @@ TEST_F(CommandQueueTest, RemoveLater) {
   queue_.RemoveLater(id1);
   EXPECT_EQ(1u, queue_.GetCount());
 
-  Cleanup(base::TimeDelta::FromMinutes(1));
+  RunFor(base::TimeDelta::FromMinutes(1));
   EXPECT_EQ(1u, queue_.GetCount());
 
-  Cleanup(base::TimeDelta::FromMinutes(15));
+  RunFor(base::TimeDelta::FromMinutes(15));
   EXPECT_EQ(0u, queue_.GetCount());
+  EXPECT_EQ(0u, task_runner_.GetTaskQueueSize());
 }
 
 TEST_F(CommandQueueTest, RemoveLaterOnCleanupTask) {
   const std::string id1 = "id1";
+  const std::string id2 = "id2";
   queue_.Add(CreateDummyCommandInstance("base.reboot", id1));
-  EXPECT_EQ(1u, queue_.GetCount());
+  queue_.Add(CreateDummyCommandInstance("base.reboot", id2));
+  EXPECT_EQ(2u, queue_.GetCount());
 
   queue_.RemoveLater(id1);
-  EXPECT_EQ(1u, queue_.GetCount());
+  queue_.RemoveLater(id2);
+  EXPECT_EQ(2u, queue_.GetCount());
+  // A single periodic cleanup task serves all finished commands.
   ASSERT_EQ(1u, task_runner_.GetTaskQueueSize());
 
-  task_runner_.RunOnce();
+  task_runner_.Run();
 
   EXPECT_EQ(0u, queue_.GetCount());
   EXPECT_EQ(0u, task_runner_.GetTaskQueueSize());
@@ -154,22 +165,70 @@ TEST_F(CommandQueueTest, CleanupMultipleCommands) {
   auto remove_task = [this](const std::string& id) { queue_.RemoveLater(id); };
   remove_task(id1);
   task_runner_.PostDelayedTask(FROM_HERE, base::Bind(remove_task, id2),
-                               base::TimeDelta::FromSeconds(10));
+                               base::TimeDelta::FromMinutes(1));
   EXPECT_EQ(2u, queue_.GetCount());
   ASSERT_EQ(2u, task_runner_.GetTaskQueueSize());
-  task_runner_.RunOnce();  // Executes "remove_task(id2) @ T+10s".
-  ASSERT_EQ(2u, queue_.GetCount());
-  ASSERT_EQ(1u, task_runner_.GetTaskQueueSize());
-  EXPECT_EQ(id1, GetFirstCommandToBeRemoved());
-  task_runner_.RunOnce();  // Should remove task "id1" from queue.
-  ASSERT_EQ(1u, queue_.GetCount());
-  ASSERT_EQ(1u, task_runner_.GetTaskQueueSize());
-  EXPECT_EQ(id2, GetFirstCommandToBeRemoved());
-  task_runner_.RunOnce();  // Should remove task "id2" from queue.
+  RunFor(base::TimeDelta::FromMinutes(5) + base::TimeDelta::FromSeconds(10));
+  EXPECT_EQ(nullptr, queue_.Find(id1));
+  EXPECT_NE(nullptr, queue_.Find(id2));
+  RunFor(base::TimeDelta::FromMinutes(1));
   EXPECT_EQ(0u, queue_.GetCount());
   EXPECT_EQ(0u, task_runner_.GetTaskQueueSize());
 }
 
+TEST_F(CommandQueueTest, RetentionPerOrigin) {
+  queue_.SetRetention(Command::Origin::kLocal,
+                      base::TimeDelta::FromMinutes(10));
+  queue_.SetRetention(Command::Origin::kCloud, base::TimeDelta::FromMinutes(1));
+  queue_.Add(CreateDummyCommandInstance("base.reboot", "local"));
+  queue_.Add(CreateDummyCommandInstance("base.reboot", "cloud",
+                                        Command::Origin::kCloud));
+  queue_.RemoveLater("local");
+  queue_.RemoveLater("cloud");
+
+  RunFor(base::TimeDelta::FromSeconds(50));
+  EXPECT_EQ(2u, queue_.GetCount());
+  RunFor(base::TimeDelta::FromSeconds(20));
+  EXPECT_EQ(nullptr, queue_.Find("cloud"));
+  EXPECT_NE(nullptr, queue_.Find("local"));
+  RunFor(base::TimeDelta::FromMinutes(8));
+  EXPECT_NE(nullptr, queue_.Find("local"));
+  RunFor(base::TimeDelta::FromMinutes(2));
+  EXPECT_EQ(0u, queue_.GetCount());
+}
+
+TEST_F(CommandQueueTest, MaxFinishedCommands) {
+  queue_.SetRetention(Command::Origin::kCloud, base::TimeDelta::FromMinutes(1));
+  queue_.SetMaxFinishedCommands(2);
+  for (const char* id : {"id1", "id2", "id3", "id4"})
+    queue_.Add(CreateDummyCommandInstance("base.reboot", id));
+  queue_.Add(CreateDummyCommandInstance("base.reboot", "cloud",
+                                        Command::Origin::kCloud));
+
+  queue_.RemoveLater("id1");
+  queue_.RemoveLater("id2");
+  queue_.RemoveLater("id3");
+  queue_.RemoveLater("cloud");
+  EXPECT_EQ(nullptr, queue_.Find("id1"));
+  EXPECT_EQ(nullptr, queue_.Find("id2"));
+  EXPECT_EQ(3u, queue_.GetCount());
+  queue_.RemoveLater("id4");
+  // The cloud command expires first, so it is evicted before older ones.
+  EXPECT_EQ(nullptr, queue_.Find("cloud"));
+  EXPECT_EQ(2u, queue_.GetCount());
+
+  queue_.SetMaxFinishedCommands(1);
+  EXPECT_EQ(nullptr, queue_.Find("id3"));
+  EXPECT_NE(nullptr, queue_.Find("id4"));
+
+  task_runner_.Run();
+  EXPECT_TRUE(queue_.IsEmpty());
+}
+
+TEST_F(CommandQueueTest, MaxFinishedCommandsAtLeastOne) {
+  EXPECT_DEATH(queue_.SetMaxFinishedCommands(0), "");
+}
+
 TEST_F(CommandQueueTest, Dispatch) {
   FakeDispatcher dispatch(&queue_);
   const std::string id1 = "id1";
@@ -186,6 +245,288 @@ TEST_F(CommandQueueTest, Dispatch) {
   EXPECT_EQ("", dispatch.GetIDs());
 }
 
+TEST_F(CommandQueueTest, HandlerSlots) {
+  size_t slot = queue_.ResolveHandlerSlot("comp", "base.reboot");
+  EXPECT_NE(0u, slot);
+  EXPECT_EQ(slot, queue_.ResolveHandlerSlot("comp", "base.reboot"));
+  EXPECT_NE(slot, queue_.ResolveHandlerSlot("comp", "base.shutdown"));
+  EXPECT_NE(slot, queue_.ResolveHandlerSlot("comp2", "base.reboot"));
+  EXPECT_EQ(slot, queue_.FindHandlerSlot("comp", "base.reboot"));
+
+  // Looking up names without a handler doesn't create anything.
+  size_t slot_count = GetHandlerSlotCount();
+  EXPECT_EQ(0u, queue_.FindHandlerSlot("comp3", "base.reboot"));
+  EXPECT_EQ(0u, queue_.FindHandlerSlot("comp", "base.unknown"));
+  EXPECT_EQ(slot_count, GetHandlerSlotCount());
+
+  std::vector<std::string> handled;
+  auto handler = [&handled](const std::string& tag,
+                            const std::weak_ptr<Command>& command) {
+    handled.push_back(tag + ":" + command.lock()->GetID());
+  };
+
+  // Queued before the handler is added, with the slot resolved at parse time.
+  auto command = CreateDummyCommandInstance("base.reboot", "id1");
+  command->SetComponent("comp");
+  command->SetHandlerSlot(slot);
+  queue_.Add(std::move(command));
+  // Queued without a resolved slot.
+  command = CreateDummyCommandInstance("base.reboot", "id2");
+  command->SetComponent("comp");
+  queue_.Add(std::move(command));
+  EXPECT_TRUE(handled.empty());
+
+  queue_.AddCommandHandler("comp", "base.reboot", base::Bind(handler, "h1"));
+  std::sort(handled.begin(), handled.end());
+  EXPECT_EQ((std::vector<std::string>{"h1:id1", "h1:id2"}), handled);
+  handled.clear();
+
+  command = CreateDummyCommandInstance("base.reboot", "id3");
+  command->SetComponent("comp");
+  command->SetHandlerSlot(slot);
+  queue_.Add(std::move(command));
+  EXPECT_EQ(std::vector<std::string>{"h1:id3"}, handled);
+  handled.clear();
+
+  command = CreateDummyCommandInstance("base.shutdown", "id4");
+  command->SetComponent("comp");
+  queue_.Add(std::move(command));
+  EXPECT_TRUE(handled.empty());
+
+  queue_.AddCommandHandler("", "", base::Bind(handler, "default"));
+  EXPECT_EQ(std::vector<std::string>{"default:id4"}, handled);
+  handled.clear();
+
+  command = CreateDummyCommandInstance("base.shutdown", "id5");
+  command->SetComponent("comp2");
+  command->SetHandlerSlot(queue_.ResolveHandlerSlot("comp2", "base.shutdown"));
+  queue_.Add(std::move(command));
+  EXPECT_EQ(std::vector<std::string>{"default:id5"}, handled);
+}
+
+TEST_F(CommandQueueTest, DispatchByPriority) {
+  std::vector<std::string> handled;
+  auto handler = [&handled](const std::weak_ptr<Command>& command) {
+    handled.push_back(command.lock()->GetID());
+  };
+
+  const std::pair<const char*, int> kCommands[] = {
+      {"low", -1}, {"high", 10}, {"normal", 0}};
+  for (const auto& pair : kCommands) {
+    auto command = CreateDummyCommandInstance("base.reboot", pair.first);
+    command->SetComponent("comp");
+    command->SetPriority(pair.second);
+    queue_.Add(std::move(command));
+  }
+  queue_.AddCommandHandler("comp", "base.reboot", base::Bind(handler));
+  EXPECT_EQ((std::vector<std::string>{"high", "normal", "low"}), handled);
+}
+
+TEST_F(CommandQueueTest, ExpireCommands) {
+  base::Time now = task_runner_.GetClock()->Now();
+  std::vector<std::string> handled;
+  auto handler = [&handled](const std::weak_ptr<Command>& command) {
+    handled.push_back(command.lock()->GetID());
+  };
+  queue_.AddCommandHandler("", "", base::Bind(handler));
+
+  // Expired before it is added.
+  auto command = CreateDummyCommandInstance("base.reboot", "stale");
+  command->SetExpirationTime(now - base::TimeDelta::FromSeconds(1));
+  queue_.Add(std::move(command));
+  EXPECT_EQ(Command::State::kExpired, queue_.Find("stale")->GetState());
+
+  // Dispatched in time, but still queued when it expires.
+  command = CreateDummyCommandInstance("base.reboot", "queued");
+  command->SetExpirationTime(now + base::TimeDelta::FromSeconds(30));
+  queue_.Add(std::move(command));
+
+  // Started in time.
+  command = CreateDummyCommandInstance("base.reboot", "started");
+  command->SetExpirationTime(now + base::TimeDelta::FromSeconds(10));
+  queue_.Add(std::move(command));
+  EXPECT_TRUE(queue_.Find("started")->SetProgress({}, nullptr));
+
+  EXPECT_EQ((std::vector<std::string>{"queued", "started"}), handled);
+
+  RunFor(base::TimeDelta::FromSeconds(20));
+  EXPECT_EQ(Command::State::kQueued, queue_.Find("queued")->GetState());
+  EXPECT_EQ(Command::State::kInProgress, queue_.Find("started")->GetState());
+
+  RunFor(base::TimeDelta::FromSeconds(20));
+  EXPECT_EQ(Command::State::kExpired, queue_.Find("queued")->GetState());
+  EXPECT_EQ(Command::State::kInProgress, queue_.Find("started")->GetState());
+
+  task_runner_.Run();
+  EXPECT_EQ(nullptr, queue_.Find("stale"));
+  EXPECT_EQ(nullptr, queue_.Find("queued"));
+  EXPECT_NE(nullptr, queue_.Find("started"));
+}
+
+TEST_F(CommandQueueTest, SupersedePending) {
+  size_t slot = queue_.ResolveHandlerSlot("comp", "light.set");
+  auto add_command = [this, slot](const std::string& id) {
+    auto command = CreateDummyCommandInstance("light.set", id);
+    command->SetComponent("comp");
+    command->SetHandlerSlot(slot);
+    command->SetSupersedesPending(true);
+    queue_.Add(std::move(command));
+  };
+
+  add_command("id1");
+  add_command("id2");
+  EXPECT_EQ(Command::State::kCancelled, queue_.Find("id1")->GetState());
+  EXPECT_EQ(Command::State::kQueued, queue_.Find("id2")->GetState());
+
+  // Commands already picked up by the handler are not cancelled.
+  EXPECT_TRUE(queue_.Find("id2")->SetProgress({}, nullptr));
+  add_command("id3");
+  EXPECT_EQ(Command::State::kInProgress, queue_.Find("id2")->GetState());
+  EXPECT_EQ(Command::State::kQueued, queue_.Find("id3")->GetState());
+
+  // Commands which do not supersede pending ones are kept.
+  auto command = CreateDummyCommandInstance("light.set", "id4");
+  command->SetComponent("comp");
+  command->SetHandlerSlot(slot);
+  queue_.Add(std::move(command));
+  EXPECT_EQ(Command::State::kQueued, queue_.Find("id3")->GetState());
+
+  // The latest command is forgotten once it finishes.
+  EXPECT_EQ(1u, GetLatestPendingCount());
+  EXPECT_TRUE(queue_.Find("id3")->Cancel(nullptr));
+  EXPECT_EQ(0u, GetLatestPendingCount());
+  add_command("id5");
+  EXPECT_EQ(1u, GetLatestPendingCount());
+  EXPECT_TRUE(Remove("id5"));
+  EXPECT_EQ(0u, GetLatestPendingCount());
+}
+
+TEST_F(CommandQueueTest, BatchHandler) {
+  std::vector<std::vector<std::string>> batches;
+  auto handler = [&batches](
+      const std::vector<std::weak_ptr<Command>>& commands) {
+    batches.emplace_back();
+    for (const auto& command : commands)
+      batches.back().push_back(command.lock()->GetID());
+  };
+  auto add_command = [this](const std::string& name, const std::string& id,
+                            int priority) {
+    auto command = CreateDummyCommandInstance(name, id);
+    command->SetComponent("comp");
+    command->SetPriority(priority);
+    queue_.Add(std::move(command));
+  };
+
+  // Commands queued before registration are delivered in one batch.
+  add_command("bus.write", "id1", 0);
+  add_command("bus.write", "id2", 0);
+  queue_.AddCommandBatchHandler("comp", "bus.write", base::Bind(handler));
+  EXPECT_TRUE(batches.empty());
+  task_runner_.RunOnce();
+  ASSERT_EQ(1u, batches.size());
+  std::sort(batches[0].begin(), batches[0].end());
+  EXPECT_EQ((std::vector<std::string>{"id1", "id2"}), batches[0]);
+  batches.clear();
+
+  // Commands added during one task are accumulated and ordered by priority.
+  add_command("bus.write", "id3", 0);
+  add_command("bus.write", "id4", 1);
+  add_command("bus.write", "id5", 0);
+  EXPECT_TRUE(queue_.Find("id5")->Cancel(nullptr));
+  task_runner_.RunOnce();
+  EXPECT_EQ((std::vector<std::vector<std::string>>{{"id4", "id3"}}), batches);
+}
+
+TEST_F(CommandQueueTest, ComponentBatchHandler) {
+  std::vector<std::string> batched;
+  auto batch_handler = [&batched](
+      const std::vector<std::weak_ptr<Command>>& commands) {
+    for (const auto& command : commands)
+      batched.push_back(command.lock()->GetID());
+  };
+  std::vector<std::string> handled;
+  auto handler = [&handled](const std::weak_ptr<Command>& command) {
+    handled.push_back(command.lock()->GetID());
+  };
+  auto add_command = [this](const std::string& name, const std::string& id,
+                            const std::string& component) {
+    auto command = CreateDummyCommandInstance(name, id);
+    command->SetComponent(component);
+    queue_.Add(std::move(command));
+  };
+
+  queue_.AddCommandHandler("comp", "bus.reset", base::Bind(handler));
+  queue_.AddCommandBatchHandler("comp", "", base::Bind(batch_handler));
+  queue_.AddCommandHandler("", "", base::Bind(handler));
+
+  add_command("bus.write", "id1", "comp");
+  add_command("bus.read", "id2", "comp");
+  add_command("bus.reset", "id3", "comp");
+  add_command("bus.write", "id4", "other");
+  task_runner_.RunOnce();
+
+  EXPECT_EQ((std::vector<std::string>{"id1", "id2"}), batched);
+  EXPECT_EQ((std::vector<std::string>{"id3", "id4"}), handled);
+}
+
+TEST_F(CommandQueueTest, HandlerAfterComponentBatchHandler) {
+  std::vector<std::string> batched;
+  auto batch_handler = [&batched](
+      const std::vector<std::weak_ptr<Command>>& commands) {
+    for (const auto& command : commands)
+      batched.push_back(command.lock()->GetID());
+  };
+  std::vector<std::string> handled;
+  auto handler = [&handled](const std::weak_ptr<Command>& command) {
+    handled.push_back(command.lock()->GetID());
+  };
+
+  queue_.AddCommandBatchHandler("comp", "", base::Bind(batch_handler));
+  auto command = CreateDummyCommandInstance("bus.write", "id1");
+  command->SetComponent("comp");
+  queue_.Add(std::move(command));
+  // The command is already in a batch, so it isn't passed to the new handler.
+  queue_.AddCommandHandler("comp", "bus.write", base::Bind(handler));
+  task_runner_.RunOnce();
+  EXPECT_EQ((std::vector<std::string>{"id1"}), batched);
+  EXPECT_TRUE(handled.empty());
+
+  command = CreateDummyCommandInstance("bus.write", "id2");
+  command->SetComponent("comp");
+  queue_.Add(std::move(command));
+  EXPECT_EQ((std::vector<std::string>{"id2"}), handled);
+}
+
+TEST_F(CommandQueueTest, History) {
+  auto handler = [](const std::weak_ptr<Command>& command) {
+    EXPECT_TRUE(command.lock()->Complete({}, nullptr));
+  };
+  queue_.AddCommandHandler("", "base.reboot", base::Bind(handler));
+  queue_.Add(CreateDummyCommandInstance("base.reboot", "id1"));
+
+  const base::ListValue* commands = nullptr;
+  ASSERT_TRUE(queue_.GetHistory()->GetJson().GetList("commands", &commands));
+  ASSERT_EQ(1u, commands->GetSize());
+  const base::DictionaryValue* command = nullptr;
+  ASSERT_TRUE(commands->GetDictionary(0, &command));
+  const base::ListValue* events = nullptr;
+  ASSERT_TRUE(command->GetList("events", &events));
+  std::vector<std::string> stages;
+  for (const base::Value* event : *events) {
+    const base::DictionaryValue* event_dict = nullptr;
+    ASSERT_TRUE(event->GetAsDictionary(&event_dict));
+    std::string stage;
+    EXPECT_TRUE(event_dict->GetString("stage", &stage));
+    std::string state;
+    if (event_dict->GetString("state", &state))
+      stage += ":" + state;
+    stages.push_back(stage);
+  }
+  EXPECT_EQ((std::vector<std::string>{"queued", "handlerInvoked",
+                                      "stateChanged:done"}),
+            stages);
+}
+
 TEST_F(CommandQueueTest, Find) {
   const std::string id1 = "id1";
   const std::string id2 = "id2";
@@ -31,6 +31,10 @@ const char kCommand_Progress[] = "progress";
 const char kCommand_Results[] = "results";
 const char kCommand_State[] = "state";
 const char kCommand_Error[] = "error";
+const char kCommand_Priority[] = "priority";
+const char kCommand_ExpirationTimeMs[] = "expirationTimeMs";
+const char kCommand_ExpirationTimeoutMs[] = "expirationTimeoutMs";
+const char kCommand_SupersedePending[] = "supersedePending";
 
 const char kCommand_Role[] = "minimalRole";
 const char kCommand_Role_Manager[] = "manager";
@@ -33,6 +33,10 @@ extern const char kCommand_Progress[];
 extern const char kCommand_Results[];
 extern const char kCommand_State[];
 extern const char kCommand_Error[];
+extern const char kCommand_Priority[];
+extern const char kCommand_ExpirationTimeMs[];
+extern const char kCommand_ExpirationTimeoutMs[];
+extern const char kCommand_SupersedePending[];
 
 extern const char kCommand_Role[];
 extern const char kCommand_Role_Manager[];
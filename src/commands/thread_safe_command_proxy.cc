@@ -0,0 +1,200 @@
+// Copyright 2015 The Weave Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "src/commands/thread_safe_command_proxy.h"
+
+#include <base/bind.h>
+#include <base/logging.h>
+#include <weave/enum_to_string.h>
+#include <weave/provider/task_runner.h>
+
+#include "src/commands/schema_constants.h"
+
+namespace weave {
+
+namespace {
+
+bool IsTerminalState(Command::State state) {
+  switch (state) {
+    case Command::State::kDone:
+    case Command::State::kCancelled:
+    case Command::State::kAborted:
+    case Command::State::kExpired:
+      return true;
+    default:
+      return false;
+  }
+}
+
+void ApplyUpdate(const std::weak_ptr<Command>& command,
+                 const std::string& id,
+                 const ThreadSafeCommandProxy::Update& update) {
+  auto instance = command.lock();
+  if (!instance) {
+    LOG(WARNING) << "Command '" << id << "' is gone, update dropped";
+    return;
+  }
+  ErrorPtr error;
+  if (!update.Run(instance.get(), &error)) {
+    LOG(ERROR) << "Failed to update command '" << id
+               << "': " << error->GetMessage();
+  }
+}
+
+bool DoSetProgress(const base::DictionaryValue* progress,
+                   Command* command,
+                   ErrorPtr* error) {
+  return command->SetProgress(*progress, error);
+}
+
+bool DoComplete(const base::DictionaryValue* results,
+                Command* command,
+                ErrorPtr* error) {
+  return command->Complete(*results, error);
+}
+
+bool DoPause(Command* command, ErrorPtr* error) {
+  return command->Pause(error);
+}
+
+bool DoSetError(const Error* command_error, Command* command, ErrorPtr* error) {
+  return command->SetError(command_error, error);
+}
+
+bool DoAbort(const Error* command_error, Command* command, ErrorPtr* error) {
+  return command->Abort(command_error, error);
+}
+
+bool DoCancel(Command* command, ErrorPtr* error) {
+  return command->Cancel(error);
+}
+
+}  // anonymous namespace
+
+ThreadSafeCommandProxy::ThreadSafeCommandProxy(
+    const std::weak_ptr<Command>& command,
+    provider::TaskRunner* task_runner)
+    : command_{command}, task_runner_{task_runner} {
+  auto instance = command.lock();
+  CHECK(instance);
+  CHECK(task_runner_);
+  id_ = instance->GetID();
+  name_ = instance->GetName();
+  component_ = instance->GetComponent();
+  origin_ = instance->GetOrigin();
+  state_ = instance->GetState();
+  parameters_.reset(instance->GetParameters().DeepCopy());
+  progress_.reset(instance->GetProgress().DeepCopy());
+  results_.reset(instance->GetResults().DeepCopy());
+  if (instance->GetError())
+    error_ = instance->GetError()->Clone();
+}
+
+ThreadSafeCommandProxy::~ThreadSafeCommandProxy() {}
+
+const std::string& ThreadSafeCommandProxy::GetID() const {
+  return id_;
+}
+
+const std::string& ThreadSafeCommandProxy::GetName() const {
+  return name_;
+}
+
+const std::string& ThreadSafeCommandProxy::GetComponent() const {
+  return component_;
+}
+
+Command::State ThreadSafeCommandProxy::GetState() const {
+  return state_;
+}
+
+Command::Origin ThreadSafeCommandProxy::GetOrigin() const {
+  return origin_;
+}
+
+const base::DictionaryValue& ThreadSafeCommandProxy::GetParameters() const {
+  return *parameters_;
+}
+
+const base::DictionaryValue& ThreadSafeCommandProxy::GetProgress() const {
+  return *progress_;
+}
+
+const base::DictionaryValue& ThreadSafeCommandProxy::GetResults() const {
+  return *results_;
+}
+
+const Error* ThreadSafeCommandProxy::GetError() const {
+  return error_.get();
+}
+
+bool ThreadSafeCommandProxy::SetProgress(const base::DictionaryValue& progress,
+                                         ErrorPtr* error) {
+  if (!PostUpdate(State::kInProgress,
+                  base::Bind(&DoSetProgress, base::Owned(progress.DeepCopy())),
+                  error)) {
+    return false;
+  }
+  progress_.reset(progress.DeepCopy());
+  return true;
+}
+
+bool ThreadSafeCommandProxy::Complete(const base::DictionaryValue& results,
+                                      ErrorPtr* error) {
+  if (!PostUpdate(State::kDone,
+                  base::Bind(&DoComplete, base::Owned(results.DeepCopy())),
+                  error)) {
+    return false;
+  }
+  results_.reset(results.DeepCopy());
+  return true;
+}
+
+bool ThreadSafeCommandProxy::Pause(ErrorPtr* error) {
+  return PostUpdate(State::kPaused, base::Bind(&DoPause), error);
+}
+
+bool ThreadSafeCommandProxy::SetError(const Error* command_error,
+                                      ErrorPtr* error) {
+  ErrorPtr copy = command_error ? command_error->Clone() : nullptr;
+  if (!PostUpdate(State::kError,
+                  base::Bind(&DoSetError, base::Owned(copy.release())),
+                  error)) {
+    return false;
+  }
+  error_ = command_error ? command_error->Clone() : nullptr;
+  return true;
+}
+
+bool ThreadSafeCommandProxy::Abort(const Error* command_error,
+                                   ErrorPtr* error) {
+  ErrorPtr copy = command_error ? command_error->Clone() : nullptr;
+  if (!PostUpdate(State::kAborted,
+                  base::Bind(&DoAbort, base::Owned(copy.release())), error)) {
+    return false;
+  }
+  error_ = command_error ? command_error->Clone() : nullptr;
+  return true;
+}
+
+bool ThreadSafeCommandProxy::Cancel(ErrorPtr* error) {
+  return PostUpdate(State::kCancelled, base::Bind(&DoCancel), error);
+}
+
+bool ThreadSafeCommandProxy::PostUpdate(Command::State state,
+                                        const Update& update,
+                                        ErrorPtr* error) {
+  if (IsTerminalState(state_)) {
+    return Error::AddToPrintf(error, FROM_HERE, errors::commands::kInvalidState,
+                              "State switch impossible: '%s' -> '%s'",
+                              EnumToString(state_).c_str(),
+                              EnumToString(state).c_str());
+  }
+  state_ = state;
+  task_runner_->PostDelayedTask(
+      FROM_HERE, base::Bind(&ApplyUpdate, command_, id_, update), {});
+  return true;
+}
+
+}  // namespace weave
@@ -0,0 +1,82 @@
+// Copyright 2015 The Weave Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef LIBWEAVE_SRC_COMMANDS_THREAD_SAFE_COMMAND_PROXY_H_
+#define LIBWEAVE_SRC_COMMANDS_THREAD_SAFE_COMMAND_PROXY_H_
+
+#include <memory>
+#include <string>
+
+#include <base/callback.h>
+#include <base/macros.h>
+#include <base/values.h>
+#include <weave/command.h>
+#include <weave/error.h>
+
+namespace weave {
+
+namespace provider {
+class TaskRunner;
+}
+
+// Command proxy which can be used from a thread other than the one running
+// libweave. Getters return a snapshot of the command taken when the proxy was
+// created, as modified by the proxy's own setters. Setters post the change to
+// the TaskRunner, which applies it to the actual command.
+// The proxy must be created on the thread running libweave, but then it can be
+// used from any single thread at a time.
+class ThreadSafeCommandProxy final : public Command {
+ public:
+  // Changes the actual |command| and returns false on failure.
+  using Update = base::Callback<bool(Command* command, ErrorPtr* error)>;
+
+  ThreadSafeCommandProxy(const std::weak_ptr<Command>& command,
+                         provider::TaskRunner* task_runner);
+  ~ThreadSafeCommandProxy() override;
+
+  // Command implementation.
+  const std::string& GetID() const override;
+  const std::string& GetName() const override;
+  const std::string& GetComponent() const override;
+  Command::State GetState() const override;
+  Command::Origin GetOrigin() const override;
+  const base::DictionaryValue& GetParameters() const override;
+  const base::DictionaryValue& GetProgress() const override;
+  const base::DictionaryValue& GetResults() const override;
+  const Error* GetError() const override;
+  bool SetProgress(const base::DictionaryValue& progress,
+                   ErrorPtr* error) override;
+  bool Complete(const base::DictionaryValue& results,
+                ErrorPtr* error) override;
+  bool Pause(ErrorPtr* error) override;
+  bool SetError(const Error* command_error, ErrorPtr* error) override;
+  bool Abort(const Error* command_error, ErrorPtr* error) override;
+  bool Cancel(ErrorPtr* error) override;
+
+ private:
+  // Moves the snapshot into |state| and posts |update|. Fails without posting
+  // anything if the snapshot is already in a terminal state.
+  bool PostUpdate(Command::State state,
+                  const Update& update,
+                  ErrorPtr* error);
+
+  std::weak_ptr<Command> command_;
+  provider::TaskRunner* task_runner_{nullptr};
+
+  std::string id_;
+  std::string name_;
+  std::string component_;
+  Command::Origin origin_;
+  Command::State state_;
+  std::unique_ptr<base::DictionaryValue> parameters_;
+  std::unique_ptr<base::DictionaryValue> progress_;
+  std::unique_ptr<base::DictionaryValue> results_;
+  ErrorPtr error_;
+
+  DISALLOW_COPY_AND_ASSIGN(ThreadSafeCommandProxy);
+};
+
+}  // namespace weave
+
+#endif  // LIBWEAVE_SRC_COMMANDS_THREAD_SAFE_COMMAND_PROXY_H_
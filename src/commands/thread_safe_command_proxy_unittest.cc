@@ -0,0 +1,92 @@
+// Copyright 2015 The Weave Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "src/commands/thread_safe_command_proxy.h"
+
+#include <thread>
+
+#include <gtest/gtest.h>
+#include <weave/provider/test/fake_task_runner.h>
+#include <weave/test/unittest_utils.h>
+
+#include "src/commands/command_instance.h"
+
+namespace weave {
+
+using test::CreateDictionaryValue;
+
+class ThreadSafeCommandProxyTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    command_ = std::make_shared<CommandInstance>(
+        "robot.speak", Command::Origin::kCloud,
+        *CreateDictionaryValue("{'phrase': 'iPityDaFool'}"));
+    command_->SetID("1");
+    proxy_.reset(new ThreadSafeCommandProxy{command_, &task_runner_});
+  }
+
+  provider::test::FakeTaskRunner task_runner_;
+  std::shared_ptr<CommandInstance> command_;
+  std::unique_ptr<ThreadSafeCommandProxy> proxy_;
+};
+
+TEST_F(ThreadSafeCommandProxyTest, Snapshot) {
+  EXPECT_EQ("1", proxy_->GetID());
+  EXPECT_EQ("robot.speak", proxy_->GetName());
+  EXPECT_EQ(Command::Origin::kCloud, proxy_->GetOrigin());
+  EXPECT_EQ(Command::State::kQueued, proxy_->GetState());
+  EXPECT_JSON_EQ("{'phrase': 'iPityDaFool'}", proxy_->GetParameters());
+}
+
+TEST_F(ThreadSafeCommandProxyTest, UpdatesFromWorkerThread) {
+  std::thread worker{[this]() {
+    EXPECT_TRUE(
+        proxy_->SetProgress(*CreateDictionaryValue("{'p': 50}"), nullptr));
+    EXPECT_EQ(Command::State::kInProgress, proxy_->GetState());
+    EXPECT_TRUE(proxy_->Complete(*CreateDictionaryValue("{'r': 1}"), nullptr));
+  }};
+  worker.join();
+
+  EXPECT_EQ(Command::State::kDone, proxy_->GetState());
+  EXPECT_JSON_EQ("{'p': 50}", proxy_->GetProgress());
+  EXPECT_JSON_EQ("{'r': 1}", proxy_->GetResults());
+
+  // Nothing is applied until the TaskRunner runs.
+  EXPECT_EQ(Command::State::kQueued, command_->GetState());
+  EXPECT_EQ(2u, task_runner_.GetTaskQueueSize());
+  task_runner_.RunOnce();
+  EXPECT_EQ(Command::State::kInProgress, command_->GetState());
+  EXPECT_JSON_EQ("{'p': 50}", command_->GetProgress());
+  task_runner_.RunOnce();
+  EXPECT_EQ(Command::State::kDone, command_->GetState());
+  EXPECT_JSON_EQ("{'r': 1}", command_->GetResults());
+}
+
+TEST_F(ThreadSafeCommandProxyTest, Abort) {
+  ErrorPtr command_error;
+  Error::AddTo(&command_error, FROM_HERE, "busy", "Device is busy");
+  EXPECT_TRUE(proxy_->Abort(command_error.get(), nullptr));
+  EXPECT_EQ("busy", proxy_->GetError()->GetCode());
+
+  task_runner_.RunOnce();
+  EXPECT_EQ(Command::State::kAborted, command_->GetState());
+  EXPECT_EQ("busy", command_->GetError()->GetCode());
+}
+
+TEST_F(ThreadSafeCommandProxyTest, TerminalState) {
+  EXPECT_TRUE(proxy_->Cancel(nullptr));
+  ErrorPtr error;
+  EXPECT_FALSE(proxy_->SetProgress({}, &error));
+  EXPECT_EQ("invalid_state", error->GetCode());
+  EXPECT_EQ(1u, task_runner_.GetTaskQueueSize());
+}
+
+TEST_F(ThreadSafeCommandProxyTest, CommandDestroyed) {
+  EXPECT_TRUE(proxy_->Pause(nullptr));
+  command_.reset();
+  task_runner_.RunOnce();
+  EXPECT_EQ(Command::State::kPaused, proxy_->GetState());
+}
+
+}  // namespace weave
@@ -51,6 +51,15 @@ class ComponentManager {
     UpdateID update_id;
     std::vector<ComponentStateChange> state_changes;
   };
+  // Counters of state writes, i.e. SetStateProperties() and
+  // UpdateStateProperty() calls.
+  struct StateWriteStats {
+    uint64_t writes{0};
+    // Writes dropped because they would not change any property.
+    uint64_t suppressed_writes{0};
+    // Properties dropped from writes because they already had the same value.
+    uint64_t suppressed_properties{0};
+  };
 
   ComponentManager() {}
   virtual ~ComponentManager() {}
@@ -125,6 +134,16 @@ class ComponentManager {
   // Find a command instance with the given ID in the command queue.
   virtual CommandInstance* FindCommand(const std::string& id) = 0;
 
+  // Records |stage| of the command with |id| in the command history. |name|
+  // may be empty if it is not known yet.
+  virtual void RecordCommandStage(const std::string& id,
+                                  const std::string& name,
+                                  CommandHistory::Stage stage) = 0;
+
+  // Returns the lifecycle history of recent commands and their latency
+  // histograms, see CommandHistory::GetJson().
+  virtual const base::DictionaryValue& GetCommandHistory() const = 0;
+
   // Command queue monitoring callbacks (called when a new command is added to
   // or removed from the queue).
   virtual void AddCommandAddedCallback(
@@ -141,6 +160,19 @@ class ComponentManager {
       const std::string& command_name,
       const Device::CommandHandlerCallback& callback) = 0;
 
+  // Adds a handler receiving commands in batches. Empty |command_name| selects
+  // all commands of the component without a handler of their own.
+  virtual void AddCommandBatchHandler(
+      const std::string& component_path,
+      const std::string& command_name,
+      const Device::CommandBatchHandlerCallback& callback) = 0;
+
+  // Sets how long finished commands stay in the queue, by origin, and the
+  // maximum number of finished commands kept.
+  virtual void SetCommandRetention(base::TimeDelta local_retention,
+                                   base::TimeDelta cloud_retention,
+                                   size_t max_finished_commands) = 0;
+
   // Finds a component instance by its full path.
   virtual const base::DictionaryValue* FindComponent(const std::string& path,
                                                      ErrorPtr* error) const = 0;
@@ -178,12 +210,32 @@ class ComponentManager {
                                 const std::string& name,
                                 const base::Value& value,
                                 ErrorPtr* error) = 0;
+  // Resolves state property |name| of component at |component_path| into a
+  // |handle| for UpdateStateProperty(). See Device::GetStatePropertyHandle().
+  virtual bool GetStatePropertyHandle(const std::string& component_path,
+                                      const std::string& name,
+                                      Device::StatePropertyHandle* handle,
+                                      ErrorPtr* error) = 0;
+  virtual bool UpdateStateProperty(Device::StatePropertyHandle handle,
+                                   const base::Value& value,
+                                   ErrorPtr* error) = 0;
+  // Queues a state property update from any thread. See
+  // Device::EnqueueStateUpdate().
+  virtual bool EnqueueStateUpdate(Device::StatePropertyHandle handle,
+                                  const base::FundamentalValue& value) = 0;
+  // Groups state updates under a single change ID and a single state changed
+  // notification. See Device::BeginStateTransaction().
+  virtual void BeginStateTransaction() = 0;
+  virtual void CommitStateTransaction() = 0;
 
   virtual void AddStateChangedCallback(const base::Closure& callback) = 0;
 
   // Returns the recorded state changes since last time this method was called.
   virtual StateSnapshot GetAndClearRecordedStateChanges() = 0;
 
+  // Returns counters of state writes since the start.
+  virtual StateWriteStats GetStateWriteStats() const = 0;
+
   // Called to notify that the state patch with |id| has been successfully sent
   // to the server and processed.
   virtual void NotifyStateUpdatedOnServer(UpdateID id) = 0;
@@ -4,6 +4,9 @@
 
 #include "src/component_manager_impl.h"
 
+#include <algorithm>
+
+#include <base/bind.h>
 #include <base/strings/string_number_conversions.h>
 #include <base/strings/string_util.h>
 #include <base/strings/stringprintf.h>
@@ -18,6 +21,9 @@ namespace weave {
 namespace {
 // Max of 100 state update events should be enough in the queue.
 const size_t kMaxStateChangeQueueSize = 100;
+// Max number of state updates queued by EnqueueStateUpdate() and not applied
+// yet. It is also the max number of updates applied by a single task.
+const size_t kStateIngestionQueueSize = 1024;
 
 const EnumToStringMap<UserRole>::Map kMap[] = {
     {UserRole::kViewer, commands::attributes::kCommand_Role_Viewer},
@@ -25,6 +31,240 @@ const EnumToStringMap<UserRole>::Map kMap[] = {
     {UserRole::kOwner, commands::attributes::kCommand_Role_Owner},
     {UserRole::kManager, commands::attributes::kCommand_Role_Manager},
 };
+
+const char kCoalescing[] = "coalescing";
+
+// Reads the state change coalescing policy from the "coalescing" attribute of
+// a trait or state property definition, e.g.:
+//   "coalescing": {"minIntervalMs": 1000, "deadband": 0.5,
+//                  "lastValueOnly": true}
+// Attributes not specified keep their value in |policy|.
+bool ReadStateChangePolicy(const base::DictionaryValue& definition,
+                           StateChangePolicy* policy) {
+  const base::DictionaryValue* dict = nullptr;
+  if (!definition.GetDictionary(kCoalescing, &dict))
+    return false;
+  int min_interval_ms = 0;
+  if (dict->GetInteger("minIntervalMs", &min_interval_ms))
+    policy->min_interval = base::TimeDelta::FromMilliseconds(min_interval_ms);
+  dict->GetDouble("deadband", &policy->deadband);
+  dict->GetBoolean("lastValueOnly", &policy->last_value_only);
+  return true;
+}
+
+// Moves attribute |key| of |definition|, if any, to |local|.
+void MoveAttribute(const char* key,
+                   base::DictionaryValue* definition,
+                   base::DictionaryValue* local) {
+  scoped_ptr<base::Value> value;
+  if (definition->RemoveWithoutPathExpansion(key, &value))
+    local->SetWithoutPathExpansion(key, value.release());
+}
+
+// Moves attributes |keys| of the definitions listed in the |member| dictionary
+// of |definition| (e.g. the properties in "state") to the same place in
+// |local|.
+void MoveMemberAttributes(const char* member,
+                          const std::vector<const char*>& keys,
+                          base::DictionaryValue* definition,
+                          base::DictionaryValue* local) {
+  base::DictionaryValue* members = nullptr;
+  if (!definition->GetDictionaryWithoutPathExpansion(member, &members))
+    return;
+  std::unique_ptr<base::DictionaryValue> local_members{
+      new base::DictionaryValue};
+  for (base::DictionaryValue::Iterator it(*members); !it.IsAtEnd();
+       it.Advance()) {
+    base::DictionaryValue* member_def = nullptr;
+    if (!members->GetDictionaryWithoutPathExpansion(it.key(), &member_def))
+      continue;
+    std::unique_ptr<base::DictionaryValue> local_def{new base::DictionaryValue};
+    for (const char* key : keys)
+      MoveAttribute(key, member_def, local_def.get());
+    if (!local_def->empty())
+      local_members->SetWithoutPathExpansion(it.key(), local_def.release());
+  }
+  if (!local_members->empty())
+    local->SetWithoutPathExpansion(member, local_members.release());
+}
+
+// Moves the attributes of trait definition |trait_def| which only configure
+// this device to |local_def|, so that they are not published with the trait.
+void SplitLocalTraitAttributes(base::DictionaryValue* trait_def,
+                               base::DictionaryValue* local_def) {
+  MoveAttribute(kCoalescing, trait_def, local_def);
+  MoveMemberAttributes("state", {kCoalescing}, trait_def, local_def);
+  MoveMemberAttributes("commands",
+                       {commands::attributes::kCommand_Priority,
+                        commands::attributes::kCommand_ExpirationTimeoutMs,
+                        commands::attributes::kCommand_SupersedePending},
+                       trait_def, local_def);
+}
+
+// Returns the definition of command |command_name| ("trait.command") in
+// |traits|, or nullptr if there is none.
+const base::DictionaryValue* FindCommandIn(const base::DictionaryValue& traits,
+                                           const std::string& command_name) {
+  const base::DictionaryValue* definition = nullptr;
+  std::vector<std::string> components = Split(command_name, ".", true, false);
+  // Make sure the |command_name| came in form of trait_name.command_name.
+  if (components.size() != 2)
+    return definition;
+  std::string key = base::StringPrintf("%s.commands.%s", components[0].c_str(),
+                                       components[1].c_str());
+  traits.GetDictionary(key, &definition);
+  return definition;
+}
+
+// Returns true if a component called |name| can be addressed by a path. Paths
+// are split at '.' and '[', and their elements are trimmed, so components with
+// other names can't be found by path and are not indexed.
+bool IsValidPathElement(const std::string& name) {
+  if (name.empty() || name.find_first_of(".[") != std::string::npos)
+    return false;
+  std::string trimmed;
+  base::TrimWhitespaceASCII(name, base::TRIM_ALL, &trimmed);
+  return trimmed == name;
+}
+
+std::string AppendPath(const std::string& path, const std::string& name) {
+  return path.empty() ? name : path + '.' + name;
+}
+
+// Returns true if |path| is |root| itself or a path to one of its
+// sub-components.
+bool IsInSubtree(const std::string& path, const std::string& root) {
+  if (path.compare(0, root.size(), root) != 0)
+    return false;
+  return path.size() == root.size() || path[root.size()] == '.' ||
+         path[root.size()] == '[';
+}
+
+// Overwrites |target| with |source| if both hold a primitive value of the same
+// type. Returns false if |target| has to be replaced instead.
+bool AssignValueInPlace(const base::Value& source, base::Value* target) {
+  if (source.GetType() != target->GetType())
+    return false;
+  switch (source.GetType()) {
+    case base::Value::TYPE_NULL:
+      return true;
+    case base::Value::TYPE_BOOLEAN:
+    case base::Value::TYPE_INTEGER:
+    case base::Value::TYPE_DOUBLE:
+      *static_cast<base::FundamentalValue*>(target) =
+          static_cast<const base::FundamentalValue&>(source);
+      return true;
+    case base::Value::TYPE_STRING:
+      *static_cast<base::StringValue*>(target)->GetString() =
+          static_cast<const base::StringValue&>(source).GetString();
+      return true;
+    default:
+      return false;
+  }
+}
+
+// Same as base::DictionaryValue::MergeDictionary(), but primitive properties
+// already present in |state| are updated in place. Periodic state updates then
+// do not allocate a new base::Value for every property they touch, and
+// pointers returned by GetStateProperty() stay valid.
+void MergeState(const base::DictionaryValue& patch,
+                base::DictionaryValue* state) {
+  for (base::DictionaryValue::Iterator it(patch); !it.IsAtEnd(); it.Advance()) {
+    base::Value* existing = nullptr;
+    if (state->GetWithoutPathExpansion(it.key(), &existing)) {
+      const base::DictionaryValue* sub_patch = nullptr;
+      base::DictionaryValue* sub_state = nullptr;
+      if (it.value().GetAsDictionary(&sub_patch) &&
+          existing->GetAsDictionary(&sub_state)) {
+        MergeState(*sub_patch, sub_state);
+        continue;
+      }
+      if (AssignValueInPlace(it.value(), existing))
+        continue;
+    }
+    state->SetWithoutPathExpansion(it.key(), it.value().DeepCopy());
+  }
+}
+
+// Returns true if merging |patch| into |target| would leave |target| as is.
+bool IsUnchangedByMerge(const base::Value& patch, const base::Value& target) {
+  const base::DictionaryValue* patch_dict = nullptr;
+  const base::DictionaryValue* target_dict = nullptr;
+  if (!patch.GetAsDictionary(&patch_dict) ||
+      !target.GetAsDictionary(&target_dict)) {
+    return patch.Equals(&target);
+  }
+  for (base::DictionaryValue::Iterator it(*patch_dict); !it.IsAtEnd();
+       it.Advance()) {
+    const base::Value* value = nullptr;
+    if (!target_dict->GetWithoutPathExpansion(it.key(), &value) ||
+        !IsUnchangedByMerge(it.value(), *value)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Returns true if setting property |name| of |trait| to |value| would not
+// change |state|.
+bool IsUnchangedProperty(const base::DictionaryValue& state,
+                         const std::string& trait,
+                         const std::string& name,
+                         const base::Value& value) {
+  const base::DictionaryValue* trait_state = nullptr;
+  const base::Value* existing = nullptr;
+  return state.GetDictionaryWithoutPathExpansion(trait, &trait_state) &&
+         trait_state->GetWithoutPathExpansion(name, &existing) &&
+         IsUnchangedByMerge(value, *existing);
+}
+
+// Counts state properties in |patch| (trait to property to value) which
+// already have the same value in |state|. If there are any, |changes|
+// receives the remaining part of |patch|.
+size_t FilterUnchangedProperties(
+    const base::DictionaryValue& patch,
+    const base::DictionaryValue& state,
+    std::unique_ptr<base::DictionaryValue>* changes) {
+  size_t unchanged = 0;
+  for (base::DictionaryValue::Iterator trait(patch); !trait.IsAtEnd();
+       trait.Advance()) {
+    const base::DictionaryValue* properties = nullptr;
+    if (!trait.value().GetAsDictionary(&properties))
+      continue;
+    for (base::DictionaryValue::Iterator prop(*properties); !prop.IsAtEnd();
+         prop.Advance()) {
+      if (IsUnchangedProperty(state, trait.key(), prop.key(), prop.value()))
+        unchanged++;
+    }
+  }
+  if (unchanged == 0)
+    return 0;
+
+  changes->reset(new base::DictionaryValue);
+  for (base::DictionaryValue::Iterator trait(patch); !trait.IsAtEnd();
+       trait.Advance()) {
+    const base::DictionaryValue* properties = nullptr;
+    if (!trait.value().GetAsDictionary(&properties)) {
+      (*changes)->SetWithoutPathExpansion(trait.key(),
+                                          trait.value().DeepCopy());
+      continue;
+    }
+    for (base::DictionaryValue::Iterator prop(*properties); !prop.IsAtEnd();
+         prop.Advance()) {
+      if (IsUnchangedProperty(state, trait.key(), prop.key(), prop.value()))
+        continue;
+      base::DictionaryValue* trait_changes = nullptr;
+      if (!(*changes)->GetDictionaryWithoutPathExpansion(trait.key(),
+                                                         &trait_changes)) {
+        trait_changes = new base::DictionaryValue;
+        (*changes)->SetWithoutPathExpansion(trait.key(), trait_changes);
+      }
+      trait_changes->SetWithoutPathExpansion(prop.key(),
+                                             prop.value().DeepCopy());
+    }
+  }
+  return unchanged;
+}
 }  // anonymous namespace
 
 template <>
@@ -33,8 +273,14 @@ LIBWEAVE_EXPORT EnumToStringMap<UserRole>::EnumToStringMap()
 
 ComponentManagerImpl::ComponentManagerImpl(provider::TaskRunner* task_runner,
                                            base::Clock* clock)
-    : clock_{clock ? clock : &default_clock_},
-      command_queue_{task_runner, clock_} {}
+    : task_runner_{task_runner},
+      clock_{clock ? clock : &default_clock_},
+      command_queue_{task_runner, clock_},
+      state_update_queue_{kStateIngestionQueueSize} {
+  apply_queued_state_updates_ =
+      base::Bind(&ComponentManagerImpl::ApplyQueuedStateUpdates,
+                 weak_ptr_factory_.GetWeakPtr());
+}
 
 ComponentManagerImpl::~ComponentManagerImpl() {}
 
@@ -43,8 +289,9 @@ bool ComponentManagerImpl::AddComponent(const std::string& path,
                                         const std::vector<std::string>& traits,
                                         ErrorPtr* error) {
   base::DictionaryValue* root = &components_;
+  std::string root_path;
   if (!path.empty()) {
-    root = FindComponentGraftNode(path, error);
+    root = FindComponentGraftNode(path, &root_path, error);
     if (!root)
       return false;
   }
@@ -66,7 +313,11 @@ bool ComponentManagerImpl::AddComponent(const std::string& path,
   std::unique_ptr<base::ListValue> traits_list{new base::ListValue};
   traits_list->AppendStrings(traits);
   dict->Set("traits", traits_list.release());
+  base::DictionaryValue* component = dict.get();
   root->SetWithoutPathExpansion(name, dict.release());
+  if (IsValidPathElement(name))
+    AddToComponentIndex(AppendPath(root_path, name), component);
+  legacy_state_dirty_ = true;
   for (const auto& cb : on_componet_tree_changed_)
     cb.Run();
   return true;
@@ -78,13 +329,16 @@ bool ComponentManagerImpl::AddComponentArrayItem(
     const std::vector<std::string>& traits,
     ErrorPtr* error) {
   base::DictionaryValue* root = &components_;
+  std::string root_path;
   if (!path.empty()) {
-    root = FindComponentGraftNode(path, error);
+    root = FindComponentGraftNode(path, &root_path, error);
     if (!root)
       return false;
   }
+  std::string array_path = AppendPath(root_path, name);
   base::ListValue* array_value = nullptr;
   if (!root->GetListWithoutPathExpansion(name, &array_value)) {
+    RemoveFromComponentIndex(array_path);
     array_value = new base::ListValue;
     root->SetWithoutPathExpansion(name, array_value);
   }
@@ -92,7 +346,14 @@ bool ComponentManagerImpl::AddComponentArrayItem(
   std::unique_ptr<base::ListValue> traits_list{new base::ListValue};
   traits_list->AppendStrings(traits);
   dict->Set("traits", traits_list.release());
+  if (IsValidPathElement(name)) {
+    AddToComponentIndex(base::StringPrintf("%s[%zu]", array_path.c_str(),
+                                           array_value->GetSize()),
+                        dict.get());
+  }
   array_value->Append(dict.release());
+  DropStateChangeQueues(array_path);
+  legacy_state_dirty_ = true;
   for (const auto& cb : on_componet_tree_changed_)
     cb.Run();
   return true;
@@ -102,18 +363,24 @@ bool ComponentManagerImpl::RemoveComponent(const std::string& path,
                                            const std::string& name,
                                            ErrorPtr* error) {
   base::DictionaryValue* root = &components_;
+  std::string root_path;
   if (!path.empty()) {
-    root = FindComponentGraftNode(path, error);
+    root = FindComponentGraftNode(path, &root_path, error);
     if (!root)
       return false;
   }
 
-  if (!root->RemoveWithoutPathExpansion(name, nullptr)) {
+  // The removed components are read while they are dropped from the index.
+  scoped_ptr<base::Value> removed;
+  if (!root->RemoveWithoutPathExpansion(name, &removed)) {
     return Error::AddToPrintf(error, FROM_HERE, errors::commands::kInvalidState,
                               "Component '%s' does not exist at path '%s'",
                               name.c_str(), path.c_str());
   }
+  RemoveFromComponentIndex(AppendPath(root_path, name));
+  DropStateChangeQueues(AppendPath(root_path, name));
 
+  legacy_state_dirty_ = true;
   for (const auto& cb : on_componet_tree_changed_)
     cb.Run();
   return true;
@@ -124,8 +391,9 @@ bool ComponentManagerImpl::RemoveComponentArrayItem(const std::string& path,
                                                     size_t index,
                                                     ErrorPtr* error) {
   base::DictionaryValue* root = &components_;
+  std::string root_path;
   if (!path.empty()) {
-    root = FindComponentGraftNode(path, error);
+    root = FindComponentGraftNode(path, &root_path, error);
     if (!root)
       return false;
   }
@@ -138,13 +406,29 @@ bool ComponentManagerImpl::RemoveComponentArrayItem(const std::string& path,
         path.c_str());
   }
 
-  if (!array_value->Remove(index, nullptr)) {
+  scoped_ptr<base::Value> removed;
+  if (!array_value->Remove(index, &removed)) {
     return Error::AddToPrintf(
         error, FROM_HERE, errors::commands::kInvalidState,
         "Component array '%s' at path '%s' does not have an element %zu",
         name.c_str(), path.c_str(), index);
   }
 
+  // Elements following the removed one have shifted, so re-index all of them.
+  std::string array_path = AppendPath(root_path, name);
+  RemoveFromComponentIndex(array_path);
+  if (IsValidPathElement(name)) {
+    for (size_t i = 0; i < array_value->GetSize(); i++) {
+      base::DictionaryValue* item = nullptr;
+      if (array_value->GetDictionary(i, &item)) {
+        AddToComponentIndex(
+            base::StringPrintf("%s[%zu]", array_path.c_str(), i), item);
+      }
+    }
+  }
+  DropStateChangeQueues(array_path);
+
+  legacy_state_dirty_ = true;
   for (const auto& cb : on_componet_tree_changed_)
     cb.Run();
   return true;
@@ -169,21 +453,33 @@ bool ComponentManagerImpl::LoadTraits(const base::DictionaryValue& dict,
       result = false;
       break;
     }
+    std::unique_ptr<base::DictionaryValue> definition{
+        static_cast<base::DictionaryValue*>(it.value().DeepCopy())};
+    std::unique_ptr<base::DictionaryValue> local_def{new base::DictionaryValue};
+    SplitLocalTraitAttributes(definition.get(), local_def.get());
     const base::DictionaryValue* existing_def = nullptr;
     if (traits_.GetDictionary(it.key(), &existing_def)) {
-      if (!existing_def->Equals(&it.value())) {
+      const base::DictionaryValue empty;
+      const base::DictionaryValue* existing_local_def = &empty;
+      local_trait_attributes_.GetDictionary(it.key(), &existing_local_def);
+      if (!existing_def->Equals(definition.get()) ||
+          !existing_local_def->Equals(local_def.get())) {
         Error::AddToPrintf(error, FROM_HERE, errors::commands::kTypeMismatch,
                            "Trait '%s' cannot be redefined", it.key().c_str());
         result = false;
         break;
       }
     } else {
-      traits_.Set(it.key(), it.value().DeepCopy());
+      traits_.Set(it.key(), definition.release());
+      if (!local_def->empty())
+        local_trait_attributes_.Set(it.key(), local_def.release());
       modified = true;
     }
   }
 
   if (modified) {
+    legacy_command_defs_dirty_ = true;
+    UpdateStateChangePolicies();
     for (const auto& cb : on_trait_changed_)
       cb.Run();
   }
@@ -255,27 +551,14 @@ std::unique_ptr<CommandInstance> ComponentManagerImpl::ParseCommandInstance(
     command_instance->SetComponent(component_path);
   }
 
-  const base::DictionaryValue* component = FindComponent(component_path, error);
-  if (!component)
+  std::string canonical_path;
+  if (!FindComponentAndPath(component_path, &canonical_path, error))
     return nullptr;
 
   // Check that the command's trait is supported by the given component.
   auto pair = SplitAtFirst(command_instance->GetName(), ".", true);
 
-  bool trait_supported = false;
-  const base::ListValue* supported_traits = nullptr;
-  if (component->GetList("traits", &supported_traits)) {
-    for (const base::Value* value : *supported_traits) {
-      std::string trait;
-      CHECK(value->GetAsString(&trait));
-      if (trait == pair.first) {
-        trait_supported = true;
-        break;
-      }
-    }
-  }
-
-  if (!trait_supported) {
+  if (!IsTraitSupported(canonical_path, pair.first)) {
     return Error::AddToPrintf(error, FROM_HERE, "trait_not_supported",
                               "Component '%s' doesn't support trait '%s'",
                               component_path.c_str(), pair.first.c_str());
@@ -288,6 +571,40 @@ std::unique_ptr<CommandInstance> ComponentManagerImpl::ParseCommandInstance(
       *id = command_id;
   }
 
+  // Priority and expiration not specified by the command itself default to
+  // the values from the command definition.
+  const base::DictionaryValue empty;
+  const base::DictionaryValue* definition =
+      FindCommandIn(local_trait_attributes_, command_instance->GetName());
+  if (!definition)
+    definition = &empty;
+  int priority = 0;
+  if (!command.HasKey(commands::attributes::kCommand_Priority) &&
+      definition->GetInteger(commands::attributes::kCommand_Priority,
+                             &priority)) {
+    command_instance->SetPriority(priority);
+  }
+  int timeout_ms = 0;
+  if (command_instance->GetExpirationTime().is_null() &&
+      definition->GetInteger(commands::attributes::kCommand_ExpirationTimeoutMs,
+                             &timeout_ms)) {
+    command_instance->SetExpirationTime(
+        clock_->Now() + base::TimeDelta::FromMilliseconds(timeout_ms));
+  }
+  bool supersedes = false;
+  if (definition->GetBoolean(commands::attributes::kCommand_SupersedePending,
+                             &supersedes)) {
+    command_instance->SetSupersedesPending(supersedes);
+  }
+
+  // Routed by the canonical path, so that handler lookups match whatever
+  // spelling of the path the sender used.
+  command_instance->SetComponent(canonical_path);
+  command_instance->SetHandlerSlot(command_queue_.FindHandlerSlot(
+      canonical_path, command_instance->GetName()));
+  command_queue_.GetHistory()->RecordStage(command_id,
+                                           command_instance->GetName(),
+                                           CommandHistory::Stage::kParsed);
   return command_instance;
 }
 
@@ -295,6 +612,16 @@ CommandInstance* ComponentManagerImpl::FindCommand(const std::string& id) {
   return command_queue_.Find(id);
 }
 
+void ComponentManagerImpl::RecordCommandStage(const std::string& id,
+                                              const std::string& name,
+                                              CommandHistory::Stage stage) {
+  command_queue_.GetHistory()->RecordStage(id, name, stage);
+}
+
+const base::DictionaryValue& ComponentManagerImpl::GetCommandHistory() const {
+  return command_queue_.GetHistory()->GetJson();
+}
+
 void ComponentManagerImpl::AddCommandAddedCallback(
     const CommandQueue::CommandCallback& callback) {
   command_queue_.AddCommandAddedCallback(callback);
@@ -318,10 +645,30 @@ void ComponentManagerImpl::AddCommandHandler(
   command_queue_.AddCommandHandler(component_path, command_name, callback);
 }
 
+void ComponentManagerImpl::AddCommandBatchHandler(
+    const std::string& component_path,
+    const std::string& command_name,
+    const Device::CommandBatchHandlerCallback& callback) {
+  if (!command_name.empty()) {
+    CHECK(FindCommandDefinition(command_name)) << "Command undefined: "
+                                               << command_name;
+  }
+  command_queue_.AddCommandBatchHandler(component_path, command_name,
+                                        callback);
+}
+
+void ComponentManagerImpl::SetCommandRetention(base::TimeDelta local_retention,
+                                               base::TimeDelta cloud_retention,
+                                               size_t max_finished_commands) {
+  command_queue_.SetRetention(Command::Origin::kLocal, local_retention);
+  command_queue_.SetRetention(Command::Origin::kCloud, cloud_retention);
+  command_queue_.SetMaxFinishedCommands(max_finished_commands);
+}
+
 const base::DictionaryValue* ComponentManagerImpl::FindComponent(
     const std::string& path,
     ErrorPtr* error) const {
-  return FindComponentAt(&components_, path, error);
+  return FindComponentAndPath(path, nullptr, error);
 }
 
 const base::DictionaryValue* ComponentManagerImpl::FindTraitDefinition(
@@ -333,15 +680,7 @@ const base::DictionaryValue* ComponentManagerImpl::FindTraitDefinition(
 
 const base::DictionaryValue* ComponentManagerImpl::FindCommandDefinition(
     const std::string& command_name) const {
-  const base::DictionaryValue* definition = nullptr;
-  std::vector<std::string> components = Split(command_name, ".", true, false);
-  // Make sure the |command_name| came in form of trait_name.command_name.
-  if (components.size() != 2)
-    return definition;
-  std::string key = base::StringPrintf("%s.commands.%s", components[0].c_str(),
-                                       components[1].c_str());
-  traits_.GetDictionary(key, &definition);
-  return definition;
+  return FindCommandIn(traits_, command_name);
 }
 
 bool ComponentManagerImpl::GetMinimalRole(const std::string& command_name,
@@ -367,28 +706,82 @@ void ComponentManagerImpl::AddStateChangedCallback(
   callback.Run();  // Force to read current state.
 }
 
+bool ComponentManagerImpl::EnqueueStateUpdate(
+    Device::StatePropertyHandle handle,
+    const base::FundamentalValue& value) {
+  bool schedule_drain = false;
+  if (!state_update_queue_.Push({handle, value}, &schedule_drain))
+    return false;
+  if (schedule_drain) {
+    task_runner_->PostDelayedTask(FROM_HERE, apply_queued_state_updates_,
+                                  {});
+  }
+  return true;
+}
+
+void ComponentManagerImpl::ApplyQueuedStateUpdates() {
+  state_update_queue_.BeginDrain();
+  BeginStateTransaction();
+  StateIngestionQueue::Update update;
+  bool drained = false;
+  for (size_t i = 0; i < state_update_queue_.GetCapacity(); i++) {
+    if (!state_update_queue_.Pop(&update)) {
+      drained = true;
+      break;
+    }
+    ErrorPtr error;
+    if (!UpdateStateProperty(update.handle, update.GetValue(), &error))
+      LOG(ERROR) << "Failed to apply state update: " << error->GetMessage();
+  }
+  CommitStateTransaction();
+  // Leave the rest for another task, so producers can not starve the thread.
+  if (!drained && state_update_queue_.RequestDrain()) {
+    task_runner_->PostDelayedTask(FROM_HERE, apply_queued_state_updates_,
+                                  {});
+  }
+}
+
+void ComponentManagerImpl::BeginStateTransaction() {
+  if (state_transaction_depth_++ == 0) {
+    state_transaction_changed_ = false;
+    state_transaction_recorded_ = false;
+    state_transaction_timestamp_ = clock_->Now();
+  }
+}
+
+void ComponentManagerImpl::CommitStateTransaction() {
+  CHECK_GT(state_transaction_depth_, 0) << "No state transaction to commit";
+  if (--state_transaction_depth_ > 0 || !state_transaction_changed_)
+    return;
+  state_transaction_changed_ = false;
+  bool recorded = state_transaction_recorded_;
+  state_transaction_recorded_ = false;
+  NotifyStateChanged(recorded);
+}
+
 bool ComponentManagerImpl::SetStateProperties(const std::string& component_path,
                                               const base::DictionaryValue& dict,
                                               ErrorPtr* error) {
-  base::DictionaryValue* component =
-      FindMutableComponent(component_path, error);
-  if (!component)
+  std::string canonical_path;
+  base::DictionaryValue* state =
+      FindMutableState(component_path, &canonical_path, error);
+  if (!state)
     return false;
 
-  base::DictionaryValue* state = nullptr;
-  if (!component->GetDictionary("state", &state)) {
-    state = new base::DictionaryValue;
-    component->Set("state", state);
+  state_write_stats_.writes++;
+  // Drop properties which already have the requested values, so that drivers
+  // periodically re-publishing their full state do not generate changes.
+  std::unique_ptr<base::DictionaryValue> changes;
+  size_t unchanged = FilterUnchangedProperties(dict, *state, &changes);
+  state_write_stats_.suppressed_properties += unchanged;
+  const base::DictionaryValue& patch = changes ? *changes : dict;
+  if (changes && changes->empty()) {
+    state_write_stats_.suppressed_writes++;
+    return true;
   }
-  state->MergeDictionary(&dict);
-  last_state_change_id_++;
-  auto& queue = state_change_queues_[component_path];
-  if (!queue)
-    queue.reset(new StateChangeQueue{kMaxStateChangeQueueSize});
-  base::Time timestamp = clock_->Now();
-  queue->NotifyPropertiesUpdated(timestamp, dict);
-  for (const auto& cb : on_state_changed_)
-    cb.Run();
+
+  MergeState(patch, state);
+  NotifyStateChanged(RecordStateChanges(canonical_path, patch));
   return true;
 }
 
@@ -449,28 +842,311 @@ bool ComponentManagerImpl::SetStateProperty(const std::string& component_path,
   return SetStateProperties(component_path, dict, error);
 }
 
+bool ComponentManagerImpl::GetStatePropertyHandle(
+    const std::string& component_path,
+    const std::string& name,
+    Device::StatePropertyHandle* handle,
+    ErrorPtr* error) {
+  auto pair = SplitAtFirst(name, ".", true);
+  if (pair.first.empty()) {
+    return Error::AddToPrintf(error, FROM_HERE,
+                              errors::commands::kPropertyMissing,
+                              "Empty state package in '%s'", name.c_str());
+  }
+  if (pair.second.empty()) {
+    return Error::AddToPrintf(
+        error, FROM_HERE, errors::commands::kPropertyMissing,
+        "State property name not specified in '%s'", name.c_str());
+  }
+  StatePropertySlot slot;
+  slot.state = FindMutableState(component_path, &slot.component_path, error);
+  if (!slot.state)
+    return false;
+  slot.trait = pair.first;
+  slot.property = pair.second;
+
+  std::pair<std::string, std::string> key{slot.component_path,
+                                          slot.trait + '.' + slot.property};
+  Device::StatePropertyHandle& existing = state_property_handles_[key];
+  if (existing != 0) {
+    state_property_slots_[existing - 1].state = slot.state;
+    *handle = existing;
+    return true;
+  }
+  state_property_slots_.push_back(std::move(slot));
+  existing = state_property_slots_.size();
+  *handle = existing;
+  return true;
+}
+
+bool ComponentManagerImpl::UpdateStateProperty(
+    Device::StatePropertyHandle handle,
+    const base::Value& value,
+    ErrorPtr* error) {
+  if (handle == 0 || handle > state_property_slots_.size()) {
+    return Error::AddToPrintf(error, FROM_HERE,
+                              errors::commands::kPropertyMissing,
+                              "Invalid state property handle %u", handle);
+  }
+  StatePropertySlot& slot = state_property_slots_[handle - 1];
+  if (!slot.state) {
+    // The component was removed since the handle was resolved.
+    slot.state = FindMutableState(slot.component_path, nullptr, error);
+    if (!slot.state)
+      return false;
+  }
+
+  if (value.IsType(base::Value::TYPE_DICTIONARY)) {
+    // Merged into the existing value, the same as by SetStateProperty().
+    std::unique_ptr<base::DictionaryValue> trait_patch{
+        new base::DictionaryValue};
+    trait_patch->SetWithoutPathExpansion(slot.property, value.DeepCopy());
+    base::DictionaryValue patch;
+    patch.SetWithoutPathExpansion(slot.trait, trait_patch.release());
+    return SetStateProperties(slot.component_path, patch, error);
+  }
+
+  base::DictionaryValue* trait_state = nullptr;
+  if (!slot.state->GetDictionaryWithoutPathExpansion(slot.trait,
+                                                     &trait_state)) {
+    trait_state = new base::DictionaryValue;
+    slot.state->SetWithoutPathExpansion(slot.trait, trait_state);
+  }
+  state_write_stats_.writes++;
+  base::Value* existing = nullptr;
+  if (trait_state->GetWithoutPathExpansion(slot.property, &existing) &&
+      value.Equals(existing)) {
+    state_write_stats_.suppressed_properties++;
+    state_write_stats_.suppressed_writes++;
+    return true;
+  }
+  if (!existing || !AssignValueInPlace(value, existing))
+    trait_state->SetWithoutPathExpansion(slot.property, value.DeepCopy());
+
+  StateChangeQueue* queue = GetStateChangeQueue(slot.component_path);
+  base::Time timestamp = GetStateChangeTimestamp();
+  const StateChangePolicy* policy =
+      FindStateChangePolicy(slot.trait, slot.property);
+  if (!policy) {
+    queue->NotifyPropertyUpdated(timestamp, slot.trait, slot.property, value);
+    NotifyStateChanged(true);
+    return true;
+  }
+  bool recorded = queue->NotifyPropertyUpdated(timestamp, slot.trait,
+                                               slot.property, value, *policy);
+  ScheduleStateChangeFlush(queue->GetNextFlushTime());
+  NotifyStateChanged(recorded);
+  return true;
+}
+
+base::DictionaryValue* ComponentManagerImpl::FindMutableState(
+    const std::string& component_path,
+    std::string* canonical_path,
+    ErrorPtr* error) {
+  base::DictionaryValue* component =
+      FindMutableComponent(component_path, canonical_path, error);
+  if (!component)
+    return nullptr;
+
+  base::DictionaryValue* state = nullptr;
+  if (!component->GetDictionary("state", &state)) {
+    state = new base::DictionaryValue;
+    component->Set("state", state);
+  }
+  return state;
+}
+
+StateChangeQueue* ComponentManagerImpl::GetStateChangeQueue(
+    const std::string& component_path) {
+  auto& queue = state_change_queues_[component_path];
+  if (!queue)
+    queue.reset(new StateChangeQueue{kMaxStateChangeQueueSize});
+  return queue.get();
+}
+
+base::Time ComponentManagerImpl::GetStateChangeTimestamp() const {
+  return state_transaction_depth_ > 0 ? state_transaction_timestamp_
+                                      : clock_->Now();
+}
+
+bool ComponentManagerImpl::HasRecordedStateChanges() const {
+  for (const auto& pair : state_change_queues_) {
+    if (!pair.second->IsEmpty())
+      return true;
+  }
+  return false;
+}
+
+bool ComponentManagerImpl::RecordStateChanges(
+    const std::string& component_path,
+    const base::DictionaryValue& dict) {
+  StateChangeQueue* queue = GetStateChangeQueue(component_path);
+  base::Time timestamp = GetStateChangeTimestamp();
+  if (state_change_policies_.empty())
+    return queue->NotifyPropertiesUpdated(timestamp, dict);
+
+  // Properties without a policy are recorded together, as a single patch.
+  base::DictionaryValue unrestricted;
+  bool recorded = false;
+  for (base::DictionaryValue::Iterator trait(dict); !trait.IsAtEnd();
+       trait.Advance()) {
+    const base::DictionaryValue* properties = nullptr;
+    if (state_change_policies_.count(trait.key()) == 0 ||
+        !trait.value().GetAsDictionary(&properties)) {
+      unrestricted.SetWithoutPathExpansion(trait.key(),
+                                           trait.value().DeepCopy());
+      continue;
+    }
+    for (base::DictionaryValue::Iterator prop(*properties); !prop.IsAtEnd();
+         prop.Advance()) {
+      const StateChangePolicy* policy =
+          FindStateChangePolicy(trait.key(), prop.key());
+      if (policy) {
+        recorded |= queue->NotifyPropertyUpdated(timestamp, trait.key(),
+                                                 prop.key(), prop.value(),
+                                                 *policy);
+        continue;
+      }
+      base::DictionaryValue* trait_changes = nullptr;
+      if (!unrestricted.GetDictionaryWithoutPathExpansion(trait.key(),
+                                                          &trait_changes)) {
+        trait_changes = new base::DictionaryValue;
+        unrestricted.SetWithoutPathExpansion(trait.key(), trait_changes);
+      }
+      trait_changes->SetWithoutPathExpansion(prop.key(),
+                                             prop.value().DeepCopy());
+    }
+  }
+  if (!unrestricted.empty())
+    recorded |= queue->NotifyPropertiesUpdated(timestamp, unrestricted);
+  ScheduleStateChangeFlush(queue->GetNextFlushTime());
+  return recorded;
+}
+
+const StateChangePolicy* ComponentManagerImpl::FindStateChangePolicy(
+    const std::string& trait,
+    const std::string& name) const {
+  auto it = state_change_policies_.find(trait);
+  if (it == state_change_policies_.end())
+    return nullptr;
+  auto prop_it = it->second.properties.find(name);
+  if (prop_it != it->second.properties.end())
+    return &prop_it->second;
+  return it->second.has_trait_policy ? &it->second.trait_policy : nullptr;
+}
+
+void ComponentManagerImpl::UpdateStateChangePolicies() {
+  state_change_policies_.clear();
+  for (base::DictionaryValue::Iterator it(local_trait_attributes_);
+       !it.IsAtEnd(); it.Advance()) {
+    const base::DictionaryValue* trait_def = nullptr;
+    if (!it.value().GetAsDictionary(&trait_def))
+      continue;
+    TraitStateChangePolicies policies;
+    policies.has_trait_policy =
+        ReadStateChangePolicy(*trait_def, &policies.trait_policy);
+    const base::DictionaryValue* state_defs = nullptr;
+    if (trait_def->GetDictionary("state", &state_defs)) {
+      for (base::DictionaryValue::Iterator prop(*state_defs); !prop.IsAtEnd();
+           prop.Advance()) {
+        const base::DictionaryValue* prop_def = nullptr;
+        // Property policies override the trait policy attribute by attribute.
+        StateChangePolicy policy = policies.trait_policy;
+        if (prop.value().GetAsDictionary(&prop_def) &&
+            ReadStateChangePolicy(*prop_def, &policy)) {
+          policies.properties.emplace(prop.key(), policy);
+        }
+      }
+    }
+    if (policies.has_trait_policy || !policies.properties.empty())
+      state_change_policies_.emplace(it.key(), std::move(policies));
+  }
+}
+
+void ComponentManagerImpl::ScheduleStateChangeFlush(base::Time time) {
+  if (time.is_null())
+    return;
+  if (!state_change_flush_time_.is_null() && state_change_flush_time_ <= time)
+    return;
+  state_change_flush_time_ = time;
+  task_runner_->PostDelayedTask(
+      FROM_HERE, base::Bind(&ComponentManagerImpl::FlushPostponedStateChanges,
+                            weak_ptr_factory_.GetWeakPtr()),
+      time - clock_->Now());
+}
+
+void ComponentManagerImpl::FlushPostponedStateChanges() {
+  state_change_flush_time_ = base::Time{};
+  base::Time now = clock_->Now();
+  base::Time next;
+  bool recorded = false;
+  for (auto& pair : state_change_queues_) {
+    recorded |= pair.second->FlushPostponedChanges(now);
+    base::Time time = pair.second->GetNextFlushTime();
+    if (!time.is_null() && (next.is_null() || time < next))
+      next = time;
+  }
+  ScheduleStateChangeFlush(next);
+  if (recorded)
+    NotifyStateChanged(true);
+}
+
+void ComponentManagerImpl::NotifyStateChanged(bool recorded) {
+  legacy_state_dirty_ = true;
+  if (state_transaction_depth_ > 0) {
+    state_transaction_changed_ = true;
+    state_transaction_recorded_ |= recorded;
+    return;
+  }
+  // Changes not recorded for the cloud do not get a change ID, so nobody waits
+  // for them to reach the server.
+  if (recorded)
+    last_state_change_id_++;
+  for (const auto& cb : on_state_changed_)
+    cb.Run();
+}
+
 ComponentManager::StateSnapshot
 ComponentManagerImpl::GetAndClearRecordedStateChanges() {
   StateSnapshot snapshot;
   snapshot.update_id = GetLastStateChangeId();
+
+  // Each queue is already sorted by timestamp, so merge them instead of
+  // sorting the combined list. Events recorded at the same time are ordered by
+  // component path. The queues are kept for the next publishing cycle.
+  size_t count = 0;
+  state_change_merge_heap_.clear();
   for (auto& pair : state_change_queues_) {
-    auto changes = pair.second->GetAndClearRecordedStateChanges();
-    auto component = pair.first;
-    auto conv = [component](weave::StateChange& change) {
-      return ComponentStateChange{change.timestamp, component,
-                                  std::move(change.changed_properties)};
-    };
-    std::transform(changes.begin(), changes.end(),
-                   std::back_inserter(snapshot.state_changes), conv);
-  }
-
-  // Sort events by the timestamp.
-  auto pred = [](const ComponentStateChange& lhs,
-                 const ComponentStateChange& rhs) {
-    return lhs.timestamp < rhs.timestamp;
+    if (pair.second->IsEmpty())
+      continue;
+    count += pair.second->GetSize();
+    state_change_merge_heap_.emplace_back(&pair.first, pair.second.get());
+  }
+  auto later = [](const QueueRef& lhs, const QueueRef& rhs) {
+    base::Time lhs_time = lhs.second->GetOldestTimestamp();
+    base::Time rhs_time = rhs.second->GetOldestTimestamp();
+    return lhs_time != rhs_time ? lhs_time > rhs_time : *lhs.first > *rhs.first;
   };
-  std::sort(snapshot.state_changes.begin(), snapshot.state_changes.end(), pred);
-  state_change_queues_.clear();
+  std::make_heap(state_change_merge_heap_.begin(),
+                 state_change_merge_heap_.end(), later);
+  snapshot.state_changes.reserve(count);
+  while (!state_change_merge_heap_.empty()) {
+    std::pop_heap(state_change_merge_heap_.begin(),
+                  state_change_merge_heap_.end(), later);
+    const QueueRef& queue = state_change_merge_heap_.back();
+    StateChange change = queue.second->PopOldest();
+    snapshot.state_changes.emplace_back(change.timestamp, *queue.first,
+                                        std::move(change.changed_properties));
+    if (queue.second->IsEmpty()) {
+      // Drop the drained queue if its component has been removed.
+      if (component_index_.count(*queue.first) == 0)
+        state_change_queues_.erase(state_change_queues_.find(*queue.first));
+      state_change_merge_heap_.pop_back();
+    } else {
+      std::push_heap(state_change_merge_heap_.begin(),
+                     state_change_merge_heap_.end(), later);
+    }
+  }
   return snapshot;
 }
 
@@ -480,30 +1156,30 @@ void ComponentManagerImpl::NotifyStateUpdatedOnServer(UpdateID id) {
 
 ComponentManager::Token ComponentManagerImpl::AddServerStateUpdatedCallback(
     const base::Callback<void(UpdateID)>& callback) {
-  if (state_change_queues_.empty())
+  if (!HasRecordedStateChanges())
     callback.Run(GetLastStateChangeId());
   return Token{on_server_state_updated_.Add(callback).release()};
 }
 
 std::string ComponentManagerImpl::FindComponentWithTrait(
     const std::string& trait) const {
-  for (base::DictionaryValue::Iterator it(components_); !it.IsAtEnd();
-       it.Advance()) {
-    const base::ListValue* supported_traits = nullptr;
-    const base::DictionaryValue* component = nullptr;
-    CHECK(it.value().GetAsDictionary(&component));
-    if (component->GetList("traits", &supported_traits)) {
-      for (const base::Value* value : *supported_traits) {
-        std::string supported_trait;
-        CHECK(value->GetAsString(&supported_trait));
-        if (trait == supported_trait)
-          return it.key();
-      }
-    }
+  auto it = trait_index_.find(trait);
+  if (it == trait_index_.end())
+    return std::string{};
+  for (const std::string& path : it->second) {
+    // Only top-level components have paths without any separators.
+    if (IsValidPathElement(path))
+      return path;
   }
   return std::string{};
 }
 
+bool ComponentManagerImpl::IsTraitSupported(const std::string& component_path,
+                                            const std::string& trait) const {
+  auto it = trait_index_.find(trait);
+  return it != trait_index_.end() && it->second.count(component_path) > 0;
+}
+
 bool ComponentManagerImpl::AddLegacyCommandDefinitions(
     const base::DictionaryValue& dict,
     ErrorPtr* error) {
@@ -536,6 +1212,8 @@ bool ComponentManagerImpl::AddLegacyCommandDefinitions(
   }
 
   if (modified) {
+    legacy_command_defs_dirty_ = true;
+    UpdateStateChangePolicies();
     for (const auto& cb : on_trait_changed_)
       cb.Run();
   }
@@ -574,6 +1252,8 @@ bool ComponentManagerImpl::AddLegacyStateDefinitions(
   }
 
   if (modified) {
+    legacy_command_defs_dirty_ = true;
+    UpdateStateChangePolicies();
     for (const auto& cb : on_trait_changed_)
       cb.Run();
   }
@@ -581,6 +1261,9 @@ bool ComponentManagerImpl::AddLegacyStateDefinitions(
 }
 
 const base::DictionaryValue& ComponentManagerImpl::GetLegacyState() const {
+  if (!legacy_state_dirty_)
+    return legacy_state_;
+  legacy_state_dirty_ = false;
   legacy_state_.Clear();
   // Build state from components.
   for (base::DictionaryValue::Iterator it(components_); !it.IsAtEnd();
@@ -597,6 +1280,9 @@ const base::DictionaryValue& ComponentManagerImpl::GetLegacyState() const {
 
 const base::DictionaryValue& ComponentManagerImpl::GetLegacyCommandDefinitions()
     const {
+  if (!legacy_command_defs_dirty_)
+    return legacy_command_defs_;
+  legacy_command_defs_dirty_ = false;
   legacy_command_defs_.Clear();
   // Build commandDefs from traits.
   for (base::DictionaryValue::Iterator it(traits_); !it.IsAtEnd();
@@ -620,15 +1306,19 @@ void ComponentManagerImpl::AddTraitToLegacyComponent(const std::string& trait) {
 
   // If not, add this trait to the first component available.
   base::DictionaryValue* component = nullptr;
+  std::string path;
   base::DictionaryValue::Iterator it(components_);
   if (it.IsAtEnd()) {
     // No components at all. Create a new one with dummy name.
     // This normally wouldn't happen since libweave creates its own component
     // at startup.
+    path = "__weave__";
     component = new base::DictionaryValue;
-    components_.Set("__weave__", component);
+    components_.Set(path, component);
+    AddToComponentIndex(path, component);
   } else {
-    CHECK(components_.GetDictionary(it.key(), &component));
+    path = it.key();
+    CHECK(components_.GetDictionary(path, &component));
   }
   base::ListValue* traits = nullptr;
   if (!component->GetList("traits", &traits)) {
@@ -636,13 +1326,17 @@ void ComponentManagerImpl::AddTraitToLegacyComponent(const std::string& trait) {
     component->Set("traits", traits);
   }
   traits->AppendString(trait);
+  if (IsValidPathElement(path))
+    trait_index_[trait].insert(path);
 }
 
 base::DictionaryValue* ComponentManagerImpl::FindComponentGraftNode(
     const std::string& path,
+    std::string* canonical_path,
     ErrorPtr* error) {
   base::DictionaryValue* root = nullptr;
-  base::DictionaryValue* component = FindMutableComponent(path, error);
+  base::DictionaryValue* component =
+      FindMutableComponent(path, canonical_path, error);
   if (component && !component->GetDictionary("components", &root)) {
     root = new base::DictionaryValue;
     component->Set("components", root);
@@ -652,17 +1346,123 @@ base::DictionaryValue* ComponentManagerImpl::FindComponentGraftNode(
 
 base::DictionaryValue* ComponentManagerImpl::FindMutableComponent(
     const std::string& path,
+    std::string* canonical_path,
     ErrorPtr* error) {
   return const_cast<base::DictionaryValue*>(
-      FindComponentAt(&components_, path, error));
+      FindComponentAndPath(path, canonical_path, error));
+}
+
+const base::DictionaryValue* ComponentManagerImpl::FindComponentAndPath(
+    const std::string& path,
+    std::string* canonical_path,
+    ErrorPtr* error) const {
+  auto it = component_index_.find(path);
+  if (it != component_index_.end()) {
+    if (canonical_path)
+      *canonical_path = path;
+    return it->second;
+  }
+  // Not a normalized path to an existing component. Do the full walk which
+  // also takes care of reporting the exact error.
+  return FindComponentAt(&components_, path, canonical_path, error);
+}
+
+void ComponentManagerImpl::AddToComponentIndex(
+    const std::string& path,
+    base::DictionaryValue* component) {
+  component_index_[path] = component;
+  const base::ListValue* traits = nullptr;
+  if (component->GetList("traits", &traits)) {
+    for (const base::Value* value : *traits) {
+      std::string trait;
+      CHECK(value->GetAsString(&trait));
+      trait_index_[trait].insert(path);
+    }
+  }
+  base::DictionaryValue* sub_components = nullptr;
+  if (!component->GetDictionary("components", &sub_components))
+    return;
+  for (base::DictionaryValue::Iterator it(*sub_components); !it.IsAtEnd();
+       it.Advance()) {
+    if (!IsValidPathElement(it.key()))
+      continue;
+    std::string sub_path = AppendPath(path, it.key());
+    base::DictionaryValue* sub_component = nullptr;
+    base::ListValue* component_array = nullptr;
+    if (sub_components->GetDictionaryWithoutPathExpansion(it.key(),
+                                                          &sub_component)) {
+      AddToComponentIndex(sub_path, sub_component);
+    } else if (sub_components->GetListWithoutPathExpansion(it.key(),
+                                                           &component_array)) {
+      for (size_t i = 0; i < component_array->GetSize(); i++) {
+        if (component_array->GetDictionary(i, &sub_component)) {
+          AddToComponentIndex(
+              base::StringPrintf("%s[%zu]", sub_path.c_str(), i),
+              sub_component);
+        }
+      }
+    }
+  }
+}
+
+void ComponentManagerImpl::RemoveFromComponentIndex(const std::string& path) {
+  // Paths starting with |path| are adjacent in the sorted index.
+  auto it = component_index_.lower_bound(path);
+  while (it != component_index_.end() &&
+         it->first.compare(0, path.size(), path) == 0) {
+    if (!IsInSubtree(it->first, path)) {
+      ++it;
+      continue;
+    }
+    // Only the traits of the removed components need to be updated.
+    const base::ListValue* traits = nullptr;
+    if (it->second->GetList("traits", &traits)) {
+      for (const base::Value* value : *traits) {
+        std::string trait;
+        CHECK(value->GetAsString(&trait));
+        auto trait_it = trait_index_.find(trait);
+        if (trait_it == trait_index_.end())
+          continue;
+        trait_it->second.erase(it->first);
+        if (trait_it->second.empty())
+          trait_index_.erase(trait_it);
+      }
+    }
+    it = component_index_.erase(it);
+  }
+  auto handle_it = state_property_handles_.lower_bound({path, std::string{}});
+  while (handle_it != state_property_handles_.end() &&
+         handle_it->first.first.compare(0, path.size(), path) == 0) {
+    if (IsInSubtree(handle_it->first.first, path))
+      state_property_slots_[handle_it->second - 1].state = nullptr;
+    ++handle_it;
+  }
+}
+
+void ComponentManagerImpl::DropStateChangeQueues(const std::string& path) {
+  // Queues still holding changes are dropped once those are collected by
+  // GetAndClearRecordedStateChanges(). Postponed changes of removed components
+  // are lost, as they have not been recorded yet.
+  auto it = state_change_queues_.lower_bound(path);
+  while (it != state_change_queues_.end() &&
+         it->first.compare(0, path.size(), path) == 0) {
+    if (IsInSubtree(it->first, path) && it->second->IsEmpty() &&
+        component_index_.count(it->first) == 0) {
+      it = state_change_queues_.erase(it);
+    } else {
+      ++it;
+    }
+  }
 }
 
 const base::DictionaryValue* ComponentManagerImpl::FindComponentAt(
     const base::DictionaryValue* root,
     const std::string& path,
+    std::string* canonical_path,
     ErrorPtr* error) {
   auto parts = Split(path, ".", true, false);
   std::string root_path;
+  std::string normalized_path;
   for (size_t i = 0; i < parts.size(); i++) {
     auto element = SplitAtFirst(parts[i], "[", true);
     int array_index = -1;
@@ -735,10 +1535,17 @@ const base::DictionaryValue* ComponentManagerImpl::FindComponentAt(
             element.first.c_str(), array_index);
       }
     }
-    if (!root_path.empty())
+    if (!root_path.empty()) {
       root_path += '.';
+      normalized_path += '.';
+    }
     root_path += parts[i];
+    normalized_path += element.first;
+    if (array_index >= 0)
+      normalized_path += base::StringPrintf("[%d]", array_index);
   }
+  if (canonical_path)
+    *canonical_path = normalized_path;
   return root;
 }
 
@@ -5,11 +5,17 @@
 #ifndef LIBWEAVE_SRC_COMPONENT_MANAGER_IMPL_H_
 #define LIBWEAVE_SRC_COMPONENT_MANAGER_IMPL_H_
 
+#include <map>
+#include <set>
+#include <unordered_map>
+
+#include <base/memory/weak_ptr.h>
 #include <base/time/default_clock.h>
 
 #include "src/commands/command_queue.h"
 #include "src/component_manager.h"
 #include "src/states/state_change_queue.h"
+#include "src/states/state_ingestion_queue.h"
 
 namespace weave {
 
@@ -87,6 +93,11 @@ class ComponentManagerImpl final : public ComponentManager {
   // Find a command instance with the given ID in the command queue.
   CommandInstance* FindCommand(const std::string& id) override;
 
+  void RecordCommandStage(const std::string& id,
+                          const std::string& name,
+                          CommandHistory::Stage stage) override;
+  const base::DictionaryValue& GetCommandHistory() const override;
+
   // Command queue monitoring callbacks (called when a new command is added to
   // or removed from the queue).
   void AddCommandAddedCallback(
@@ -103,6 +114,18 @@ class ComponentManagerImpl final : public ComponentManager {
       const std::string& command_name,
       const Device::CommandHandlerCallback& callback) override;
 
+  // Adds a handler receiving commands in batches. Empty |command_name| selects
+  // all commands of the component without a handler of their own.
+  void AddCommandBatchHandler(
+      const std::string& component_path,
+      const std::string& command_name,
+      const Device::CommandBatchHandlerCallback& callback) override;
+
+  // Sets how long finished commands stay in the queue.
+  void SetCommandRetention(base::TimeDelta local_retention,
+                           base::TimeDelta cloud_retention,
+                           size_t max_finished_commands) override;
+
   // Finds a component instance by its full path.
   const base::DictionaryValue* FindComponent(const std::string& path,
                                              ErrorPtr* error) const override;
@@ -142,12 +165,28 @@ class ComponentManagerImpl final : public ComponentManager {
                         const std::string& name,
                         const base::Value& value,
                         ErrorPtr* error) override;
+  bool GetStatePropertyHandle(const std::string& component_path,
+                              const std::string& name,
+                              Device::StatePropertyHandle* handle,
+                              ErrorPtr* error) override;
+  bool UpdateStateProperty(Device::StatePropertyHandle handle,
+                           const base::Value& value,
+                           ErrorPtr* error) override;
+  bool EnqueueStateUpdate(Device::StatePropertyHandle handle,
+                          const base::FundamentalValue& value) override;
+  void BeginStateTransaction() override;
+  void CommitStateTransaction() override;
 
   void AddStateChangedCallback(const base::Closure& callback) override;
 
   // Returns the recorded state changes since last time this method was called.
   StateSnapshot GetAndClearRecordedStateChanges() override;
 
+  // Returns counters of state writes since the start.
+  StateWriteStats GetStateWriteStats() const override {
+    return state_write_stats_;
+  }
+
   // Called to notify that the state patch with |id| has been successfully sent
   // to the server and processed.
   void NotifyStateUpdatedOnServer(UpdateID id) override;
@@ -186,12 +225,72 @@ class ComponentManagerImpl final : public ComponentManager {
   const base::DictionaryValue& GetLegacyCommandDefinitions() const override;
 
  private:
+  friend class ComponentManagerTest;
+
   // A helper method to find a JSON element of component at |path| to add new
-  // sub-components to.
+  // sub-components to. The normalized form of |path| is returned through
+  // |canonical_path|.
   base::DictionaryValue* FindComponentGraftNode(const std::string& path,
+                                                std::string* canonical_path,
                                                 ErrorPtr* error);
   base::DictionaryValue* FindMutableComponent(const std::string& path,
+                                              std::string* canonical_path,
                                               ErrorPtr* error);
+  const base::DictionaryValue* FindComponentAndPath(
+      const std::string& path,
+      std::string* canonical_path,
+      ErrorPtr* error) const;
+
+  // Adds |component| and all of its sub-components to |component_index_| and
+  // |trait_index_|. |path| is the normalized path of |component|.
+  void AddToComponentIndex(const std::string& path,
+                           base::DictionaryValue* component);
+  // Removes the component at |path| and all of its sub-components from
+  // |component_index_| and |trait_index_|. Must be called before the removed
+  // components are destroyed.
+  void RemoveFromComponentIndex(const std::string& path);
+  // Drops the empty state change queues of components removed from the
+  // subtree at |path|.
+  void DropStateChangeQueues(const std::string& path);
+
+  // Returns the "state" dictionary of the component at |component_path|,
+  // creating it if necessary.
+  base::DictionaryValue* FindMutableState(const std::string& component_path,
+                                          std::string* canonical_path,
+                                          ErrorPtr* error);
+  // Returns the queue recording state changes of component at normalized
+  // |component_path|.
+  StateChangeQueue* GetStateChangeQueue(const std::string& component_path);
+  // Returns the timestamp to record state changes with. All changes of a state
+  // transaction share the same timestamp.
+  base::Time GetStateChangeTimestamp() const;
+  // Returns true if any state change has not been collected with
+  // GetAndClearRecordedStateChanges() yet.
+  bool HasRecordedStateChanges() const;
+  // Records the |dict| patch of component at |component_path| in its state
+  // change queue, applying state change policies. Returns false if all the
+  // changes were dropped or postponed by the policies.
+  bool RecordStateChanges(const std::string& component_path,
+                          const base::DictionaryValue& dict);
+  // Returns the policy for state property |name| of |trait|, or nullptr if
+  // changes of the property are recorded as is.
+  const StateChangePolicy* FindStateChangePolicy(const std::string& trait,
+                                                 const std::string& name) const;
+  // Rebuilds |state_change_policies_| from |local_trait_attributes_|.
+  void UpdateStateChangePolicies();
+  // Applies updates queued with EnqueueStateUpdate().
+  void ApplyQueuedStateUpdates();
+  // Makes sure postponed state changes are recorded at |time|.
+  void ScheduleStateChangeFlush(base::Time time);
+  void FlushPostponedStateChanges();
+  // Runs state changed callbacks, or defers that until the current state
+  // transaction is committed. If |recorded|, the changes have been recorded
+  // for the cloud and |last_state_change_id_| is bumped as well.
+  void NotifyStateChanged(bool recorded);
+
+  // Checks if the component at normalized |component_path| supports |trait|.
+  bool IsTraitSupported(const std::string& component_path,
+                        const std::string& trait) const;
 
   // Legacy API support: Helper function to support state/command definitions.
   // Adds the given trait to at least one component.
@@ -200,12 +299,15 @@ class ComponentManagerImpl final : public ComponentManager {
   void AddTraitToLegacyComponent(const std::string& trait);
 
   // Helper method to find a sub-component given a root node and a relative path
-  // from the root to the target component.
+  // from the root to the target component. If |canonical_path| is not null,
+  // it receives |path| with whitespace removed, e.g. "comp1.comp2[1]".
   static const base::DictionaryValue* FindComponentAt(
       const base::DictionaryValue* root,
       const std::string& path,
+      std::string* canonical_path,
       ErrorPtr* error);
 
+  provider::TaskRunner* task_runner_{nullptr};
   base::DefaultClock default_clock_;
   base::Clock* clock_{nullptr};
 
@@ -217,18 +319,80 @@ class ComponentManagerImpl final : public ComponentManager {
   base::CallbackList<void(UpdateID)> on_server_state_updated_;
 
   base::DictionaryValue traits_;      // Trait definitions.
+  // Attributes split off the trait definitions because they only configure
+  // this device and are not published with the traits. Laid out the same way
+  // as |traits_|, e.g. {"trait": {"state": {"prop": {"coalescing": {...}}}}}.
+  base::DictionaryValue local_trait_attributes_;
   base::DictionaryValue components_;  // Component instances.
+  // Normalized component path (e.g. "stove.burners[3].igniter") to component
+  // instance in |components_|. Kept up to date by the component tree mutators
+  // so that looking up a component does not need to parse the path. Sorted, so
+  // that the components of a subtree are adjacent.
+  std::map<std::string, base::DictionaryValue*> component_index_;
+  // Trait name to normalized paths of all the components supporting it,
+  // including nested ones. Paths are sorted, so top-level components come in
+  // the same order as in |components_|.
+  std::unordered_map<std::string, std::set<std::string>> trait_index_;
+  // State property resolved by GetStatePropertyHandle(). A handle is an index
+  // into |state_property_slots_| plus one, so zero is never a valid handle.
+  struct StatePropertySlot {
+    std::string component_path;  // Normalized path.
+    std::string trait;
+    std::string property;
+    // "state" dictionary of the component, or nullptr if the component has
+    // been removed and has to be looked up again.
+    base::DictionaryValue* state{nullptr};
+  };
+  std::vector<StatePropertySlot> state_property_slots_;
+  // Handles in |state_property_slots_| by normalized component path and
+  // property name (e.g. "trait.property").
+  std::map<std::pair<std::string, std::string>, Device::StatePropertyHandle>
+      state_property_handles_;
   CommandQueue command_queue_;  // Command queue containing command instances.
   std::vector<base::Closure> on_trait_changed_;
   std::vector<base::Closure> on_componet_tree_changed_;
   std::vector<base::Closure> on_state_changed_;
+  StateWriteStats state_write_stats_;
+  // Updates queued by EnqueueStateUpdate(), possibly from other threads.
+  StateIngestionQueue state_update_queue_;
+  // Task applying |state_update_queue_|. It is bound in advance, so producer
+  // threads only copy it and never touch |weak_ptr_factory_|.
+  base::Closure apply_queued_state_updates_;
+  // Nesting depth of BeginStateTransaction() calls.
+  int state_transaction_depth_{0};
+  // Set if the current state transaction has changed any state.
+  bool state_transaction_changed_{false};
+  // Set if any of the changes have been recorded in a state change queue.
+  bool state_transaction_recorded_{false};
+  base::Time state_transaction_timestamp_;
   uint32_t next_command_id_{0};
+  // State change queues by component path. The queue of a removed component
+  // is dropped once its changes have been collected.
   std::map<std::string, std::unique_ptr<StateChangeQueue>> state_change_queues_;
-
-  // Legacy API support.
+  // Scratch heap for merging |state_change_queues_|, kept to reuse its storage.
+  using QueueRef = std::pair<const std::string*, StateChangeQueue*>;
+  std::vector<QueueRef> state_change_merge_heap_;
+  // State change policies declared in the definition of a trait.
+  struct TraitStateChangePolicies {
+    // Policy declared for the whole trait.
+    bool has_trait_policy{false};
+    StateChangePolicy trait_policy;
+    // Policies of individual properties, inheriting from |trait_policy|.
+    std::map<std::string, StateChangePolicy> properties;
+  };
+  // Traits with state change policies, keyed by trait name.
+  std::map<std::string, TraitStateChangePolicies> state_change_policies_;
+  // Time the next FlushPostponedStateChanges() is scheduled for, if any.
+  base::Time state_change_flush_time_;
+
+  // Legacy API support. Both views are rebuilt lazily, only after a state,
+  // component tree or trait definition change has marked them dirty.
   mutable base::DictionaryValue legacy_state_;         // Device state.
   mutable base::DictionaryValue legacy_command_defs_;  // Command definitions.
+  mutable bool legacy_state_dirty_{true};
+  mutable bool legacy_command_defs_dirty_{true};
 
+  base::WeakPtrFactory<ComponentManagerImpl> weak_ptr_factory_{this};
   DISALLOW_COPY_AND_ASSIGN(ComponentManagerImpl);
 };
 
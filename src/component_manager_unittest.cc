@@ -5,6 +5,7 @@
 #include "src/component_manager_impl.h"
 
 #include <map>
+#include <thread>
 
 #include <gtest/gtest.h>
 #include <weave/provider/test/fake_task_runner.h>
@@ -69,6 +70,8 @@ bool HasTrait(const base::DictionaryValue& comp, const std::string& trait) {
 //     }
 //   }
 // }
+}  // anonymous namespace
+
 class ComponentManagerTest : public ::testing::Test {
  protected:
   void SetUp() override {
@@ -91,13 +94,21 @@ class ComponentManagerTest : public ::testing::Test {
                                       {"t5", "t6"}, nullptr));
   }
 
+  size_t GetStateChangeQueueCount() const {
+    return manager_.state_change_queues_.size();
+  }
+
+  // Returns the number of indexed components supporting |trait|.
+  size_t GetTraitIndexSize(const std::string& trait) const {
+    auto it = manager_.trait_index_.find(trait);
+    return it != manager_.trait_index_.end() ? it->second.size() : 0;
+  }
+
   StrictMock<provider::test::FakeTaskRunner> task_runner_;
   StrictMock<test::MockClock> clock_;
   ComponentManagerImpl manager_{&task_runner_, &clock_};
 };
 
-}  // anonymous namespace
-
 TEST_F(ComponentManagerTest, Empty) {
   EXPECT_TRUE(manager_.GetTraits().empty());
   EXPECT_TRUE(manager_.GetComponents().empty());
@@ -653,6 +664,66 @@ TEST_F(ComponentManagerTest, FindComponent) {
   EXPECT_EQ(nullptr, manager_.FindComponent("comp1.comp2[1", nullptr));
 }
 
+TEST_F(ComponentManagerTest, FindComponentAfterTreeChanges) {
+  CreateTestComponentTree(&manager_);
+  const base::DictionaryValue* comp3 =
+      manager_.FindComponent("comp1.comp2[1].comp3", nullptr);
+  ASSERT_NE(nullptr, comp3);
+
+  // Adding a component with a non-normalized parent path still makes it
+  // reachable through its normalized path.
+  EXPECT_TRUE(manager_.AddComponent(" comp1 . comp2[ 1 ] ", "comp5", {"t1"},
+                                    nullptr));
+  const base::DictionaryValue* comp =
+      manager_.FindComponent("comp1.comp2[1].comp5", nullptr);
+  ASSERT_NE(nullptr, comp);
+  EXPECT_TRUE(HasTrait(*comp, "t1"));
+
+  // Removing an array element shifts the elements that follow it.
+  EXPECT_TRUE(manager_.RemoveComponentArrayItem("comp1", "comp2", 0, nullptr));
+  EXPECT_EQ(nullptr, manager_.FindComponent("comp1.comp2[1]", nullptr));
+  EXPECT_EQ(nullptr, manager_.FindComponent("comp1.comp2[1].comp3", nullptr));
+  EXPECT_EQ(comp3, manager_.FindComponent("comp1.comp2[0].comp3", nullptr));
+  comp = manager_.FindComponent("comp1.comp2[0].comp3.comp4", nullptr);
+  ASSERT_NE(nullptr, comp);
+  EXPECT_TRUE(HasTrait(*comp, "t5"));
+
+  // Removing a component removes all its sub-components as well.
+  EXPECT_TRUE(manager_.RemoveComponent("comp1.comp2[0]", "comp3", nullptr));
+  EXPECT_EQ(nullptr, manager_.FindComponent("comp1.comp2[0].comp3", nullptr));
+  EXPECT_EQ(nullptr,
+            manager_.FindComponent("comp1.comp2[0].comp3.comp4", nullptr));
+  EXPECT_NE(nullptr, manager_.FindComponent("comp1.comp2[0].comp5", nullptr));
+
+  EXPECT_TRUE(manager_.RemoveComponent("", "comp1", nullptr));
+  EXPECT_EQ(nullptr, manager_.FindComponent("comp1", nullptr));
+  EXPECT_EQ(nullptr, manager_.FindComponent("comp1.comp2[0]", nullptr));
+}
+
+// Compares the indexed component lookup against the full path walk, which is
+// still used for paths that are not in normalized form. Run with
+// --gtest_also_run_disabled_tests.
+TEST_F(ComponentManagerTest, DISABLED_FindComponentBenchmark) {
+  CreateTestComponentTree(&manager_);
+  const int kIterations = 1000000;
+  const char kPath[] = "comp1.comp2[1].comp3.comp4";
+  const char kPathToWalk[] = "comp1 .comp2[1].comp3.comp4";
+
+  base::TimeTicks start = base::TimeTicks::Now();
+  for (int i = 0; i < kIterations; i++)
+    ASSERT_NE(nullptr, manager_.FindComponent(kPath, nullptr));
+  base::TimeDelta indexed = base::TimeTicks::Now() - start;
+
+  start = base::TimeTicks::Now();
+  for (int i = 0; i < kIterations; i++)
+    ASSERT_NE(nullptr, manager_.FindComponent(kPathToWalk, nullptr));
+  base::TimeDelta walked = base::TimeTicks::Now() - start;
+
+  LOG(INFO) << "FindComponent x" << kIterations
+            << ": indexed=" << indexed.InMilliseconds()
+            << "ms, path walk=" << walked.InMilliseconds() << "ms";
+}
+
 TEST_F(ComponentManagerTest, ParseCommandInstance) {
   const char kTraits[] = R"({
     "trait1": {
@@ -756,6 +827,39 @@ TEST_F(ComponentManagerTest, ParseCommandInstance) {
                 .get());
 }
 
+TEST_F(ComponentManagerTest, ParseCommandInstanceNameWithSpaces) {
+  const char kTraits[] = R"({
+    "trait1": {
+      "commands": {
+        "command1": { "minimalRole": "user" }
+      }
+    }
+  })";
+  auto traits = CreateDictionaryValue(kTraits);
+  ASSERT_TRUE(manager_.LoadTraits(*traits, nullptr));
+  ASSERT_TRUE(manager_.AddComponent("", "comp 1", {"trait1"}, nullptr));
+  ASSERT_TRUE(manager_.AddComponent("comp 1", "sub 1", {"trait1"}, nullptr));
+  EXPECT_NE(nullptr, manager_.FindComponent("comp 1.sub 1", nullptr));
+
+  for (const char* component : {"comp 1", " comp 1 . sub 1 "}) {
+    base::DictionaryValue command;
+    command.SetString("name", "trait1.command1");
+    command.SetString("component", component);
+    ErrorPtr error;
+    EXPECT_NE(nullptr,
+              manager_.ParseCommandInstance(command, Command::Origin::kLocal,
+                                            UserRole::kUser, nullptr, &error)
+                  .get())
+        << component;
+    EXPECT_EQ(nullptr, error.get());
+  }
+
+  // The rest of the tree stays indexed after a removal next to it.
+  ASSERT_TRUE(manager_.AddComponent("", "comp", {"trait1"}, nullptr));
+  ASSERT_TRUE(manager_.RemoveComponent("", "comp", nullptr));
+  EXPECT_NE(nullptr, manager_.FindComponent("comp 1.sub 1", nullptr));
+}
+
 TEST_F(ComponentManagerTest, AddCommand) {
   const char kTraits[] = R"({
     "trait1": {
@@ -855,6 +959,161 @@ TEST_F(ComponentManagerTest, AddCommandHandler) {
   manager_.AddCommand(std::move(command_instance));
   EXPECT_EQ("3", last_tags);
   last_tags.clear();
+
+  // Routed by the canonical path of the component.
+  auto command4 = CreateDictionaryValue(
+      "{'name': 'trait1.command1', 'component': ' comp1 '}");
+  command_instance = manager_.ParseCommandInstance(
+      *command4, Command::Origin::kCloud, UserRole::kUser, nullptr, nullptr);
+  ASSERT_NE(nullptr, command_instance.get());
+  EXPECT_EQ("comp1", command_instance->GetComponent());
+  EXPECT_NE(0u, command_instance->GetHandlerSlot());
+  manager_.AddCommand(std::move(command_instance));
+  EXPECT_EQ("1", last_tags);
+  last_tags.clear();
+}
+
+TEST_F(ComponentManagerTest, CommandPriorityAndExpiration) {
+  const char kTraits[] = R"({
+    "trait1": {
+      "commands": {
+        "command1": {
+          "minimalRole": "user",
+          "priority": 5,
+          "expirationTimeoutMs": 30000
+        },
+        "command2": { "minimalRole": "user" }
+      }
+    }
+  })";
+  auto traits = CreateDictionaryValue(kTraits);
+  ASSERT_TRUE(manager_.LoadTraits(*traits, nullptr));
+  ASSERT_TRUE(manager_.AddComponent("", "comp1", {"trait1"}, nullptr));
+  base::Time now = clock_.Now();
+
+  // The scheduling hints are not published with the trait.
+  EXPECT_JSON_EQ("{'minimalRole': 'user'}",
+                 *manager_.FindCommandDefinition("trait1.command1"));
+
+  auto command = CreateDictionaryValue(
+      "{'name': 'trait1.command1', 'component': 'comp1'}");
+  auto instance = manager_.ParseCommandInstance(
+      *command, Command::Origin::kLocal, UserRole::kUser, nullptr, nullptr);
+  ASSERT_NE(nullptr, instance.get());
+  EXPECT_EQ(5, instance->GetPriority());
+  EXPECT_EQ(now + base::TimeDelta::FromSeconds(30),
+            instance->GetExpirationTime());
+
+  // Values of the command override the definition.
+  command = CreateDictionaryValue(R"({
+    'name': 'trait1.command1',
+    'component': 'comp1',
+    'priority': 0,
+    'expirationTimeMs': 1450000000000
+  })");
+  instance = manager_.ParseCommandInstance(
+      *command, Command::Origin::kLocal, UserRole::kUser, nullptr, nullptr);
+  ASSERT_NE(nullptr, instance.get());
+  EXPECT_EQ(0, instance->GetPriority());
+  EXPECT_EQ(base::Time::FromJsTime(1450000000000.0),
+            instance->GetExpirationTime());
+
+  command = CreateDictionaryValue(
+      "{'name': 'trait1.command2', 'component': 'comp1'}");
+  instance = manager_.ParseCommandInstance(
+      *command, Command::Origin::kLocal, UserRole::kUser, nullptr, nullptr);
+  ASSERT_NE(nullptr, instance.get());
+  EXPECT_EQ(0, instance->GetPriority());
+  EXPECT_TRUE(instance->GetExpirationTime().is_null());
+}
+
+TEST_F(ComponentManagerTest, SupersedePendingCommands) {
+  const char kTraits[] = R"({
+    "trait1": {
+      "commands": {
+        "set": { "minimalRole": "user", "supersedePending": true },
+        "toggle": { "minimalRole": "user" }
+      }
+    }
+  })";
+  auto traits = CreateDictionaryValue(kTraits);
+  ASSERT_TRUE(manager_.LoadTraits(*traits, nullptr));
+  ASSERT_TRUE(manager_.AddComponent("", "comp1", {"trait1"}, nullptr));
+  ASSERT_TRUE(manager_.AddComponent("", "comp2", {"trait1"}, nullptr));
+  EXPECT_JSON_EQ("{'minimalRole': 'user'}",
+                 *manager_.FindCommandDefinition("trait1.set"));
+
+  auto add_command = [this](const std::string& name,
+                            const std::string& component) {
+    base::DictionaryValue command;
+    command.SetString("name", name);
+    command.SetString("component", component);
+    std::string id;
+    auto instance = manager_.ParseCommandInstance(
+        command, Command::Origin::kLocal, UserRole::kUser, &id, nullptr);
+    EXPECT_NE(nullptr, instance.get());
+    manager_.AddCommand(std::move(instance));
+    return manager_.FindCommand(id);
+  };
+
+  auto set1 = add_command("trait1.set", "comp1");
+  auto set2 = add_command("trait1.set", "comp2");
+  auto toggle1 = add_command("trait1.toggle", "comp1");
+  auto toggle2 = add_command("trait1.toggle", "comp1");
+  auto set3 = add_command("trait1.set", "comp1");
+
+  EXPECT_EQ(Command::State::kCancelled, set1->GetState());
+  EXPECT_EQ(Command::State::kQueued, set2->GetState());
+  EXPECT_EQ(Command::State::kQueued, toggle1->GetState());
+  EXPECT_EQ(Command::State::kQueued, toggle2->GetState());
+  EXPECT_EQ(Command::State::kQueued, set3->GetState());
+}
+
+// Measures the rate of commands dispatched to their handlers through
+// AddCommand(). Run with --gtest_also_run_disabled_tests.
+TEST_F(ComponentManagerTest, DISABLED_AddCommandBenchmark) {
+  const char kTraits[] = R"({
+    "trait1": {
+      "commands": {
+        "command1": { "minimalRole": "user" },
+        "command2": { "minimalRole": "user" }
+      }
+    }
+  })";
+  auto traits = CreateDictionaryValue(kTraits);
+  ASSERT_TRUE(manager_.LoadTraits(*traits, nullptr));
+  ASSERT_TRUE(manager_.AddComponent("", "comp1", {"trait1"}, nullptr));
+  ASSERT_TRUE(manager_.AddComponent("", "comp2", {"trait1"}, nullptr));
+
+  int handled = 0;
+  auto handler = [&handled](const std::weak_ptr<Command>& command) {
+    handled++;
+  };
+  manager_.AddCommandHandler("comp1", "trait1.command1", base::Bind(handler));
+  manager_.AddCommandHandler("comp1", "trait1.command2", base::Bind(handler));
+  manager_.AddCommandHandler("comp2", "trait1.command1", base::Bind(handler));
+  manager_.AddCommandHandler("comp2", "trait1.command2", base::Bind(handler));
+
+  const int kCommands = 100000;
+  auto command = CreateDictionaryValue(
+      "{'name': 'trait1.command2', 'component': 'comp2'}");
+  std::vector<std::unique_ptr<CommandInstance>> instances;
+  for (int i = 0; i < kCommands; i++) {
+    instances.push_back(manager_.ParseCommandInstance(
+        *command, Command::Origin::kLocal, UserRole::kUser, nullptr, nullptr));
+    ASSERT_NE(nullptr, instances.back().get());
+  }
+
+  base::TimeTicks start = base::TimeTicks::Now();
+  for (auto& instance : instances)
+    manager_.AddCommand(std::move(instance));
+  base::TimeDelta elapsed = base::TimeTicks::Now() - start;
+  EXPECT_EQ(kCommands, handled);
+
+  LOG(INFO) << "AddCommand x" << kCommands << ": "
+            << elapsed.InMilliseconds() << "ms, "
+            << static_cast<int64_t>(kCommands / elapsed.InSecondsF())
+            << " commands/s";
 }
 
 TEST_F(ComponentManagerTest, AddDefaultCommandHandler) {
@@ -1110,6 +1369,197 @@ TEST_F(ComponentManagerTest, SetGetStateProperty) {
   EXPECT_EQ(nullptr, manager_.GetStateProperty("comp1", "trait2", nullptr));
 }
 
+TEST_F(ComponentManagerTest, SetStatePropertyInPlace) {
+  const char kTraits[] = R"({"trait1": {}})";
+  auto traits = CreateDictionaryValue(kTraits);
+  ASSERT_TRUE(manager_.LoadTraits(*traits, nullptr));
+  ASSERT_TRUE(manager_.AddComponent("", "comp1", {"trait1"}, nullptr));
+
+  ASSERT_TRUE(manager_.SetStatePropertiesFromJson(
+      "comp1", R"({"trait1": {"p1": 1, "p2": "foo", "p3": {"a": 1}}})",
+      nullptr));
+  const base::Value* p1 =
+      manager_.GetStateProperty("comp1", "trait1.p1", nullptr);
+  const base::Value* p2 =
+      manager_.GetStateProperty("comp1", "trait1.p2", nullptr);
+  ASSERT_NE(nullptr, p1);
+  ASSERT_NE(nullptr, p2);
+
+  // Values of the same type are updated in place.
+  ASSERT_TRUE(manager_.SetStatePropertiesFromJson(
+      "comp1", R"({"trait1": {"p1": 2, "p2": "bar", "p3": {"b": 2}}})",
+      nullptr));
+  EXPECT_EQ(p1, manager_.GetStateProperty("comp1", "trait1.p1", nullptr));
+  EXPECT_EQ(p2, manager_.GetStateProperty("comp1", "trait1.p2", nullptr));
+  EXPECT_JSON_EQ("2", *p1);
+  EXPECT_JSON_EQ("'bar'", *p2);
+
+  // Values changing their type are replaced.
+  ASSERT_TRUE(manager_.SetStatePropertiesFromJson(
+      "comp1", R"({"trait1": {"p1": 2.5, "p3": 3}})", nullptr));
+  const char kExpected[] = R"({
+    "trait1": {"p1": 2.5, "p2": "bar", "p3": 3}
+  })";
+  const base::DictionaryValue* comp = manager_.FindComponent("comp1", nullptr);
+  ASSERT_NE(nullptr, comp);
+  const base::DictionaryValue* state = nullptr;
+  ASSERT_TRUE(comp->GetDictionary("state", &state));
+  EXPECT_JSON_EQ(kExpected, *state);
+}
+
+TEST_F(ComponentManagerTest, UpdateStatePropertyWithHandle) {
+  const char kTraits[] = R"({"trait1": {}, "trait2": {}})";
+  auto traits = CreateDictionaryValue(kTraits);
+  ASSERT_TRUE(manager_.LoadTraits(*traits, nullptr));
+  ASSERT_TRUE(manager_.AddComponent("", "comp1", {"trait1"}, nullptr));
+  ASSERT_TRUE(manager_.AddComponent("comp1", "comp2", {"trait2"}, nullptr));
+
+  int count = 0;
+  manager_.AddStateChangedCallback(base::Bind([&count]() { count++; }));
+  EXPECT_EQ(1, count);
+
+  Device::StatePropertyHandle handle1 = 0;
+  Device::StatePropertyHandle handle2 = 0;
+  ASSERT_TRUE(manager_.GetStatePropertyHandle("comp1", "trait1.p1", &handle1,
+                                              nullptr));
+  ASSERT_TRUE(manager_.GetStatePropertyHandle("comp1 . comp2", "trait2.p2",
+                                              &handle2, nullptr));
+  EXPECT_NE(0u, handle1);
+  EXPECT_NE(handle1, handle2);
+  Device::StatePropertyHandle handle = 0;
+  ASSERT_TRUE(manager_.GetStatePropertyHandle("comp1", "trait1.p1", &handle,
+                                              nullptr));
+  EXPECT_EQ(handle1, handle);
+
+  ASSERT_TRUE(manager_.UpdateStateProperty(handle1, base::FundamentalValue{1},
+                                           nullptr));
+  const base::Value* p1 =
+      manager_.GetStateProperty("comp1", "trait1.p1", nullptr);
+  ASSERT_NE(nullptr, p1);
+  ASSERT_TRUE(manager_.UpdateStateProperty(handle1, base::FundamentalValue{2},
+                                           nullptr));
+  EXPECT_EQ(p1, manager_.GetStateProperty("comp1", "trait1.p1", nullptr));
+  EXPECT_JSON_EQ("2", *p1);
+  ASSERT_TRUE(
+      manager_.UpdateStateProperty(handle2, base::StringValue{"foo"}, nullptr));
+  EXPECT_EQ(4, count);
+  EXPECT_EQ(3u, manager_.GetLastStateChangeId());
+
+  auto snapshot = manager_.GetAndClearRecordedStateChanges();
+  EXPECT_EQ(3u, snapshot.update_id);
+  ASSERT_EQ(2u, snapshot.state_changes.size());
+  EXPECT_EQ("comp1", snapshot.state_changes[0].component);
+  EXPECT_JSON_EQ(R"({"trait1": {"p1": 2}})",
+                 *snapshot.state_changes[0].changed_properties);
+  EXPECT_EQ("comp1.comp2", snapshot.state_changes[1].component);
+  EXPECT_JSON_EQ(R"({"trait2": {"p2": "foo"}})",
+                 *snapshot.state_changes[1].changed_properties);
+
+  // Handles survive removing and adding the component again.
+  ASSERT_TRUE(manager_.RemoveComponent("comp1", "comp2", nullptr));
+  EXPECT_FALSE(
+      manager_.UpdateStateProperty(handle2, base::StringValue{"bar"}, nullptr));
+  // The parent's handle is not affected.
+  EXPECT_TRUE(manager_.UpdateStateProperty(handle1, base::FundamentalValue{3},
+                                           nullptr));
+  EXPECT_EQ(p1, manager_.GetStateProperty("comp1", "trait1.p1", nullptr));
+  ASSERT_TRUE(manager_.AddComponent("comp1", "comp2", {"trait2"}, nullptr));
+  ASSERT_TRUE(
+      manager_.UpdateStateProperty(handle2, base::StringValue{"bar"}, nullptr));
+  const base::Value* p2 =
+      manager_.GetStateProperty("comp1.comp2", "trait2.p2", nullptr);
+  ASSERT_NE(nullptr, p2);
+  EXPECT_JSON_EQ("'bar'", *p2);
+
+  // Invalid names and handles.
+  EXPECT_FALSE(
+      manager_.GetStatePropertyHandle("comp1", "trait1", &handle, nullptr));
+  EXPECT_FALSE(
+      manager_.GetStatePropertyHandle("comp3", "trait1.p1", &handle, nullptr));
+  EXPECT_FALSE(
+      manager_.UpdateStateProperty(0, base::FundamentalValue{1}, nullptr));
+  EXPECT_FALSE(
+      manager_.UpdateStateProperty(100, base::FundamentalValue{1}, nullptr));
+}
+
+TEST_F(ComponentManagerTest, UpdateStatePropertyWithHandleMergesDictionary) {
+  const char kTraits[] = R"({"trait1": {}})";
+  ASSERT_TRUE(manager_.LoadTraits(kTraits, nullptr));
+  ASSERT_TRUE(manager_.AddComponent("", "comp1", {"trait1"}, nullptr));
+  ASSERT_TRUE(manager_.SetStatePropertiesFromJson(
+      "comp1", R"({"trait1": {"p1": {"a": 1, "b": 2}}})", nullptr));
+  manager_.GetAndClearRecordedStateChanges();
+
+  Device::StatePropertyHandle handle = 0;
+  ASSERT_TRUE(manager_.GetStatePropertyHandle("comp1", "trait1.p1", &handle,
+                                              nullptr));
+  ASSERT_TRUE(manager_.UpdateStateProperty(
+      handle, *CreateDictionaryValue("{'b': 3, 'c': 4}"), nullptr));
+  const base::Value* p1 =
+      manager_.GetStateProperty("comp1", "trait1.p1", nullptr);
+  ASSERT_NE(nullptr, p1);
+  EXPECT_JSON_EQ(R"({"a": 1, "b": 3, "c": 4})", *p1);
+
+  auto snapshot = manager_.GetAndClearRecordedStateChanges();
+  ASSERT_EQ(1u, snapshot.state_changes.size());
+  EXPECT_JSON_EQ(R"({"trait1": {"p1": {"b": 3, "c": 4}}})",
+                 *snapshot.state_changes[0].changed_properties);
+
+  // A subset of the current value changes nothing.
+  ASSERT_TRUE(manager_.UpdateStateProperty(
+      handle, *CreateDictionaryValue("{'a': 1}"), nullptr));
+  EXPECT_TRUE(manager_.GetAndClearRecordedStateChanges().state_changes.empty());
+}
+
+TEST_F(ComponentManagerTest, SkipUnchangedStateWrites) {
+  const char kTraits[] = R"({"trait1": {}, "trait2": {}})";
+  ASSERT_TRUE(manager_.LoadTraits(kTraits, nullptr));
+  ASSERT_TRUE(manager_.AddComponent("", "comp1", {"trait1", "trait2"},
+                                    nullptr));
+  int count = 0;
+  manager_.AddStateChangedCallback(base::Bind([&count]() { count++; }));
+
+  const char kState[] = R"({
+    "trait1": {"p1": 1, "p2": {"a": 1, "b": 2}},
+    "trait2": {"p3": "foo"}
+  })";
+  ASSERT_TRUE(manager_.SetStatePropertiesFromJson("comp1", kState, nullptr));
+  EXPECT_EQ(2, count);
+  EXPECT_EQ(1u, manager_.GetLastStateChangeId());
+  manager_.GetAndClearRecordedStateChanges();
+
+  // Re-publishing the same state does not change anything.
+  ASSERT_TRUE(manager_.SetStatePropertiesFromJson("comp1", kState, nullptr));
+  ASSERT_TRUE(manager_.SetStatePropertiesFromJson(
+      "comp1", R"({"trait1": {"p2": {"b": 2}}})", nullptr));
+  Device::StatePropertyHandle handle = 0;
+  ASSERT_TRUE(manager_.GetStatePropertyHandle("comp1", "trait2.p3", &handle,
+                                              nullptr));
+  ASSERT_TRUE(
+      manager_.UpdateStateProperty(handle, base::StringValue{"foo"}, nullptr));
+  EXPECT_EQ(2, count);
+  EXPECT_EQ(1u, manager_.GetLastStateChangeId());
+  EXPECT_TRUE(manager_.GetAndClearRecordedStateChanges().state_changes.empty());
+
+  // Only the changed properties are recorded.
+  const char kPatch[] = R"({
+    "trait1": {"p1": 1, "p2": {"a": 3}},
+    "trait2": {"p3": "foo"}
+  })";
+  ASSERT_TRUE(manager_.SetStatePropertiesFromJson("comp1", kPatch, nullptr));
+  EXPECT_EQ(3, count);
+  EXPECT_EQ(2u, manager_.GetLastStateChangeId());
+  auto snapshot = manager_.GetAndClearRecordedStateChanges();
+  ASSERT_EQ(1u, snapshot.state_changes.size());
+  EXPECT_JSON_EQ(R"({"trait1": {"p2": {"a": 3}}})",
+                 *snapshot.state_changes[0].changed_properties);
+
+  auto stats = manager_.GetStateWriteStats();
+  EXPECT_EQ(5u, stats.writes);
+  EXPECT_EQ(3u, stats.suppressed_writes);
+  EXPECT_EQ(7u, stats.suppressed_properties);
+}
+
 TEST_F(ComponentManagerTest, AddStateChangedCallback) {
   const char kTraits[] = R"({
     "trait1": {
@@ -1149,6 +1599,219 @@ TEST_F(ComponentManagerTest, AddStateChangedCallback) {
   EXPECT_EQ(2u, manager_.GetLastStateChangeId());
 }
 
+TEST_F(ComponentManagerTest, EnqueueStateUpdate) {
+  const char kTraits[] = R"({"trait1": {}})";
+  ASSERT_TRUE(manager_.LoadTraits(kTraits, nullptr));
+  ASSERT_TRUE(manager_.AddComponent("", "comp1", {"trait1"}, nullptr));
+  Device::StatePropertyHandle handle1 = 0;
+  Device::StatePropertyHandle handle2 = 0;
+  ASSERT_TRUE(manager_.GetStatePropertyHandle("comp1", "trait1.p1", &handle1,
+                                              nullptr));
+  ASSERT_TRUE(manager_.GetStatePropertyHandle("comp1", "trait1.p2", &handle2,
+                                              nullptr));
+  int count = 0;
+  manager_.AddStateChangedCallback(base::Bind([&count]() { count++; }));
+
+  std::thread producer{[this, handle1, handle2]() {
+    for (int i = 1; i <= 100; i++) {
+      EXPECT_TRUE(
+          manager_.EnqueueStateUpdate(handle1, base::FundamentalValue{i}));
+      EXPECT_TRUE(manager_.EnqueueStateUpdate(
+          handle2, base::FundamentalValue{i % 2 == 0}));
+    }
+  }};
+  producer.join();
+  EXPECT_EQ(1u, task_runner_.GetTaskQueueSize());
+  EXPECT_EQ(1, count);
+
+  // All the updates are applied by a single task, as a single transaction.
+  task_runner_.RunOnce();
+  EXPECT_EQ(2, count);
+  EXPECT_EQ(1u, manager_.GetLastStateChangeId());
+  EXPECT_JSON_EQ("100",
+                 *manager_.GetStateProperty("comp1", "trait1.p1", nullptr));
+  EXPECT_JSON_EQ("true",
+                 *manager_.GetStateProperty("comp1", "trait1.p2", nullptr));
+
+  EXPECT_TRUE(manager_.EnqueueStateUpdate(handle1, base::FundamentalValue{0}));
+  task_runner_.RunOnce();
+  EXPECT_EQ(3, count);
+  EXPECT_JSON_EQ("0",
+                 *manager_.GetStateProperty("comp1", "trait1.p1", nullptr));
+}
+
+TEST_F(ComponentManagerTest, StateTransaction) {
+  const char kTraits[] = R"({"trait1": {}, "trait2": {}})";
+  ASSERT_TRUE(manager_.LoadTraits(kTraits, nullptr));
+  ASSERT_TRUE(manager_.AddComponent("", "comp1", {"trait1"}, nullptr));
+  ASSERT_TRUE(manager_.AddComponent("", "comp2", {"trait2"}, nullptr));
+
+  int count = 0;
+  manager_.AddStateChangedCallback(base::Bind([&count]() { count++; }));
+  EXPECT_EQ(1, count);
+
+  base::Time time1 = base::Time::Now();
+  base::Time time2 = time1 + base::TimeDelta::FromSeconds(1);
+  EXPECT_CALL(clock_, Now())
+      .WillOnce(Return(time1))
+      .WillRepeatedly(Return(time2));
+
+  base::StringValue foo("foo");
+  manager_.BeginStateTransaction();
+  ASSERT_TRUE(manager_.SetStateProperty("comp1", "trait1.prop1", foo, nullptr));
+  manager_.BeginStateTransaction();
+  ASSERT_TRUE(manager_.SetStateProperty("comp2", "trait2.prop2", foo, nullptr));
+  manager_.CommitStateTransaction();
+  ASSERT_TRUE(manager_.SetStateProperty("comp1", "trait1.prop3", foo, nullptr));
+  // Nothing is announced until the outermost transaction is committed.
+  EXPECT_EQ(1, count);
+  EXPECT_EQ(0u, manager_.GetLastStateChangeId());
+  EXPECT_JSON_EQ(R"({"trait1": {"prop1": "foo", "prop3": "foo"},
+                     "trait2": {"prop2": "foo"}})",
+                 manager_.GetLegacyState());
+  manager_.CommitStateTransaction();
+  EXPECT_EQ(2, count);
+  EXPECT_EQ(1u, manager_.GetLastStateChangeId());
+
+  // All changes share the timestamp of the transaction start.
+  auto snapshot = manager_.GetAndClearRecordedStateChanges();
+  EXPECT_EQ(1u, snapshot.update_id);
+  ASSERT_EQ(2u, snapshot.state_changes.size());
+  EXPECT_EQ(time1, snapshot.state_changes[0].timestamp);
+  EXPECT_JSON_EQ(R"({"trait1": {"prop1": "foo", "prop3": "foo"}})",
+                 *snapshot.state_changes[0].changed_properties);
+  EXPECT_EQ(time1, snapshot.state_changes[1].timestamp);
+  EXPECT_JSON_EQ(R"({"trait2": {"prop2": "foo"}})",
+                 *snapshot.state_changes[1].changed_properties);
+
+  // Empty transactions do not notify.
+  manager_.BeginStateTransaction();
+  manager_.CommitStateTransaction();
+  EXPECT_EQ(2, count);
+  EXPECT_EQ(1u, manager_.GetLastStateChangeId());
+}
+
+TEST_F(ComponentManagerTest, StateChangesMergedByTimestamp) {
+  const char kTraits[] = R"({"trait1": {}})";
+  ASSERT_TRUE(manager_.LoadTraits(kTraits, nullptr));
+  ASSERT_TRUE(manager_.AddComponent("", "comp1", {"trait1"}, nullptr));
+  ASSERT_TRUE(manager_.AddComponent("", "comp2", {"trait1"}, nullptr));
+  ASSERT_TRUE(manager_.AddComponent("", "comp3", {"trait1"}, nullptr));
+
+  base::Time start = base::Time::Now();
+  const char* const kUpdates[] = {"comp3", "comp1", "comp2", "comp1", "comp3"};
+  for (int cycle = 0; cycle < 2; cycle++) {
+    for (size_t i = 0; i < arraysize(kUpdates); i++) {
+      EXPECT_CALL(clock_, Now())
+          .WillOnce(Return(start + base::TimeDelta::FromSeconds(i)));
+      base::FundamentalValue value{static_cast<int>(cycle * 10 + i)};
+      ASSERT_TRUE(manager_.SetStateProperty(kUpdates[i], "trait1.prop", value,
+                                            nullptr));
+    }
+    auto snapshot = manager_.GetAndClearRecordedStateChanges();
+    ASSERT_EQ(arraysize(kUpdates), snapshot.state_changes.size());
+    for (size_t i = 0; i < arraysize(kUpdates); i++) {
+      EXPECT_EQ(kUpdates[i], snapshot.state_changes[i].component);
+      EXPECT_EQ(start + base::TimeDelta::FromSeconds(i),
+                snapshot.state_changes[i].timestamp);
+    }
+    snapshot = manager_.GetAndClearRecordedStateChanges();
+    EXPECT_TRUE(snapshot.state_changes.empty());
+  }
+}
+
+TEST_F(ComponentManagerTest, StateChangeQueuesOfRemovedComponents) {
+  const char kTraits[] = R"({"t1": {"state": {"p": {"type": "integer"}}}})";
+  ASSERT_TRUE(manager_.LoadTraits(kTraits, nullptr));
+  for (int i = 0; i < 3; i++) {
+    ASSERT_TRUE(manager_.AddComponentArrayItem("", "arr", {"t1"}, nullptr));
+    std::string path = "arr[" + std::to_string(i) + "]";
+    ASSERT_TRUE(manager_.SetStateProperty(path, "t1.p",
+                                          base::FundamentalValue{i}, nullptr));
+  }
+  EXPECT_EQ(3u, GetStateChangeQueueCount());
+  manager_.GetAndClearRecordedStateChanges();
+  EXPECT_EQ(3u, GetStateChangeQueueCount());
+
+  // Drained queues go away with their components.
+  ASSERT_TRUE(manager_.RemoveComponentArrayItem("", "arr", 2, nullptr));
+  EXPECT_EQ(2u, GetStateChangeQueueCount());
+
+  // Changes still in the queue are published first.
+  ASSERT_TRUE(manager_.SetStateProperty("arr[1]", "t1.p",
+                                        base::FundamentalValue{5}, nullptr));
+  ASSERT_TRUE(manager_.RemoveComponent("", "arr", nullptr));
+  EXPECT_EQ(1u, GetStateChangeQueueCount());
+  auto snapshot = manager_.GetAndClearRecordedStateChanges();
+  ASSERT_EQ(1u, snapshot.state_changes.size());
+  EXPECT_EQ("arr[1]", snapshot.state_changes[0].component);
+  EXPECT_EQ(0u, GetStateChangeQueueCount());
+}
+
+TEST_F(ComponentManagerTest, StateChangePolicies) {
+  const char kTraits[] = R"({
+    "sensor": {
+      "coalescing": {"minIntervalMs": 10000},
+      "state": {
+        "temp": {"type": "number", "coalescing": {"deadband": 0.5}},
+        "name": {"type": "string"}
+      }
+    },
+    "other": {"state": {"prop": {"type": "integer"}}}
+  })";
+  ASSERT_TRUE(manager_.LoadTraits(kTraits, nullptr));
+  ASSERT_TRUE(manager_.AddComponent("", "comp", {"sensor", "other"}, nullptr));
+  int count = 0;
+  manager_.AddStateChangedCallback(base::Bind([&count]() { count++; }));
+
+  base::Time start = base::Time::Now();
+  base::TimeDelta second = base::TimeDelta::FromSeconds(1);
+  EXPECT_CALL(clock_, Now()).WillRepeatedly(Return(start));
+  const char kState[] =
+      R"({"sensor": {"temp": 20.0, "name": "a"}, "other": {"prop": 1}})";
+  ASSERT_TRUE(manager_.SetStatePropertiesFromJson("comp", kState, nullptr));
+  EXPECT_EQ(1u, manager_.GetLastStateChangeId());
+  auto snapshot = manager_.GetAndClearRecordedStateChanges();
+  ASSERT_EQ(1u, snapshot.state_changes.size());
+  EXPECT_JSON_EQ(kState, *snapshot.state_changes[0].changed_properties);
+
+  // Changes within the minimal interval are postponed.
+  EXPECT_CALL(clock_, Now()).WillRepeatedly(Return(start + second * 5));
+  ASSERT_TRUE(manager_.SetStateProperty("comp", "sensor.name",
+                                        base::StringValue{"b"}, nullptr));
+  EXPECT_EQ(3, count);
+  EXPECT_EQ(1u, manager_.GetLastStateChangeId());
+  EXPECT_TRUE(manager_.GetAndClearRecordedStateChanges().state_changes.empty());
+
+  // Properties without a policy are not affected.
+  ASSERT_TRUE(manager_.SetStateProperty("comp", "other.prop",
+                                        base::FundamentalValue{2}, nullptr));
+  EXPECT_EQ(2u, manager_.GetLastStateChangeId());
+  snapshot = manager_.GetAndClearRecordedStateChanges();
+  ASSERT_EQ(1u, snapshot.state_changes.size());
+  EXPECT_JSON_EQ(R"({"other": {"prop": 2}})",
+                 *snapshot.state_changes[0].changed_properties);
+
+  EXPECT_CALL(clock_, Now()).WillRepeatedly(Return(start + second * 10));
+  task_runner_.RunOnce();
+  EXPECT_EQ(3u, manager_.GetLastStateChangeId());
+  snapshot = manager_.GetAndClearRecordedStateChanges();
+  ASSERT_EQ(1u, snapshot.state_changes.size());
+  EXPECT_EQ(start + second * 10, snapshot.state_changes[0].timestamp);
+  EXPECT_JSON_EQ(R"({"sensor": {"name": "b"}})",
+                 *snapshot.state_changes[0].changed_properties);
+
+  // Within the deadband: the state is updated, but nothing is recorded.
+  EXPECT_CALL(clock_, Now()).WillRepeatedly(Return(start + second * 20));
+  base::FundamentalValue temp{20.2};
+  ASSERT_TRUE(manager_.SetStateProperty("comp", "sensor.temp", temp, nullptr));
+  EXPECT_EQ(6, count);
+  EXPECT_EQ(3u, manager_.GetLastStateChangeId());
+  EXPECT_JSON_EQ("20.2", *manager_.GetStateProperty("comp", "sensor.temp",
+                                                     nullptr));
+  EXPECT_TRUE(manager_.GetAndClearRecordedStateChanges().state_changes.empty());
+}
+
 TEST_F(ComponentManagerTest, ComponentStateUpdates) {
   const char kTraits[] = R"({
     "trait1": {
@@ -1262,6 +1925,86 @@ TEST_F(ComponentManagerTest, FindComponentWithTrait) {
   EXPECT_EQ("", manager_.FindComponentWithTrait("trait4"));
 }
 
+TEST_F(ComponentManagerTest, FindComponentWithTraitNameWithSpaces) {
+  const char kTraits[] = R"({
+    "trait1": {},
+    "trait2": {}
+  })";
+  auto traits = CreateDictionaryValue(kTraits);
+  ASSERT_TRUE(manager_.LoadTraits(*traits, nullptr));
+  ASSERT_TRUE(manager_.AddComponent("", "comp 1", {"trait1"}, nullptr));
+  ASSERT_TRUE(manager_.AddComponent("", "comp 2", {"trait1"}, nullptr));
+  ASSERT_TRUE(
+      manager_.AddComponentArrayItem("comp 1", "arr", {"trait2"}, nullptr));
+  ASSERT_TRUE(
+      manager_.AddComponentArrayItem("comp 1", "arr", {"trait2"}, nullptr));
+
+  // Same as the first component with the trait in GetComponents().
+  EXPECT_EQ("comp 1", manager_.FindComponentWithTrait("trait1"));
+  ASSERT_TRUE(manager_.RemoveComponent("", "comp 1", nullptr));
+  EXPECT_EQ("comp 2", manager_.FindComponentWithTrait("trait1"));
+
+  // The nested components are gone with their parent.
+  EXPECT_EQ(0u, GetTraitIndexSize("trait2"));
+
+  ASSERT_TRUE(
+      manager_.AddComponentArrayItem("comp 2", "arr", {"trait2"}, nullptr));
+  ASSERT_TRUE(
+      manager_.AddComponentArrayItem("comp 2", "arr", {"trait2"}, nullptr));
+  EXPECT_EQ(2u, GetTraitIndexSize("trait2"));
+  ASSERT_TRUE(manager_.RemoveComponentArrayItem("comp 2", "arr", 0, nullptr));
+  EXPECT_EQ(1u, GetTraitIndexSize("trait2"));
+  ASSERT_TRUE(manager_.RemoveComponentArrayItem("comp 2", "arr", 0, nullptr));
+  EXPECT_EQ(0u, GetTraitIndexSize("trait2"));
+  EXPECT_EQ(1u, GetTraitIndexSize("trait1"));
+}
+
+TEST_F(ComponentManagerTest, FindComponentWithTraitAfterTreeChanges) {
+  const char kTraits[] = R"({
+    "trait1": {},
+    "trait2": {
+      "commands": {
+        "command1": { "minimalRole": "user" }
+      }
+    }
+  })";
+  auto traits = CreateDictionaryValue(kTraits);
+  ASSERT_TRUE(manager_.LoadTraits(*traits, nullptr));
+  ASSERT_TRUE(manager_.AddComponent("", "comp", {"trait1"}, nullptr));
+  ASSERT_TRUE(manager_.AddComponent("", "comp-a", {"trait1"}, nullptr));
+  ASSERT_TRUE(manager_.AddComponent("comp", "sub", {"trait2"}, nullptr));
+  ASSERT_TRUE(
+      manager_.AddComponentArrayItem("comp", "arr", {"trait2"}, nullptr));
+
+  EXPECT_EQ("comp", manager_.FindComponentWithTrait("trait1"));
+  // Only top-level components are considered.
+  EXPECT_EQ("", manager_.FindComponentWithTrait("trait2"));
+
+  // Commands for nested components are still checked for trait support.
+  const char kCommand[] = R"({
+    "name": "trait2.command1",
+    "component": "comp . arr[0]"
+  })";
+  auto command = CreateDictionaryValue(kCommand);
+  EXPECT_NE(nullptr,
+            manager_.ParseCommandInstance(*command, Command::Origin::kLocal,
+                                          UserRole::kUser, nullptr, nullptr)
+                .get());
+
+  ASSERT_TRUE(manager_.RemoveComponent("", "comp", nullptr));
+  EXPECT_EQ("comp-a", manager_.FindComponentWithTrait("trait1"));
+  ErrorPtr error;
+  EXPECT_EQ(nullptr,
+            manager_.ParseCommandInstance(*command, Command::Origin::kLocal,
+                                          UserRole::kUser, nullptr, &error)
+                .get());
+
+  ASSERT_TRUE(manager_.AddComponent("", "comp", {"trait2"}, nullptr));
+  EXPECT_EQ("comp", manager_.FindComponentWithTrait("trait2"));
+  ASSERT_TRUE(manager_.RemoveComponent("", "comp-a", nullptr));
+  EXPECT_EQ("", manager_.FindComponentWithTrait("trait1"));
+}
+
 TEST_F(ComponentManagerTest, AddLegacyCommandAndStateDefinitions) {
   const char kCommandDefs1[] = R"({
     "package1": {
@@ -1479,6 +2222,43 @@ TEST_F(ComponentManagerTest, GetLegacyState) {
   EXPECT_JSON_EQ(kExpected, manager_.GetLegacyState());
 }
 
+TEST_F(ComponentManagerTest, GetLegacyViewsRebuiltOnlyWhenDirty) {
+  const char kTraits[] = R"({
+    "trait1": {
+      "commands": {"command1": {}},
+      "state": {"prop1": {"type": "string"}}
+    }
+  })";
+  ASSERT_TRUE(manager_.LoadTraits(kTraits, nullptr));
+  ASSERT_TRUE(manager_.AddComponent("", "comp1", {"trait1"}, nullptr));
+  ASSERT_TRUE(manager_.SetStatePropertiesFromJson(
+      "comp1", R"({"trait1": {"prop1": "foo"}})", nullptr));
+
+  // Repeated reads return the same cached values.
+  const base::Value* prop = nullptr;
+  ASSERT_TRUE(manager_.GetLegacyState().Get("trait1.prop1", &prop));
+  const base::Value* cached = nullptr;
+  ASSERT_TRUE(manager_.GetLegacyState().Get("trait1.prop1", &cached));
+  EXPECT_EQ(prop, cached);
+  const base::Value* command = nullptr;
+  ASSERT_TRUE(manager_.GetLegacyCommandDefinitions().Get("trait1.command1",
+                                                         &command));
+  ASSERT_TRUE(manager_.GetLegacyCommandDefinitions().Get("trait1.command1",
+                                                         &cached));
+  EXPECT_EQ(command, cached);
+
+  // Changes are picked up on the next read.
+  ASSERT_TRUE(manager_.SetStateProperty("comp1", "trait1.prop1",
+                                        base::StringValue{"bar"}, nullptr));
+  EXPECT_JSON_EQ(R"({"trait1": {"prop1": "bar"}})", manager_.GetLegacyState());
+  ASSERT_TRUE(manager_.LoadTraits(R"({"trait2": {"commands": {"c": {}}}})",
+                                  nullptr));
+  EXPECT_JSON_EQ(R"({"trait1": {"command1": {}}, "trait2": {"c": {}}})",
+                 manager_.GetLegacyCommandDefinitions());
+  ASSERT_TRUE(manager_.RemoveComponent("", "comp1", nullptr));
+  EXPECT_JSON_EQ("{}", manager_.GetLegacyState());
+}
+
 TEST_F(ComponentManagerTest, TestMockComponentManager) {
   // Check that all the virtual methods are mocked out.
   MockComponentManager mock;
@@ -4,6 +4,8 @@
 
 #include "src/data_encoding.h"
 
+#include <zlib.h>
+
 #include <memory>
 
 #include <base/logging.h>
@@ -146,4 +148,60 @@ bool Base64Decode(const std::string& input, std::vector<uint8_t>* output) {
   return true;
 }
 
+bool IsGzipData(const std::string& data) {
+  return data.size() >= 2 && static_cast<uint8_t>(data[0]) == 0x1f &&
+         static_cast<uint8_t>(data[1]) == 0x8b;
+}
+
+bool GzipCompress(const std::string& input, int level, std::string* output) {
+  z_stream stream{};
+  // Adding 16 to the window bits selects the gzip format.
+  if (deflateInit2(&stream, level, Z_DEFLATED, MAX_WBITS + 16, 8,
+                   Z_DEFAULT_STRATEGY) != Z_OK) {
+    return false;
+  }
+  output->resize(deflateBound(&stream, input.size()));
+  stream.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(input.data()));
+  stream.avail_in = input.size();
+  stream.next_out = reinterpret_cast<Bytef*>(&(*output)[0]);
+  stream.avail_out = output->size();
+  int result = deflate(&stream, Z_FINISH);
+  deflateEnd(&stream);
+  if (result != Z_STREAM_END) {
+    output->clear();
+    return false;
+  }
+  output->resize(stream.total_out);
+  return true;
+}
+
+bool GzipDecompress(const std::string& input,
+                    size_t max_output_size,
+                    std::string* output) {
+  z_stream stream{};
+  if (inflateInit2(&stream, MAX_WBITS + 16) != Z_OK)
+    return false;
+  stream.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(input.data()));
+  stream.avail_in = input.size();
+  output->clear();
+  char buffer[4096];
+  int result = Z_OK;
+  while (result == Z_OK) {
+    stream.next_out = reinterpret_cast<Bytef*>(buffer);
+    stream.avail_out = sizeof(buffer);
+    result = inflate(&stream, Z_NO_FLUSH);
+    if (result != Z_OK && result != Z_STREAM_END)
+      break;
+    output->append(buffer, sizeof(buffer) - stream.avail_out);
+    if (output->size() > max_output_size)
+      break;
+  }
+  inflateEnd(&stream);
+  if (result != Z_STREAM_END || output->size() > max_output_size) {
+    output->clear();
+    return false;
+  }
+  return true;
+}
+
 }  // namespace weave
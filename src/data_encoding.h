@@ -71,6 +71,19 @@ inline bool Base64Decode(const std::string& input, std::string* output) {
   return true;
 }
 
+// Returns true if |data| starts with the gzip magic number.
+bool IsGzipData(const std::string& data);
+
+// Compresses |input| into the gzip format with zlib compression |level|
+// (1 to 9).
+bool GzipCompress(const std::string& input, int level, std::string* output);
+
+// Decompresses gzip |input|. Fails if the output would be larger than
+// |max_output_size|.
+bool GzipDecompress(const std::string& input,
+                    size_t max_output_size,
+                    std::string* output);
+
 }  // namespace weave
 
 #endif  // LIBWEAVE_SRC_DATA_ENCODING_H_
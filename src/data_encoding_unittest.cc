@@ -143,4 +143,28 @@ TEST(data_encoding, Base64Decode) {
   EXPECT_TRUE(decoded_blob.empty());
 }
 
+TEST(data_encoding, Gzip) {
+  std::string input(1000, 'a');
+  std::string compressed;
+  EXPECT_TRUE(GzipCompress(input, 6, &compressed));
+  EXPECT_TRUE(IsGzipData(compressed));
+  EXPECT_LT(compressed.size(), input.size());
+  EXPECT_FALSE(IsGzipData(input));
+
+  std::string decompressed;
+  EXPECT_TRUE(GzipDecompress(compressed, input.size(), &decompressed));
+  EXPECT_EQ(input, decompressed);
+
+  EXPECT_FALSE(GzipDecompress(compressed, input.size() - 1, &decompressed));
+  EXPECT_TRUE(decompressed.empty());
+
+  EXPECT_FALSE(GzipDecompress(compressed.substr(0, compressed.size() / 2),
+                              input.size(), &decompressed));
+  EXPECT_FALSE(GzipDecompress(input, input.size(), &decompressed));
+
+  EXPECT_TRUE(GzipCompress("", 9, &compressed));
+  EXPECT_TRUE(GzipDecompress(compressed, 0, &decompressed));
+  EXPECT_TRUE(decompressed.empty());
+}
+
 }  // namespace weave
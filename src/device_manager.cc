@@ -12,6 +12,7 @@
 #include "src/access_black_list_manager_impl.h"
 #include "src/base_api_handler.h"
 #include "src/commands/schema_constants.h"
+#include "src/commands/thread_safe_command_proxy.h"
 #include "src/component_manager_impl.h"
 #include "src/config.h"
 #include "src/device_registration_info.h"
@@ -22,6 +23,20 @@
 
 namespace weave {
 
+namespace {
+
+void RunWorkerCommandHandler(
+    provider::TaskRunner* task_runner,
+    provider::Executor* executor,
+    const Device::WorkerCommandHandlerCallback& callback,
+    const std::weak_ptr<Command>& command) {
+  std::shared_ptr<Command> proxy{
+      new ThreadSafeCommandProxy{command, task_runner}};
+  executor->PostTask(FROM_HERE, base::Bind(callback, proxy));
+}
+
+}  // anonymous namespace
+
 DeviceManager::DeviceManager(provider::ConfigStore* config_store,
                              provider::TaskRunner* task_runner,
                              provider::HttpClient* http_client,
@@ -30,7 +45,8 @@ DeviceManager::DeviceManager(provider::ConfigStore* config_store,
                              provider::HttpServer* http_server,
                              provider::Wifi* wifi,
                              provider::Bluetooth* bluetooth)
-    : config_{new Config{config_store}},
+    : task_runner_{task_runner},
+      config_{new Config{config_store}},
       component_manager_{new ComponentManagerImpl{task_runner}} {
   if (http_server) {
     auth_manager_.reset(new privet::AuthManager(
@@ -40,6 +56,10 @@ DeviceManager::DeviceManager(provider::ConfigStore* config_store,
   device_info_.reset(new DeviceRegistrationInfo(
       config_.get(), component_manager_.get(), task_runner, http_client,
       network, auth_manager_.get()));
+  const Settings& settings = device_info_->GetSettings();
+  component_manager_->SetCommandRetention(settings.local_command_retention,
+                                          settings.cloud_command_retention,
+                                          settings.max_finished_commands);
   base_api_handler_.reset(new BaseApiHandler{device_info_.get(), this});
 
   black_list_manager_.reset(new AccessBlackListManagerImpl{config_store});
@@ -150,12 +170,58 @@ bool DeviceManager::SetStateProperty(const std::string& component,
   return component_manager_->SetStateProperty(component, name, value, error);
 }
 
+bool DeviceManager::GetStatePropertyHandle(const std::string& component,
+                                           const std::string& name,
+                                           StatePropertyHandle* handle,
+                                           ErrorPtr* error) {
+  return component_manager_->GetStatePropertyHandle(component, name, handle,
+                                                    error);
+}
+
+bool DeviceManager::UpdateStateProperty(StatePropertyHandle handle,
+                                        const base::Value& value,
+                                        ErrorPtr* error) {
+  return component_manager_->UpdateStateProperty(handle, value, error);
+}
+
+bool DeviceManager::EnqueueStateUpdate(StatePropertyHandle handle,
+                                       const base::FundamentalValue& value) {
+  return component_manager_->EnqueueStateUpdate(handle, value);
+}
+
+void DeviceManager::BeginStateTransaction() {
+  component_manager_->BeginStateTransaction();
+}
+
+void DeviceManager::CommitStateTransaction() {
+  component_manager_->CommitStateTransaction();
+}
+
 void DeviceManager::AddCommandHandler(const std::string& component,
                                       const std::string& command_name,
                                       const CommandHandlerCallback& callback) {
   component_manager_->AddCommandHandler(component, command_name, callback);
 }
 
+void DeviceManager::AddCommandBatchHandler(
+    const std::string& component,
+    const std::string& command_name,
+    const CommandBatchHandlerCallback& callback) {
+  component_manager_->AddCommandBatchHandler(component, command_name,
+                                             callback);
+}
+
+void DeviceManager::AddWorkerCommandHandler(
+    const std::string& component,
+    const std::string& command_name,
+    provider::Executor* executor,
+    const WorkerCommandHandlerCallback& callback) {
+  CHECK(executor);
+  component_manager_->AddCommandHandler(
+      component, command_name,
+      base::Bind(&RunWorkerCommandHandler, task_runner_, executor, callback));
+}
+
 void DeviceManager::AddCommandDefinitionsFromJson(const std::string& json) {
   auto dict = LoadJsonDict(json, nullptr);
   CHECK(dict);
@@ -181,6 +247,14 @@ Command* DeviceManager::FindCommand(const std::string& id) {
   return component_manager_->FindCommand(id);
 }
 
+const base::DictionaryValue& DeviceManager::GetCommandHistory() const {
+  return component_manager_->GetCommandHistory();
+}
+
+const base::DictionaryValue& DeviceManager::GetCloudRequestMetrics() const {
+  return device_info_->GetCloudRequestMetrics();
+}
+
 void DeviceManager::AddCommandHandler(const std::string& command_name,
                                       const CommandHandlerCallback& callback) {
   if (command_name.empty())
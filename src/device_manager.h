@@ -61,13 +61,35 @@ class DeviceManager final : public Device {
                         const std::string& name,
                         const base::Value& value,
                         ErrorPtr* error) override;
+  bool GetStatePropertyHandle(const std::string& component,
+                              const std::string& name,
+                              StatePropertyHandle* handle,
+                              ErrorPtr* error) override;
+  bool UpdateStateProperty(StatePropertyHandle handle,
+                           const base::Value& value,
+                           ErrorPtr* error) override;
+  bool EnqueueStateUpdate(StatePropertyHandle handle,
+                          const base::FundamentalValue& value) override;
+  void BeginStateTransaction() override;
+  void CommitStateTransaction() override;
   void AddCommandHandler(const std::string& component,
                          const std::string& command_name,
                          const CommandHandlerCallback& callback) override;
+  void AddCommandBatchHandler(
+      const std::string& component,
+      const std::string& command_name,
+      const CommandBatchHandlerCallback& callback) override;
+  void AddWorkerCommandHandler(
+      const std::string& component,
+      const std::string& command_name,
+      provider::Executor* executor,
+      const WorkerCommandHandlerCallback& callback) override;
   bool AddCommand(const base::DictionaryValue& command,
                   std::string* id,
                   ErrorPtr* error) override;
   Command* FindCommand(const std::string& id) override;
+  const base::DictionaryValue& GetCommandHistory() const override;
+  const base::DictionaryValue& GetCloudRequestMetrics() const override;
   void AddStateChangedCallback(const base::Closure& callback) override;
   void Register(const std::string& ticket_id,
                 const DoneCallback& callback) override;
@@ -104,6 +126,7 @@ class DeviceManager final : public Device {
                    provider::Wifi* wifi,
                    provider::Bluetooth* bluetooth);
 
+  provider::TaskRunner* task_runner_{nullptr};
   std::unique_ptr<Config> config_;
   std::unique_ptr<privet::AuthManager> auth_manager_;
   std::unique_ptr<ComponentManager> component_manager_;
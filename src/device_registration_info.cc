@@ -21,11 +21,12 @@
 #include <weave/provider/task_runner.h>
 
 #include "src/bind_lambda.h"
-#include "src/commands/cloud_command_proxy.h"
+#include "src/commands/cloud_command_updater.h"
 #include "src/commands/schema_constants.h"
 #include "src/data_encoding.h"
 #include "src/http_constants.h"
 #include "src/json_error_codes.h"
+#include "src/json_stream_writer.h"
 #include "src/notification/xmpp_channel.h"
 #include "src/privet/auth_manager.h"
 #include "src/string_utils.h"
@@ -39,6 +40,14 @@ namespace {
 
 const int kPollingPeriodSeconds = 7;
 const int kBackupPollingPeriodMinutes = 30;
+// Time to gather command updates into a single batch request while other
+// updates are in flight.
+const int kCommandUpdateBatchWindowMs = 100;
+// Limit on the size of decompressed responses of the cloud server.
+const size_t kMaxDecompressedResponseSize = 16 * 1024 * 1024;
+const char kCommandUpdateBatchPath[] = "commands/batchUpdate";
+// Error of command update batches the server doesn't support.
+const char kErrorBatchesNotSupported[] = "batches_not_supported";
 
 namespace fetch_reason {
 
@@ -108,14 +117,6 @@ void IgnoreCloudErrorWithCallback(const base::Closure& cb, ErrorPtr) {
 
 void IgnoreCloudError(ErrorPtr) {}
 
-void IgnoreCloudResult(const base::DictionaryValue&, ErrorPtr error) {}
-
-void IgnoreCloudResultWithCallback(const DoneCallback& cb,
-                                   const base::DictionaryValue&,
-                                   ErrorPtr error) {
-  cb.Run(std::move(error));
-}
-
 class RequestSender final {
  public:
   RequestSender(HttpClient::Method method,
@@ -151,6 +152,10 @@ class RequestSender final {
     access_token_ = access_token;
   }
 
+  void AddHeader(const std::string& name, const std::string& value) {
+    extra_headers_.emplace_back(name, value);
+  }
+
   void SetData(const std::string& data, const std::string& mime_type) {
     data_ = data;
     mime_type_ = mime_type;
@@ -174,6 +179,7 @@ class RequestSender final {
       headers.emplace_back(http::kAuthorization, "Bearer " + access_token_);
     if (!mime_type_.empty())
       headers.emplace_back(http::kContentType, mime_type_);
+    headers.insert(headers.end(), extra_headers_.begin(), extra_headers_.end());
     return headers;
   }
 
@@ -182,14 +188,18 @@ class RequestSender final {
   std::string data_;
   std::string mime_type_;
   std::string access_token_;
+  HttpClient::Headers extra_headers_;
   HttpClient* transport_{nullptr};
 
   DISALLOW_COPY_AND_ASSIGN(RequestSender);
 };
 
+// Responses are decompressed if the server gzipped them, and the size
+// difference is added to |gzip_bytes_saved|, if not null.
 std::unique_ptr<base::DictionaryValue> ParseJsonResponse(
     const HttpClient::Response& response,
-    ErrorPtr* error) {
+    ErrorPtr* error,
+    int64_t* gzip_bytes_saved = nullptr) {
   // Make sure we have a correct content type. Do not try to parse
   // binary files, or HTML output. Limit to application/json and text/plain.
   std::string content_type =
@@ -201,7 +211,18 @@ std::unique_ptr<base::DictionaryValue> ParseJsonResponse(
         "Unexpected content type: \'" + response.GetContentType() + "\'");
   }
 
-  const std::string& json = response.GetData();
+  std::string json = response.GetData();
+  if (IsGzipData(json)) {
+    std::string decompressed;
+    if (!GzipDecompress(json, kMaxDecompressedResponseSize, &decompressed)) {
+      return Error::AddTo(error, FROM_HERE, "invalid_gzip_data",
+                          "Failed to decompress the response");
+    }
+    if (gzip_bytes_saved)
+      *gzip_bytes_saved += static_cast<int64_t>(decompressed.size()) -
+                           static_cast<int64_t>(json.size());
+    json.swap(decompressed);
+  }
   std::string error_message;
   auto value = base::JSONReader::ReadAndReturnError(json, base::JSON_PARSE_RFC,
                                                     nullptr, &error_message);
@@ -224,6 +245,63 @@ std::unique_ptr<base::DictionaryValue> ParseJsonResponse(
   return std::unique_ptr<base::DictionaryValue>(dict_value);
 }
 
+// Returns true if |value| is a dictionary with a null member at any depth,
+// which a JSON merge patch would take for a removal. Lists are replaced as a
+// whole, so nulls in them are fine.
+bool HasNullMember(const base::Value& value) {
+  const base::DictionaryValue* dict = nullptr;
+  if (!value.GetAsDictionary(&dict))
+    return false;
+  for (base::DictionaryValue::Iterator it(*dict); !it.IsAtEnd(); it.Advance()) {
+    if (it.value().IsType(base::Value::TYPE_NULL) || HasNullMember(it.value()))
+      return true;
+  }
+  return false;
+}
+
+// Builds a JSON merge patch (RFC 7396) turning |from| into |to|: changed
+// values are replaced as a whole, except for dictionaries which are compared
+// recursively, and removed keys are set to null. Returns false if the change
+// can't be expressed this way, that is, if |to| has null members.
+bool BuildMergePatch(const base::DictionaryValue& from,
+                     const base::DictionaryValue& to,
+                     base::DictionaryValue* patch) {
+  for (base::DictionaryValue::Iterator it(from); !it.IsAtEnd(); it.Advance()) {
+    if (!to.HasKey(it.key()))
+      patch->SetWithoutPathExpansion(it.key(), base::Value::CreateNullValue());
+  }
+  for (base::DictionaryValue::Iterator it(to); !it.IsAtEnd(); it.Advance()) {
+    const base::Value& to_value = it.value();
+    if (to_value.IsType(base::Value::TYPE_NULL))
+      return false;
+    const base::Value* from_value = nullptr;
+    if (from.GetWithoutPathExpansion(it.key(), &from_value) &&
+        from_value->Equals(&to_value)) {
+      continue;
+    }
+    const base::DictionaryValue* from_dict = nullptr;
+    const base::DictionaryValue* to_dict = nullptr;
+    if (from_value && from_value->GetAsDictionary(&from_dict) &&
+        to_value.GetAsDictionary(&to_dict)) {
+      std::unique_ptr<base::DictionaryValue> child{new base::DictionaryValue};
+      if (!BuildMergePatch(*from_dict, *to_dict, child.get()))
+        return false;
+      patch->SetWithoutPathExpansion(it.key(), child.release());
+      continue;
+    }
+    if (HasNullMember(to_value))
+      return false;
+    patch->SetWithoutPathExpansion(it.key(), to_value.CreateDeepCopy());
+  }
+  return true;
+}
+
+// Returns the code of the innermost error of cloud responses with an
+// unsuccessful HTTP |status_code|.
+std::string GetHttpErrorCode(int status_code) {
+  return base::StringPrintf("http_%d", status_code);
+}
+
 bool IsSuccessful(const HttpClient::Response& response) {
   int code = response.GetStatusCode();
   return code >= http::kContinue && code < http::kBadRequest;
@@ -254,6 +332,15 @@ DeviceRegistrationInfo::DeviceRegistrationInfo(
   cloud_backoff_policy_->always_use_initial_delay = false;
   cloud_backoff_entry_.reset(new BackoffEntry{cloud_backoff_policy_.get()});
   oauth2_backoff_entry_.reset(new BackoffEntry{cloud_backoff_policy_.get()});
+  std::unique_ptr<BackoffEntry> command_backoff_entry{
+      new BackoffEntry{cloud_backoff_policy_.get()}};
+  // Command updates are batched by UpdateCommand() and limited by
+  // |cloud_request_scheduler_|, so the updater passes them on right away.
+  command_updater_.reset(new CloudCommandUpdater{
+      this, component_manager_, std::move(command_backoff_entry), task_runner_,
+      0});
+  cloud_request_scheduler_.reset(
+      new CloudRequestScheduler{GetSettings().max_cloud_requests_in_flight});
 
   bool revoked =
       !GetSettings().cloud_id.empty() && !HaveRegistrationCredentials();
@@ -506,7 +593,8 @@ void DeviceRegistrationInfo::GetDeviceInfo(
   ErrorPtr error;
   if (!VerifyRegistrationCredentials(&error))
     return callback.Run({}, std::move(error));
-  DoCloudRequest(HttpClient::Method::kGet, GetDeviceURL(), nullptr, callback);
+  DoCloudRequest(CloudRequestScheduler::Priority::kDeviceResource,
+                 HttpClient::Method::kGet, GetDeviceURL(), nullptr, callback);
 }
 
 void DeviceRegistrationInfo::RegisterDeviceError(const DoneCallback& callback,
@@ -647,10 +735,23 @@ void DeviceRegistrationInfo::RegisterDeviceOnAuthCodeSent(
 }
 
 void DeviceRegistrationInfo::DoCloudRequest(
+    CloudRequestScheduler::Priority priority,
     HttpClient::Method method,
     const std::string& url,
     const base::DictionaryValue* body,
     const CloudRequestDoneCallback& callback) {
+  std::string json;
+  if (body)
+    base::JSONWriter::Write(*body, &json);
+  DoCloudRequestWithJson(priority, method, url, std::move(json), callback);
+}
+
+void DeviceRegistrationInfo::DoCloudRequestWithJson(
+    CloudRequestScheduler::Priority priority,
+    HttpClient::Method method,
+    const std::string& url,
+    std::string body,
+    const CloudRequestDoneCallback& callback) {
   // We make CloudRequestData shared here because we want to make sure
   // there is only one instance of callback and error_calback since
   // those may have move-only types and making a copy of the callback with
@@ -658,12 +759,79 @@ void DeviceRegistrationInfo::DoCloudRequest(
   auto data = std::make_shared<CloudRequestData>();
   data->method = method;
   data->url = url;
-  if (body)
-    base::JSONWriter::Write(*body, &data->body);
-  data->callback = callback;
+  data->body = std::move(body);
+  data->callbacks.push_back(callback);
+  data->command_update_batch = url == GetServiceURL(kCommandUpdateBatchPath);
+
+  int level = GetSettings().cloud_compression_level;
+  if (level > 0 &&
+      data->body.size() > GetSettings().cloud_compression_threshold) {
+    std::string compressed;
+    if (GzipCompress(data->body, level, &compressed) &&
+        compressed.size() < data->body.size()) {
+      compression_stats_.compressed_requests++;
+      compression_stats_.request_bytes_saved +=
+          data->body.size() - compressed.size();
+      data->body.swap(compressed);
+      data->gzipped = true;
+    }
+  }
+
+  // Requests other than POST are idempotent, so a request equivalent to the
+  // last one to the same URL still waiting for its turn can share its
+  // response. Merging it into an earlier one would undo the requests made in
+  // between.
+  std::shared_ptr<CloudRequestData>& last_request =
+      waiting_cloud_requests_[url];
+  if (last_request && method != HttpClient::Method::kPost &&
+      last_request->method == method && last_request->body == data->body &&
+      last_request->gzipped == data->gzipped) {
+    VLOG(1) << "Merged a duplicate cloud request to " << url;
+    last_request->callbacks.push_back(callback);
+    cloud_request_scheduler_->RecordDuplicate(priority);
+    return;
+  }
+  last_request = data;
+  cloud_request_scheduler_->Schedule(
+      priority, base::Bind(&DeviceRegistrationInfo::StartCloudRequest,
+                           AsWeakPtr(), data));
+}
+
+void DeviceRegistrationInfo::StartCloudRequest(
+    const std::shared_ptr<CloudRequestData>& data) {
+  auto it = waiting_cloud_requests_.find(data->url);
+  if (it != waiting_cloud_requests_.end() && it->second == data)
+    waiting_cloud_requests_.erase(it);
   SendCloudRequest(data);
 }
 
+void DeviceRegistrationInfo::FinishCloudRequest(
+    const std::shared_ptr<const CloudRequestData>& data,
+    const base::DictionaryValue& response,
+    ErrorPtr error) {
+  for (size_t i = 1; i < data->callbacks.size(); i++)
+    data->callbacks[i].Run(response, error ? error->Clone() : nullptr);
+  data->callbacks.front().Run(response, std::move(error));
+  cloud_request_scheduler_->OnRequestDone();
+}
+
+const base::DictionaryValue& DeviceRegistrationInfo::GetCloudRequestMetrics()
+    const {
+  std::unique_ptr<base::DictionaryValue> compression{new base::DictionaryValue};
+  compression->SetInteger(
+      "compressedRequests",
+      static_cast<int>(compression_stats_.compressed_requests));
+  compression->SetDouble(
+      "requestBytesSaved",
+      static_cast<double>(compression_stats_.request_bytes_saved));
+  compression->SetDouble(
+      "responseBytesSaved",
+      static_cast<double>(compression_stats_.response_bytes_saved));
+  cloud_request_metrics_.reset(cloud_request_scheduler_->GetJson().DeepCopy());
+  cloud_request_metrics_->Set("compression", compression.release());
+  return *cloud_request_metrics_;
+}
+
 void DeviceRegistrationInfo::SendCloudRequest(
     const std::shared_ptr<const CloudRequestData>& data) {
   // TODO(antonm): Add reauthorization on access token expiration (do not
@@ -672,7 +840,7 @@ void DeviceRegistrationInfo::SendCloudRequest(
 
   ErrorPtr error;
   if (!VerifyRegistrationCredentials(&error))
-    return data->callback.Run({}, std::move(error));
+    return FinishCloudRequest(data, {}, std::move(error));
 
   if (cloud_backoff_entry_->ShouldRejectRequest()) {
     VLOG(1) << "Cloud request delayed for "
@@ -687,6 +855,10 @@ void DeviceRegistrationInfo::SendCloudRequest(
   RequestSender sender{data->method, data->url, http_client_};
   sender.SetData(data->body, http::kJsonUtf8);
   sender.SetAccessToken(access_token_);
+  if (data->gzipped)
+    sender.AddHeader(http::kContentEncoding, http::kGzip);
+  if (GetSettings().cloud_compression_level > 0)
+    sender.AddHeader(http::kAcceptEncoding, http::kGzip);
   sender.Send(base::Bind(&DeviceRegistrationInfo::OnCloudRequestDone,
                          AsWeakPtr(), data));
 }
@@ -705,7 +877,20 @@ void DeviceRegistrationInfo::OnCloudRequestDone(
     return;
   }
 
-  if (status_code >= http::kInternalServerError) {
+  if (data->command_update_batch &&
+      (status_code == http::kNotFound ||
+       status_code == http::kMethodNotAllowed ||
+       status_code == http::kNotSupported)) {
+    // The server doesn't know the batch request, so it is not retried.
+    cloud_backoff_entry_->InformOfRequest(false);
+    Error::AddToPrintf(&error, FROM_HERE, kErrorBatchesNotSupported,
+                       "Command update batch failed with HTTP status %d",
+                       status_code);
+    return FinishCloudRequest(data, {}, std::move(error));
+  }
+
+  if (status_code >= http::kInternalServerError &&
+      status_code != http::kNotSupported) {
     // Request was valid, but server failed, retry.
     // TODO(antonm): Reconsider status codes, maybe only some require
     // retry.
@@ -714,16 +899,23 @@ void DeviceRegistrationInfo::OnCloudRequestDone(
     return;
   }
 
+  if (!IsSuccessful(*response)) {
+    // Errors of the response are added on top of this one.
+    Error::AddToPrintf(&error, FROM_HERE, GetHttpErrorCode(status_code),
+                       "HTTP status %d", status_code);
+  }
+
   if (response->GetContentType().empty()) {
     // Assume no body if no content type.
-    cloud_backoff_entry_->InformOfRequest(true);
-    return data->callback.Run({}, nullptr);
+    cloud_backoff_entry_->InformOfRequest(!error);
+    return FinishCloudRequest(data, {}, std::move(error));
   }
 
-  auto json_resp = ParseJsonResponse(*response, &error);
+  auto json_resp = ParseJsonResponse(*response, &error,
+                                     &compression_stats_.response_bytes_saved);
   if (!json_resp) {
     cloud_backoff_entry_->InformOfRequest(false);
-    return data->callback.Run({}, std::move(error));
+    return FinishCloudRequest(data, {}, std::move(error));
   }
 
   if (!IsSuccessful(*response)) {
@@ -735,12 +927,12 @@ void DeviceRegistrationInfo::OnCloudRequestDone(
     }
 
     cloud_backoff_entry_->InformOfRequest(false);
-    return data->callback.Run({}, std::move(error));
+    return FinishCloudRequest(data, {}, std::move(error));
   }
 
   cloud_backoff_entry_->InformOfRequest(true);
   SetGcdState(GcdState::kConnected);
-  data->callback.Run(*json_resp, nullptr);
+  FinishCloudRequest(data, *json_resp, nullptr);
 }
 
 void DeviceRegistrationInfo::RetryCloudRequest(
@@ -756,7 +948,7 @@ void DeviceRegistrationInfo::OnAccessTokenRefreshed(
     ErrorPtr error) {
   if (error) {
     CheckAccessTokenError(error->Clone());
-    return data->callback.Run({}, std::move(error));
+    return FinishCloudRequest(data, {}, std::move(error));
   }
   SendCloudRequest(data);
 }
@@ -797,6 +989,7 @@ void DeviceRegistrationInfo::OnConnectedToCloud(ErrorPtr error) {
     return;
   LOG(INFO) << "Device connected to cloud server";
   connected_to_cloud_ = true;
+  command_update_batches_supported_ = true;
   FetchCommands(base::Bind(&DeviceRegistrationInfo::ProcessInitialCommandList,
                            AsWeakPtr()),
                 fetch_reason::kDeviceStart);
@@ -860,9 +1053,130 @@ void DeviceRegistrationInfo::UpdateCommand(
     const std::string& command_id,
     const base::DictionaryValue& command_patch,
     const DoneCallback& callback) {
-  DoCloudRequest(HttpClient::Method::kPatch,
-                 GetServiceURL("commands/" + command_id), &command_patch,
-                 base::Bind(&IgnoreCloudResultWithCallback, callback));
+  auto it = std::find_if(queued_command_updates_.begin(),
+                         queued_command_updates_.end(),
+                         [&command_id](const QueuedCommandUpdatePtr& update) {
+                           return update->command_id == command_id;
+                         });
+  if (it != queued_command_updates_.end()) {
+    // Keep a single entry per command, so the patches of a command are applied
+    // in order even if the batch is split into individual requests.
+    (*it)->patch->MergeDictionary(&command_patch);
+    (*it)->callbacks.push_back(callback);
+    return;
+  }
+  QueuedCommandUpdatePtr update{new QueuedCommandUpdate};
+  update->command_id = command_id;
+  update->patch.reset(command_patch.DeepCopy());
+  update->callbacks.push_back(callback);
+  queued_command_updates_.push_back(std::move(update));
+
+  if (command_updates_send_scheduled_)
+    return;
+  command_updates_send_scheduled_ = true;
+  // Updates made during the current task are sent together. While other
+  // updates are in flight, wait longer to gather more of them.
+  base::TimeDelta delay;
+  if (!command_updates_in_flight_.empty())
+    delay = base::TimeDelta::FromMilliseconds(kCommandUpdateBatchWindowMs);
+  task_runner_->PostDelayedTask(
+      FROM_HERE,
+      base::Bind(&DeviceRegistrationInfo::SendCommandUpdates, AsWeakPtr()),
+      delay);
+}
+
+void DeviceRegistrationInfo::SendCommandUpdates() {
+  command_updates_send_scheduled_ = false;
+  // Updates of commands which have a request in flight wait for it to finish.
+  std::vector<QueuedCommandUpdatePtr> batch;
+  for (auto it = queued_command_updates_.begin();
+       it != queued_command_updates_.end();) {
+    if (command_updates_in_flight_.count((*it)->command_id)) {
+      ++it;
+      continue;
+    }
+    command_updates_in_flight_.insert((*it)->command_id);
+    batch.push_back(std::move(*it));
+    it = queued_command_updates_.erase(it);
+  }
+
+  if (batch.size() < 2 || !command_update_batches_supported_) {
+    for (auto& update : batch)
+      SendCommandUpdate(std::move(update));
+    return;
+  }
+
+  VLOG(1) << "Sending a batch of " << batch.size() << " command updates";
+  std::unique_ptr<base::ListValue> commands{new base::ListValue};
+  for (const auto& update : batch) {
+    std::unique_ptr<base::DictionaryValue> command{new base::DictionaryValue};
+    command->SetString("id", update->command_id);
+    command->Set("patch", update->patch->DeepCopy());
+    commands->Append(command.release());
+  }
+  base::DictionaryValue body;
+  body.Set("commands", commands.release());
+  auto shared_batch =
+      std::make_shared<std::vector<QueuedCommandUpdatePtr>>(std::move(batch));
+  DoCloudRequest(
+      CloudRequestScheduler::Priority::kCommands, HttpClient::Method::kPost,
+      GetServiceURL(kCommandUpdateBatchPath), &body,
+      base::Bind(&DeviceRegistrationInfo::OnCommandUpdateBatchDone, AsWeakPtr(),
+                 shared_batch));
+}
+
+void DeviceRegistrationInfo::SendCommandUpdate(QueuedCommandUpdatePtr update) {
+  std::shared_ptr<QueuedCommandUpdate> shared_update{std::move(update)};
+  DoCloudRequest(
+      CloudRequestScheduler::Priority::kCommands, HttpClient::Method::kPatch,
+      GetServiceURL("commands/" + shared_update->command_id),
+      shared_update->patch.get(),
+      base::Bind(&DeviceRegistrationInfo::OnCommandUpdateDone, AsWeakPtr(),
+                 shared_update));
+}
+
+void DeviceRegistrationInfo::OnCommandUpdateBatchDone(
+    const std::shared_ptr<std::vector<QueuedCommandUpdatePtr>>& batch,
+    const base::DictionaryValue& reply,
+    ErrorPtr error) {
+  if (error) {
+    // If the server doesn't support batches, fall back to individual requests
+    // until the next connection to the cloud. Otherwise only this batch is
+    // resent separately, e.g. if one of its commands is gone.
+    if (error->HasError(kErrorBatchesNotSupported))
+      command_update_batches_supported_ = false;
+    LOG(WARNING) << "Command update batch rejected, sending "
+                 << batch->size() << " updates separately: "
+                 << error->GetMessage();
+    for (auto& update : *batch)
+      SendCommandUpdate(std::move(update));
+    return;
+  }
+  for (const auto& update : *batch)
+    FinishCommandUpdate(*update, nullptr);
+}
+
+void DeviceRegistrationInfo::OnCommandUpdateDone(
+    const std::shared_ptr<QueuedCommandUpdate>& update,
+    const base::DictionaryValue& reply,
+    ErrorPtr error) {
+  FinishCommandUpdate(*update, std::move(error));
+}
+
+void DeviceRegistrationInfo::FinishCommandUpdate(
+    const QueuedCommandUpdate& update,
+    ErrorPtr error) {
+  command_updates_in_flight_.erase(update.command_id);
+  // Send the updates which waited for this one.
+  if (!queued_command_updates_.empty() && !command_updates_send_scheduled_) {
+    command_updates_send_scheduled_ = true;
+    task_runner_->PostDelayedTask(
+        FROM_HERE,
+        base::Bind(&DeviceRegistrationInfo::SendCommandUpdates, AsWeakPtr()),
+        {});
+  }
+  for (const auto& callback : update.callbacks)
+    callback.Run(error ? error->Clone() : nullptr);
 }
 
 void DeviceRegistrationInfo::NotifyCommandAborted(const std::string& command_id,
@@ -918,7 +1232,39 @@ void DeviceRegistrationInfo::StartQueuedUpdateDeviceResource() {
   std::string url = GetDeviceURL(
       {}, {{"lastUpdateTimeMs", last_device_resource_updated_timestamp_}});
 
-  DoCloudRequest(HttpClient::Method::kPut, url, device_resource.get(),
+  // Send only what changed since the last resource accepted by the server,
+  // unless it was uploaded for another registration.
+  std::string uploaded_cloud_id;
+  std::unique_ptr<base::DictionaryValue> patch;
+  if (uploaded_device_resource_ &&
+      uploaded_device_resource_->GetString("id", &uploaded_cloud_id) &&
+      uploaded_cloud_id == GetSettings().cloud_id) {
+    patch.reset(new base::DictionaryValue);
+    if (!BuildMergePatch(*uploaded_device_resource_, *device_resource,
+                         patch.get())) {
+      patch.reset();
+    }
+  }
+  device_resource_in_flight_ = std::move(device_resource);
+
+  if (patch && patch->empty()) {
+    VLOG(1) << "Device resource is unchanged";
+    // Keep the callbacks asynchronous, as if the request was sent.
+    task_runner_->PostDelayedTask(
+        FROM_HERE,
+        base::Bind(&DeviceRegistrationInfo::FinishUpdateDeviceResource,
+                   AsWeakPtr()),
+        {});
+    return;
+  }
+
+  if (patch) {
+    VLOG(1) << "Patching the device resource with " << patch->size()
+            << " changed top-level fields";
+  }
+  DoCloudRequest(CloudRequestScheduler::Priority::kDeviceResource,
+                 patch ? HttpClient::Method::kPatch : HttpClient::Method::kPut,
+                 url, patch ? patch.get() : device_resource_in_flight_.get(),
                  base::Bind(&DeviceRegistrationInfo::OnUpdateDeviceResourceDone,
                             AsWeakPtr()));
 }
@@ -952,7 +1298,8 @@ void DeviceRegistrationInfo::SendAuthInfo() {
   root->Set("localAuthInfo", auth.release());
 
   std::string url = GetDeviceURL("upsertLocalAuthInfo", {});
-  DoCloudRequest(HttpClient::Method::kPost, url, root.get(),
+  DoCloudRequest(CloudRequestScheduler::Priority::kDeviceResource,
+                 HttpClient::Method::kPost, url, root.get(),
                  base::Bind(&DeviceRegistrationInfo::OnSendAuthInfoDone,
                             AsWeakPtr(), token));
 }
@@ -1001,6 +1348,11 @@ void DeviceRegistrationInfo::OnUpdateDeviceResourceDone(
   if (error)
     return OnUpdateDeviceResourceError(std::move(error));
   UpdateDeviceInfoTimestamp(device_info);
+  FinishUpdateDeviceResource();
+}
+
+void DeviceRegistrationInfo::FinishUpdateDeviceResource() {
+  uploaded_device_resource_ = std::move(device_resource_in_flight_);
   // Make a copy of the callback list so that if the callback triggers another
   // call to UpdateDeviceResource(), we do not modify the list we are iterating
   // over.
@@ -1011,6 +1363,11 @@ void DeviceRegistrationInfo::OnUpdateDeviceResourceDone(
 }
 
 void DeviceRegistrationInfo::OnUpdateDeviceResourceError(ErrorPtr error) {
+  // The resource on the server is unknown now, or has been changed by someone
+  // else. The next update is a full one.
+  uploaded_device_resource_.reset();
+  device_resource_in_flight_.reset();
+
   if (error->HasError("invalid_last_update_time_ms")) {
     // If the server rejected our previous request, retrieve the latest
     // timestamp from the server and retry.
@@ -1057,7 +1414,7 @@ void DeviceRegistrationInfo::FetchCommands(
   fetch_commands_request_sent_ = true;
   fetch_commands_request_queued_ = false;
   DoCloudRequest(
-      HttpClient::Method::kGet,
+      CloudRequestScheduler::Priority::kCommands, HttpClient::Method::kGet,
       GetServiceURL("commands/queue",
                     {{"deviceId", GetSettings().cloud_id}, {"reason", reason}}),
       nullptr, base::Bind(&DeviceRegistrationInfo::OnFetchCommandsDone,
@@ -1082,6 +1439,7 @@ void DeviceRegistrationInfo::ProcessInitialCommandList(
     ErrorPtr error) {
   if (error)
     return;
+  std::vector<const base::DictionaryValue*> queued_commands;
   for (const base::Value* command : commands) {
     const base::DictionaryValue* command_dict{nullptr};
     if (!command->GetAsDictionary(&command_dict)) {
@@ -1093,7 +1451,7 @@ void DeviceRegistrationInfo::ProcessInitialCommandList(
       LOG(WARNING) << "Command with no state at " << *command;
       continue;
     }
-    if (command_state == "error" && command_state == "inProgress" &&
+    if (command_state == "error" || command_state == "inProgress" ||
         command_state == "paused") {
       // It's a limbo command, abort it.
       std::string command_id;
@@ -1102,35 +1460,68 @@ void DeviceRegistrationInfo::ProcessInitialCommandList(
         continue;
       }
 
-      std::unique_ptr<base::DictionaryValue> cmd_copy{command_dict->DeepCopy()};
-      cmd_copy->SetString("state", "aborted");
-      // TODO(wiley) We could consider handling this error case more gracefully.
-      DoCloudRequest(HttpClient::Method::kPut,
-                     GetServiceURL("commands/" + command_id), cmd_copy.get(),
-                     base::Bind(&IgnoreCloudResult));
+      // The aborts are sent together in a batch request.
+      NotifyCommandAborted(command_id, nullptr);
     } else {
       // Normal command, publish it to local clients.
-      PublishCommand(*command_dict);
+      queued_commands.push_back(command_dict);
     }
   }
+  PublishCommandBatch(queued_commands);
 }
 
 void DeviceRegistrationInfo::PublishCommands(const base::ListValue& commands,
                                              ErrorPtr error) {
   if (error)
     return;
+  std::vector<const base::DictionaryValue*> command_dicts;
   for (const base::Value* command : commands) {
     const base::DictionaryValue* command_dict{nullptr};
     if (!command->GetAsDictionary(&command_dict)) {
       LOG(WARNING) << "Not a command dictionary: " << *command;
       continue;
     }
-    PublishCommand(*command_dict);
+    command_dicts.push_back(command_dict);
+  }
+  PublishCommandBatch(command_dicts);
+}
+
+void DeviceRegistrationInfo::PublishCommandBatch(
+    const std::vector<const base::DictionaryValue*>& commands) {
+  std::vector<std::unique_ptr<CommandInstance>> command_instances;
+  for (const base::DictionaryValue* command : commands) {
+    auto command_instance = ParseCloudCommand(*command);
+    if (command_instance)
+      command_instances.push_back(std::move(command_instance));
   }
+  // Commands fetched together, e.g. after a reconnect, are dispatched in the
+  // order of priority so that a burst of commands does not delay urgent ones.
+  std::stable_sort(command_instances.begin(), command_instances.end(),
+                   [](const std::unique_ptr<CommandInstance>& a,
+                      const std::unique_ptr<CommandInstance>& b) {
+                     return a->GetPriority() > b->GetPriority();
+                   });
+  for (auto& command_instance : command_instances)
+    AddCloudCommand(std::move(command_instance));
 }
 
 void DeviceRegistrationInfo::PublishCommand(
     const base::DictionaryValue& command) {
+  auto command_instance = ParseCloudCommand(command);
+  if (command_instance)
+    AddCloudCommand(std::move(command_instance));
+}
+
+std::unique_ptr<CommandInstance> DeviceRegistrationInfo::ParseCloudCommand(
+    const base::DictionaryValue& command) {
+  std::string received_id;
+  std::string received_name;
+  if (command.GetString(commands::attributes::kCommand_Id, &received_id)) {
+    command.GetString(commands::attributes::kCommand_Name, &received_name);
+    component_manager_->RecordCommandStage(
+        received_id, received_name, CommandHistory::Stage::kReceived);
+  }
+
   std::string command_id;
   ErrorPtr error;
   auto command_instance = component_manager_->ParseCommandInstance(
@@ -1139,22 +1530,17 @@ void DeviceRegistrationInfo::PublishCommand(
     LOG(WARNING) << "Failed to parse a command instance: " << command;
     if (!command_id.empty())
       NotifyCommandAborted(command_id, std::move(error));
-    return;
   }
+  return command_instance;
+}
 
+void DeviceRegistrationInfo::AddCloudCommand(
+    std::unique_ptr<CommandInstance> command_instance) {
   // TODO(antonm): Properly process cancellation of commands.
   if (!component_manager_->FindCommand(command_instance->GetID())) {
     LOG(INFO) << "New command '" << command_instance->GetName()
               << "' arrived, ID: " << command_instance->GetID();
-    std::unique_ptr<BackoffEntry> backoff_entry{
-        new BackoffEntry{cloud_backoff_policy_.get()}};
-    std::unique_ptr<CloudCommandProxy> cloud_proxy{
-        new CloudCommandProxy{command_instance.get(), this, component_manager_,
-                              std::move(backoff_entry), task_runner_}};
-    // CloudCommandProxy::CloudCommandProxy() subscribe itself to Command
-    // notifications. When Command is being destroyed it sends
-    // ::OnCommandDestroyed() and CloudCommandProxy deletes itself.
-    cloud_proxy.release();
+    command_updater_->AddCommand(command_instance.get());
     component_manager_->AddCommand(std::move(command_instance));
   }
 }
@@ -1168,25 +1554,38 @@ void DeviceRegistrationInfo::PublishStateUpdates() {
   if (snapshot.state_changes.empty())
     return;
 
-  std::unique_ptr<base::ListValue> patches{new base::ListValue};
-  for (auto& state_change : snapshot.state_changes) {
-    std::unique_ptr<base::DictionaryValue> patch{new base::DictionaryValue};
-    patch->SetString("timeMs",
-                     std::to_string(state_change.timestamp.ToJavaTime()));
-    patch->SetString("component", state_change.component);
-    patch->Set("patch", state_change.changed_properties.release());
-    patches->Append(patch.release());
+  // Serialize the state changes straight into the request body, with the
+  // keys sorted as base::JSONWriter would.
+  std::string body;
+  JsonStreamWriter writer{&body};
+  writer.BeginObject();
+  writer.WriteKey("patches");
+  writer.BeginArray();
+  for (const auto& state_change : snapshot.state_changes) {
+    writer.BeginObject();
+    writer.WriteKey("component");
+    writer.WriteString(state_change.component);
+    writer.WriteKey("patch");
+    if (state_change.changed_properties)
+      writer.WriteValue(*state_change.changed_properties);
+    else
+      writer.WriteNull();
+    writer.WriteKey("timeMs");
+    writer.WriteString(std::to_string(state_change.timestamp.ToJavaTime()));
+    writer.EndObject();
   }
-
-  base::DictionaryValue body;
-  body.SetString("requestTimeMs",
-                 std::to_string(base::Time::Now().ToJavaTime()));
-  body.Set("patches", patches.release());
+  writer.EndArray();
+  writer.WriteKey("requestTimeMs");
+  writer.WriteString(std::to_string(base::Time::Now().ToJavaTime()));
+  writer.EndObject();
+  CHECK(writer.IsComplete());
 
   device_state_update_pending_ = true;
-  DoCloudRequest(HttpClient::Method::kPost, GetDeviceURL("patchState"), &body,
-                 base::Bind(&DeviceRegistrationInfo::OnPublishStateDone,
-                            AsWeakPtr(), snapshot.update_id));
+  DoCloudRequestWithJson(
+      CloudRequestScheduler::Priority::kState, HttpClient::Method::kPost,
+      GetDeviceURL("patchState"), std::move(body),
+      base::Bind(&DeviceRegistrationInfo::OnPublishStateDone, AsWeakPtr(),
+                 snapshot.update_id));
 }
 
 void DeviceRegistrationInfo::OnPublishStateDone(
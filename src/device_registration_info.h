@@ -7,6 +7,7 @@
 
 #include <map>
 #include <memory>
+#include <set>
 #include <string>
 #include <utility>
 #include <vector>
@@ -20,6 +21,7 @@
 #include <weave/provider/http_client.h>
 
 #include "src/backoff_entry.h"
+#include "src/cloud_request_scheduler.h"
 #include "src/commands/cloud_command_update_interface.h"
 #include "src/component_manager.h"
 #include "src/config.h"
@@ -34,6 +36,7 @@ class DictionaryValue;
 
 namespace weave {
 
+class CloudCommandUpdater;
 class StateManager;
 
 namespace provider {
@@ -121,6 +124,11 @@ class DeviceRegistrationInfo : public NotificationDelegate,
 
   GcdState GetGcdState() const { return gcd_state_; }
 
+  // Returns queue depth and wait time statistics of cloud requests by priority
+  // class, see CloudRequestScheduler::GetJson(), and the bytes saved by
+  // compression, in "compression".
+  const base::DictionaryValue& GetCloudRequestMetrics() const;
+
  private:
   friend class DeviceRegistrationInfoTest;
 
@@ -168,20 +176,39 @@ class DeviceRegistrationInfo : public NotificationDelegate,
   // Handles many cases like reauthorization, 5xx HTTP response codes
   // and device removal.  It is a recommended way to do cloud API
   // requests.
+  // Requests are sent by |cloud_request_scheduler_| according to |priority|.
   // TODO(antonm): Consider moving into some other class.
-  void DoCloudRequest(provider::HttpClient::Method method,
+  void DoCloudRequest(CloudRequestScheduler::Priority priority,
+                      provider::HttpClient::Method method,
                       const std::string& url,
                       const base::DictionaryValue* body,
                       const CloudRequestDoneCallback& callback);
+  // Same as DoCloudRequest(), with a |body| which is already serialized JSON.
+  void DoCloudRequestWithJson(CloudRequestScheduler::Priority priority,
+                              provider::HttpClient::Method method,
+                              const std::string& url,
+                              std::string body,
+                              const CloudRequestDoneCallback& callback);
 
   // Helper for DoCloudRequest().
   struct CloudRequestData {
     provider::HttpClient::Method method;
     std::string url;
     std::string body;
-    CloudRequestDoneCallback callback;
+    // Callbacks of the request and of the equivalent requests merged into it.
+    std::vector<CloudRequestDoneCallback> callbacks;
+    // Set to true if |body| is gzip-compressed.
+    bool gzipped{false};
+    // Set to true for a batch of command updates, whose 404, 405 and 501
+    // responses mean that the server doesn't support batches.
+    bool command_update_batch{false};
   };
+  void StartCloudRequest(const std::shared_ptr<CloudRequestData>& data);
   void SendCloudRequest(const std::shared_ptr<const CloudRequestData>& data);
+  // Runs the callbacks of the request and lets the next one start.
+  void FinishCloudRequest(const std::shared_ptr<const CloudRequestData>& data,
+                          const base::DictionaryValue& response,
+                          ErrorPtr error);
   void OnCloudRequestDone(
       const std::shared_ptr<const CloudRequestData>& data,
       std::unique_ptr<provider::HttpClient::Response> response,
@@ -192,10 +219,14 @@ class DeviceRegistrationInfo : public NotificationDelegate,
       ErrorPtr error);
   void CheckAccessTokenError(ErrorPtr error);
 
+  // Uploads the device resource. The first upload is a full PUT, later ones
+  // PATCH the changes since the last upload accepted by the server.
   void UpdateDeviceResource(const DoneCallback& callback);
   void StartQueuedUpdateDeviceResource();
   void OnUpdateDeviceResourceDone(const base::DictionaryValue& device_info,
                                   ErrorPtr error);
+  // Marks the resource in flight as uploaded and runs the callbacks.
+  void FinishUpdateDeviceResource();
   void OnUpdateDeviceResourceError(ErrorPtr error);
 
   void SendAuthInfo();
@@ -233,6 +264,15 @@ class DeviceRegistrationInfo : public NotificationDelegate,
 
   void PublishCommands(const base::ListValue& commands, ErrorPtr error);
   void PublishCommand(const base::DictionaryValue& command);
+  // Publishes commands received together, in the order of their priority.
+  void PublishCommandBatch(
+      const std::vector<const base::DictionaryValue*>& commands);
+  // Parses a command received from the server. Aborts the command on the
+  // server and returns nullptr if it is invalid.
+  std::unique_ptr<CommandInstance> ParseCloudCommand(
+      const base::DictionaryValue& command);
+  // Adds a parsed cloud command to the queue unless it is already there.
+  void AddCloudCommand(std::unique_ptr<CommandInstance> command_instance);
 
   // Helper function to pull the pending command list from the server using
   // FetchCommands() and make them available on D-Bus with PublishCommands().
@@ -250,6 +290,27 @@ class DeviceRegistrationInfo : public NotificationDelegate,
   // notify the server that the command is aborted by the device.
   void NotifyCommandAborted(const std::string& command_id, ErrorPtr error);
 
+  // Command patch waiting to be sent to the server by SendCommandUpdates().
+  struct QueuedCommandUpdate {
+    std::string command_id;
+    std::unique_ptr<base::DictionaryValue> patch;
+    std::vector<DoneCallback> callbacks;
+  };
+  using QueuedCommandUpdatePtr = std::unique_ptr<QueuedCommandUpdate>;
+
+  // Sends the queued command updates in a single batch request, or one request
+  // per command if there is only one or the server doesn't accept batches.
+  void SendCommandUpdates();
+  void SendCommandUpdate(QueuedCommandUpdatePtr update);
+  void OnCommandUpdateBatchDone(
+      const std::shared_ptr<std::vector<QueuedCommandUpdatePtr>>& batch,
+      const base::DictionaryValue& reply,
+      ErrorPtr error);
+  void OnCommandUpdateDone(const std::shared_ptr<QueuedCommandUpdate>& update,
+                           const base::DictionaryValue& reply,
+                           ErrorPtr error);
+  void FinishCommandUpdate(const QueuedCommandUpdate& update, ErrorPtr error);
+
   // Builds Cloud API devices collection REST resource which matches
   // current state of the device including command definitions
   // for all supported commands and current device state.
@@ -296,6 +357,11 @@ class DeviceRegistrationInfo : public NotificationDelegate,
   base::Time access_token_expiration_;
   // The time stamp of last device resource update on the server.
   std::string last_device_resource_updated_timestamp_;
+  // The device resource last accepted by the server. Later updates only send
+  // the changes to it, as a JSON merge patch.
+  std::unique_ptr<base::DictionaryValue> uploaded_device_resource_;
+  // The device resource sent by the update request in flight.
+  std::unique_ptr<base::DictionaryValue> device_resource_in_flight_;
   // Set to true if the device has connected to the cloud server correctly.
   // At this point, normal state and command updates can be dispatched to the
   // server.
@@ -316,6 +382,38 @@ class DeviceRegistrationInfo : public NotificationDelegate,
   std::unique_ptr<BackoffEntry> cloud_backoff_entry_;
   std::unique_ptr<BackoffEntry> oauth2_backoff_entry_;
 
+  // Publishes updates of cloud commands.
+  std::unique_ptr<CloudCommandUpdater> command_updater_;
+
+  // Orders requests sent by DoCloudRequest().
+  std::unique_ptr<CloudRequestScheduler> cloud_request_scheduler_;
+  // The last request waiting in |cloud_request_scheduler_| by URL. An
+  // equivalent request which follows it can be merged into it.
+  std::map<std::string, std::shared_ptr<CloudRequestData>>
+      waiting_cloud_requests_;
+
+  // Savings of gzip compression of cloud requests and responses.
+  struct CompressionStats {
+    uint64_t compressed_requests{0};
+    int64_t request_bytes_saved{0};
+    int64_t response_bytes_saved{0};
+  };
+  CompressionStats compression_stats_;
+  // Built by GetCloudRequestMetrics().
+  mutable std::unique_ptr<base::DictionaryValue> cloud_request_metrics_;
+
+  // Command updates waiting to be sent, in the order they were made. There is
+  // at most one entry per command, later patches are merged into it.
+  std::vector<QueuedCommandUpdatePtr> queued_command_updates_;
+  // IDs of commands with an update request in flight. Their queued updates
+  // wait for the request to finish.
+  std::set<std::string> command_updates_in_flight_;
+  // Set to true while a SendCommandUpdates() task is posted.
+  bool command_updates_send_scheduled_{false};
+  // Cleared when the server rejects a batch of command updates, until the next
+  // connection to the cloud.
+  bool command_update_batches_supported_{true};
+
   // Flag set to true while a device state update patch request is in flight
   // to the cloud server.
   bool device_state_update_pending_{false};
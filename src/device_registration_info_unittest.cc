@@ -15,12 +15,14 @@
 
 #include "src/bind_lambda.h"
 #include "src/component_manager_impl.h"
+#include "src/data_encoding.h"
 #include "src/http_constants.h"
 #include "src/privet/auth_manager.h"
 #include "src/test/mock_clock.h"
 
 using testing::_;
 using testing::AtLeast;
+using testing::DoAll;
 using testing::HasSubstr;
 using testing::Invoke;
 using testing::InvokeWithoutArgs;
@@ -107,6 +109,17 @@ std::unique_ptr<HttpClient::Response> ReplyWithJson(int status_code,
   return std::move(response);
 }
 
+// Returns a response with no body.
+std::unique_ptr<HttpClient::Response> ReplyWithStatus(int status_code) {
+  std::unique_ptr<MockHttpClientResponse> response{
+      new StrictMock<MockHttpClientResponse>};
+  EXPECT_CALL(*response, GetStatusCode())
+      .Times(AtLeast(1))
+      .WillRepeatedly(Return(status_code));
+  EXPECT_CALL(*response, GetContentType()).WillRepeatedly(Return(""));
+  return std::move(response);
+}
+
 std::pair<std::string, std::string> GetAuthHeader() {
   return {http::kAuthorization,
           std::string("Bearer ") + test_data::kAccessToken};
@@ -132,7 +145,7 @@ class DeviceRegistrationInfoTest : public ::testing::Test {
 
   void ReloadDefaults() {
     EXPECT_CALL(config_store_, LoadDefaults(_))
-        .WillOnce(Invoke([](Settings* settings) {
+        .WillOnce(Invoke([this](Settings* settings) {
           settings->client_id = test_data::kClientId;
           settings->client_secret = test_data::kClientSecret;
           settings->api_key = test_data::kApiKey;
@@ -146,6 +159,7 @@ class DeviceRegistrationInfoTest : public ::testing::Test {
           settings->oauth_url = test_data::kOAuthURL;
           settings->service_url = test_data::kServiceURL;
           settings->xmpp_endpoint = test_data::kXmppEndpoint;
+          settings->cloud_compression_level = compression_level_;
           return true;
         }));
     config_.reset(new Config{&config_store_});
@@ -188,14 +202,45 @@ class DeviceRegistrationInfoTest : public ::testing::Test {
     return succeeded;
   }
 
+  void ProcessInitialCommandList(const base::ListValue& commands) {
+    dev_reg_->ProcessInitialCommandList(commands, nullptr);
+  }
+
+  bool CommandUpdateBatchesSupported() const {
+    return dev_reg_->command_update_batches_supported_;
+  }
+
+  void PublishStateUpdates() { dev_reg_->PublishStateUpdates(); }
+
+  void UpdateDeviceResource(const DoneCallback& callback) {
+    dev_reg_->UpdateDeviceResource(callback);
+  }
+
+  std::unique_ptr<base::DictionaryValue> BuildDeviceResource() const {
+    return dev_reg_->BuildDeviceResource();
+  }
+
+  void DoCloudRequest(HttpClient::Method method,
+                      const std::string& url,
+                      const base::DictionaryValue& body) {
+    dev_reg_->DoCloudRequest(
+        CloudRequestScheduler::Priority::kCommands, method, url, &body,
+        base::Bind([](const base::DictionaryValue&, ErrorPtr error) {
+          EXPECT_FALSE(error);
+        }));
+  }
+
   void SetAccessToken() { dev_reg_->access_token_ = test_data::kAccessToken; }
 
+  void ResetCloudBackoff() { dev_reg_->cloud_backoff_entry_->Reset(); }
+
   GcdState GetGcdState() const { return dev_reg_->GetGcdState(); }
 
   bool HaveRegistrationCredentials() const {
     return dev_reg_->HaveRegistrationCredentials();
   }
 
+  int compression_level_{0};
   provider::test::FakeTaskRunner task_runner_;
   provider::test::MockConfigStore config_store_;
   StrictMock<MockHttpClient> http_client_;
@@ -594,6 +639,358 @@ TEST_F(DeviceRegistrationInfoTest, OOBRegistrationStatus) {
   EXPECT_EQ(GcdState::kConnecting, GetGcdState());
 }
 
+TEST_F(DeviceRegistrationInfoTest, CloudRequestsLimitAndDuplicates) {
+  ReloadSettings();
+  SetAccessToken();
+
+  std::vector<HttpClient::SendRequestCallback> http_callbacks;
+  EXPECT_CALL(http_client_,
+              SendRequest(HttpClient::Method::kGet, dev_reg_->GetDeviceURL(),
+                          HttpClient::Headers{GetAuthHeader(), GetJsonHeader()},
+                          _, _))
+      .Times(5)
+      .WillRepeatedly(WithArgs<4>(Invoke(
+          [&http_callbacks](const HttpClient::SendRequestCallback& callback) {
+            http_callbacks.push_back(callback);
+          })));
+
+  int replies = 0;
+  auto on_reply = [&replies](const base::DictionaryValue& reply,
+                             ErrorPtr error) {
+    EXPECT_FALSE(error);
+    replies++;
+  };
+  // The first four requests are sent, the fifth one waits and the sixth one is
+  // merged into it.
+  for (int i = 0; i < 6; i++)
+    dev_reg_->GetDeviceInfo(base::Bind(on_reply));
+  EXPECT_EQ(4u, http_callbacks.size());
+
+  for (size_t i = 0; i < http_callbacks.size(); i++) {
+    base::DictionaryValue json;
+    http_callbacks[i].Run(ReplyWithJson(200, json), nullptr);
+  }
+  EXPECT_EQ(5u, http_callbacks.size());
+  EXPECT_EQ(6, replies);
+
+  const base::DictionaryValue* stats = nullptr;
+  ASSERT_TRUE(dev_reg_->GetCloudRequestMetrics().GetDictionary(
+      "classes.deviceResource", &stats));
+  int value = 0;
+  EXPECT_TRUE(stats->GetInteger("maxQueueDepth", &value));
+  EXPECT_EQ(1, value);
+  EXPECT_TRUE(stats->GetInteger("scheduled", &value));
+  EXPECT_EQ(5, value);
+  EXPECT_TRUE(stats->GetInteger("deduplicated", &value));
+  EXPECT_EQ(1, value);
+}
+
+TEST_F(DeviceRegistrationInfoTest, CloudRequestsNotMergedOutOfOrder) {
+  ReloadSettings();
+  SetAccessToken();
+
+  std::vector<HttpClient::SendRequestCallback> http_callbacks;
+  EXPECT_CALL(http_client_, SendRequest(HttpClient::Method::kGet, _, _, _, _))
+      .Times(4)
+      .WillRepeatedly(WithArgs<4>(Invoke(
+          [&http_callbacks](const HttpClient::SendRequestCallback& callback) {
+            http_callbacks.push_back(callback);
+          })));
+  std::vector<std::string> patches;
+  EXPECT_CALL(http_client_,
+              SendRequest(HttpClient::Method::kPatch,
+                          dev_reg_->GetServiceURL("commands/1"), _, _, _))
+      .Times(3)
+      .WillRepeatedly(WithArgs<3, 4>(
+          Invoke([&patches](const std::string& data,
+                            const HttpClient::SendRequestCallback& callback) {
+            patches.push_back(data);
+            callback.Run(ReplyWithJson(200, base::DictionaryValue{}), nullptr);
+          })));
+
+  // Fill up the requests in flight so the next ones wait.
+  for (int i = 0; i < 4; i++) {
+    dev_reg_->GetDeviceInfo(
+        base::Bind([](const base::DictionaryValue&, ErrorPtr) {}));
+  }
+  base::DictionaryValue x;
+  x.SetString("state", "x");
+  base::DictionaryValue y;
+  y.SetString("state", "y");
+  const std::string url = dev_reg_->GetServiceURL("commands/1");
+  DoCloudRequest(HttpClient::Method::kPatch, url, x);
+  DoCloudRequest(HttpClient::Method::kPatch, url, y);
+  // Not merged with the first request, which would leave the command at y.
+  DoCloudRequest(HttpClient::Method::kPatch, url, x);
+  // Merged with the previous request.
+  DoCloudRequest(HttpClient::Method::kPatch, url, x);
+
+  for (const auto& callback : http_callbacks)
+    callback.Run(ReplyWithJson(200, base::DictionaryValue{}), nullptr);
+  EXPECT_EQ((std::vector<std::string>{R"({"state":"x"})", R"({"state":"y"})",
+                                      R"({"state":"x"})"}),
+            patches);
+}
+
+TEST_F(DeviceRegistrationInfoTest, CloudRequestErrorHasHttpStatus) {
+  ReloadSettings();
+  SetAccessToken();
+
+  EXPECT_CALL(http_client_, SendRequest(HttpClient::Method::kGet, _, _, _, _))
+      .WillOnce(WithArgs<4>(
+          Invoke([](const HttpClient::SendRequestCallback& callback) {
+            auto json = CreateDictionaryValue(R"({
+              'error': {
+                'errors': [{'reason': 'notFound', 'message': 'Not found'}]
+              }
+            })");
+            callback.Run(ReplyWithJson(404, *json), nullptr);
+          })));
+  bool done = false;
+  dev_reg_->GetDeviceInfo(base::Bind(
+      [&done](const base::DictionaryValue& info, ErrorPtr error) {
+        ASSERT_TRUE(error);
+        EXPECT_EQ("notFound", error->GetCode());
+        EXPECT_TRUE(error->HasError("http_404"));
+        EXPECT_TRUE(info.empty());
+        done = true;
+      }));
+  EXPECT_TRUE(done);
+}
+
+TEST_F(DeviceRegistrationInfoTest, CloudRequestErrorWithoutBody) {
+  ReloadSettings();
+  SetAccessToken();
+
+  EXPECT_CALL(http_client_, SendRequest(HttpClient::Method::kGet, _, _, _, _))
+      .WillOnce(WithArgs<4>(
+          Invoke([](const HttpClient::SendRequestCallback& callback) {
+            callback.Run(ReplyWithStatus(404), nullptr);
+          })));
+  bool done = false;
+  dev_reg_->GetDeviceInfo(base::Bind(
+      [&done](const base::DictionaryValue& info, ErrorPtr error) {
+        // Reported as an error, not as an empty reply.
+        ASSERT_TRUE(error);
+        EXPECT_EQ("http_404", error->GetCode());
+        done = true;
+      }));
+  EXPECT_TRUE(done);
+}
+
+TEST_F(DeviceRegistrationInfoTest, CloudRequestNotImplementedNotRetried) {
+  ReloadSettings();
+  SetAccessToken();
+
+  EXPECT_CALL(http_client_, SendRequest(HttpClient::Method::kGet, _, _, _, _))
+      .WillOnce(WithArgs<4>(
+          Invoke([](const HttpClient::SendRequestCallback& callback) {
+            callback.Run(ReplyWithStatus(501), nullptr);
+          })));
+  bool done = false;
+  dev_reg_->GetDeviceInfo(base::Bind(
+      [&done](const base::DictionaryValue& info, ErrorPtr error) {
+        ASSERT_TRUE(error);
+        EXPECT_EQ("http_501", error->GetCode());
+        done = true;
+      }));
+  EXPECT_TRUE(done);
+  // Nothing is left to resend the request.
+  task_runner_.Run();
+}
+
+TEST_F(DeviceRegistrationInfoTest, CompressedRequestAndResponse) {
+  compression_level_ = 6;
+  ReloadSettings();
+  SetAccessToken();
+
+  const std::string text(2000, 'x');
+  EXPECT_CALL(
+      http_client_,
+      SendRequest(HttpClient::Method::kPatch,
+                  dev_reg_->GetServiceURL("commands/1234"),
+                  HttpClient::Headers{GetAuthHeader(), GetJsonHeader(),
+                                      {http::kContentEncoding, http::kGzip},
+                                      {http::kAcceptEncoding, http::kGzip}},
+                  _, _))
+      .WillOnce(WithArgs<3, 4>(
+          Invoke([&text](const std::string& data,
+                         const HttpClient::SendRequestCallback& callback) {
+            EXPECT_LT(data.size(), text.size());
+            std::string json;
+            EXPECT_TRUE(GzipDecompress(data, 4 * text.size(), &json));
+            auto patch = CreateDictionaryValue(json);
+            std::string patch_text;
+            EXPECT_TRUE(patch->GetString("results.text", &patch_text));
+            EXPECT_EQ(text, patch_text);
+
+            std::string reply;
+            EXPECT_TRUE(
+                GzipCompress(R"({"text": ")" + text + R"("})", 6, &reply));
+            std::unique_ptr<MockHttpClientResponse> response{
+                new StrictMock<MockHttpClientResponse>};
+            EXPECT_CALL(*response, GetStatusCode())
+                .WillRepeatedly(Return(200));
+            EXPECT_CALL(*response, GetContentType())
+                .WillRepeatedly(Return(http::kJsonUtf8));
+            EXPECT_CALL(*response, GetData()).WillRepeatedly(Return(reply));
+            callback.Run(std::move(response), nullptr);
+          })));
+
+  base::DictionaryValue patch;
+  patch.SetString("results.text", text);
+  bool done = false;
+  dev_reg_->UpdateCommand("1234", patch,
+                          base::Bind([this, &done](ErrorPtr error) {
+                            EXPECT_FALSE(error);
+                            done = true;
+                            task_runner_.Break();
+                          }));
+  task_runner_.Run();
+  EXPECT_TRUE(done);
+
+  const base::DictionaryValue* compression = nullptr;
+  ASSERT_TRUE(dev_reg_->GetCloudRequestMetrics().GetDictionary(
+      "compression", &compression));
+  int requests = 0;
+  EXPECT_TRUE(compression->GetInteger("compressedRequests", &requests));
+  EXPECT_EQ(1, requests);
+  double saved = 0;
+  EXPECT_TRUE(compression->GetDouble("requestBytesSaved", &saved));
+  EXPECT_GT(saved, 0);
+  EXPECT_TRUE(compression->GetDouble("responseBytesSaved", &saved));
+  EXPECT_GT(saved, 0);
+}
+
+TEST_F(DeviceRegistrationInfoTest, DeviceResourceOmitsLocalAttributes) {
+  auto json_traits = CreateDictionaryValue(R"({
+    'sensor': {
+      'coalescing': {'minIntervalMs': 1000},
+      'state': {
+        'temp': {'type': 'number', 'coalescing': {'deadband': 0.5}}
+      },
+      'commands': {
+        'reset': {
+          'minimalRole': 'user',
+          'priority': 5,
+          'expirationTimeoutMs': 30000,
+          'supersedePending': true
+        }
+      }
+    }
+  })");
+  EXPECT_TRUE(component_manager_.LoadTraits(*json_traits, nullptr));
+
+  const char kExpected[] = R"({
+    'sensor': {
+      'state': {
+        'temp': {'type': 'number'}
+      },
+      'commands': {
+        'reset': {'minimalRole': 'user'}
+      }
+    }
+  })";
+  auto resource = BuildDeviceResource();
+  const base::DictionaryValue* traits = nullptr;
+  ASSERT_TRUE(resource->GetDictionary("traits", &traits));
+  EXPECT_JSON_EQ(kExpected, *traits);
+}
+
+TEST_F(DeviceRegistrationInfoTest, PatchDeviceResource) {
+  ReloadSettings();
+  SetAccessToken();
+
+  auto reply_with_timestamp = [](const std::string& timestamp) {
+    return WithArgs<4>(
+        Invoke([timestamp](const HttpClient::SendRequestCallback& callback) {
+          base::DictionaryValue json;
+          json.SetString("lastUpdateTimeMs", timestamp);
+          callback.Run(ReplyWithJson(200, json), nullptr);
+        }));
+  };
+  auto device_url = [this](const std::string& timestamp) {
+    return dev_reg_->GetDeviceURL({}, {{"lastUpdateTimeMs", timestamp}});
+  };
+
+  // The first update is a full one.
+  EXPECT_CALL(http_client_, SendRequest(HttpClient::Method::kGet,
+                                        dev_reg_->GetDeviceURL(), _, _, _))
+      .WillOnce(reply_with_timestamp("100"));
+  EXPECT_CALL(http_client_, SendRequest(HttpClient::Method::kPut,
+                                        device_url("100"), _, _, _))
+      .WillOnce(DoAll(WithArgs<3>(Invoke([](const std::string& data) {
+                        auto json = CreateDictionaryValue(data);
+                        EXPECT_TRUE(json->HasKey("traits"));
+                        EXPECT_TRUE(json->HasKey("components"));
+                        EXPECT_TRUE(json->HasKey("channel"));
+                      })),
+                      reply_with_timestamp("101")));
+  dev_reg_->UpdateDeviceInfo("Coffee Pot", "", "Kitchen");
+  Mock::VerifyAndClearExpectations(&http_client_);
+
+  // Then only the changes are sent.
+  EXPECT_CALL(http_client_, SendRequest(HttpClient::Method::kPatch,
+                                        device_url("101"), _, _, _))
+      .WillOnce(WithArgs<3, 4>(
+          Invoke([](const std::string& data,
+                    const HttpClient::SendRequestCallback& callback) {
+            EXPECT_JSON_EQ(R"({"name": "Tea Pot"})",
+                           *CreateDictionaryValue(data));
+            base::DictionaryValue json;
+            json.SetString("lastUpdateTimeMs", "102");
+            callback.Run(ReplyWithJson(200, json), nullptr);
+          })));
+  dev_reg_->UpdateDeviceInfo("Tea Pot", "", "Kitchen");
+  Mock::VerifyAndClearExpectations(&http_client_);
+
+  // Nothing is sent if nothing changed, but the callback still runs.
+  bool done = false;
+  UpdateDeviceResource(base::Bind([this, &done](ErrorPtr error) {
+    EXPECT_FALSE(error);
+    done = true;
+    task_runner_.Break();
+  }));
+  EXPECT_FALSE(done);
+  task_runner_.Run();
+  EXPECT_TRUE(done);
+
+  // If the server has a newer resource, the update falls back to a full one.
+  EXPECT_CALL(http_client_, SendRequest(HttpClient::Method::kPatch,
+                                        device_url("102"), _, _, _))
+      .WillOnce(WithArgs<3, 4>(
+          Invoke([](const std::string& data,
+                    const HttpClient::SendRequestCallback& callback) {
+            EXPECT_JSON_EQ(R"({"name": "Milk Pot", "location": null})",
+                           *CreateDictionaryValue(data));
+            auto json = CreateDictionaryValue(R"({
+              'error': {
+                'errors': [{
+                  'reason': 'invalid_last_update_time_ms',
+                  'message': 'Outdated timestamp'
+                }]
+              }
+            })");
+            callback.Run(ReplyWithJson(400, *json), nullptr);
+          })));
+  EXPECT_CALL(http_client_, SendRequest(HttpClient::Method::kGet,
+                                        dev_reg_->GetDeviceURL(), _, _, _))
+      .WillOnce(reply_with_timestamp("105"));
+  EXPECT_CALL(http_client_, SendRequest(HttpClient::Method::kPut,
+                                        device_url("105"), _, _, _))
+      .WillOnce(DoAll(WithArgs<3>(Invoke([this](const std::string& data) {
+                        auto json = CreateDictionaryValue(data);
+                        EXPECT_TRUE(json->HasKey("traits"));
+                        EXPECT_FALSE(json->HasKey("location"));
+                        task_runner_.Break();
+                      })),
+                      reply_with_timestamp("106")));
+  dev_reg_->UpdateDeviceInfo("Milk Pot", "", "");
+  // The device resource is retrieved after the backoff caused by the error.
+  ResetCloudBackoff();
+  task_runner_.Run();
+}
+
 class DeviceRegistrationInfoUpdateCommandTest
     : public DeviceRegistrationInfoTest {
  protected:
@@ -637,7 +1034,8 @@ class DeviceRegistrationInfoUpdateCommandTest
   }
 
   void TearDown() override {
-    task_runner_.RunOnce();
+    // Sends the command update after the batching window.
+    task_runner_.Run(2);
     DeviceRegistrationInfoTest::TearDown();
   }
 
@@ -695,4 +1093,363 @@ TEST_F(DeviceRegistrationInfoUpdateCommandTest, Cancel) {
   EXPECT_TRUE(command_->Cancel(nullptr));
 }
 
+TEST_F(DeviceRegistrationInfoUpdateCommandTest, Expire) {
+  EXPECT_CALL(
+      http_client_,
+      SendRequest(HttpClient::Method::kPatch,
+                  dev_reg_->GetServiceURL("commands/5678"),
+                  HttpClient::Headers{GetAuthHeader(), GetJsonHeader()}, _, _))
+      .WillOnce(WithArgs<3, 4>(
+          Invoke([](const std::string& data,
+                    const HttpClient::SendRequestCallback& callback) {
+            EXPECT_JSON_EQ(R"({"state":"expired"})",
+                           *CreateDictionaryValue(data));
+            base::DictionaryValue json;
+            callback.Run(ReplyWithJson(200, json), nullptr);
+          })));
+  auto commands_json = CreateValue(R"([{
+    'name':'robot._jump',
+    'component': 'comp',
+    'id':'5678',
+    'parameters': {'_height': 100},
+    'expirationTimeMs': 1000
+  }])");
+  const base::ListValue* command_list = nullptr;
+  ASSERT_TRUE(commands_json->GetAsList(&command_list));
+  PublishCommands(*command_list);
+  Command* command = component_manager_.FindCommand("5678");
+  ASSERT_NE(nullptr, command);
+  EXPECT_EQ(Command::State::kExpired, command->GetState());
+}
+
+TEST_F(DeviceRegistrationInfoUpdateCommandTest, BatchUpdates) {
+  EXPECT_CALL(
+      http_client_,
+      SendRequest(HttpClient::Method::kPost,
+                  dev_reg_->GetServiceURL("commands/batchUpdate"),
+                  HttpClient::Headers{GetAuthHeader(), GetJsonHeader()}, _, _))
+      .WillOnce(WithArgs<3, 4>(
+          Invoke([](const std::string& data,
+                    const HttpClient::SendRequestCallback& callback) {
+            EXPECT_JSON_EQ(R"({"commands": [
+                             {"id": "1234", "patch": {"state": "cancelled"}},
+                             {"id": "5678", "patch": {"state": "expired"}}
+                           ]})",
+                           *CreateDictionaryValue(data));
+            base::DictionaryValue json;
+            callback.Run(ReplyWithJson(200, json), nullptr);
+          })));
+  EXPECT_TRUE(command_->Cancel(nullptr));
+  auto commands_json = CreateValue(R"([{
+    'name':'robot._jump',
+    'component': 'comp',
+    'id':'5678',
+    'parameters': {'_height': 100},
+    'expirationTimeMs': 1000
+  }])");
+  const base::ListValue* command_list = nullptr;
+  ASSERT_TRUE(commands_json->GetAsList(&command_list));
+  PublishCommands(*command_list);
+}
+
+TEST_F(DeviceRegistrationInfoUpdateCommandTest, BatchRejected) {
+  EXPECT_CALL(
+      http_client_,
+      SendRequest(HttpClient::Method::kPost,
+                  dev_reg_->GetServiceURL("commands/batchUpdate"), _, _, _))
+      .WillOnce(WithArgs<4>(
+          Invoke([](const HttpClient::SendRequestCallback& callback) {
+            callback.Run(ReplyWithStatus(404), nullptr);
+          })));
+  EXPECT_CALL(http_client_,
+              SendRequest(HttpClient::Method::kPatch, command_url_, _, _, _))
+      .WillOnce(WithArgs<3, 4>(
+          Invoke([](const std::string& data,
+                    const HttpClient::SendRequestCallback& callback) {
+            EXPECT_JSON_EQ(R"({"state":"cancelled"})",
+                           *CreateDictionaryValue(data));
+            base::DictionaryValue json;
+            callback.Run(ReplyWithJson(200, json), nullptr);
+          })));
+  EXPECT_CALL(http_client_,
+              SendRequest(HttpClient::Method::kPatch,
+                          dev_reg_->GetServiceURL("commands/5678"), _, _, _))
+      .WillOnce(WithArgs<3, 4>(
+          Invoke([](const std::string& data,
+                    const HttpClient::SendRequestCallback& callback) {
+            EXPECT_JSON_EQ(R"({"state":"expired"})",
+                           *CreateDictionaryValue(data));
+            base::DictionaryValue json;
+            callback.Run(ReplyWithJson(200, json), nullptr);
+          })));
+  EXPECT_TRUE(command_->Cancel(nullptr));
+  auto commands_json = CreateValue(R"([{
+    'name':'robot._jump',
+    'component': 'comp',
+    'id':'5678',
+    'parameters': {'_height': 100},
+    'expirationTimeMs': 1000
+  }])");
+  const base::ListValue* command_list = nullptr;
+  ASSERT_TRUE(commands_json->GetAsList(&command_list));
+  PublishCommands(*command_list);
+  task_runner_.Run(2);
+  EXPECT_FALSE(CommandUpdateBatchesSupported());
+  // The individual requests are sent in TearDown(), after the backoff caused by
+  // the rejected batch.
+  ResetCloudBackoff();
+}
+
+TEST_F(DeviceRegistrationInfoUpdateCommandTest, BatchNotImplemented) {
+  // The batch is not retried.
+  EXPECT_CALL(
+      http_client_,
+      SendRequest(HttpClient::Method::kPost,
+                  dev_reg_->GetServiceURL("commands/batchUpdate"), _, _, _))
+      .WillOnce(WithArgs<4>(
+          Invoke([](const HttpClient::SendRequestCallback& callback) {
+            callback.Run(ReplyWithStatus(501), nullptr);
+          })));
+  EXPECT_CALL(http_client_,
+              SendRequest(HttpClient::Method::kPatch, command_url_, _, _, _))
+      .WillOnce(WithArgs<4>(
+          Invoke([](const HttpClient::SendRequestCallback& callback) {
+            callback.Run(ReplyWithJson(200, base::DictionaryValue{}), nullptr);
+          })));
+  EXPECT_CALL(http_client_,
+              SendRequest(HttpClient::Method::kPatch,
+                          dev_reg_->GetServiceURL("commands/5678"), _, _, _))
+      .WillOnce(WithArgs<4>(
+          Invoke([](const HttpClient::SendRequestCallback& callback) {
+            callback.Run(ReplyWithJson(200, base::DictionaryValue{}), nullptr);
+          })));
+  EXPECT_TRUE(command_->Cancel(nullptr));
+  auto commands_json = CreateValue(R"([{
+    'name':'robot._jump',
+    'component': 'comp',
+    'id':'5678',
+    'parameters': {'_height': 100},
+    'expirationTimeMs': 1000
+  }])");
+  const base::ListValue* command_list = nullptr;
+  ASSERT_TRUE(commands_json->GetAsList(&command_list));
+  PublishCommands(*command_list);
+  task_runner_.Run(2);
+  EXPECT_FALSE(CommandUpdateBatchesSupported());
+  ResetCloudBackoff();
+}
+
+TEST_F(DeviceRegistrationInfoUpdateCommandTest, BatchFailed) {
+  EXPECT_CALL(
+      http_client_,
+      SendRequest(HttpClient::Method::kPost,
+                  dev_reg_->GetServiceURL("commands/batchUpdate"), _, _, _))
+      .WillOnce(WithArgs<4>(
+          Invoke([](const HttpClient::SendRequestCallback& callback) {
+            auto json = CreateDictionaryValue(R"({
+              'error': {
+                'errors': [{'reason': 'invalid', 'message': 'Bad command'}]
+              }
+            })");
+            callback.Run(ReplyWithJson(400, *json), nullptr);
+          })));
+  EXPECT_CALL(http_client_,
+              SendRequest(HttpClient::Method::kPatch, command_url_, _, _, _))
+      .WillOnce(WithArgs<4>(
+          Invoke([](const HttpClient::SendRequestCallback& callback) {
+            callback.Run(ReplyWithJson(200, base::DictionaryValue{}), nullptr);
+          })));
+  EXPECT_CALL(http_client_,
+              SendRequest(HttpClient::Method::kPatch,
+                          dev_reg_->GetServiceURL("commands/5678"), _, _, _))
+      .WillOnce(WithArgs<4>(
+          Invoke([](const HttpClient::SendRequestCallback& callback) {
+            callback.Run(ReplyWithJson(200, base::DictionaryValue{}), nullptr);
+          })));
+  EXPECT_TRUE(command_->Cancel(nullptr));
+  auto commands_json = CreateValue(R"([{
+    'name':'robot._jump',
+    'component': 'comp',
+    'id':'5678',
+    'parameters': {'_height': 100},
+    'expirationTimeMs': 1000
+  }])");
+  const base::ListValue* command_list = nullptr;
+  ASSERT_TRUE(commands_json->GetAsList(&command_list));
+  PublishCommands(*command_list);
+  task_runner_.Run(2);
+  // Only this batch is split, later ones are still batched.
+  EXPECT_TRUE(CommandUpdateBatchesSupported());
+  ResetCloudBackoff();
+}
+
+TEST_F(DeviceRegistrationInfoUpdateCommandTest, BatchManyUpdates) {
+  EXPECT_CALL(
+      http_client_,
+      SendRequest(HttpClient::Method::kPost,
+                  dev_reg_->GetServiceURL("commands/batchUpdate"), _, _, _))
+      .WillOnce(WithArgs<3, 4>(
+          Invoke([](const std::string& data,
+                    const HttpClient::SendRequestCallback& callback) {
+            auto json = CreateDictionaryValue(data);
+            const base::ListValue* commands = nullptr;
+            ASSERT_TRUE(json->GetList("commands", &commands));
+            EXPECT_EQ(7u, commands->GetSize());
+            callback.Run(ReplyWithJson(200, base::DictionaryValue{}), nullptr);
+          })));
+  auto commands_json = CreateValue(R"([
+    {'name':'robot._jump', 'component': 'comp', 'id':'1'},
+    {'name':'robot._jump', 'component': 'comp', 'id':'2'},
+    {'name':'robot._jump', 'component': 'comp', 'id':'3'},
+    {'name':'robot._jump', 'component': 'comp', 'id':'4'},
+    {'name':'robot._jump', 'component': 'comp', 'id':'5'},
+    {'name':'robot._jump', 'component': 'comp', 'id':'6'}
+  ])");
+  const base::ListValue* command_list = nullptr;
+  ASSERT_TRUE(commands_json->GetAsList(&command_list));
+  PublishCommands(*command_list);
+  // All the updates made at once go in a single batch.
+  EXPECT_TRUE(command_->Cancel(nullptr));
+  for (const char* id : {"1", "2", "3", "4", "5", "6"})
+    EXPECT_TRUE(component_manager_.FindCommand(id)->Cancel(nullptr));
+}
+
+TEST_F(DeviceRegistrationInfoTest, ProcessInitialCommandList) {
+  ReloadSettings();
+  SetAccessToken();
+  auto json_traits = CreateDictionaryValue(
+      "{'robot': {'commands': {'_jump': {'minimalRole': 'user'}}}}");
+  EXPECT_TRUE(component_manager_.LoadTraits(*json_traits, nullptr));
+  EXPECT_TRUE(component_manager_.AddComponent("", "comp", {"robot"}, nullptr));
+  std::vector<std::string> ids;
+  auto handler = [&ids](const std::weak_ptr<Command>& command) {
+    ids.push_back(command.lock()->GetID());
+  };
+  component_manager_.AddCommandHandler("comp", "robot._jump",
+                                       base::Bind(handler));
+
+  // Commands left in transitional states by a previous run are aborted with a
+  // single request.
+  EXPECT_CALL(
+      http_client_,
+      SendRequest(HttpClient::Method::kPost,
+                  dev_reg_->GetServiceURL("commands/batchUpdate"),
+                  HttpClient::Headers{GetAuthHeader(), GetJsonHeader()}, _, _))
+      .WillOnce(WithArgs<3, 4>(
+          Invoke([this](const std::string& data,
+                        const HttpClient::SendRequestCallback& callback) {
+            EXPECT_JSON_EQ(R"({"commands": [
+                             {"id": "2", "patch": {"state": "aborted"}},
+                             {"id": "3", "patch": {"state": "aborted"}},
+                             {"id": "4", "patch": {"state": "aborted"}}
+                           ]})",
+                           *CreateDictionaryValue(data));
+            callback.Run(ReplyWithJson(200, base::DictionaryValue{}), nullptr);
+            task_runner_.Break();
+          })));
+
+  auto commands_json = CreateValue(R"([
+    {'name':'robot._jump', 'component': 'comp', 'id':'1', 'state':'queued'},
+    {'name':'robot._jump', 'component': 'comp', 'id':'2', 'state':'error'},
+    {'name':'robot._jump', 'component': 'comp', 'id':'3',
+     'state':'inProgress'},
+    {'name':'robot._jump', 'component': 'comp', 'id':'4', 'state':'paused'},
+    {'name':'robot._jump', 'component': 'comp', 'state':'error'}
+  ])");
+  const base::ListValue* command_list = nullptr;
+  ASSERT_TRUE(commands_json->GetAsList(&command_list));
+  ProcessInitialCommandList(*command_list);
+  // Only the queued command is published to local handlers. The limbo
+  // command with no ID is skipped.
+  EXPECT_EQ((std::vector<std::string>{"1"}), ids);
+  EXPECT_EQ(nullptr, component_manager_.FindCommand("2"));
+  task_runner_.Run();
+}
+
+TEST_F(DeviceRegistrationInfoTest, PublishStateUpdates) {
+  ReloadSettings();
+  SetAccessToken();
+
+  auto json_traits = CreateDictionaryValue(R"({
+    'robot': {
+      'state': {
+        'name': {'type': 'string'},
+        'speed': {'type': 'number'}
+      }
+    }
+  })");
+  EXPECT_TRUE(component_manager_.LoadTraits(*json_traits, nullptr));
+  EXPECT_TRUE(component_manager_.AddComponent("", "comp1", {"robot"}, nullptr));
+  EXPECT_TRUE(component_manager_.AddComponent("", "comp2", {"robot"}, nullptr));
+  EXPECT_TRUE(component_manager_.SetStateProperty(
+      "comp1", "robot.name", base::StringValue{"R2-D2"}, nullptr));
+  EXPECT_TRUE(component_manager_.SetStateProperty(
+      "comp2", "robot.speed", base::FundamentalValue{0.5}, nullptr));
+
+  EXPECT_CALL(http_client_,
+              SendRequest(HttpClient::Method::kPost,
+                          dev_reg_->GetDeviceURL("patchState"),
+                          HttpClient::Headers{GetAuthHeader(), GetJsonHeader()},
+                          _, _))
+      .WillOnce(WithArgs<3, 4>(
+          Invoke([this](const std::string& data,
+                        const HttpClient::SendRequestCallback& callback) {
+            auto json = CreateDictionaryValue(data);
+            ASSERT_TRUE(json);
+            // Same text as base::JSONWriter would produce.
+            std::string expected;
+            EXPECT_TRUE(base::JSONWriter::Write(*json, &expected));
+            EXPECT_EQ(expected, data);
+
+            std::string time;
+            EXPECT_TRUE(json->GetString("requestTimeMs", &time));
+            const base::ListValue* patches = nullptr;
+            ASSERT_TRUE(json->GetList("patches", &patches));
+            ASSERT_EQ(2u, patches->GetSize());
+            const char* const kExpected[][2] = {
+                {"comp1", "{'robot': {'name': 'R2-D2'}}"},
+                {"comp2", "{'robot': {'speed': 0.5}}"},
+            };
+            for (size_t i = 0; i < patches->GetSize(); i++) {
+              const base::DictionaryValue* patch = nullptr;
+              ASSERT_TRUE(patches->GetDictionary(i, &patch));
+              std::string component;
+              EXPECT_TRUE(patch->GetString("component", &component));
+              EXPECT_EQ(kExpected[i][0], component);
+              EXPECT_TRUE(patch->GetString("timeMs", &time));
+              const base::DictionaryValue* state = nullptr;
+              ASSERT_TRUE(patch->GetDictionary("patch", &state));
+              EXPECT_JSON_EQ(kExpected[i][1], *state);
+            }
+
+            callback.Run(ReplyWithJson(200, base::DictionaryValue{}), nullptr);
+          })));
+  PublishStateUpdates();
+}
+
+TEST_F(DeviceRegistrationInfoTest, PublishCommandsByPriority) {
+  auto json_traits = CreateDictionaryValue(
+      "{'robot': {'commands': {'_jump': {'minimalRole': 'user'}}}}");
+  EXPECT_TRUE(component_manager_.LoadTraits(*json_traits, nullptr));
+  EXPECT_TRUE(component_manager_.AddComponent("", "comp", {"robot"}, nullptr));
+
+  std::vector<std::string> ids;
+  auto handler = [&ids](const std::weak_ptr<Command>& command) {
+    ids.push_back(command.lock()->GetID());
+  };
+  component_manager_.AddCommandHandler("comp", "robot._jump",
+                                       base::Bind(handler));
+
+  auto commands_json = CreateValue(R"([
+    {'name':'robot._jump', 'component': 'comp', 'id':'1'},
+    {'name':'robot._jump', 'component': 'comp', 'id':'2', 'priority': 1},
+    {'name':'robot._jump', 'component': 'comp', 'id':'3'},
+    {'name':'robot._jump', 'component': 'comp', 'id':'4', 'priority': 2}
+  ])");
+  const base::ListValue* command_list = nullptr;
+  ASSERT_TRUE(commands_json->GetAsList(&command_list));
+  PublishCommands(*command_list);
+  EXPECT_EQ((std::vector<std::string>{"4", "2", "1", "3"}), ids);
+}
+
 }  // namespace weave
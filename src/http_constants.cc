@@ -12,12 +12,16 @@ namespace http {
 
 const char kAuthorization[] = "Authorization";
 const char kContentType[] = "Content-Type";
+const char kContentEncoding[] = "Content-Encoding";
+const char kAcceptEncoding[] = "Accept-Encoding";
 
 const char kJson[] = "application/json";
 const char kJsonUtf8[] = "application/json; charset=utf-8";
 const char kPlain[] = "text/plain";
 const char kWwwFormUrlEncoded[] = "application/x-www-form-urlencoded";
 
+const char kGzip[] = "gzip";
+
 }  // namespace http
 
 using provider::HttpClient;
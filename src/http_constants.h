@@ -14,18 +14,24 @@ const int kBadRequest = 400;
 const int kDenied = 401;
 const int kForbidden = 403;
 const int kNotFound = 404;
+const int kMethodNotAllowed = 405;
+const int kTooManyRequests = 429;
 const int kInternalServerError = 500;
 const int kServiceUnavailable = 503;
 const int kNotSupported = 501;
 
 extern const char kAuthorization[];
 extern const char kContentType[];
+extern const char kContentEncoding[];
+extern const char kAcceptEncoding[];
 
 extern const char kJson[];
 extern const char kJsonUtf8[];
 extern const char kPlain[];
 extern const char kWwwFormUrlEncoded[];
 
+extern const char kGzip[];
+
 }  // namespace http
 }  // namespace weave
 
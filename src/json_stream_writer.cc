@@ -0,0 +1,167 @@
+// Copyright 2015 The Weave Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "src/json_stream_writer.h"
+
+#include <base/json/string_escape.h>
+#include <base/logging.h>
+#include <base/strings/string_number_conversions.h>
+
+namespace weave {
+
+JsonStreamWriter::JsonStreamWriter(std::string* buffer) : buffer_{buffer} {
+  CHECK(buffer_);
+}
+
+JsonStreamWriter::~JsonStreamWriter() {}
+
+void JsonStreamWriter::BeginObject() {
+  BeginScope(true, '{');
+}
+
+void JsonStreamWriter::EndObject() {
+  EndScope(true, '}');
+}
+
+void JsonStreamWriter::BeginArray() {
+  BeginScope(false, '[');
+}
+
+void JsonStreamWriter::EndArray() {
+  EndScope(false, ']');
+}
+
+void JsonStreamWriter::WriteKey(const std::string& key) {
+  CHECK(!scopes_.empty() && scopes_.back().is_object) << "Key outside object";
+  CHECK(!after_key_) << "Missing value of a key";
+  if (scopes_.back().has_members)
+    buffer_->push_back(',');
+  scopes_.back().has_members = true;
+  base::EscapeJSONString(key, true, buffer_);
+  buffer_->push_back(':');
+  after_key_ = true;
+}
+
+void JsonStreamWriter::WriteNull() {
+  BeginValue();
+  buffer_->append("null");
+}
+
+void JsonStreamWriter::WriteBool(bool value) {
+  BeginValue();
+  buffer_->append(value ? "true" : "false");
+}
+
+void JsonStreamWriter::WriteInt(int64_t value) {
+  BeginValue();
+  buffer_->append(base::Int64ToString(value));
+}
+
+void JsonStreamWriter::WriteDouble(double value) {
+  BeginValue();
+  std::string real = base::DoubleToString(value);
+  // Same as base::JSONWriter: keep a ".0" so the value is read back as a
+  // double, and a zero before the decimal point.
+  if (real.find_first_of(".eE") == std::string::npos)
+    real.append(".0");
+  if (real[0] == '.')
+    real.insert(0, 1, '0');
+  else if (real.size() > 1 && real[0] == '-' && real[1] == '.')
+    real.insert(1, 1, '0');
+  buffer_->append(real);
+}
+
+void JsonStreamWriter::WriteString(const std::string& value) {
+  BeginValue();
+  base::EscapeJSONString(value, true, buffer_);
+}
+
+bool JsonStreamWriter::WriteValue(const base::Value& value) {
+  switch (value.GetType()) {
+    case base::Value::TYPE_NULL:
+      WriteNull();
+      return true;
+    case base::Value::TYPE_BOOLEAN: {
+      bool bool_value = false;
+      CHECK(value.GetAsBoolean(&bool_value));
+      WriteBool(bool_value);
+      return true;
+    }
+    case base::Value::TYPE_INTEGER: {
+      int int_value = 0;
+      CHECK(value.GetAsInteger(&int_value));
+      WriteInt(int_value);
+      return true;
+    }
+    case base::Value::TYPE_DOUBLE: {
+      double double_value = 0;
+      CHECK(value.GetAsDouble(&double_value));
+      WriteDouble(double_value);
+      return true;
+    }
+    case base::Value::TYPE_STRING: {
+      std::string string_value;
+      CHECK(value.GetAsString(&string_value));
+      WriteString(string_value);
+      return true;
+    }
+    case base::Value::TYPE_LIST: {
+      const base::ListValue* list = nullptr;
+      CHECK(value.GetAsList(&list));
+      bool result = true;
+      BeginArray();
+      for (const base::Value* item : *list)
+        result = WriteValue(*item) && result;
+      EndArray();
+      return result;
+    }
+    case base::Value::TYPE_DICTIONARY: {
+      const base::DictionaryValue* dict = nullptr;
+      CHECK(value.GetAsDictionary(&dict));
+      bool result = true;
+      BeginObject();
+      for (base::DictionaryValue::Iterator it(*dict); !it.IsAtEnd();
+           it.Advance()) {
+        WriteKey(it.key());
+        result = WriteValue(it.value()) && result;
+      }
+      EndObject();
+      return result;
+    }
+    case base::Value::TYPE_BINARY:
+      break;
+  }
+  // Keep the document valid.
+  WriteNull();
+  return false;
+}
+
+void JsonStreamWriter::BeginValue() {
+  if (after_key_) {
+    after_key_ = false;
+    return;
+  }
+  if (scopes_.empty())
+    return;
+  CHECK(!scopes_.back().is_object) << "Object member without a key";
+  if (scopes_.back().has_members)
+    buffer_->push_back(',');
+  scopes_.back().has_members = true;
+}
+
+void JsonStreamWriter::BeginScope(bool is_object, char bracket) {
+  BeginValue();
+  buffer_->push_back(bracket);
+  scopes_.push_back(Scope{is_object, false});
+}
+
+void JsonStreamWriter::EndScope(bool is_object, char bracket) {
+  CHECK(!scopes_.empty() && scopes_.back().is_object == is_object)
+      << "Mismatched '" << bracket << "'";
+  CHECK(!after_key_) << "Missing value of a key";
+  scopes_.pop_back();
+  buffer_->push_back(bracket);
+}
+
+}  // namespace weave
@@ -0,0 +1,74 @@
+// Copyright 2015 The Weave Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef LIBWEAVE_SRC_JSON_STREAM_WRITER_H_
+#define LIBWEAVE_SRC_JSON_STREAM_WRITER_H_
+
+#include <string>
+#include <vector>
+
+#include <base/macros.h>
+#include <base/values.h>
+
+namespace weave {
+
+// Appends JSON text to a buffer as it is produced, without building a
+// base::Value tree first. The output is the same as of base::JSONWriter::Write
+// for the equivalent tree, with keys written in the order they are given.
+//
+//   std::string buffer;
+//   JsonStreamWriter writer{&buffer};
+//   writer.BeginObject();
+//   writer.WriteKey("id");
+//   writer.WriteString("1");
+//   writer.EndObject();  // buffer == R"({"id":"1"})"
+class JsonStreamWriter final {
+ public:
+  // Appends to |buffer|, which must outlive the writer.
+  explicit JsonStreamWriter(std::string* buffer);
+  ~JsonStreamWriter();
+
+  void BeginObject();
+  void EndObject();
+  void BeginArray();
+  void EndArray();
+
+  // Writes the key of the next member of the current object.
+  void WriteKey(const std::string& key);
+
+  void WriteNull();
+  void WriteBool(bool value);
+  void WriteInt(int64_t value);
+  void WriteDouble(double value);
+  void WriteString(const std::string& value);
+
+  // Writes an existing |value|. Returns false if it contains binary values,
+  // which have no JSON representation.
+  bool WriteValue(const base::Value& value);
+
+  // Returns true if all the objects and arrays are closed.
+  bool IsComplete() const { return scopes_.empty(); }
+
+ private:
+  struct Scope {
+    bool is_object;
+    bool has_members;
+  };
+
+  // Writes a separator from the previous value of the current scope, if any.
+  void BeginValue();
+  void BeginScope(bool is_object, char bracket);
+  void EndScope(bool is_object, char bracket);
+
+  std::string* buffer_{nullptr};
+  std::vector<Scope> scopes_;
+  // Set to true after a key, until its value is written.
+  bool after_key_{false};
+
+  DISALLOW_COPY_AND_ASSIGN(JsonStreamWriter);
+};
+
+}  // namespace weave
+
+#endif  // LIBWEAVE_SRC_JSON_STREAM_WRITER_H_
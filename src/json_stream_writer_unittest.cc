@@ -0,0 +1,99 @@
+// Copyright 2015 The Weave Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "src/json_stream_writer.h"
+
+#include <base/json/json_writer.h>
+#include <gtest/gtest.h>
+#include <weave/test/unittest_utils.h>
+
+namespace weave {
+
+using test::CreateDictionaryValue;
+
+TEST(JsonStreamWriter, Nesting) {
+  std::string buffer;
+  JsonStreamWriter writer{&buffer};
+  writer.BeginObject();
+  writer.WriteKey("a");
+  writer.BeginArray();
+  writer.WriteInt(1);
+  writer.BeginObject();
+  writer.EndObject();
+  writer.BeginArray();
+  writer.EndArray();
+  writer.WriteNull();
+  writer.EndArray();
+  writer.WriteKey("b");
+  writer.WriteBool(true);
+  writer.WriteKey("c");
+  writer.BeginObject();
+  writer.WriteKey("d");
+  writer.WriteBool(false);
+  writer.EndObject();
+  EXPECT_FALSE(writer.IsComplete());
+  writer.EndObject();
+  EXPECT_TRUE(writer.IsComplete());
+  EXPECT_EQ(R"({"a":[1,{},[],null],"b":true,"c":{"d":false}})", buffer);
+}
+
+TEST(JsonStreamWriter, AppendsToBuffer) {
+  std::string buffer = "x";
+  JsonStreamWriter writer{&buffer};
+  writer.WriteString("y");
+  EXPECT_EQ("x\"y\"", buffer);
+}
+
+TEST(JsonStreamWriter, Strings) {
+  std::string buffer;
+  JsonStreamWriter writer{&buffer};
+  writer.BeginObject();
+  writer.WriteKey("k\"ey");
+  writer.WriteString("a\\b\n\x01</");
+  writer.EndObject();
+  EXPECT_EQ(R"({"k\"ey":"a\\b\n\u0001\u003C/"})", buffer);
+}
+
+TEST(JsonStreamWriter, Numbers) {
+  std::string buffer;
+  JsonStreamWriter writer{&buffer};
+  writer.BeginArray();
+  writer.WriteInt(-5);
+  writer.WriteInt(10000000000);
+  writer.WriteDouble(2);
+  writer.WriteDouble(0.5);
+  writer.WriteDouble(-0.25);
+  writer.EndArray();
+  EXPECT_EQ("[-5,10000000000,2.0,0.5,-0.25]", buffer);
+}
+
+TEST(JsonStreamWriter, WriteValue) {
+  auto value = CreateDictionaryValue(R"({
+    'str': 'text\\n<tab>',
+    'int': 3,
+    'double': -1.5,
+    'list': [true, null, {'a': 1}, [], 0.1],
+    'dict': {'z': {}, 'y': 'y'}
+  })");
+  std::string expected;
+  ASSERT_TRUE(base::JSONWriter::Write(*value, &expected));
+
+  std::string buffer;
+  JsonStreamWriter writer{&buffer};
+  EXPECT_TRUE(writer.WriteValue(*value));
+  EXPECT_EQ(expected, buffer);
+}
+
+TEST(JsonStreamWriter, WriteBinaryValue) {
+  base::ListValue list;
+  list.Append(base::BinaryValue::CreateWithCopiedBuffer("a", 1));
+  list.AppendInteger(1);
+
+  std::string buffer;
+  JsonStreamWriter writer{&buffer};
+  EXPECT_FALSE(writer.WriteValue(list));
+  EXPECT_EQ("[null,1]", buffer);
+}
+
+}  // namespace weave
@@ -47,6 +47,11 @@ class MockComponentManager : public ComponentManager {
                                 std::string* id,
                                 ErrorPtr* error));
   MOCK_METHOD1(FindCommand, CommandInstance*(const std::string& id));
+  MOCK_METHOD3(RecordCommandStage,
+               void(const std::string& id,
+                    const std::string& name,
+                    CommandHistory::Stage stage));
+  MOCK_CONST_METHOD0(GetCommandHistory, const base::DictionaryValue&());
   MOCK_METHOD1(AddCommandAddedCallback,
                void(const CommandQueue::CommandCallback& callback));
   MOCK_METHOD1(AddCommandRemovedCallback,
@@ -55,6 +60,14 @@ class MockComponentManager : public ComponentManager {
                void(const std::string& component_path,
                     const std::string& command_name,
                     const Device::CommandHandlerCallback& callback));
+  MOCK_METHOD3(AddCommandBatchHandler,
+               void(const std::string& component_path,
+                    const std::string& command_name,
+                    const Device::CommandBatchHandlerCallback& callback));
+  MOCK_METHOD3(SetCommandRetention,
+               void(base::TimeDelta local_retention,
+                    base::TimeDelta cloud_retention,
+                    size_t max_finished_commands));
   MOCK_CONST_METHOD2(FindComponent,
                      const base::DictionaryValue*(const std::string& path,
                                                   ErrorPtr* error));
@@ -86,8 +99,23 @@ class MockComponentManager : public ComponentManager {
                     const std::string& name,
                     const base::Value& value,
                     ErrorPtr* error));
+  MOCK_METHOD4(GetStatePropertyHandle,
+               bool(const std::string& component_path,
+                    const std::string& name,
+                    Device::StatePropertyHandle* handle,
+                    ErrorPtr* error));
+  MOCK_METHOD3(UpdateStateProperty,
+               bool(Device::StatePropertyHandle handle,
+                    const base::Value& value,
+                    ErrorPtr* error));
+  MOCK_METHOD2(EnqueueStateUpdate,
+               bool(Device::StatePropertyHandle handle,
+                    const base::FundamentalValue& value));
+  MOCK_METHOD0(BeginStateTransaction, void());
+  MOCK_METHOD0(CommitStateTransaction, void());
   MOCK_METHOD1(AddStateChangedCallback, void(const base::Closure& callback));
   MOCK_METHOD0(MockGetAndClearRecordedStateChanges, StateSnapshot&());
+  MOCK_CONST_METHOD0(GetStateWriteStats, StateWriteStats());
   MOCK_METHOD1(NotifyStateUpdatedOnServer, void(UpdateID id));
   MOCK_CONST_METHOD0(GetLastStateChangeId, UpdateID());
   MOCK_METHOD1(MockAddServerStateUpdatedCallback,
@@ -30,6 +30,19 @@ const BackoffEntry::Policy register_backoff_policy = {0,    1000, 2.0,  0.2,
 
 const int kMaxDeviceRegistrationRetries = 100;  // ~ 8 minutes @5s retries.
 
+const char kCommandLimitsKey[] = "limits";
+const char kMaxActiveCommandsKey[] = "maxActiveCommands";
+const char kMaxActiveCommandsPerUserKey[] = "maxActiveCommandsPerUser";
+const char kActiveCommandsKey[] = "activeCommands";
+const char kActiveCommandsForUserKey[] = "activeCommandsForUser";
+
+// Returns true if the command in |state| has not finished yet.
+bool IsActive(Command::State state) {
+  return state == Command::State::kQueued ||
+         state == Command::State::kInProgress ||
+         state == Command::State::kPaused || state == Command::State::kError;
+}
+
 CommandInstance* ReturnNotFound(const std::string& command_id,
                                 ErrorPtr* error) {
   Error::AddToPrintf(error, FROM_HERE, errors::kNotFound,
@@ -176,6 +189,11 @@ class CloudDelegateImpl : public CloudDelegate {
       return callback.Run({}, std::move(error));
     }
 
+    // Checked before parsing, so rejected requests are cheap.
+    base::DictionaryValue limits;
+    if (!CheckCommandLimits(user_info, &limits, &error))
+      return callback.Run(limits, std::move(error));
+
     std::string id;
     auto command_instance = component_manager_->ParseCommandInstance(
         command, Command::Origin::kLocal, role, &id, &error);
@@ -183,7 +201,14 @@ class CloudDelegateImpl : public CloudDelegate {
       return callback.Run({}, std::move(error));
     component_manager_->AddCommand(std::move(command_instance));
     command_owners_[id] = user_info.id();
-    callback.Run(*component_manager_->FindCommand(id)->ToJson(), nullptr);
+
+    // Let the client see how much room is left, including the new command.
+    base::DictionaryValue reply;
+    reply.MergeDictionary(&component_manager_->FindCommand(id)->GetJson());
+    size_t active_for_user = 0;
+    size_t active = CountActiveCommands(user_info.id(), &active_for_user);
+    AddCommandLimits(active, active_for_user, &reply);
+    callback.Run(reply, nullptr);
   }
 
   void GetCommand(const std::string& id,
@@ -194,7 +219,7 @@ class CloudDelegateImpl : public CloudDelegate {
     auto command = GetCommandInternal(id, user_info, &error);
     if (!command)
       return callback.Run({}, std::move(error));
-    callback.Run(*command->ToJson(), nullptr);
+    callback.Run(command->GetJson(), nullptr);
   }
 
   void CancelCommand(const std::string& id,
@@ -205,28 +230,34 @@ class CloudDelegateImpl : public CloudDelegate {
     auto command = GetCommandInternal(id, user_info, &error);
     if (!command || !command->Cancel(&error))
       return callback.Run({}, std::move(error));
-    callback.Run(*command->ToJson(), nullptr);
+    callback.Run(command->GetJson(), nullptr);
   }
 
   void ListCommands(const UserInfo& user_info,
                     const CommandDoneCallback& callback) override {
     CHECK(user_info.scope() != AuthScope::kNone);
 
-    base::ListValue list_value;
+    std::unique_ptr<base::ListValue> list_value{new base::ListValue};
 
+    // The reply owns its values, while the cached JSON of a command belongs
+    // to the command and changes with it, so each one has to be copied.
     for (const auto& it : command_owners_) {
       if (CanAccessCommand(it.second, user_info, nullptr)) {
-        list_value.Append(
-            component_manager_->FindCommand(it.first)->ToJson().release());
+        list_value->Append(
+            component_manager_->FindCommand(it.first)->GetJson().DeepCopy());
       }
     }
 
     base::DictionaryValue commands_json;
-    commands_json.Set("commands", list_value.DeepCopy());
+    commands_json.Set("commands", list_value.release());
 
     callback.Run(commands_json, nullptr);
   }
 
+  const base::DictionaryValue& GetCommandHistory() const override {
+    return component_manager_->GetCommandHistory();
+  }
+
  private:
   void OnCommandAdded(Command* command) {
     // Set to "" for any new unknown command.
@@ -309,6 +340,67 @@ class CloudDelegateImpl : public CloudDelegate {
     return command;
   }
 
+  // Returns the number of unfinished commands, and in |active_for_user| the
+  // number of such commands of |user|.
+  size_t CountActiveCommands(const UserAppId& user,
+                             size_t* active_for_user) const {
+    size_t active = 0;
+    *active_for_user = 0;
+    for (const auto& it : command_owners_) {
+      const Command* command = component_manager_->FindCommand(it.first);
+      if (!command || !IsActive(command->GetState()))
+        continue;
+      active++;
+      if (it.second == user)
+        (*active_for_user)++;
+    }
+    return active;
+  }
+
+  // Adds the "limits" dictionary to |reply|, with the limits on the number of
+  // unfinished commands and the given current numbers of such commands.
+  void AddCommandLimits(size_t active,
+                        size_t active_for_user,
+                        base::DictionaryValue* reply) const {
+    const Settings& settings = device_->GetSettings();
+    std::unique_ptr<base::DictionaryValue> limits{new base::DictionaryValue};
+    limits->SetInteger(kMaxActiveCommandsKey, settings.max_active_commands);
+    limits->SetInteger(kMaxActiveCommandsPerUserKey,
+                       settings.max_active_commands_per_user);
+    limits->SetInteger(kActiveCommandsKey, active);
+    limits->SetInteger(kActiveCommandsForUserKey, active_for_user);
+    reply->Set(kCommandLimitsKey, limits.release());
+  }
+
+  // Returns false if a new command of the user would exceed the limits on the
+  // number of unfinished commands. Adds the limits and the current number of
+  // such commands to |limits| as for AddCommandLimits().
+  bool CheckCommandLimits(const UserInfo& user_info,
+                          base::DictionaryValue* limits,
+                          ErrorPtr* error) const {
+    const Settings& settings = device_->GetSettings();
+    size_t active_for_user = 0;
+    size_t active = CountActiveCommands(user_info.id(), &active_for_user);
+    AddCommandLimits(active, active_for_user, limits);
+
+    if (settings.max_active_commands > 0 &&
+        active >= settings.max_active_commands) {
+      return Error::AddToPrintf(
+          error, FROM_HERE, errors::kTooManyCommands,
+          "Too many commands in progress (%zu); retry after some finish",
+          active);
+    }
+    if (settings.max_active_commands_per_user > 0 &&
+        active_for_user >= settings.max_active_commands_per_user) {
+      return Error::AddToPrintf(
+          error, FROM_HERE, errors::kTooManyCommands,
+          "Too many commands of the user in progress (%zu); retry after some "
+          "finish",
+          active_for_user);
+    }
+    return true;
+  }
+
   bool CanAccessCommand(const UserAppId& owner,
                         const UserInfo& user_info,
                         ErrorPtr* error) const {
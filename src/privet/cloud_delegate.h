@@ -111,7 +111,10 @@ class CloudDelegate {
   // Returns dictionary with trait definitions.
   virtual const base::DictionaryValue& GetTraits() const = 0;
 
-  // Adds command created from the given JSON representation.
+  // Adds command created from the given JSON representation. The reply holds
+  // the command and, under "limits", the limits on the number of active
+  // commands. If the command would exceed them, fails with
+  // errors::kTooManyCommands, passing just the "limits" to |callback|.
   virtual void AddCommand(const base::DictionaryValue& command,
                           const UserInfo& user_info,
                           const CommandDoneCallback& callback) = 0;
@@ -130,6 +133,9 @@ class CloudDelegate {
   virtual void ListCommands(const UserInfo& user_info,
                             const CommandDoneCallback& callback) = 0;
 
+  // Returns the lifecycle history of recent commands.
+  virtual const base::DictionaryValue& GetCommandHistory() const = 0;
+
   void AddObserver(Observer* observer) { observer_list_.AddObserver(observer); }
   void RemoveObserver(Observer* observer) {
     observer_list_.RemoveObserver(observer);
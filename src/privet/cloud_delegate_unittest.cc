@@ -0,0 +1,182 @@
+// Copyright 2015 The Weave Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "src/privet/cloud_delegate.h"
+
+#include <gmock/gmock.h>
+#include <gtest/gtest.h>
+#include <weave/provider/test/fake_task_runner.h>
+#include <weave/provider/test/mock_config_store.h>
+#include <weave/provider/test/mock_http_client.h>
+#include <weave/test/unittest_utils.h>
+
+#include "src/bind_lambda.h"
+#include "src/component_manager_impl.h"
+#include "src/config.h"
+#include "src/device_registration_info.h"
+#include "src/privet/constants.h"
+
+using testing::_;
+using testing::Invoke;
+using testing::StrictMock;
+
+namespace weave {
+namespace privet {
+
+using test::CreateDictionaryValue;
+
+class CloudDelegateTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    EXPECT_CALL(config_store_, LoadDefaults(_))
+        .WillOnce(Invoke([](Settings* settings) {
+          settings->oem_name = "TEST_OEM";
+          settings->model_name = "TEST_MODEL";
+          settings->model_id = "ABCDE";
+          settings->name = "TEST_NAME";
+          settings->client_id = "TEST_CLIENT_ID";
+          settings->client_secret = "TEST_CLIENT_SECRET";
+          settings->api_key = "TEST_API_KEY";
+          settings->max_active_commands = 3;
+          settings->max_active_commands_per_user = 2;
+          return true;
+        }));
+    config_.reset(new Config{&config_store_});
+    dev_reg_.reset(new DeviceRegistrationInfo{config_.get(),
+                                              &component_manager_,
+                                              &task_runner_, &http_client_,
+                                              nullptr, nullptr});
+
+    auto json_traits = CreateDictionaryValue(R"({
+      'robot': {
+        'commands': {
+          '_jump': {
+            'minimalRole': 'user'
+          }
+        }
+      }
+    })");
+    EXPECT_TRUE(component_manager_.LoadTraits(*json_traits, nullptr));
+    EXPECT_TRUE(
+        component_manager_.AddComponent("", "comp", {"robot"}, nullptr));
+
+    cloud_ = CloudDelegate::CreateDefault(&task_runner_, dev_reg_.get(),
+                                          &component_manager_);
+  }
+
+  // Adds a command of |user| and returns the ID, or an empty string on error.
+  // The reply is stored in |reply_| and the error in |error_|.
+  std::string AddCommand(const UserInfo& user) {
+    auto command = CreateDictionaryValue(
+        "{'name': 'robot._jump', 'component': 'comp'}");
+    reply_.Clear();
+    error_.reset();
+    auto callback = [this](const base::DictionaryValue& reply,
+                           ErrorPtr error) {
+      reply_.MergeDictionary(&reply);
+      error_ = std::move(error);
+    };
+    cloud_->AddCommand(*command, user, base::Bind(callback));
+    std::string id;
+    if (!error_) {
+      EXPECT_TRUE(reply_.GetString("id", &id));
+    }
+    return id;
+  }
+
+  // Returns the |key| field of the "limits" in the reply.
+  int GetReplyLimit(const std::string& key) const {
+    const base::DictionaryValue* limits = nullptr;
+    EXPECT_TRUE(reply_.GetDictionary("limits", &limits));
+    int value = -1;
+    if (limits) {
+      EXPECT_TRUE(limits->GetInteger(key, &value));
+    }
+    return value;
+  }
+
+  const UserInfo user1_{AuthScope::kUser, {AuthType::kLocal, {1}, {}}};
+  const UserInfo user2_{AuthScope::kUser, {AuthType::kLocal, {2}, {}}};
+  const UserInfo user3_{AuthScope::kUser, {AuthType::kLocal, {3}, {}}};
+
+  provider::test::FakeTaskRunner task_runner_;
+  provider::test::MockConfigStore config_store_;
+  StrictMock<provider::test::MockHttpClient> http_client_;
+  std::unique_ptr<Config> config_;
+  ComponentManagerImpl component_manager_{&task_runner_};
+  std::unique_ptr<DeviceRegistrationInfo> dev_reg_;
+  std::unique_ptr<CloudDelegate> cloud_;
+  base::DictionaryValue reply_;
+  ErrorPtr error_;
+};
+
+TEST_F(CloudDelegateTest, AddCommandReturnsLimits) {
+  EXPECT_FALSE(AddCommand(user1_).empty());
+  std::string name;
+  EXPECT_TRUE(reply_.GetString("name", &name));
+  EXPECT_EQ("robot._jump", name);
+  EXPECT_EQ(3, GetReplyLimit("maxActiveCommands"));
+  EXPECT_EQ(2, GetReplyLimit("maxActiveCommandsPerUser"));
+  EXPECT_EQ(1, GetReplyLimit("activeCommands"));
+  EXPECT_EQ(1, GetReplyLimit("activeCommandsForUser"));
+  // The limits don't mix with the fields of the command.
+  EXPECT_FALSE(reply_.HasKey("maxActiveCommands"));
+
+  EXPECT_FALSE(AddCommand(user2_).empty());
+  EXPECT_EQ(2, GetReplyLimit("activeCommands"));
+  EXPECT_EQ(1, GetReplyLimit("activeCommandsForUser"));
+}
+
+TEST_F(CloudDelegateTest, MaxActiveCommandsPerUser) {
+  EXPECT_FALSE(AddCommand(user1_).empty());
+  EXPECT_FALSE(AddCommand(user1_).empty());
+  EXPECT_EQ(2, GetReplyLimit("activeCommandsForUser"));
+
+  EXPECT_TRUE(AddCommand(user1_).empty());
+  ASSERT_TRUE(error_);
+  EXPECT_TRUE(error_->HasError(errors::kTooManyCommands));
+  EXPECT_EQ(2, GetReplyLimit("maxActiveCommandsPerUser"));
+  EXPECT_EQ(2, GetReplyLimit("activeCommands"));
+  EXPECT_EQ(2, GetReplyLimit("activeCommandsForUser"));
+
+  // Another user still has room.
+  EXPECT_FALSE(AddCommand(user2_).empty());
+}
+
+TEST_F(CloudDelegateTest, MaxActiveCommands) {
+  EXPECT_FALSE(AddCommand(user1_).empty());
+  EXPECT_FALSE(AddCommand(user1_).empty());
+  EXPECT_FALSE(AddCommand(user2_).empty());
+  EXPECT_EQ(3, GetReplyLimit("activeCommands"));
+
+  EXPECT_TRUE(AddCommand(user3_).empty());
+  ASSERT_TRUE(error_);
+  EXPECT_TRUE(error_->HasError(errors::kTooManyCommands));
+  EXPECT_EQ(3, GetReplyLimit("maxActiveCommands"));
+  EXPECT_EQ(3, GetReplyLimit("activeCommands"));
+  EXPECT_EQ(0, GetReplyLimit("activeCommandsForUser"));
+}
+
+TEST_F(CloudDelegateTest, FinishedCommandsNotCounted) {
+  std::string id1 = AddCommand(user1_);
+  std::string id2 = AddCommand(user1_);
+  EXPECT_FALSE(AddCommand(user2_).empty());
+  EXPECT_TRUE(AddCommand(user1_).empty());
+
+  Command* command = component_manager_.FindCommand(id1);
+  ASSERT_NE(nullptr, command);
+  EXPECT_TRUE(command->Complete({}, nullptr));
+  command = component_manager_.FindCommand(id2);
+  ASSERT_NE(nullptr, command);
+  EXPECT_TRUE(command->Cancel(nullptr));
+
+  EXPECT_FALSE(AddCommand(user1_).empty());
+  EXPECT_EQ(2, GetReplyLimit("activeCommands"));
+  EXPECT_EQ(1, GetReplyLimit("activeCommandsForUser"));
+  EXPECT_FALSE(AddCommand(user3_).empty());
+  EXPECT_EQ(3, GetReplyLimit("activeCommands"));
+}
+
+}  // namespace privet
+}  // namespace weave
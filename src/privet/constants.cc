@@ -29,6 +29,7 @@ const char kInvalidPassphrase[] = "invalidPassphrase";
 const char kNotFound[] = "notFound";
 const char kNotImplemented[] = "notImplemented";
 const char kAlreadyClaimed[] = "alreadyClaimed";
+const char kTooManyCommands[] = "tooManyCommands";
 
 }  // namespace errors
 }  // namespace privet
@@ -31,6 +31,7 @@ extern const char kInvalidPassphrase[];
 extern const char kNotFound[];
 extern const char kNotImplemented[];
 extern const char kAlreadyClaimed[];
+extern const char kTooManyCommands[];
 }  // namespace errors
 }  // namespace privet
 }  // namespace weave
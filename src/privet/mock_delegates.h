@@ -205,6 +205,7 @@ class MockCloudDelegate : public CloudDelegate {
                     const UserInfo&,
                     const CommandDoneCallback&));
   MOCK_METHOD2(ListCommands, void(const UserInfo&, const CommandDoneCallback&));
+  MOCK_CONST_METHOD0(GetCommandHistory, const base::DictionaryValue&());
 
   MockCloudDelegate() {
     EXPECT_CALL(*this, GetDeviceId()).WillRepeatedly(Return("TestId"));
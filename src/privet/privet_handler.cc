@@ -147,6 +147,7 @@ struct {
     {errors::kNotFound, http::kNotFound},
     {errors::kNotImplemented, http::kNotSupported},
     {errors::kAlreadyClaimed, http::kDenied},
+    {errors::kTooManyCommands, http::kTooManyRequests},
 };
 
 std::string GetAuthTokenFromAuthHeader(const std::string& auth_header) {
@@ -181,8 +182,10 @@ void SetStateProperties(const T& state, base::DictionaryValue* parent) {
   parent->Set(kErrorKey, ErrorToJson(*state.error()).release());
 }
 
+// |details| are optionally added to the response next to the error.
 void ReturnError(const Error& error,
-                 const PrivetHandler::RequestCallback& callback) {
+                 const PrivetHandler::RequestCallback& callback,
+                 const base::DictionaryValue* details = nullptr) {
   int code = http::kInternalServerError;
   for (const auto& it : kReasonToCode) {
     if (error.HasError(it.reason)) {
@@ -190,7 +193,8 @@ void ReturnError(const Error& error,
       break;
     }
   }
-  std::unique_ptr<base::DictionaryValue> output{new base::DictionaryValue};
+  std::unique_ptr<base::DictionaryValue> output{
+      details ? details->DeepCopy() : new base::DictionaryValue};
   output->Set(kErrorKey, ErrorToJson(error).release());
   callback.Run(code, *output);
 }
@@ -209,6 +213,10 @@ void OnCommandRequestSucceeded(const PrivetHandler::RequestCallback& callback,
     Error::AddTo(&error, FROM_HERE, errors::kAccessDenied, error->GetMessage());
     return ReturnError(*error, callback);
   }
+  if (error->HasError(errors::kTooManyCommands)) {
+    // |output| describes the exceeded command limits.
+    return ReturnError(*error, callback, &output);
+  }
   return ReturnError(*error, callback);
 }
 
@@ -412,6 +420,8 @@ PrivetHandler::PrivetHandler(CloudDelegate* cloud,
                    &PrivetHandler::HandleCommandsCancel, AuthScope::kViewer);
   AddSecureHandler("/privet/v3/commands/list",
                    &PrivetHandler::HandleCommandsList, AuthScope::kViewer);
+  AddSecureHandler("/privet/v3/commands/history",
+                   &PrivetHandler::HandleCommandsHistory, AuthScope::kOwner);
   AddSecureHandler("/privet/v3/checkForUpdates",
                    &PrivetHandler::HandleCheckForUpdates, AuthScope::kViewer);
   AddSecureHandler("/privet/v3/traits", &PrivetHandler::HandleTraits,
@@ -950,6 +960,12 @@ void PrivetHandler::HandleCommandsCancel(const base::DictionaryValue& input,
                         base::Bind(&OnCommandRequestSucceeded, callback));
 }
 
+void PrivetHandler::HandleCommandsHistory(const base::DictionaryValue& input,
+                                          const UserInfo& user_info,
+                                          const RequestCallback& callback) {
+  callback.Run(http::kOk, cloud_->GetCommandHistory());
+}
+
 void PrivetHandler::HandleCheckForUpdates(const base::DictionaryValue& input,
                                           const UserInfo& user_info,
                                           const RequestCallback& callback) {
@@ -881,6 +881,26 @@ TEST_F(PrivetHandlerTestWithAuth, CommandsExecute) {
                  HandleRequest("/privet/v3/commands/execute", kInput));
 }
 
+TEST_F(PrivetHandlerTestWithAuth, CommandsExecuteTooManyCommands) {
+  EXPECT_CALL(cloud_, AddCommand(_, _, _))
+      .WillOnce(WithArgs<2>(
+          Invoke([](const CloudDelegate::CommandDoneCallback& callback) {
+            ErrorPtr error;
+            Error::AddTo(&error, FROM_HERE, "tooManyCommands", "");
+            base::DictionaryValue reply;
+            reply.SetInteger("limits.maxActiveCommands", 2);
+            callback.Run(reply, std::move(error));
+          })));
+
+  const char kInput[] = "{'name': 'test'}";
+  EXPECT_PRED2(IsEqualError, CodeWithReason(429, "tooManyCommands"),
+               HandleRequest("/privet/v3/commands/execute", kInput));
+  int max_active_commands = 0;
+  EXPECT_TRUE(GetResponse().GetInteger("limits.maxActiveCommands",
+                                       &max_active_commands));
+  EXPECT_EQ(2, max_active_commands);
+}
+
 TEST_F(PrivetHandlerTestWithAuth, CommandsStatus) {
   const char kInput[] = "{'id': '5'}";
   base::DictionaryValue command;
@@ -951,6 +971,18 @@ TEST_F(PrivetHandlerTestWithAuth, CommandsList) {
   EXPECT_JSON_EQ(kExpected, HandleRequest("/privet/v3/commands/list", "{}"));
 }
 
+TEST_F(PrivetHandlerTestWithAuth, CommandsHistory) {
+  const char kHistory[] = R"({
+    'commands': [{'id': '5', 'name': 'robot.jump', 'timeMs': 1.0,
+                  'events': [{'stage': 'queued', 'elapsedMs': 0}]}],
+    'latency': {'bucketLimitsMs': [1], 'histograms': {}}
+  })";
+  auto history = test::CreateDictionaryValue(kHistory);
+  EXPECT_CALL(cloud_, GetCommandHistory()).WillOnce(ReturnRef(*history));
+
+  EXPECT_JSON_EQ(kHistory, HandleRequest("/privet/v3/commands/history", "{}"));
+}
+
 class PrivetHandlerCheckForUpdatesTest : public PrivetHandlerTestWithAuth {};
 
 TEST_F(PrivetHandlerCheckForUpdatesTest, NoInput) {
@@ -4,50 +4,220 @@
 
 #include "src/states/state_change_queue.h"
 
+#include <cmath>
+
 #include <base/logging.h>
 
 namespace weave {
 
 StateChangeQueue::StateChangeQueue(size_t max_queue_size)
-    : max_queue_size_(max_queue_size) {
+    : max_queue_size_(max_queue_size), records_(max_queue_size + 1) {
   CHECK_GT(max_queue_size_, 0U) << "Max queue size must not be zero";
 }
 
 bool StateChangeQueue::NotifyPropertiesUpdated(
     base::Time timestamp,
     const base::DictionaryValue& changed_properties) {
-  auto& stored_changes = state_changes_[timestamp];
   // Merge the old property set.
-  if (stored_changes)
-    stored_changes->MergeDictionary(&changed_properties);
-  else
-    stored_changes.reset(changed_properties.DeepCopy());
+  GetRecord(timestamp)->MergeDictionary(&changed_properties);
+  Shrink();
+  return true;
+}
+
+bool StateChangeQueue::NotifyPropertyUpdated(base::Time timestamp,
+                                             const std::string& trait,
+                                             const std::string& name,
+                                             const base::Value& value) {
+  base::DictionaryValue* stored_changes = GetRecord(timestamp);
+  base::DictionaryValue* trait_changes = nullptr;
+  if (!stored_changes->GetDictionaryWithoutPathExpansion(trait,
+                                                         &trait_changes)) {
+    trait_changes = new base::DictionaryValue;
+    stored_changes->SetWithoutPathExpansion(trait, trait_changes);
+  }
+  trait_changes->SetWithoutPathExpansion(name, value.DeepCopy());
+  Shrink();
+  return true;
+}
+
+bool StateChangeQueue::NotifyPropertyUpdated(base::Time timestamp,
+                                             const std::string& trait,
+                                             const std::string& name,
+                                             const base::Value& value,
+                                             const StateChangePolicy& policy) {
+  PropertyHistory& history = history_[std::make_pair(trait, name)];
+  history.policy = policy;
+  if (history.last_value_is_number && policy.deadband > 0) {
+    double new_value = 0;
+    if (value.GetAsDouble(&new_value) &&
+        std::abs(new_value - history.last_number) < policy.deadband) {
+      // The property is back within the deadband of the recorded value, so a
+      // postponed change would no longer reflect the device state.
+      history.postponed_value.reset();
+      return false;
+    }
+  }
+
+  if (history.has_last_value && policy.min_interval > base::TimeDelta() &&
+      timestamp - history.last_recorded < policy.min_interval) {
+    base::DictionaryValue* trait_changes = FindRecordedTrait(trait, name);
+    if (trait_changes) {
+      trait_changes->SetWithoutPathExpansion(name, value.DeepCopy());
+      SetLastValue(value, &history);
+      return true;
+    }
+    history.postponed_value.reset(value.DeepCopy());
+    history.postponed_until = history.last_recorded + policy.min_interval;
+    return false;
+  }
+
+  RecordProperty(timestamp, trait, name, value, &history);
+  return true;
+}
+
+bool StateChangeQueue::FlushPostponedChanges(base::Time timestamp) {
+  bool recorded = false;
+  for (auto& pair : history_) {
+    PropertyHistory& history = pair.second;
+    if (!history.postponed_value || history.postponed_until > timestamp)
+      continue;
+    std::unique_ptr<base::Value> value = std::move(history.postponed_value);
+    RecordProperty(timestamp, pair.first.first, pair.first.second, *value,
+                   &history);
+    recorded = true;
+  }
+  return recorded;
+}
+
+base::Time StateChangeQueue::GetNextFlushTime() const {
+  base::Time next;
+  for (const auto& pair : history_) {
+    const PropertyHistory& history = pair.second;
+    if (history.postponed_value &&
+        (next.is_null() || history.postponed_until < next)) {
+      next = history.postponed_until;
+    }
+  }
+  return next;
+}
+
+std::vector<StateChange> StateChangeQueue::GetAndClearRecordedStateChanges() {
+  std::vector<StateChange> changes;
+  changes.reserve(size_);
+  while (!IsEmpty())
+    changes.push_back(PopOldest());
+  return changes;
+}
 
-  while (state_changes_.size() > max_queue_size_) {
+base::Time StateChangeQueue::GetOldestTimestamp() const {
+  CHECK(!IsEmpty());
+  return At(0).timestamp;
+}
+
+StateChange StateChangeQueue::PopOldest() {
+  CHECK(!IsEmpty());
+  Record& record = At(0);
+  StateChange change{record.timestamp, std::move(record.changed_properties)};
+  begin_ = (begin_ + 1) % records_.size();
+  size_--;
+  return change;
+}
+
+base::DictionaryValue* StateChangeQueue::GetRecord(base::Time timestamp) {
+  // Events are normally recorded in chronological order, so look for the
+  // position of |timestamp| starting from the newest record.
+  size_t pos = size_;
+  while (pos > 0 && At(pos - 1).timestamp > timestamp)
+    pos--;
+  if (pos > 0 && At(pos - 1).timestamp == timestamp)
+    return At(pos - 1).changed_properties.get();
+
+  // Shrink() keeps at least one slot free.
+  CHECK_LT(size_, records_.size());
+  size_++;
+  for (size_t i = size_ - 1; i > pos; i--)
+    std::swap(At(i), At(i - 1));
+  Record& record = At(pos);
+  record.timestamp = timestamp;
+  // Free slots keep the empty dictionaries of dropped records for reuse.
+  if (!record.changed_properties)
+    record.changed_properties.reset(new base::DictionaryValue);
+  return record.changed_properties.get();
+}
+
+void StateChangeQueue::RecordProperty(base::Time timestamp,
+                                      const std::string& trait,
+                                      const std::string& name,
+                                      const base::Value& value,
+                                      PropertyHistory* history) {
+  if (history->policy.last_value_only)
+    RemoveRecordedProperty(trait, name);
+  NotifyPropertyUpdated(timestamp, trait, name, value);
+  history->last_recorded = timestamp;
+  SetLastValue(value, history);
+  history->postponed_value.reset();
+}
+
+// static
+void StateChangeQueue::SetLastValue(const base::Value& value,
+                                    PropertyHistory* history) {
+  history->has_last_value = true;
+  history->last_value_is_number = value.GetAsDouble(&history->last_number);
+}
+
+base::DictionaryValue* StateChangeQueue::FindRecordedTrait(
+    const std::string& trait,
+    const std::string& name) {
+  for (size_t i = size_; i > 0; i--) {
+    base::DictionaryValue* trait_changes = nullptr;
+    if (At(i - 1).changed_properties->GetDictionaryWithoutPathExpansion(
+            trait, &trait_changes) &&
+        trait_changes->HasKey(name)) {
+      return trait_changes;
+    }
+  }
+  return nullptr;
+}
+
+void StateChangeQueue::RemoveRecordedProperty(const std::string& trait,
+                                              const std::string& name) {
+  size_t kept = 0;
+  for (size_t i = 0; i < size_; i++) {
+    base::DictionaryValue* changes = At(i).changed_properties.get();
+    base::DictionaryValue* trait_changes = nullptr;
+    if (changes->GetDictionaryWithoutPathExpansion(trait, &trait_changes)) {
+      trait_changes->RemoveWithoutPathExpansion(name, nullptr);
+      if (trait_changes->empty())
+        changes->RemoveWithoutPathExpansion(trait, nullptr);
+    }
+    if (changes->empty())
+      continue;
+    if (kept != i)
+      std::swap(At(kept), At(i));
+    kept++;
+  }
+  // The records left behind are empty and stay in their slots for reuse.
+  size_ = kept;
+}
+
+void StateChangeQueue::Shrink() {
+  while (size_ > max_queue_size_) {
     // Queue is full.
     // Merge the two oldest records into one. The merge strategy is:
     //  - Move non-existent properties from element [old] to [new].
     //  - If both [old] and [new] specify the same property,
     //    keep the value of [new].
     //  - Keep the timestamp of [new].
-    auto element_old = state_changes_.begin();
-    auto element_new = std::next(element_old);
+    Record& element_old = At(0);
+    Record& element_new = At(1);
     // This will skip elements that exist in both [old] and [new].
-    element_old->second->MergeDictionary(element_new->second.get());
-    std::swap(element_old->second, element_new->second);
-    state_changes_.erase(element_old);
-  }
-  return true;
-}
-
-std::vector<StateChange> StateChangeQueue::GetAndClearRecordedStateChanges() {
-  std::vector<StateChange> changes;
-  changes.reserve(state_changes_.size());
-  for (auto& pair : state_changes_) {
-    changes.push_back(StateChange{pair.first, std::move(pair.second)});
+    element_old.changed_properties->MergeDictionary(
+        element_new.changed_properties.get());
+    std::swap(element_old.changed_properties, element_new.changed_properties);
+    element_old.changed_properties->Clear();
+    begin_ = (begin_ + 1) % records_.size();
+    size_--;
   }
-  state_changes_.clear();
-  return changes;
 }
 
 }  // namespace weave
@@ -7,6 +7,7 @@
 
 #include <map>
 #include <memory>
+#include <string>
 #include <vector>
 
 #include <base/macros.h>
@@ -27,6 +28,20 @@ struct StateChange {
   std::unique_ptr<base::DictionaryValue> changed_properties;
 };
 
+// Coalescing policy applied when recording changes of a state property.
+struct StateChangePolicy {
+  // A change recorded sooner than |min_interval| after the previous recorded
+  // change of the property overwrites the value still waiting in the queue. If
+  // that value has already been collected, the change is postponed until the
+  // interval elapses.
+  base::TimeDelta min_interval;
+  // Numeric changes smaller than |deadband| relative to the last recorded
+  // value are not recorded.
+  double deadband{0};
+  // Only the latest value of the property is kept in the queue.
+  bool last_value_only{false};
+};
+
 // An object to record and retrieve device state change notification events.
 class StateChangeQueue {
  public:
@@ -34,15 +49,101 @@ class StateChangeQueue {
 
   bool NotifyPropertiesUpdated(base::Time timestamp,
                                const base::DictionaryValue& changed_properties);
+  // Same as NotifyPropertiesUpdated() for a single property |name| of |trait|,
+  // without the need to build a dictionary of changed properties first.
+  bool NotifyPropertyUpdated(base::Time timestamp,
+                             const std::string& trait,
+                             const std::string& name,
+                             const base::Value& value);
+  // Same as above, but the change is subject to |policy|. Returns false if the
+  // change was dropped or postponed by the policy.
+  bool NotifyPropertyUpdated(base::Time timestamp,
+                             const std::string& trait,
+                             const std::string& name,
+                             const base::Value& value,
+                             const StateChangePolicy& policy);
+  // Records changes postponed by StateChangePolicy::min_interval which are due
+  // at |timestamp|. Returns true if any change has been recorded.
+  bool FlushPostponedChanges(base::Time timestamp);
+  // Returns the time the earliest postponed change is due, or a null time if
+  // there are no postponed changes.
+  base::Time GetNextFlushTime() const;
   std::vector<StateChange> GetAndClearRecordedStateChanges();
 
+  // Returns the number of recorded state change events.
+  size_t GetSize() const { return size_; }
+  bool IsEmpty() const { return size_ == 0; }
+  // Returns the timestamp of the oldest recorded event. The queue must not be
+  // empty.
+  base::Time GetOldestTimestamp() const;
+  // Removes the oldest recorded event from the queue and returns it. The queue
+  // must not be empty.
+  StateChange PopOldest();
+
  private:
+  struct Record {
+    base::Time timestamp;
+    std::unique_ptr<base::DictionaryValue> changed_properties;
+  };
+
+  // Returns the |index|-th oldest record.
+  Record& At(size_t index) {
+    return records_[(begin_ + index) % records_.size()];
+  }
+  const Record& At(size_t index) const {
+    return records_[(begin_ + index) % records_.size()];
+  }
+  // Recording history of a property with a StateChangePolicy.
+  struct PropertyHistory {
+    StateChangePolicy policy;
+    base::Time last_recorded;
+    // Set to true once a value has been recorded. Only a numeric value is
+    // kept, for StateChangePolicy::deadband, to avoid copying every value.
+    bool has_last_value{false};
+    bool last_value_is_number{false};
+    double last_number{0};
+    // Change postponed by |policy.min_interval| and the time it is due.
+    std::unique_ptr<base::Value> postponed_value;
+    base::Time postponed_until;
+  };
+
+  // Remembers |value| as the last recorded value in |history|.
+  static void SetLastValue(const base::Value& value, PropertyHistory* history);
+  // Returns properties recorded at |timestamp|, adding a new empty record if
+  // there is none yet.
+  base::DictionaryValue* GetRecord(base::Time timestamp);
+  // Records |value| of property |name| of |trait| and updates its |history|.
+  void RecordProperty(base::Time timestamp,
+                      const std::string& trait,
+                      const std::string& name,
+                      const base::Value& value,
+                      PropertyHistory* history);
+  // Returns the changes of |trait| in the newest record containing property
+  // |name|, or nullptr if no record contains it.
+  base::DictionaryValue* FindRecordedTrait(const std::string& trait,
+                                           const std::string& name);
+  // Removes property |name| of |trait| from all the records, dropping records
+  // left empty.
+  void RemoveRecordedProperty(const std::string& trait,
+                              const std::string& name);
+  // Merges the oldest records until the queue fits |max_queue_size_|.
+  void Shrink();
+
   // Maximum queue size. If it is full, the oldest state update records are
   // merged together until the queue size is within the size limit.
   const size_t max_queue_size_;
 
-  // Accumulated list of device state change notifications.
-  std::map<base::Time, std::unique_ptr<base::DictionaryValue>> state_changes_;
+  // Accumulated list of device state change notifications, sorted by
+  // timestamp. This is a ring buffer preallocated with one slot more than
+  // |max_queue_size_|, so recording and draining events does not allocate
+  // queue storage.
+  std::vector<Record> records_;
+  size_t begin_{0};
+  size_t size_{0};
+
+  // History of properties recorded with a StateChangePolicy, keyed by trait
+  // and property name.
+  std::map<std::pair<std::string, std::string>, PropertyHistory> history_;
 
   DISALLOW_COPY_AND_ASSIGN(StateChangeQueue);
 };
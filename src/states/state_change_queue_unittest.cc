@@ -4,6 +4,7 @@
 
 #include "src/states/state_change_queue.h"
 
+#include <base/strings/stringprintf.h>
 #include <gtest/gtest.h>
 #include <weave/test/unittest_utils.h>
 
@@ -85,6 +86,25 @@ TEST_F(StateChangeQueueTest, GroupByTimestamp) {
   EXPECT_JSON_EQ(expected2, *changes[1].changed_properties);
 }
 
+TEST_F(StateChangeQueueTest, UpdateSingleProperty) {
+  base::Time timestamp = base::Time::Now();
+  ASSERT_TRUE(queue_->NotifyPropertiesUpdated(
+      timestamp, *CreateDictionaryValue("{'prop': {'name1': 1}}")));
+  ASSERT_TRUE(queue_->NotifyPropertyUpdated(timestamp, "prop", "name2",
+                                            base::FundamentalValue{2}));
+  ASSERT_TRUE(queue_->NotifyPropertyUpdated(timestamp, "prop", "name1",
+                                            base::FundamentalValue{3}));
+  ASSERT_TRUE(queue_->NotifyPropertyUpdated(
+      timestamp + base::TimeDelta::FromMinutes(1), "other", "name",
+      base::StringValue{"foo"}));
+
+  auto changes = queue_->GetAndClearRecordedStateChanges();
+  ASSERT_EQ(2u, changes.size());
+  EXPECT_JSON_EQ("{'prop': {'name1': 3, 'name2': 2}}",
+                 *changes[0].changed_properties);
+  EXPECT_JSON_EQ("{'other': {'name': 'foo'}}", *changes[1].changed_properties);
+}
+
 TEST_F(StateChangeQueueTest, MaxQueueSize) {
   queue_.reset(new StateChangeQueue(2));
   base::Time start_time = base::Time::Now();
@@ -116,4 +136,165 @@ TEST_F(StateChangeQueueTest, MaxQueueSize) {
   EXPECT_JSON_EQ(expected2, *changes[1].changed_properties);
 }
 
+TEST_F(StateChangeQueueTest, OutOfOrderUpdates) {
+  base::Time timestamp = base::Time::Now();
+  base::TimeDelta time_delta = base::TimeDelta::FromMinutes(1);
+
+  ASSERT_TRUE(queue_->NotifyPropertiesUpdated(
+      timestamp + time_delta * 2,
+      *CreateDictionaryValue("{'prop': {'a': 3}}")));
+  ASSERT_TRUE(queue_->NotifyPropertiesUpdated(
+      timestamp, *CreateDictionaryValue("{'prop': {'a': 1}}")));
+  ASSERT_TRUE(queue_->NotifyPropertiesUpdated(
+      timestamp + time_delta, *CreateDictionaryValue("{'prop': {'a': 2}}")));
+  ASSERT_TRUE(queue_->NotifyPropertiesUpdated(
+      timestamp, *CreateDictionaryValue("{'prop': {'b': 1}}")));
+
+  auto changes = queue_->GetAndClearRecordedStateChanges();
+  ASSERT_EQ(3u, changes.size());
+  EXPECT_EQ(timestamp, changes[0].timestamp);
+  EXPECT_JSON_EQ("{'prop': {'a': 1, 'b': 1}}", *changes[0].changed_properties);
+  EXPECT_EQ(timestamp + time_delta, changes[1].timestamp);
+  EXPECT_JSON_EQ("{'prop': {'a': 2}}", *changes[1].changed_properties);
+  EXPECT_EQ(timestamp + time_delta * 2, changes[2].timestamp);
+  EXPECT_JSON_EQ("{'prop': {'a': 3}}", *changes[2].changed_properties);
+}
+
+TEST_F(StateChangeQueueTest, ReuseAfterDrain) {
+  queue_.reset(new StateChangeQueue(3));
+  base::Time timestamp = base::Time::Now();
+  base::TimeDelta time_delta = base::TimeDelta::FromSeconds(1);
+
+  // Cycle through the ring buffer several times.
+  for (int cycle = 0; cycle < 5; cycle++) {
+    for (int i = 0; i < 2; i++) {
+      timestamp += time_delta;
+      ASSERT_TRUE(queue_->NotifyPropertyUpdated(
+          timestamp, "prop", "name", base::FundamentalValue{cycle * 10 + i}));
+    }
+    EXPECT_EQ(2u, queue_->GetSize());
+    EXPECT_EQ(timestamp - time_delta, queue_->GetOldestTimestamp());
+    StateChange change = queue_->PopOldest();
+    EXPECT_EQ(timestamp - time_delta, change.timestamp);
+    EXPECT_JSON_EQ(base::StringPrintf("{'prop': {'name': %d}}", cycle * 10),
+                   *change.changed_properties);
+    change = queue_->PopOldest();
+    EXPECT_EQ(timestamp, change.timestamp);
+    EXPECT_JSON_EQ(
+        base::StringPrintf("{'prop': {'name': %d}}", cycle * 10 + 1),
+        *change.changed_properties);
+    EXPECT_TRUE(queue_->IsEmpty());
+  }
+}
+
+TEST_F(StateChangeQueueTest, DeadbandPolicy) {
+  StateChangePolicy policy;
+  policy.deadband = 0.5;
+  base::Time timestamp = base::Time::Now();
+  base::TimeDelta time_delta = base::TimeDelta::FromSeconds(1);
+
+  EXPECT_TRUE(queue_->NotifyPropertyUpdated(
+      timestamp, "sensor", "temp", base::FundamentalValue{20.0}, policy));
+  EXPECT_FALSE(queue_->NotifyPropertyUpdated(timestamp + time_delta, "sensor",
+                                             "temp",
+                                             base::FundamentalValue{20.4},
+                                             policy));
+  EXPECT_FALSE(queue_->NotifyPropertyUpdated(timestamp + time_delta * 2,
+                                             "sensor", "temp",
+                                             base::FundamentalValue{19.6},
+                                             policy));
+  EXPECT_TRUE(queue_->NotifyPropertyUpdated(timestamp + time_delta * 3,
+                                            "sensor", "temp",
+                                            base::FundamentalValue{20.5},
+                                            policy));
+
+  auto changes = queue_->GetAndClearRecordedStateChanges();
+  ASSERT_EQ(2u, changes.size());
+  EXPECT_JSON_EQ("{'sensor': {'temp': 20.0}}", *changes[0].changed_properties);
+  EXPECT_EQ(timestamp + time_delta * 3, changes[1].timestamp);
+  EXPECT_JSON_EQ("{'sensor': {'temp': 20.5}}", *changes[1].changed_properties);
+}
+
+TEST_F(StateChangeQueueTest, LastValueOnlyPolicy) {
+  StateChangePolicy policy;
+  policy.last_value_only = true;
+  base::Time timestamp = base::Time::Now();
+  base::TimeDelta time_delta = base::TimeDelta::FromSeconds(1);
+
+  ASSERT_TRUE(queue_->NotifyPropertiesUpdated(
+      timestamp, *CreateDictionaryValue("{'sensor': {'other': 1}}")));
+  EXPECT_TRUE(queue_->NotifyPropertyUpdated(
+      timestamp, "sensor", "power", base::FundamentalValue{1}, policy));
+  EXPECT_TRUE(queue_->NotifyPropertyUpdated(timestamp + time_delta, "sensor",
+                                            "power", base::FundamentalValue{2},
+                                            policy));
+  EXPECT_TRUE(queue_->NotifyPropertyUpdated(timestamp + time_delta * 2,
+                                            "sensor", "power",
+                                            base::FundamentalValue{3}, policy));
+
+  auto changes = queue_->GetAndClearRecordedStateChanges();
+  ASSERT_EQ(2u, changes.size());
+  EXPECT_EQ(timestamp, changes[0].timestamp);
+  EXPECT_JSON_EQ("{'sensor': {'other': 1}}", *changes[0].changed_properties);
+  EXPECT_EQ(timestamp + time_delta * 2, changes[1].timestamp);
+  EXPECT_JSON_EQ("{'sensor': {'power': 3}}", *changes[1].changed_properties);
+}
+
+TEST_F(StateChangeQueueTest, MinIntervalPolicy) {
+  StateChangePolicy policy;
+  policy.min_interval = base::TimeDelta::FromSeconds(10);
+  base::Time start = base::Time::Now();
+  base::TimeDelta second = base::TimeDelta::FromSeconds(1);
+
+  EXPECT_TRUE(queue_->NotifyPropertyUpdated(
+      start, "sensor", "temp", base::FundamentalValue{1}, policy));
+  // Overwrites the value still in the queue.
+  EXPECT_TRUE(queue_->NotifyPropertyUpdated(
+      start + second * 2, "sensor", "temp", base::FundamentalValue{2}, policy));
+  auto changes = queue_->GetAndClearRecordedStateChanges();
+  ASSERT_EQ(1u, changes.size());
+  EXPECT_EQ(start, changes[0].timestamp);
+  EXPECT_JSON_EQ("{'sensor': {'temp': 2}}", *changes[0].changed_properties);
+
+  // Postponed until the interval elapses.
+  EXPECT_TRUE(queue_->GetNextFlushTime().is_null());
+  EXPECT_FALSE(queue_->NotifyPropertyUpdated(
+      start + second * 4, "sensor", "temp", base::FundamentalValue{3}, policy));
+  EXPECT_FALSE(queue_->NotifyPropertyUpdated(
+      start + second * 5, "sensor", "temp", base::FundamentalValue{4}, policy));
+  EXPECT_TRUE(queue_->IsEmpty());
+  EXPECT_EQ(start + second * 10, queue_->GetNextFlushTime());
+  EXPECT_FALSE(queue_->FlushPostponedChanges(start + second * 9));
+  EXPECT_TRUE(queue_->FlushPostponedChanges(start + second * 10));
+  EXPECT_TRUE(queue_->GetNextFlushTime().is_null());
+
+  changes = queue_->GetAndClearRecordedStateChanges();
+  ASSERT_EQ(1u, changes.size());
+  EXPECT_EQ(start + second * 10, changes[0].timestamp);
+  EXPECT_JSON_EQ("{'sensor': {'temp': 4}}", *changes[0].changed_properties);
+}
+
+TEST_F(StateChangeQueueTest, DeadbandDropsPostponedChange) {
+  StateChangePolicy policy;
+  policy.min_interval = base::TimeDelta::FromSeconds(10);
+  policy.deadband = 1;
+  base::Time start = base::Time::Now();
+  base::TimeDelta second = base::TimeDelta::FromSeconds(1);
+
+  EXPECT_TRUE(queue_->NotifyPropertyUpdated(
+      start, "sensor", "temp", base::FundamentalValue{10.0}, policy));
+  queue_->GetAndClearRecordedStateChanges();
+
+  EXPECT_FALSE(queue_->NotifyPropertyUpdated(
+      start + second, "sensor", "temp", base::FundamentalValue{20.0}, policy));
+  EXPECT_EQ(start + second * 10, queue_->GetNextFlushTime());
+  // Back within the deadband of the recorded value.
+  EXPECT_FALSE(queue_->NotifyPropertyUpdated(
+      start + second * 2, "sensor", "temp", base::FundamentalValue{10.5},
+      policy));
+  EXPECT_TRUE(queue_->GetNextFlushTime().is_null());
+  EXPECT_FALSE(queue_->FlushPostponedChanges(start + second * 10));
+  EXPECT_TRUE(queue_->IsEmpty());
+}
+
 }  // namespace weave
@@ -0,0 +1,106 @@
+// Copyright 2015 The Weave Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "src/states/state_ingestion_queue.h"
+
+#include <base/logging.h>
+
+namespace weave {
+
+namespace {
+
+size_t RoundUpToPowerOfTwo(size_t value) {
+  size_t result = 1;
+  while (result < value)
+    result <<= 1;
+  return result;
+}
+
+}  // anonymous namespace
+
+StateIngestionQueue::Update::Update(uint32_t handle,
+                                    const base::FundamentalValue& value)
+    : handle{handle}, type{value.GetType()} {
+  switch (type) {
+    case base::Value::TYPE_BOOLEAN:
+      CHECK(value.GetAsBoolean(&bool_value));
+      break;
+    case base::Value::TYPE_INTEGER:
+      CHECK(value.GetAsInteger(&int_value));
+      break;
+    case base::Value::TYPE_DOUBLE:
+      CHECK(value.GetAsDouble(&double_value));
+      break;
+    default:
+      NOTREACHED();
+  }
+}
+
+base::FundamentalValue StateIngestionQueue::Update::GetValue() const {
+  switch (type) {
+    case base::Value::TYPE_BOOLEAN:
+      return base::FundamentalValue{bool_value};
+    case base::Value::TYPE_INTEGER:
+      return base::FundamentalValue{int_value};
+    default:
+      CHECK_EQ(base::Value::TYPE_DOUBLE, type);
+      return base::FundamentalValue{double_value};
+  }
+}
+
+StateIngestionQueue::StateIngestionQueue(size_t capacity)
+    : mask_{RoundUpToPowerOfTwo(capacity) - 1}, cells_{new Cell[mask_ + 1]} {
+  CHECK_GT(capacity, 0U) << "Queue capacity must not be zero";
+  for (size_t i = 0; i <= mask_; i++)
+    cells_[i].sequence.store(i, std::memory_order_relaxed);
+}
+
+StateIngestionQueue::~StateIngestionQueue() {}
+
+bool StateIngestionQueue::Push(const Update& update, bool* schedule_drain) {
+  size_t position = enqueue_position_.load(std::memory_order_relaxed);
+  Cell* cell = nullptr;
+  for (;;) {
+    cell = &cells_[position & mask_];
+    size_t sequence = cell->sequence.load(std::memory_order_acquire);
+    if (sequence == position) {
+      // The cell is free, try to claim it.
+      if (enqueue_position_.compare_exchange_weak(position, position + 1,
+                                                  std::memory_order_relaxed)) {
+        break;
+      }
+    } else if (sequence < position) {
+      // The cell still holds an update from the previous lap.
+      return false;
+    } else {
+      // Another producer claimed the cell.
+      position = enqueue_position_.load(std::memory_order_relaxed);
+    }
+  }
+  cell->update = update;
+  cell->sequence.store(position + 1, std::memory_order_release);
+  *schedule_drain = RequestDrain();
+  return true;
+}
+
+void StateIngestionQueue::BeginDrain() {
+  drain_requested_.store(false);
+}
+
+bool StateIngestionQueue::Pop(Update* update) {
+  Cell* cell = &cells_[dequeue_position_ & mask_];
+  if (cell->sequence.load(std::memory_order_acquire) != dequeue_position_ + 1)
+    return false;
+  *update = cell->update;
+  cell->sequence.store(dequeue_position_ + mask_ + 1,
+                       std::memory_order_release);
+  dequeue_position_++;
+  return true;
+}
+
+bool StateIngestionQueue::RequestDrain() {
+  return !drain_requested_.exchange(true);
+}
+
+}  // namespace weave
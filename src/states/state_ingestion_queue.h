@@ -0,0 +1,83 @@
+// Copyright 2015 The Weave Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef LIBWEAVE_SRC_STATES_STATE_INGESTION_QUEUE_H_
+#define LIBWEAVE_SRC_STATES_STATE_INGESTION_QUEUE_H_
+
+#include <atomic>
+#include <memory>
+
+#include <base/macros.h>
+#include <base/values.h>
+
+namespace weave {
+
+// A bounded lock-free queue passing state property updates from any number of
+// producer threads to the single thread running libweave.
+// Storage is preallocated, so pushing and popping updates does not allocate.
+class StateIngestionQueue {
+ public:
+  // A new primitive value of the state property identified by |handle|, as
+  // returned by ComponentManager::GetStatePropertyHandle().
+  struct Update {
+    Update() = default;
+    Update(uint32_t handle, const base::FundamentalValue& value);
+
+    // Returns the new value of the property.
+    base::FundamentalValue GetValue() const;
+
+    uint32_t handle{0};
+    base::Value::Type type{base::Value::TYPE_NULL};
+    union {
+      bool bool_value;
+      int int_value;
+      double double_value;
+    };
+  };
+
+  // |capacity| is rounded up to the next power of two.
+  explicit StateIngestionQueue(size_t capacity);
+  ~StateIngestionQueue();
+
+  // Adds |update| to the queue. Can be called from any thread.
+  // Returns false if the queue is full. Otherwise |schedule_drain| is set to
+  // true if this is the first update since the consumer started draining, so
+  // the caller has to make sure the consumer runs again.
+  bool Push(const Update& update, bool* schedule_drain);
+
+  // Consumer side. Must be called before popping updates: any update pushed
+  // after this call asks for another drain.
+  void BeginDrain();
+  // Consumer side. Returns false if the queue is empty.
+  bool Pop(Update* update);
+  // Consumer side. Asks for another drain if none is requested yet, e.g. when
+  // the consumer stops before the queue is empty. Returns true if the caller
+  // has to schedule it.
+  bool RequestDrain();
+
+  size_t GetCapacity() const { return mask_ + 1; }
+
+ private:
+  struct Cell {
+    // Position of the update which may use this cell next. Equals to that
+    // position when the cell is free and to the position plus one when it
+    // holds the update.
+    std::atomic<size_t> sequence;
+    Update update;
+  };
+
+  const size_t mask_;
+  std::unique_ptr<Cell[]> cells_;
+  std::atomic<size_t> enqueue_position_{0};
+  // Accessed by the consumer only.
+  size_t dequeue_position_{0};
+  // Set while a drain is pending.
+  std::atomic<bool> drain_requested_{false};
+
+  DISALLOW_COPY_AND_ASSIGN(StateIngestionQueue);
+};
+
+}  // namespace weave
+
+#endif  // LIBWEAVE_SRC_STATES_STATE_INGESTION_QUEUE_H_
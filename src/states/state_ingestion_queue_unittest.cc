@@ -0,0 +1,89 @@
+// Copyright 2015 The Weave Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "src/states/state_ingestion_queue.h"
+
+#include <thread>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+namespace weave {
+
+TEST(StateIngestionQueueTest, PushPop) {
+  StateIngestionQueue queue{3};
+  EXPECT_EQ(4u, queue.GetCapacity());
+
+  bool schedule_drain = false;
+  EXPECT_TRUE(queue.Push({1, base::FundamentalValue{true}}, &schedule_drain));
+  EXPECT_TRUE(schedule_drain);
+  EXPECT_TRUE(queue.Push({2, base::FundamentalValue{2}}, &schedule_drain));
+  EXPECT_FALSE(schedule_drain);
+  EXPECT_TRUE(queue.Push({3, base::FundamentalValue{3.5}}, &schedule_drain));
+  EXPECT_TRUE(queue.Push({4, base::FundamentalValue{4}}, &schedule_drain));
+  // Full.
+  EXPECT_FALSE(queue.Push({5, base::FundamentalValue{5}}, &schedule_drain));
+
+  queue.BeginDrain();
+  StateIngestionQueue::Update update;
+  ASSERT_TRUE(queue.Pop(&update));
+  EXPECT_EQ(1u, update.handle);
+  bool bool_value = false;
+  EXPECT_TRUE(update.GetValue().GetAsBoolean(&bool_value));
+  EXPECT_TRUE(bool_value);
+  ASSERT_TRUE(queue.Pop(&update));
+  EXPECT_EQ(2u, update.handle);
+  ASSERT_TRUE(queue.Pop(&update));
+  EXPECT_EQ(3u, update.handle);
+  double value = 0;
+  EXPECT_TRUE(update.GetValue().GetAsDouble(&value));
+  EXPECT_EQ(3.5, value);
+
+  // Pushing after BeginDrain() asks for another drain.
+  EXPECT_TRUE(queue.Push({5, base::FundamentalValue{5}}, &schedule_drain));
+  EXPECT_TRUE(schedule_drain);
+  ASSERT_TRUE(queue.Pop(&update));
+  EXPECT_EQ(4u, update.handle);
+  ASSERT_TRUE(queue.Pop(&update));
+  EXPECT_EQ(5u, update.handle);
+  EXPECT_FALSE(queue.Pop(&update));
+}
+
+TEST(StateIngestionQueueTest, MultipleProducers) {
+  const int kProducers = 4;
+  const int kUpdates = 20000;
+  StateIngestionQueue queue{64};
+
+  std::vector<std::thread> producers;
+  for (int producer = 0; producer < kProducers; producer++) {
+    producers.emplace_back([&queue, producer]() {
+      for (int i = 0; i < kUpdates; i++) {
+        bool schedule_drain = false;
+        StateIngestionQueue::Update update{static_cast<uint32_t>(producer),
+                                           base::FundamentalValue{i}};
+        while (!queue.Push(update, &schedule_drain))
+          std::this_thread::yield();
+      }
+    });
+  }
+
+  // Updates of every producer arrive in order.
+  std::vector<int> next(kProducers, 0);
+  int received = 0;
+  StateIngestionQueue::Update update;
+  while (received < kProducers * kUpdates) {
+    if (!queue.Pop(&update)) {
+      std::this_thread::yield();
+      continue;
+    }
+    ASSERT_LT(update.handle, static_cast<uint32_t>(kProducers));
+    EXPECT_EQ(next[update.handle]++, update.int_value);
+    received++;
+  }
+  for (auto& producer : producers)
+    producer.join();
+  EXPECT_FALSE(queue.Pop(&update));
+}
+
+}  // namespace weave